@@ -0,0 +1,18 @@
+#include "platform.h"
+
+// main.cpp's frame loop as a shared object for jam_host. Edit the colors,
+// rebuild jamGame and the running window picks it up.
+
+struct game_state {
+  uint8_t blue;
+};
+
+extern "C" bool jam_game_frame(game_memory *memory, uint8_t *pixels, uint32_t stride) {
+  game_state *state = (game_state *)memory->permanent;
+  window_scale scale = get_window_scale(&memory->window);
+
+  fill_pixels(pixels, stride, scale.buffer_width, scale.buffer_height, state->blue, state->blue, state->blue, 0xff);
+
+  state->blue++;
+  return true;
+}
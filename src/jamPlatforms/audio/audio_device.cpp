@@ -0,0 +1,293 @@
+#include "audio_mixer.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The audio thread and the sinks it feeds. There is no sound server
+// backend yet, the null sink stands in for a device (same pacing, one
+// period at a time on a clock) so the mixer's cost can be measured on its
+// own, and the WAV sink is for listening to what it made.
+//
+// The clock: while one period plays the next is mixed, so the period mixed
+// after a wakeup comes out at the next one. Wakeups go through
+// device_clock, and its prediction of the next one is when the frame about
+// to be mixed plays. A real backend would feed it its delay queries the
+// same way.
+
+#define WAV_HEADER_SIZE 44
+
+static uint64_t audio_now_ns() {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void audio_put_u32(uint8_t *dst, uint32_t value) {
+  memcpy(dst, &value, sizeof(value));
+}
+
+static void audio_put_u16(uint8_t *dst, uint16_t value) {
+  memcpy(dst, &value, sizeof(value));
+}
+
+// 16 bit stereo PCM. The sizes are filled in again on close, a file cut
+// short by a crash still opens, just with a wrong length.
+static bool audio_write_wav_header(audio_state *state) {
+  uint8_t header[WAV_HEADER_SIZE] = {};
+  uint32_t rate = state->settings.sample_rate;
+  uint32_t data_bytes = state->data_bytes > UINT32_MAX - WAV_HEADER_SIZE ?
+                        UINT32_MAX - WAV_HEADER_SIZE : (uint32_t)state->data_bytes;
+
+  memcpy(header, "RIFF", 4);
+  audio_put_u32(header + 4, WAV_HEADER_SIZE - 8 + data_bytes);
+  memcpy(header + 8, "WAVE", 4);
+  memcpy(header + 12, "fmt ", 4);
+  audio_put_u32(header + 16, 16);
+  audio_put_u16(header + 20, 1); // PCM
+  audio_put_u16(header + 22, 2);
+  audio_put_u32(header + 24, rate);
+  audio_put_u32(header + 28, rate * 2 * sizeof(int16_t));
+  audio_put_u16(header + 32, 2 * sizeof(int16_t));
+  audio_put_u16(header + 34, 16);
+  memcpy(header + 36, "data", 4);
+  audio_put_u32(header + 40, data_bytes);
+
+  return pwrite(state->fd, header, sizeof(header), 0) == sizeof(header);
+}
+
+static bool audio_sink_write(audio_state *state) {
+  if (state->settings.sink != AUDIO_SINK_WAV) {
+    return true;
+  }
+
+  const uint8_t *src = (const uint8_t *)state->output;
+  uint64_t size = (uint64_t)state->settings.period_frames * 2 * sizeof(int16_t);
+  while (size > 0) {
+    ssize_t written = write(state->fd, src, size);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    src += written;
+    size -= (uint64_t)written;
+    state->data_bytes += (uint64_t)written;
+  }
+
+  return true;
+}
+
+static void *audio_thread(void *arg) {
+  audio_state *state = (audio_state *)arg;
+  uint32_t frames = state->settings.period_frames;
+
+  state->start_ns = audio_now_ns();
+  state->next_period_ns = state->start_ns;
+  double nominal_ns_per_frame = 1e9 / state->settings.sample_rate;
+
+  while (!__atomic_load_n(&state->stop, __ATOMIC_ACQUIRE)) {
+    if (state->settings.frame_limit != 0 && state->stats.frames >= state->settings.frame_limit) {
+      break;
+    }
+
+    // A device asks for the next period once the last one is playing,
+    // sleeping to an absolute deadline keeps it from drifting.
+    if (!state->settings.unthrottled) {
+      struct timespec deadline = {
+        .tv_sec = (time_t)(state->next_period_ns / 1000000000ull),
+        .tv_nsec = (long)(state->next_period_ns % 1000000000ull),
+      };
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, 0) == EINTR) {}
+
+      uint64_t now = audio_now_ns();
+      av_clock_observe(&state->device_clock, now, 1);
+      audio_publish_clock(state, state->stats.frames, (uint64_t)state->device_clock.next_ns,
+                          state->device_clock.period_ns / frames);
+
+      state->next_period_ns += state->period_ns;
+      if (state->next_period_ns < now) {
+        __atomic_store_n(&state->stats.late_periods, state->stats.late_periods + 1, __ATOMIC_RELAXED);
+        state->next_period_ns = now + state->period_ns;
+      }
+    } else {
+      // Offline, "playing" is just being mixed.
+      audio_publish_clock(state, state->stats.frames, audio_now_ns(), nominal_ns_per_frame);
+    }
+
+    uint64_t mix_start = audio_now_ns();
+    audio_mix_period(state);
+    state->kernels.to_s16(state->mix, state->output, frames * 2);
+    uint64_t mix_ns = audio_now_ns() - mix_start;
+
+    if (!audio_sink_write(state)) {
+      printf("Failed to write audio to %s\n", state->path);
+      break;
+    }
+
+    __atomic_store_n(&state->stats.mix_ns_total, state->stats.mix_ns_total + mix_ns, __ATOMIC_RELAXED);
+    if (mix_ns > state->stats.mix_ns_max) {
+      __atomic_store_n(&state->stats.mix_ns_max, mix_ns, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&state->stats.periods, state->stats.periods + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&state->stats.frames, state->stats.frames + frames, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+
+static void *audio_alloc(uint64_t size) {
+  size = (size + AUDIO_BUFFER_ALIGNMENT - 1) & ~(uint64_t)(AUDIO_BUFFER_ALIGNMENT - 1);
+  void *memory = aligned_alloc(AUDIO_BUFFER_ALIGNMENT, size);
+  if (memory) memset(memory, 0, size);
+  return memory;
+}
+
+bool audio_open(audio_state *state, audio_settings *settings) {
+  if (settings) {
+    state->settings = *settings;
+  }
+
+  if (const char *sink = getenv("JAM_AUDIO_SINK")) {
+    if (strcmp(sink, "null") == 0) state->settings.sink = AUDIO_SINK_NULL;
+    if (strcmp(sink, "wav") == 0) state->settings.sink = AUDIO_SINK_WAV;
+  }
+
+  const char *path = getenv("JAM_AUDIO_PATH");
+  if (!path) path = state->settings.path;
+  if (!path) path = "jam_audio.wav";
+  strncpy(state->path, path, AUDIO_PATH_SIZE - 1);
+  state->settings.path = state->path;
+
+  if (state->settings.sample_rate == 0) {
+    state->settings.sample_rate = AUDIO_DEFAULT_SAMPLE_RATE;
+  }
+  if (state->settings.period_frames == 0) {
+    state->settings.period_frames = AUDIO_DEFAULT_PERIOD_FRAMES;
+  }
+  if (state->settings.period_frames > AUDIO_MAX_PERIOD_FRAMES) {
+    state->settings.period_frames = AUDIO_MAX_PERIOD_FRAMES;
+  }
+
+  uint32_t frames = state->settings.period_frames;
+  uint64_t nominal_period_ns = (uint64_t)frames * 1000000000ull / state->settings.sample_rate;
+  state->period_ns = nominal_period_ns;
+  if (state->settings.clock_ppm != 0) {
+    state->period_ns = (uint64_t)(nominal_period_ns * (1.0 + state->settings.clock_ppm * 1e-6) + 0.5);
+  }
+  state->fd = -1;
+
+  // Until the first wakeup, the first frame is a period out.
+  av_clock_init(&state->device_clock, nominal_period_ns);
+  audio_publish_clock(state, 0, audio_now_ns() + nominal_period_ns, 1e9 / state->settings.sample_rate);
+
+  state->kernels = cpu_kernels_get()->audio;
+
+  // Scratch holds a resampled voice, stereo at most.
+  state->mix = (float *)audio_alloc((uint64_t)frames * 2 * sizeof(float));
+  state->scratch = (float *)audio_alloc((uint64_t)frames * 2 * sizeof(float));
+  state->output = (int16_t *)audio_alloc((uint64_t)frames * 2 * sizeof(int16_t));
+  if (!state->mix || !state->scratch || !state->output) {
+    printf("Failed to allocate the audio buffers\n");
+    return false;
+  }
+
+  if (!mpsc_queue_init(&state->commands, AUDIO_COMMAND_QUEUE_SIZE)) {
+    printf("Failed to allocate the audio command queue\n");
+    return false;
+  }
+
+  if (state->settings.sink == AUDIO_SINK_WAV) {
+    state->fd = open(state->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (state->fd < 0 || !audio_write_wav_header(state) ||
+        lseek(state->fd, WAV_HEADER_SIZE, SEEK_SET) < 0) {
+      printf("Failed to open %s for audio\n", state->path);
+      return false;
+    }
+  }
+
+  thread_settings thread = {};
+  thread.name = "jam-audio";
+  thread.priority = THREAD_PRIORITY_REALTIME;
+  state->core_reserved = cpu_reserve_core(&thread.affinity);
+
+  if (!cpu_thread_start(&state->thread, audio_thread, state, &thread)) {
+    printf("Failed to start the audio thread\n");
+    return false;
+  }
+
+  printf("Audio: %s sink, %u Hz, %u frame periods, %s kernels, %s%s\n",
+         state->settings.sink == AUDIO_SINK_WAV ? "wav" : "null",
+         state->settings.sample_rate, frames, state->kernels.name,
+         (state->thread.granted & THREAD_GRANTED_REALTIME) ? "realtime" : "not realtime",
+         state->core_reserved ? " on a reserved core" : "");
+  return true;
+}
+
+void audio_close(audio_state *state) {
+  if (state->thread.running) {
+    __atomic_store_n(&state->stop, true, __ATOMIC_RELEASE);
+    cpu_thread_join(&state->thread);
+    audio_print_stats(state);
+  }
+  if (state->core_reserved) {
+    cpu_release_core();
+    state->core_reserved = false;
+  }
+
+  if (state->fd >= 0) {
+    if (!audio_write_wav_header(state)) {
+      printf("Failed to finish the WAV header of %s\n", state->path);
+    }
+    close(state->fd);
+    state->fd = -1;
+  }
+
+  mpsc_queue_free(&state->commands);
+  free(state->mix);
+  free(state->scratch);
+  free(state->output);
+  state->mix = 0;
+  state->scratch = 0;
+  state->output = 0;
+}
+
+audio_stats audio_get_stats(audio_state *state) {
+  audio_stats stats = {};
+  stats.frames = __atomic_load_n(&state->stats.frames, __ATOMIC_ACQUIRE);
+  stats.periods = __atomic_load_n(&state->stats.periods, __ATOMIC_RELAXED);
+  stats.voice_periods = __atomic_load_n(&state->stats.voice_periods, __ATOMIC_RELAXED);
+  stats.mix_ns_total = __atomic_load_n(&state->stats.mix_ns_total, __ATOMIC_RELAXED);
+  stats.mix_ns_max = __atomic_load_n(&state->stats.mix_ns_max, __ATOMIC_RELAXED);
+  stats.late_periods = __atomic_load_n(&state->stats.late_periods, __ATOMIC_RELAXED);
+  stats.late_starts = __atomic_load_n(&state->stats.late_starts, __ATOMIC_RELAXED);
+  stats.voices_playing = __atomic_load_n(&state->stats.voices_playing, __ATOMIC_RELAXED);
+  return stats;
+}
+
+// core_percent is mixing time over the audio it produced, what one core
+// spends keeping up in real time. clock_ppm is how far off the device's
+// clock is from CLOCK_MONOTONIC, as measured by device_clock.
+void audio_print_stats(audio_state *state) {
+  audio_stats stats = audio_get_stats(state);
+  if (stats.periods == 0) {
+    return;
+  }
+
+  double audio_ns = stats.frames * 1e9 / state->settings.sample_rate;
+  printf("audio: kernels=%s periods=%llu avg_voices=%.1f avg_mix_us=%.2f max_mix_us=%.2f ns_per_voice_frame=%.3f core_percent=%.3f late_periods=%llu late_starts=%llu clock_ppm=%.1f\n",
+         state->kernels.name,
+         (unsigned long long)stats.periods,
+         (double)stats.voice_periods / stats.periods,
+         stats.mix_ns_total / 1e3 / stats.periods,
+         stats.mix_ns_max / 1e3,
+         stats.voice_periods ? (double)stats.mix_ns_total / (stats.voice_periods * (double)state->settings.period_frames) : 0.0,
+         stats.mix_ns_total * 100.0 / audio_ns,
+         (unsigned long long)stats.late_periods,
+         (unsigned long long)stats.late_starts,
+         state->settings.unthrottled ? 0.0 : (audio_get_clock(state).ns_per_frame * state->settings.sample_rate / 1e9 - 1.0) * 1e6);
+  fflush(stdout);
+}
@@ -0,0 +1,701 @@
+#include "audio_mixer.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AUDIO_HAVE_AVX2 1
+#endif
+
+// All the kernels do the bulk with SIMD and the last few frames scalar,
+// none of them care about alignment of the source. The mix buffer itself
+// is AUDIO_BUFFER_ALIGNMENT aligned.
+
+static void mix_mono_scalar(const float *src, float *mix, uint32_t frames,
+                            float left, float right, float step_left, float step_right) {
+  for (uint32_t Index = 0; Index < frames; Index++) {
+    mix[Index * 2] += src[Index] * left;
+    mix[Index * 2 + 1] += src[Index] * right;
+    left += step_left;
+    right += step_right;
+  }
+}
+
+static void mix_stereo_scalar(const float *src, float *mix, uint32_t frames,
+                              float left, float right, float step_left, float step_right) {
+  for (uint32_t Index = 0; Index < frames; Index++) {
+    mix[Index * 2] += src[Index * 2] * left;
+    mix[Index * 2 + 1] += src[Index * 2 + 1] * right;
+    left += step_left;
+    right += step_right;
+  }
+}
+
+static void resample_mono_scalar(const float *src, float *dst, uint32_t frames, float position, float step) {
+  for (uint32_t Index = 0; Index < frames; Index++) {
+    float p = position + step * (float)Index;
+    int32_t i = (int32_t)p;
+    float f = p - (float)i;
+    dst[Index] = src[i] + (src[i + 1] - src[i]) * f;
+  }
+}
+
+static void resample_stereo_scalar(const float *src, float *dst, uint32_t frames, float position, float step) {
+  for (uint32_t Index = 0; Index < frames; Index++) {
+    float p = position + step * (float)Index;
+    int32_t i = (int32_t)p;
+    float f = p - (float)i;
+    dst[Index * 2] = src[i * 2] + (src[i * 2 + 2] - src[i * 2]) * f;
+    dst[Index * 2 + 1] = src[i * 2 + 1] + (src[i * 2 + 3] - src[i * 2 + 1]) * f;
+  }
+}
+
+static void to_s16_scalar(const float *mix, int16_t *dst, uint32_t samples) {
+  for (uint32_t Index = 0; Index < samples; Index++) {
+    float s = mix[Index];
+    if (s > 1.0f) s = 1.0f;
+    if (s < -1.0f) s = -1.0f;
+    dst[Index] = (int16_t)lrintf(s * 32767.0f);
+  }
+}
+
+#if defined(__SSE2__)
+// Two stereo frames per vector, the gains go [l r l r] and step two frames at a time.
+static void mix_mono_sse2(const float *src, float *mix, uint32_t frames,
+                          float left, float right, float step_left, float step_right) {
+  __m128 gain = _mm_setr_ps(left, right, left + step_left, right + step_right);
+  __m128 step = _mm_setr_ps(step_left * 2, step_right * 2, step_left * 2, step_right * 2);
+
+  uint32_t Index = 0;
+  for (; Index + 4 <= frames; Index += 4) {
+    __m128 s = _mm_loadu_ps(src + Index);
+    __m128 lo = _mm_unpacklo_ps(s, s);
+    __m128 hi = _mm_unpackhi_ps(s, s);
+
+    __m128 m0 = _mm_loadu_ps(mix + Index * 2);
+    m0 = _mm_add_ps(m0, _mm_mul_ps(lo, gain));
+    gain = _mm_add_ps(gain, step);
+    __m128 m1 = _mm_loadu_ps(mix + Index * 2 + 4);
+    m1 = _mm_add_ps(m1, _mm_mul_ps(hi, gain));
+    gain = _mm_add_ps(gain, step);
+
+    _mm_storeu_ps(mix + Index * 2, m0);
+    _mm_storeu_ps(mix + Index * 2 + 4, m1);
+  }
+
+  mix_mono_scalar(src + Index, mix + Index * 2, frames - Index,
+                  left + step_left * Index, right + step_right * Index, step_left, step_right);
+}
+
+static void mix_stereo_sse2(const float *src, float *mix, uint32_t frames,
+                            float left, float right, float step_left, float step_right) {
+  __m128 gain = _mm_setr_ps(left, right, left + step_left, right + step_right);
+  __m128 step = _mm_setr_ps(step_left * 2, step_right * 2, step_left * 2, step_right * 2);
+
+  uint32_t Index = 0;
+  for (; Index + 4 <= frames; Index += 4) {
+    __m128 s0 = _mm_loadu_ps(src + Index * 2);
+    __m128 s1 = _mm_loadu_ps(src + Index * 2 + 4);
+
+    __m128 m0 = _mm_loadu_ps(mix + Index * 2);
+    m0 = _mm_add_ps(m0, _mm_mul_ps(s0, gain));
+    gain = _mm_add_ps(gain, step);
+    __m128 m1 = _mm_loadu_ps(mix + Index * 2 + 4);
+    m1 = _mm_add_ps(m1, _mm_mul_ps(s1, gain));
+    gain = _mm_add_ps(gain, step);
+
+    _mm_storeu_ps(mix + Index * 2, m0);
+    _mm_storeu_ps(mix + Index * 2 + 4, m1);
+  }
+
+  mix_stereo_scalar(src + Index * 2, mix + Index * 2, frames - Index,
+                    left + step_left * Index, right + step_right * Index, step_left, step_right);
+}
+
+// SSE2 has no gather, the positions and weights are vector math and the
+// four pairs of taps are fetched one by one.
+static void resample_mono_sse2(const float *src, float *dst, uint32_t frames, float position, float step) {
+  __m128 base = _mm_set1_ps(position);
+  __m128 steps = _mm_set1_ps(step);
+  __m128 index = _mm_setr_ps(0, 1, 2, 3);
+  __m128 four = _mm_set1_ps(4);
+
+  uint32_t Index = 0;
+  for (; Index + 4 <= frames; Index += 4) {
+    __m128 p = _mm_add_ps(base, _mm_mul_ps(steps, index));
+    __m128i i = _mm_cvttps_epi32(p);
+    __m128 f = _mm_sub_ps(p, _mm_cvtepi32_ps(i));
+
+    alignas(16) int32_t taps[4];
+    _mm_store_si128((__m128i *)taps, i);
+    __m128 a = _mm_setr_ps(src[taps[0]], src[taps[1]], src[taps[2]], src[taps[3]]);
+    __m128 b = _mm_setr_ps(src[taps[0] + 1], src[taps[1] + 1], src[taps[2] + 1], src[taps[3] + 1]);
+
+    _mm_storeu_ps(dst + Index, _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), f)));
+    index = _mm_add_ps(index, four);
+  }
+
+  resample_mono_scalar(src, dst + Index, frames - Index, position + step * Index, step);
+}
+
+static void resample_stereo_sse2(const float *src, float *dst, uint32_t frames, float position, float step) {
+  __m128 base = _mm_set1_ps(position);
+  __m128 steps = _mm_set1_ps(step);
+  __m128 index = _mm_setr_ps(0, 0, 1, 1);
+  __m128 two = _mm_set1_ps(2);
+
+  uint32_t Index = 0;
+  for (; Index + 2 <= frames; Index += 2) {
+    __m128 p = _mm_add_ps(base, _mm_mul_ps(steps, index));
+    __m128i i = _mm_cvttps_epi32(p);
+    __m128 f = _mm_sub_ps(p, _mm_cvtepi32_ps(i));
+
+    alignas(16) int32_t taps[4];
+    _mm_store_si128((__m128i *)taps, i);
+    const float *f0 = src + taps[0] * 2;
+    const float *f1 = src + taps[2] * 2;
+    __m128 a = _mm_setr_ps(f0[0], f0[1], f1[0], f1[1]);
+    __m128 b = _mm_setr_ps(f0[2], f0[3], f1[2], f1[3]);
+
+    _mm_storeu_ps(dst + Index * 2, _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), f)));
+    index = _mm_add_ps(index, two);
+  }
+
+  resample_stereo_scalar(src, dst + Index * 2, frames - Index, position + step * Index, step);
+}
+
+// packs saturates, the clamp is only there so huge values don't turn
+// into INT_MIN in the conversion first.
+static void to_s16_sse2(const float *mix, int16_t *dst, uint32_t samples) {
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 minus_one = _mm_set1_ps(-1.0f);
+  __m128 scale = _mm_set1_ps(32767.0f);
+
+  uint32_t Index = 0;
+  for (; Index + 8 <= samples; Index += 8) {
+    __m128 a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(mix + Index), minus_one), one);
+    __m128 b = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(mix + Index + 4), minus_one), one);
+    __m128i ia = _mm_cvtps_epi32(_mm_mul_ps(a, scale));
+    __m128i ib = _mm_cvtps_epi32(_mm_mul_ps(b, scale));
+    _mm_storeu_si128((__m128i *)(dst + Index), _mm_packs_epi32(ia, ib));
+  }
+
+  to_s16_scalar(mix + Index, dst + Index, samples - Index);
+}
+#endif
+
+#if defined(AUDIO_HAVE_AVX2)
+// Built for AVX2 whatever the rest of the library targets, only ever
+// called after the CPU said it has it. Each one clears the upper halves
+// before the scalar tail, GCC doesn't when the tail is a non-AVX function
+// and the SSE code after it would pay for the dirty state on every call.
+#define AUDIO_AVX2 __attribute__((target("avx2")))
+
+AUDIO_AVX2 static void mix_mono_avx2(const float *src, float *mix, uint32_t frames,
+                                     float left, float right, float step_left, float step_right) {
+  __m256 gain = _mm256_setr_ps(left, right,
+                               left + step_left, right + step_right,
+                               left + step_left * 2, right + step_right * 2,
+                               left + step_left * 3, right + step_right * 3);
+  __m256 step = _mm256_setr_ps(step_left * 4, step_right * 4, step_left * 4, step_right * 4,
+                               step_left * 4, step_right * 4, step_left * 4, step_right * 4);
+
+  uint32_t Index = 0;
+  for (; Index + 8 <= frames; Index += 8) {
+    __m256 s = _mm256_loadu_ps(src + Index);
+    // Unpacks stay within 128 bit lanes, put the halves back in order.
+    __m256 lo = _mm256_unpacklo_ps(s, s);
+    __m256 hi = _mm256_unpackhi_ps(s, s);
+    __m256 s0 = _mm256_permute2f128_ps(lo, hi, 0x20);
+    __m256 s1 = _mm256_permute2f128_ps(lo, hi, 0x31);
+
+    __m256 m0 = _mm256_loadu_ps(mix + Index * 2);
+    m0 = _mm256_add_ps(m0, _mm256_mul_ps(s0, gain));
+    gain = _mm256_add_ps(gain, step);
+    __m256 m1 = _mm256_loadu_ps(mix + Index * 2 + 8);
+    m1 = _mm256_add_ps(m1, _mm256_mul_ps(s1, gain));
+    gain = _mm256_add_ps(gain, step);
+
+    _mm256_storeu_ps(mix + Index * 2, m0);
+    _mm256_storeu_ps(mix + Index * 2 + 8, m1);
+  }
+
+  _mm256_zeroupper();
+  mix_mono_scalar(src + Index, mix + Index * 2, frames - Index,
+                  left + step_left * Index, right + step_right * Index, step_left, step_right);
+}
+
+AUDIO_AVX2 static void mix_stereo_avx2(const float *src, float *mix, uint32_t frames,
+                                       float left, float right, float step_left, float step_right) {
+  __m256 gain = _mm256_setr_ps(left, right,
+                               left + step_left, right + step_right,
+                               left + step_left * 2, right + step_right * 2,
+                               left + step_left * 3, right + step_right * 3);
+  __m256 step = _mm256_setr_ps(step_left * 4, step_right * 4, step_left * 4, step_right * 4,
+                               step_left * 4, step_right * 4, step_left * 4, step_right * 4);
+
+  uint32_t Index = 0;
+  for (; Index + 8 <= frames; Index += 8) {
+    __m256 s0 = _mm256_loadu_ps(src + Index * 2);
+    __m256 s1 = _mm256_loadu_ps(src + Index * 2 + 8);
+
+    __m256 m0 = _mm256_loadu_ps(mix + Index * 2);
+    m0 = _mm256_add_ps(m0, _mm256_mul_ps(s0, gain));
+    gain = _mm256_add_ps(gain, step);
+    __m256 m1 = _mm256_loadu_ps(mix + Index * 2 + 8);
+    m1 = _mm256_add_ps(m1, _mm256_mul_ps(s1, gain));
+    gain = _mm256_add_ps(gain, step);
+
+    _mm256_storeu_ps(mix + Index * 2, m0);
+    _mm256_storeu_ps(mix + Index * 2 + 8, m1);
+  }
+
+  _mm256_zeroupper();
+  mix_stereo_scalar(src + Index * 2, mix + Index * 2, frames - Index,
+                    left + step_left * Index, right + step_right * Index, step_left, step_right);
+}
+
+AUDIO_AVX2 static void resample_mono_avx2(const float *src, float *dst, uint32_t frames, float position, float step) {
+  __m256 base = _mm256_set1_ps(position);
+  __m256 steps = _mm256_set1_ps(step);
+  __m256 index = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256 eight = _mm256_set1_ps(8);
+
+  uint32_t Index = 0;
+  for (; Index + 8 <= frames; Index += 8) {
+    __m256 p = _mm256_add_ps(base, _mm256_mul_ps(steps, index));
+    __m256i i = _mm256_cvttps_epi32(p);
+    __m256 f = _mm256_sub_ps(p, _mm256_cvtepi32_ps(i));
+
+    __m256 a = _mm256_i32gather_ps(src, i, 4);
+    __m256 b = _mm256_i32gather_ps(src + 1, i, 4);
+
+    _mm256_storeu_ps(dst + Index, _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), f)));
+    index = _mm256_add_ps(index, eight);
+  }
+
+  _mm256_zeroupper();
+  resample_mono_scalar(src, dst + Index, frames - Index, position + step * Index, step);
+}
+
+// Four frames a vector, every position twice so each lane gathers its own
+// channel: tap 2i for left and 2i + 1 for right.
+AUDIO_AVX2 static void resample_stereo_avx2(const float *src, float *dst, uint32_t frames, float position, float step) {
+  __m256 base = _mm256_set1_ps(position);
+  __m256 steps = _mm256_set1_ps(step);
+  __m256 index = _mm256_setr_ps(0, 0, 1, 1, 2, 2, 3, 3);
+  __m256 four = _mm256_set1_ps(4);
+  __m256i channel = _mm256_setr_epi32(0, 1, 0, 1, 0, 1, 0, 1);
+
+  uint32_t Index = 0;
+  for (; Index + 4 <= frames; Index += 4) {
+    __m256 p = _mm256_add_ps(base, _mm256_mul_ps(steps, index));
+    __m256i i = _mm256_cvttps_epi32(p);
+    __m256 f = _mm256_sub_ps(p, _mm256_cvtepi32_ps(i));
+    __m256i taps = _mm256_add_epi32(_mm256_slli_epi32(i, 1), channel);
+
+    __m256 a = _mm256_i32gather_ps(src, taps, 4);
+    __m256 b = _mm256_i32gather_ps(src + 2, taps, 4);
+
+    _mm256_storeu_ps(dst + Index * 2, _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), f)));
+    index = _mm256_add_ps(index, four);
+  }
+
+  _mm256_zeroupper();
+  resample_stereo_scalar(src, dst + Index * 2, frames - Index, position + step * Index, step);
+}
+
+AUDIO_AVX2 static void to_s16_avx2(const float *mix, int16_t *dst, uint32_t samples) {
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 minus_one = _mm256_set1_ps(-1.0f);
+  __m256 scale = _mm256_set1_ps(32767.0f);
+
+  uint32_t Index = 0;
+  for (; Index + 16 <= samples; Index += 16) {
+    __m256 a = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(mix + Index), minus_one), one);
+    __m256 b = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(mix + Index + 8), minus_one), one);
+    __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(_mm256_mul_ps(a, scale)),
+                                        _mm256_cvtps_epi32(_mm256_mul_ps(b, scale)));
+    // packs interleaves the 128 bit lanes, a0-3 b0-3 a4-7 b4-7.
+    packed = _mm256_permute4x64_epi64(packed, 0xD8);
+    _mm256_storeu_si256((__m256i *)(dst + Index), packed);
+  }
+
+  _mm256_zeroupper();
+  to_s16_scalar(mix + Index, dst + Index, samples - Index);
+}
+#endif
+
+// Best first, see cpu_dispatch.h.
+static const cpu_kernel_variant mix_mono_variants[] = {
+#if defined(AUDIO_HAVE_AVX2)
+  CPU_KERNEL(CPU_FEATURE_AVX2, mix_mono_avx2),
+#endif
+#if defined(__SSE2__)
+  CPU_KERNEL(CPU_FEATURE_SSE2, mix_mono_sse2),
+#endif
+  CPU_KERNEL(0, mix_mono_scalar),
+};
+
+static const cpu_kernel_variant mix_stereo_variants[] = {
+#if defined(AUDIO_HAVE_AVX2)
+  CPU_KERNEL(CPU_FEATURE_AVX2, mix_stereo_avx2),
+#endif
+#if defined(__SSE2__)
+  CPU_KERNEL(CPU_FEATURE_SSE2, mix_stereo_sse2),
+#endif
+  CPU_KERNEL(0, mix_stereo_scalar),
+};
+
+static const cpu_kernel_variant resample_mono_variants[] = {
+#if defined(AUDIO_HAVE_AVX2)
+  CPU_KERNEL(CPU_FEATURE_AVX2, resample_mono_avx2),
+#endif
+#if defined(__SSE2__)
+  CPU_KERNEL(CPU_FEATURE_SSE2, resample_mono_sse2),
+#endif
+  CPU_KERNEL(0, resample_mono_scalar),
+};
+
+static const cpu_kernel_variant resample_stereo_variants[] = {
+#if defined(AUDIO_HAVE_AVX2)
+  CPU_KERNEL(CPU_FEATURE_AVX2, resample_stereo_avx2),
+#endif
+#if defined(__SSE2__)
+  CPU_KERNEL(CPU_FEATURE_SSE2, resample_stereo_sse2),
+#endif
+  CPU_KERNEL(0, resample_stereo_scalar),
+};
+
+static const cpu_kernel_variant to_s16_variants[] = {
+#if defined(AUDIO_HAVE_AVX2)
+  CPU_KERNEL(CPU_FEATURE_AVX2, to_s16_avx2),
+#endif
+#if defined(__SSE2__)
+  CPU_KERNEL(CPU_FEATURE_SSE2, to_s16_sse2),
+#endif
+  CPU_KERNEL(0, to_s16_scalar),
+};
+
+void audio_kernels_resolve(audio_kernels *kernels, uint32_t features) {
+  CPU_KERNEL_RESOLVE(kernels->mix_mono, mix_mono_variants, features);
+  CPU_KERNEL_RESOLVE(kernels->mix_stereo, mix_stereo_variants, features);
+  CPU_KERNEL_RESOLVE(kernels->resample_mono, resample_mono_variants, features);
+  CPU_KERNEL_RESOLVE(kernels->resample_stereo, resample_stereo_variants, features);
+  CPU_KERNEL_RESOLVE(kernels->to_s16, to_s16_variants, features);
+
+  const char *name = cpu_kernel_pick(mix_mono_variants, sizeof(mix_mono_variants) / sizeof(mix_mono_variants[0]),
+                                     features)->name;
+  kernels->name = strrchr(name, '_') + 1;
+}
+
+// One frame of the sound, past the end is the start again when looping
+// and silence otherwise.
+static void audio_voice_frame(audio_voice *voice, uint64_t frame, float *out) {
+  const audio_sound *sound = &voice->sound;
+  if (frame >= sound->frame_count) {
+    if (!voice->loop) {
+      out[0] = out[1] = 0;
+      return;
+    }
+    frame %= sound->frame_count;
+  }
+
+  out[0] = sound->samples[frame * sound->channels];
+  out[1] = sound->samples[frame * sound->channels + sound->channels - 1];
+}
+
+static void audio_voice_free(audio_voice *voice) {
+  __atomic_store_n(&voice->generation, (voice->generation + 1) & 0xFFFFFF, __ATOMIC_RELAXED);
+  __atomic_store_n(&voice->status, (int32_t)AUDIO_VOICE_FREE, __ATOMIC_RELEASE);
+}
+
+// Mixes frames first to frames of the period, first is where a voice
+// scheduled with play_sound_at comes in. Returns false once it's done.
+static bool audio_mix_voice(audio_state *state, audio_voice *voice, uint32_t first, uint32_t frames) {
+  const audio_sound *sound = &voice->sound;
+  const audio_kernels *kernels = &state->kernels;
+  bool stereo = sound->channels == 2;
+
+  // Constant power pan.
+  float angle = (voice->pan + 1.0f) * (float)M_PI * 0.25f;
+  float target_left = voice->gain * cosf(angle);
+  float target_right = voice->gain * sinf(angle);
+  if (!voice->started) {
+    voice->left = target_left;
+    voice->right = target_right;
+    voice->started = true;
+  }
+
+  float step_left = (target_left - voice->left) / (frames - first);
+  float step_right = (target_right - voice->right) / (frames - first);
+
+  double ratio = (double)sound->sample_rate / state->settings.sample_rate * voice->pitch;
+  uint64_t step = (uint64_t)(ratio * AUDIO_FRAC_ONE);
+  if (step == 0) step = 1;
+
+  uint64_t end = (uint64_t)sound->frame_count << AUDIO_FRAC_BITS;
+  // Both taps of a linear interpolation have to be inside the sound, with
+  // a frame to spare for the kernels rounding their float positions up.
+  uint64_t last_safe = sound->frame_count > 2 ? (uint64_t)(sound->frame_count - 2) << AUDIO_FRAC_BITS : 0;
+  bool done = false;
+
+  uint32_t Done = first;
+  while (Done < frames && !done) {
+    uint32_t remaining = frames - Done;
+    float left = voice->left + step_left * (Done - first);
+    float right = voice->right + step_right * (Done - first);
+    uint64_t frame = voice->position >> AUDIO_FRAC_BITS;
+    const float *src = sound->samples + frame * sound->channels;
+    uint32_t count;
+
+    if (step == AUDIO_FRAC_ONE && (voice->position & (AUDIO_FRAC_ONE - 1)) == 0) {
+      // Same rate, straight from the sound.
+      uint64_t available = sound->frame_count - frame;
+      count = available < remaining ? (uint32_t)available : remaining;
+      if (stereo) kernels->mix_stereo(src, state->mix + Done * 2, count, left, right, step_left, step_right);
+      else kernels->mix_mono(src, state->mix + Done * 2, count, left, right, step_left, step_right);
+
+    } else if (voice->position < last_safe) {
+      uint64_t safe = (last_safe - 1 - voice->position) / step + 1;
+      count = safe < remaining ? (uint32_t)safe : remaining;
+      float position = (float)(voice->position & (AUDIO_FRAC_ONE - 1)) / (float)AUDIO_FRAC_ONE;
+      float frame_step = (float)step / (float)AUDIO_FRAC_ONE;
+
+      if (stereo) {
+        kernels->resample_stereo(src, state->scratch, count, position, frame_step);
+        kernels->mix_stereo(state->scratch, state->mix + Done * 2, count, left, right, step_left, step_right);
+      } else {
+        kernels->resample_mono(src, state->scratch, count, position, frame_step);
+        kernels->mix_mono(state->scratch, state->mix + Done * 2, count, left, right, step_left, step_right);
+      }
+
+    } else {
+      // The last frame, interpolated towards the start or silence.
+      float a[2], b[2];
+      audio_voice_frame(voice, frame, a);
+      audio_voice_frame(voice, frame + 1, b);
+      float f = (float)(voice->position & (AUDIO_FRAC_ONE - 1)) / (float)AUDIO_FRAC_ONE;
+      state->mix[Done * 2] += (a[0] + (b[0] - a[0]) * f) * left;
+      state->mix[Done * 2 + 1] += (a[1] + (b[1] - a[1]) * f) * right;
+      count = 1;
+    }
+
+    voice->position += (uint64_t)count * step;
+    Done += count;
+
+    if (voice->position >= end) {
+      if (voice->loop) {
+        voice->position %= end;
+      } else {
+        done = true;
+      }
+    }
+  }
+
+  voice->left = target_left;
+  voice->right = target_right;
+  return !done;
+}
+
+static void audio_run_commands(audio_state *state) {
+  platform_message command;
+  while (mpsc_queue_pop(&state->commands, &command)) {
+    uint32_t slot = command.args[0];
+    if (slot >= AUDIO_MAX_VOICES) continue;
+
+    audio_voice *voice = &state->voices[slot];
+    if (__atomic_load_n(&voice->status, __ATOMIC_ACQUIRE) != AUDIO_VOICE_PLAYING ||
+        voice->generation != command.args[1]) {
+      continue; // Finished already.
+    }
+
+    switch (command.type) {
+      case AUDIO_COMMAND_SET_VOICE: {
+        memcpy(&voice->gain, &command.args[2], sizeof(float));
+        memcpy(&voice->pan, &command.args[3], sizeof(float));
+        memcpy(&voice->pitch, &command.args[4], sizeof(float));
+      } break;
+
+      case AUDIO_COMMAND_STOP: {
+        // Ramped down over one period instead of cut, no click.
+        voice->gain = 0;
+        voice->stopping = true;
+      } break;
+
+      default: {
+        printf("Unknown audio command %u\n", command.type);
+      } break;
+    }
+  }
+}
+
+void audio_mix_period(audio_state *state) {
+  uint32_t frames = state->settings.period_frames;
+  memset(state->mix, 0, (uint64_t)frames * 2 * sizeof(float));
+
+  audio_run_commands(state);
+
+  // The device frame this period starts on.
+  uint64_t period_frame = state->stats.frames;
+
+  uint32_t playing = 0;
+  for (uint32_t Index = 0; Index < AUDIO_MAX_VOICES; Index++) {
+    audio_voice *voice = &state->voices[Index];
+    if (__atomic_load_n(&voice->status, __ATOMIC_ACQUIRE) != AUDIO_VOICE_PLAYING) {
+      continue;
+    }
+
+    // Waiting for its frame. Stopped before it got there, it's just gone.
+    uint32_t first = 0;
+    if (!voice->started && voice->start_frame != 0) {
+      if (voice->stopping) {
+        audio_voice_free(voice);
+        continue;
+      }
+
+      if (voice->start_frame >= period_frame + frames) {
+        playing++;
+        continue;
+      }
+
+      if (voice->start_frame >= period_frame) {
+        first = (uint32_t)(voice->start_frame - period_frame);
+      } else {
+        __atomic_store_n(&state->stats.late_starts, state->stats.late_starts + 1, __ATOMIC_RELAXED);
+      }
+    }
+
+    playing++;
+    if (!audio_mix_voice(state, voice, first, frames) || voice->stopping) {
+      audio_voice_free(voice);
+    }
+  }
+
+  __atomic_store_n(&state->stats.voice_periods, state->stats.voice_periods + playing, __ATOMIC_RELAXED);
+  __atomic_store_n(&state->stats.voices_playing, playing, __ATOMIC_RELAXED);
+}
+
+// Game thread side.
+
+uint32_t audio_play(audio_state *state, const audio_sound *sound, float gain, float pan, bool loop,
+                    uint64_t start_frame) {
+  if (!sound->samples || sound->frame_count == 0 || sound->sample_rate == 0 ||
+      (sound->channels != 1 && sound->channels != 2)) {
+    return 0;
+  }
+
+  for (uint32_t Index = 0; Index < AUDIO_MAX_VOICES; Index++) {
+    audio_voice *voice = &state->voices[Index];
+    int32_t expected = AUDIO_VOICE_FREE;
+    if (!__atomic_compare_exchange_n(&voice->status, &expected, (int32_t)AUDIO_VOICE_CLAIMED, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      continue;
+    }
+
+    voice->sound = *sound;
+    voice->loop = loop;
+    voice->gain = gain;
+    voice->pan = pan < -1.0f ? -1.0f : (pan > 1.0f ? 1.0f : pan);
+    voice->pitch = 1.0f;
+    voice->start_frame = start_frame;
+    voice->position = 0;
+    voice->started = false;
+    voice->stopping = false;
+
+    uint32_t handle = (voice->generation << 8) | (Index + 1);
+    __atomic_store_n(&voice->status, (int32_t)AUDIO_VOICE_PLAYING, __ATOMIC_RELEASE);
+    return handle;
+  }
+
+  return 0;
+}
+
+// The audio thread's side of the clock is in audio_device.cpp, this is
+// the seqlock both sides go through.
+void audio_publish_clock(audio_state *state, uint64_t frame, uint64_t time_ns, double ns_per_frame) {
+  uint64_t sequence = state->clock_sequence;
+  __atomic_store_n(&state->clock_sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  __atomic_store_n(&state->clock.frame, frame, __ATOMIC_RELAXED);
+  __atomic_store_n(&state->clock.time_ns, time_ns, __ATOMIC_RELAXED);
+  __atomic_store(&state->clock.ns_per_frame, &ns_per_frame, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&state->clock_sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+audio_clock audio_get_clock(audio_state *state) {
+  audio_clock clock = {};
+  for (;;) {
+    uint64_t sequence = __atomic_load_n(&state->clock_sequence, __ATOMIC_ACQUIRE);
+    if (sequence & 1) continue;
+
+    clock.frame = __atomic_load_n(&state->clock.frame, __ATOMIC_RELAXED);
+    clock.time_ns = __atomic_load_n(&state->clock.time_ns, __ATOMIC_RELAXED);
+    __atomic_load(&state->clock.ns_per_frame, &clock.ns_per_frame, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&state->clock_sequence, __ATOMIC_RELAXED) == sequence) {
+      return clock;
+    }
+  }
+}
+
+// 0 before the device has a clock, which play treats as right away.
+uint64_t audio_frame_at(audio_state *state, uint64_t time_ns) {
+  audio_clock clock = audio_get_clock(state);
+  if (clock.ns_per_frame <= 0.0) {
+    return 0;
+  }
+
+  double frames = (double)(int64_t)(time_ns - clock.time_ns) / clock.ns_per_frame;
+  double frame = (double)clock.frame + floor(frames + 0.5);
+  return frame < 1.0 ? 1 : (uint64_t)frame;
+}
+
+static bool audio_send_command(audio_state *state, uint32_t type, uint32_t voice,
+                               float gain = 0, float pan = 0, float pitch = 0) {
+  if (voice == 0) return false;
+
+  platform_message command = {};
+  command.type = type;
+  command.args[0] = (voice & 0xFF) - 1;
+  command.args[1] = voice >> 8;
+  memcpy(&command.args[2], &gain, sizeof(float));
+  memcpy(&command.args[3], &pan, sizeof(float));
+  memcpy(&command.args[4], &pitch, sizeof(float));
+
+  if (!mpsc_queue_push(&state->commands, &command)) {
+    printf("Audio command queue is full, dropping a command\n");
+    return false;
+  }
+  return true;
+}
+
+void audio_set_voice(audio_state *state, uint32_t voice, float gain, float pan, float pitch) {
+  if (pan < -1.0f) pan = -1.0f;
+  if (pan > 1.0f) pan = 1.0f;
+  if (!(pitch > 0.0f)) pitch = 1.0f;
+  if (pitch > AUDIO_MAX_PITCH) pitch = AUDIO_MAX_PITCH;
+  audio_send_command(state, AUDIO_COMMAND_SET_VOICE, voice, gain, pan, pitch);
+}
+
+void audio_stop_voice(audio_state *state, uint32_t voice) {
+  audio_send_command(state, AUDIO_COMMAND_STOP, voice);
+}
+
+bool audio_voice_playing(audio_state *state, uint32_t voice) {
+  uint32_t slot = (voice & 0xFF) - 1;
+  if (voice == 0 || slot >= AUDIO_MAX_VOICES) return false;
+
+  audio_voice *slot_voice = &state->voices[slot];
+  return __atomic_load_n(&slot_voice->status, __ATOMIC_ACQUIRE) == AUDIO_VOICE_PLAYING &&
+         __atomic_load_n(&slot_voice->generation, __ATOMIC_RELAXED) == voice >> 8;
+}
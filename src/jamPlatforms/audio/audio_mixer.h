@@ -0,0 +1,127 @@
+#ifndef JAM_AUDIO_MIXER_H
+#define JAM_AUDIO_MIXER_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../platform.h"
+#include "../message_queue.h"
+#include "../av_clock.h"
+#include "../cpu_topology.h"
+#include "../cpu_dispatch.h"
+
+// The mix is float stereo, interleaved, converted to the sink's format
+// once at the end of each period. Every voice goes through the same two
+// steps: resample into a scratch buffer when its rate differs from the
+// device (or its pitch isn't 1), then gain/pan/accumulate into the mix.
+// Both steps are SSE2 on every x86-64, AVX2 where the CPU has it.
+
+#define AUDIO_DEFAULT_SAMPLE_RATE 48000
+#define AUDIO_DEFAULT_PERIOD_FRAMES 256
+#define AUDIO_MAX_PERIOD_FRAMES 4096
+#define AUDIO_MAX_PITCH 4.0f
+#define AUDIO_COMMAND_QUEUE_SIZE 256
+#define AUDIO_PATH_SIZE 256
+#define AUDIO_BUFFER_ALIGNMENT 64
+
+// Positions in the source are 32.32 fixed point frames.
+#define AUDIO_FRAC_BITS 32
+#define AUDIO_FRAC_ONE (1ull << AUDIO_FRAC_BITS)
+
+enum audio_voice_status {
+  AUDIO_VOICE_FREE,
+  AUDIO_VOICE_CLAIMED, // play_sound is filling it in.
+  AUDIO_VOICE_PLAYING,
+};
+
+enum audio_command_type {
+  AUDIO_COMMAND_SET_VOICE, // args: slot, generation, gain, pan, pitch (float bits).
+  AUDIO_COMMAND_STOP, // args: slot, generation.
+};
+
+// Handed over like the data transfers: the game thread claims a free slot,
+// fills in the sound and the starting parameters and publishes it with the
+// status. From then on only the audio thread touches it, until it's done
+// and sets it free again with a new generation so old handles miss.
+struct audio_voice {
+  int32_t status; // audio_voice_status
+  uint32_t generation;
+
+  audio_sound sound;
+  bool loop;
+
+  // Targets, what the mix ramps to over the next period.
+  float gain;
+  float pan;
+  float pitch;
+  uint64_t start_frame; // Device frame to start on, 0 for the next period.
+
+  // Audio thread only.
+  uint64_t position; // 32.32 frames into the sound.
+  float left; // Gains used at the end of the last period.
+  float right;
+  bool started;
+  bool stopping; // Fading out over this period, freed after it.
+};
+
+struct audio_state {
+  audio_settings settings;
+  char path[AUDIO_PATH_SIZE];
+  audio_kernels kernels; // Picked for the CPU, see cpu_dispatch.h.
+
+  audio_voice voices[AUDIO_MAX_VOICES];
+  mpsc_queue commands;
+
+  // Audio thread buffers, period_frames stereo frames each.
+  float *mix;
+  float *scratch;
+  int16_t *output;
+
+  // Realtime, on a core of its own when there are enough to spare one.
+  cpu_thread thread;
+  bool core_reserved;
+  bool stop;
+
+  // Sink.
+  int fd;
+  uint64_t data_bytes;
+  uint64_t period_ns; // The device's, off by clock_ppm on the null sink.
+  uint64_t next_period_ns;
+
+  // Where the device is, see audio_clock. device_clock is the audio
+  // thread's, filtering when it gets woken up for each period. What comes
+  // out of it is published to clock under clock_sequence (odd while it's
+  // being written, like the headless ring slots).
+  av_clock device_clock;
+  uint64_t clock_sequence;
+  audio_clock clock;
+
+  // Written by the audio thread, read with get_audio_stats.
+  audio_stats stats;
+  uint64_t start_ns;
+};
+
+// Mixes one period of every playing voice into state->mix.
+void audio_mix_period(audio_state *state);
+
+bool audio_open(audio_state *state, audio_settings *settings);
+void audio_close(audio_state *state);
+void audio_publish_clock(audio_state *state, uint64_t frame, uint64_t time_ns, double ns_per_frame);
+audio_clock audio_get_clock(audio_state *state);
+uint64_t audio_frame_at(audio_state *state, uint64_t time_ns);
+
+uint32_t audio_play(audio_state *state, const audio_sound *sound, float gain, float pan, bool loop,
+                    uint64_t start_frame = 0);
+void audio_set_voice(audio_state *state, uint32_t voice, float gain, float pan, float pitch);
+void audio_stop_voice(audio_state *state, uint32_t voice);
+bool audio_voice_playing(audio_state *state, uint32_t voice);
+audio_stats audio_get_stats(audio_state *state);
+void audio_print_stats(audio_state *state);
+
+#endif // !JAM_AUDIO_MIXER_H
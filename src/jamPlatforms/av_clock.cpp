@@ -0,0 +1,70 @@
+#include "av_clock.h"
+
+#include <math.h>
+#include <string.h>
+
+static void av_clock_set_bandwidth(av_clock *clock) {
+  double omega = 2.0 * M_PI * AV_CLOCK_BANDWIDTH_HZ * clock->period_ns * 1e-9;
+  clock->b = sqrt(2.0) * omega;
+  clock->c = omega * omega;
+}
+
+void av_clock_init(av_clock *clock, uint64_t period_ns) {
+  memset(clock, 0, sizeof(*clock));
+  clock->nominal_ns = (double)period_ns;
+  clock->period_ns = (double)period_ns;
+  av_clock_set_bandwidth(clock);
+}
+
+void av_clock_observe(av_clock *clock, uint64_t t_ns, uint64_t elapsed) {
+  double t = (double)t_ns;
+  if (clock->period_ns <= 0.0) {
+    return;
+  }
+
+  if (clock->events == 0) {
+    clock->next_ns = t + clock->period_ns;
+    clock->events = 1;
+    return;
+  }
+
+  // The grid point we predicted last time is next_ns, the one this event
+  // belongs to is elapsed - 1 periods after it.
+  double last_ns = clock->next_ns - clock->period_ns;
+  if (elapsed == 0) {
+    double periods = floor((t - last_ns) / clock->period_ns + 0.5);
+    elapsed = periods < 1.0 ? 1 : (uint64_t)periods;
+  }
+
+  double predicted = last_ns + clock->period_ns * (double)elapsed;
+  double error = t - predicted;
+  clock->events++;
+
+  if (fabs(error) > clock->period_ns * AV_CLOCK_RESET_PERIODS) {
+    clock->next_ns = t + clock->period_ns;
+    clock->resets++;
+    return;
+  }
+
+  // The period correction is per period, so one skipping several events
+  // doesn't count the whole error against a single one of them.
+  clock->next_ns = predicted + clock->b * error + clock->period_ns;
+  clock->period_ns += clock->c * error / (double)elapsed;
+
+  // A period that wanders off means the loop is following noise, not a
+  // clock. Nothing real is 10% off its nominal rate.
+  if (clock->period_ns < clock->nominal_ns * 0.9 || clock->period_ns > clock->nominal_ns * 1.1) {
+    clock->period_ns = clock->nominal_ns;
+  }
+}
+
+uint64_t av_clock_next_after(const av_clock *clock, uint64_t t_ns) {
+  if (clock->events == 0 || clock->period_ns <= 0.0) {
+    return t_ns;
+  }
+
+  // Either way from next_ns, the grid goes back in time as well.
+  double t = (double)t_ns;
+  double periods = ceil((t - clock->next_ns) / clock->period_ns);
+  return (uint64_t)(clock->next_ns + periods * clock->period_ns);
+}
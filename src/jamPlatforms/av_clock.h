@@ -0,0 +1,44 @@
+#ifndef JAM_AV_CLOCK_H
+#define JAM_AV_CLOCK_H
+
+#include <stdint.h>
+
+// Audio and video both run off a periodic event we only see late and with
+// jitter: the audio thread waking up for the next period, the compositor's
+// frame callback. av_clock filters those observations into a smooth
+// CLOCK_MONOTONIC timeline (a second order delay-locked loop, as in
+// Adriaensen's "Using a DLL to filter time"), so the position of the next
+// event and the true period can be read off without noise and without
+// drifting from the device's own clock.
+
+// Loop bandwidth. Low enough to average out scheduler jitter, high enough
+// to follow a device clock that is a few hundred ppm off within a second.
+#define AV_CLOCK_BANDWIDTH_HZ 1.0
+
+// An observation further off than this many periods is a stall (suspend,
+// an occluded window, a late audio period), the loop starts over from it.
+#define AV_CLOCK_RESET_PERIODS 4
+
+struct av_clock {
+  double nominal_ns; // What the device says its period is.
+  double period_ns; // Filtered period.
+  double next_ns; // Filtered time of the next event.
+  double b;
+  double c;
+  uint64_t events; // Observed so far, 0 until the first one.
+  uint64_t resets;
+};
+
+void av_clock_init(av_clock *clock, uint64_t period_ns);
+
+// One event happened at t_ns. elapsed is how many periods passed since the
+// last one (1 for strictly periodic sources), or 0 to have it rounded from
+// the time in between, for sources that skip events (frame callbacks stop
+// while nothing is drawn).
+void av_clock_observe(av_clock *clock, uint64_t t_ns, uint64_t elapsed);
+
+// The first event on the filtered grid at or after t_ns. Before any
+// observation there's no grid, that's just t_ns.
+uint64_t av_clock_next_after(const av_clock *clock, uint64_t t_ns);
+
+#endif // !JAM_AV_CLOCK_H
@@ -0,0 +1,116 @@
+#include "cpu_dispatch.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define CPU_HAVE_CPUID 1
+#endif
+
+static pthread_once_t cpu_features_once = PTHREAD_ONCE_INIT;
+static uint32_t cpu_features_detected;
+
+static pthread_once_t cpu_kernels_once = PTHREAD_ONCE_INIT;
+static cpu_kernels cpu_kernels_resolved;
+
+#if defined(CPU_HAVE_CPUID)
+// The register state the OS saves and restores, XCR0. Plain asm, the
+// intrinsic wants the file built with xsave.
+static uint64_t cpu_xgetbv() {
+  uint32_t eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return ((uint64_t)edx << 32) | eax;
+}
+#endif
+
+static uint32_t cpu_detect() {
+  uint32_t features = 0;
+
+#if defined(CPU_HAVE_CPUID)
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return 0;
+  }
+
+  if (edx & bit_SSE2) features |= CPU_FEATURE_SSE2;
+  if (ecx & bit_SSE4_1) features |= CPU_FEATURE_SSE41;
+
+  // XMM and YMM state on for AVX, opmask and both ZMM halves on top for AVX-512.
+  uint64_t xcr0 = (ecx & bit_OSXSAVE) ? cpu_xgetbv() : 0;
+  bool ymm = (xcr0 & 0x6) == 0x6;
+  bool zmm = (xcr0 & 0xE6) == 0xE6;
+  bool avx = ymm && (ecx & bit_AVX);
+
+  if (avx && (ecx & bit_F16C)) features |= CPU_FEATURE_F16C;
+  if (avx && (ecx & bit_FMA)) features |= CPU_FEATURE_FMA;
+
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    if (avx && (ebx & bit_AVX2)) {
+      features |= CPU_FEATURE_AVX2;
+    }
+    uint32_t avx512 = bit_AVX512F | bit_AVX512BW | bit_AVX512VL;
+    if (zmm && (features & CPU_FEATURE_AVX2) && (ebx & avx512) == avx512) {
+      features |= CPU_FEATURE_AVX512;
+    }
+  }
+#endif
+
+  return features;
+}
+
+static void cpu_features_init() {
+  uint32_t features = cpu_detect();
+
+  if (const char *cap = getenv("JAM_CPU")) {
+    uint32_t allowed = features;
+    if (strcmp(cap, "scalar") == 0) allowed = 0;
+    else if (strcmp(cap, "sse2") == 0) allowed = CPU_FEATURE_SSE2;
+    else if (strcmp(cap, "sse4.1") == 0) allowed = CPU_FEATURE_SSE2 | CPU_FEATURE_SSE41;
+    else if (strcmp(cap, "avx2") == 0) allowed = ~(uint32_t)CPU_FEATURE_AVX512;
+    else if (strcmp(cap, "avx512") != 0) printf("Unknown JAM_CPU %s\n", cap);
+    features &= allowed;
+  }
+
+  cpu_features_detected = features;
+}
+
+uint32_t cpu_features_get() {
+  pthread_once(&cpu_features_once, cpu_features_init);
+  return cpu_features_detected;
+}
+
+const cpu_kernel_variant *cpu_kernel_pick(const cpu_kernel_variant *variants, uint32_t count, uint32_t features) {
+  for (uint32_t Index = 0; Index < count; Index++) {
+    if ((variants[Index].features & features) == variants[Index].features) {
+      return &variants[Index];
+    }
+  }
+  // Tables end with a variant that needs nothing.
+  return &variants[count - 1];
+}
+
+static void cpu_kernels_init() {
+  cpu_kernels *kernels = &cpu_kernels_resolved;
+  kernels->features = cpu_features_get();
+  pixel_kernels_resolve(&kernels->pixel, kernels->features);
+  audio_kernels_resolve(&kernels->audio, kernels->features);
+
+  uint32_t features = kernels->features;
+  printf("CPU features:%s%s%s%s%s%s%s, kernels: pixels %s, audio %s\n",
+         features ? "" : " none",
+         features & CPU_FEATURE_SSE2 ? " sse2" : "",
+         features & CPU_FEATURE_SSE41 ? " sse4.1" : "",
+         features & CPU_FEATURE_AVX2 ? " avx2" : "",
+         features & CPU_FEATURE_FMA ? " fma" : "",
+         features & CPU_FEATURE_F16C ? " f16c" : "",
+         features & CPU_FEATURE_AVX512 ? " avx512" : "",
+         kernels->pixel.name, kernels->audio.name);
+}
+
+const cpu_kernels *cpu_kernels_get() {
+  pthread_once(&cpu_kernels_once, cpu_kernels_init);
+  return &cpu_kernels_resolved;
+}
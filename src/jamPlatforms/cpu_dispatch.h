@@ -0,0 +1,76 @@
+#ifndef JAM_CPU_DISPATCH_H
+#define JAM_CPU_DISPATCH_H
+
+#include <stdint.h>
+
+#include "../platform.h"
+
+// The library is built for baseline x86-64 (SSE2) and runs the best
+// kernels the CPU it lands on has. cpuid and xgetbv are asked once, the
+// OS has to have turned on the AVX / AVX-512 register state too, not just
+// the CPU have the instructions. JAM_CPU=scalar|sse2|sse4.1|avx2|avx512
+// caps what's used, to run the lower paths on a machine that has more.
+//
+// Every kernel has a table of variants, best first, each with the
+// features it needs and the last one needing none. They're resolved into
+// cpu_kernels on first use, after that a kernel call is a load and an
+// indirect call, like an ifunc that's already been through its resolver.
+// Variants with more than baseline are built with target attributes, the
+// rest of their file stays baseline.
+
+#define CPU_KERNEL(features, fn) {features, #fn, (void *)fn}
+#define CPU_KERNEL_RESOLVE(slot, variants, features) \
+  (slot = (decltype(slot))cpu_kernel_pick(variants, sizeof(variants) / sizeof(variants[0]), features)->fn)
+
+struct cpu_kernel_variant {
+  uint32_t features; // cpu_feature_flags it needs.
+  const char *name;
+  void *fn;
+};
+
+// Kernels, see pixel_convert.cpp. Rows of RGBA8 in (a little endian u32
+// per pixel), width pixels out.
+struct pixel_kernels {
+  const char *name; // The conversion XRGB8888 windows use, the one that matters.
+  void (*fill)(uint32_t *dst, uint32_t count, uint32_t value);
+  void (*to_argb8888)(const uint32_t *src, uint32_t *dst, uint32_t width, uint32_t alpha_or);
+  void (*to_rgba8888)(const uint32_t *src, uint32_t *dst, uint32_t width);
+  void (*to_rgb565)(const uint32_t *src, uint16_t *dst, uint32_t width);
+};
+
+// See audio_mixer.cpp. mix_* accumulate frames of src into the stereo mix,
+// the left and right gains going linearly from left/right by
+// step_left/step_right per frame. resample_* write frames of linearly
+// interpolated src starting at position (in frames, relative to src) and
+// stepping by step.
+struct audio_kernels {
+  const char *name; // The mix's, the one the audio thread spends its time in.
+  void (*mix_mono)(const float *src, float *mix, uint32_t frames,
+                   float left, float right, float step_left, float step_right);
+  void (*mix_stereo)(const float *src, float *mix, uint32_t frames,
+                     float left, float right, float step_left, float step_right);
+  void (*resample_mono)(const float *src, float *dst, uint32_t frames, float position, float step);
+  void (*resample_stereo)(const float *src, float *dst, uint32_t frames, float position, float step);
+  void (*to_s16)(const float *mix, int16_t *dst, uint32_t samples);
+};
+
+struct cpu_kernels {
+  uint32_t features;
+  pixel_kernels pixel;
+  audio_kernels audio;
+};
+
+// What the CPU and OS support, capped by JAM_CPU. Asked once.
+uint32_t cpu_features_get();
+
+// The first variant features allow, variants is best first.
+const cpu_kernel_variant *cpu_kernel_pick(const cpu_kernel_variant *variants, uint32_t count, uint32_t features);
+
+// Resolved on the first call.
+const cpu_kernels *cpu_kernels_get();
+
+// Each kernel file resolves its own.
+void pixel_kernels_resolve(pixel_kernels *kernels, uint32_t features);
+void audio_kernels_resolve(audio_kernels *kernels, uint32_t features);
+
+#endif // !JAM_CPU_DISPATCH_H
@@ -0,0 +1,434 @@
+#include "cpu_topology.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+static pthread_once_t cpu_topology_once = PTHREAD_ONCE_INIT;
+static cpu_topology cpu_topology_cached;
+
+// The reservation and the floating threads that follow it.
+static pthread_mutex_t cpu_lock = PTHREAD_MUTEX_INITIALIZER;
+static cpu_mask cpu_reserved;
+static cpu_thread *cpu_floating[CPU_MAX_THREADS];
+static uint32_t cpu_floating_count;
+
+static bool cpu_read_file(const char *path, char *buffer, size_t size) {
+  FILE *file = fopen(path, "re");
+  if (!file) {
+    return false;
+  }
+
+  size_t length = fread(buffer, 1, size - 1, file);
+  fclose(file);
+  buffer[length] = 0;
+  return length > 0;
+}
+
+static bool cpu_read_u32(const char *path, uint32_t *value) {
+  char buffer[32];
+  if (!cpu_read_file(path, buffer, sizeof(buffer))) {
+    return false;
+  }
+  *value = (uint32_t)strtoul(buffer, 0, 10);
+  return true;
+}
+
+// The kernel's cpu lists, "0-3,8,10-11".
+static bool cpu_read_list(const char *path, cpu_mask *mask) {
+  char buffer[4096];
+  memset(mask, 0, sizeof(*mask));
+  if (!cpu_read_file(path, buffer, sizeof(buffer))) {
+    return false;
+  }
+
+  char *cursor = buffer;
+  while (*cursor >= '0' && *cursor <= '9') {
+    uint32_t first = (uint32_t)strtoul(cursor, &cursor, 10);
+    uint32_t last = first;
+    if (*cursor == '-') {
+      last = (uint32_t)strtoul(cursor + 1, &cursor, 10);
+    }
+    for (uint32_t cpu = first; cpu <= last && cpu < CPU_MAX; cpu++) {
+      cpu_mask_set(mask, cpu);
+    }
+    if (*cursor == ',') {
+      cursor++;
+    }
+  }
+  return true;
+}
+
+static uint32_t cpu_mask_first(const cpu_mask *mask) {
+  for (uint32_t cpu = 0; cpu < CPU_MAX; cpu++) {
+    if (cpu_mask_has(mask, cpu)) return cpu;
+  }
+  return CPU_MAX;
+}
+
+// The lowest CPU sharing cpu's L3, CPU_MAX when sysfs doesn't say.
+static uint32_t cpu_read_l3(const char *root, uint32_t cpu) {
+  char path[256];
+  for (uint32_t Index = 0; Index < 16; Index++) {
+    uint32_t level = 0;
+    snprintf(path, sizeof(path), "%s/system/cpu/cpu%u/cache/index%u/level", root, cpu, Index);
+    if (!cpu_read_u32(path, &level) || level != 3) {
+      continue;
+    }
+
+    cpu_mask shared;
+    snprintf(path, sizeof(path), "%s/system/cpu/cpu%u/cache/index%u/shared_cpu_list", root, cpu, Index);
+    if (cpu_read_list(path, &shared)) {
+      return cpu_mask_first(&shared);
+    }
+  }
+  return CPU_MAX;
+}
+
+bool cpu_topology_read(cpu_topology *topology, const char *root, const cpu_mask *allowed) {
+  memset(topology, 0, sizeof(*topology));
+
+  char path[256];
+  snprintf(path, sizeof(path), "%s/system/cpu/online", root);
+  if (!cpu_read_list(path, &topology->online)) {
+    return false;
+  }
+  if (allowed) {
+    for (uint32_t Index = 0; Index < CPU_MAX / 64; Index++) {
+      topology->online.bits[Index] &= allowed->bits[Index];
+    }
+  }
+
+  // Cores and L3 domains are keyed by their lowest CPU, then numbered in
+  // the order they first show up.
+  uint32_t core_of[CPU_MAX];
+  uint32_t l3_of[CPU_MAX + 1];
+  for (uint32_t Index = 0; Index <= CPU_MAX; Index++) {
+    if (Index < CPU_MAX) core_of[Index] = UINT32_MAX;
+    l3_of[Index] = UINT32_MAX;
+  }
+
+  uint32_t capacity_max = 0;
+  for (uint32_t cpu = 0; cpu < CPU_MAX; cpu++) {
+    if (!cpu_mask_has(&topology->online, cpu)) {
+      continue;
+    }
+    cpu_info *info = &topology->cpus[cpu];
+    topology->cpu_count++;
+
+    cpu_mask siblings;
+    snprintf(path, sizeof(path), "%s/system/cpu/cpu%u/topology/thread_siblings_list", root, cpu);
+    uint32_t core_key = cpu_read_list(path, &siblings) ? cpu_mask_first(&siblings) : cpu;
+    if (core_key >= CPU_MAX) core_key = cpu;
+    if (core_of[core_key] == UINT32_MAX) {
+      core_of[core_key] = topology->core_count++;
+    }
+    info->core = core_of[core_key];
+
+    uint32_t l3_key = cpu_read_l3(root, cpu);
+    if (l3_of[l3_key] == UINT32_MAX) {
+      l3_of[l3_key] = topology->l3_count++;
+    }
+    info->l3 = l3_of[l3_key];
+
+    snprintf(path, sizeof(path), "%s/system/cpu/cpu%u/cpu_capacity", root, cpu);
+    cpu_read_u32(path, &info->capacity);
+    if (info->capacity > capacity_max) capacity_max = info->capacity;
+
+    uint32_t max_khz = 0;
+    snprintf(path, sizeof(path), "%s/system/cpu/cpu%u/cpufreq/cpuinfo_max_freq", root, cpu);
+    if (cpu_read_u32(path, &max_khz)) {
+      info->max_mhz = max_khz / 1000;
+    }
+  }
+
+  // Intel hybrids have a PMU per core type. Elsewhere the kernel's
+  // capacity says it, a core well below the biggest is a little one.
+  cpu_mask atom;
+  snprintf(path, sizeof(path), "%s/cpu_atom/cpus", root);
+  bool has_atom = cpu_read_list(path, &atom);
+  for (uint32_t cpu = 0; cpu < CPU_MAX; cpu++) {
+    if (!cpu_mask_has(&topology->online, cpu)) {
+      continue;
+    }
+    cpu_info *info = &topology->cpus[cpu];
+    bool efficiency = has_atom ? cpu_mask_has(&atom, cpu)
+                               : info->capacity && info->capacity * 5 < capacity_max * 4;
+    if (efficiency) {
+      info->kind = CPU_KIND_EFFICIENCY;
+      cpu_mask_set(&topology->efficiency, cpu);
+    }
+  }
+
+  uint32_t efficiency_count = cpu_mask_count(&topology->efficiency);
+  topology->hybrid = efficiency_count && efficiency_count < topology->cpu_count;
+  return topology->cpu_count > 0;
+}
+
+static void cpu_topology_init() {
+  cpu_set_t set;
+  cpu_mask allowed = {};
+  cpu_mask *limit = 0;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (uint32_t cpu = 0; cpu < CPU_MAX && cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) cpu_mask_set(&allowed, cpu);
+    }
+    limit = &allowed;
+  }
+
+  cpu_topology *topology = &cpu_topology_cached;
+  if (!cpu_topology_read(topology, CPU_SYSFS_ROOT, limit)) {
+    // No sysfs, every CPU we're allowed on its own core.
+    memset(topology, 0, sizeof(*topology));
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    for (uint32_t cpu = 0; cpu < CPU_MAX && (long)cpu < count; cpu++) {
+      if (limit && !cpu_mask_has(limit, cpu)) continue;
+      cpu_mask_set(&topology->online, cpu);
+      topology->cpus[cpu].core = topology->core_count++;
+      topology->cpu_count++;
+    }
+    topology->l3_count = 1;
+  }
+
+  uint32_t efficiency_count = cpu_mask_count(&topology->efficiency);
+  printf("CPU: %u cpus, %u cores, %u L3 domains", topology->cpu_count, topology->core_count, topology->l3_count);
+  if (topology->hybrid) {
+    printf(", hybrid with %u efficiency cpus", efficiency_count);
+  }
+  printf("\n");
+}
+
+const cpu_topology *cpu_topology_get() {
+  pthread_once(&cpu_topology_once, cpu_topology_init);
+  return &cpu_topology_cached;
+}
+
+static cpu_mask cpu_floating_mask_locked() {
+  const cpu_topology *topology = cpu_topology_get();
+  cpu_mask mask = topology->online;
+  for (uint32_t Index = 0; Index < CPU_MAX / 64; Index++) {
+    mask.bits[Index] &= ~cpu_reserved.bits[Index];
+  }
+  return cpu_mask_count(&mask) ? mask : topology->online;
+}
+
+cpu_mask cpu_floating_mask() {
+  pthread_mutex_lock(&cpu_lock);
+  cpu_mask mask = cpu_floating_mask_locked();
+  pthread_mutex_unlock(&cpu_lock);
+  return mask;
+}
+
+static void cpu_mask_to_set(const cpu_mask *mask, cpu_set_t *set) {
+  CPU_ZERO(set);
+  for (uint32_t cpu = 0; cpu < CPU_MAX && cpu < CPU_SETSIZE; cpu++) {
+    if (cpu_mask_has(mask, cpu)) CPU_SET(cpu, set);
+  }
+}
+
+static uint32_t cpu_place(const thread_settings *settings, bool floating) {
+  uint32_t granted = 0;
+
+  if (settings->name) {
+    char name[16];
+    snprintf(name, sizeof(name), "%s", settings->name);
+    pthread_setname_np(pthread_self(), name);
+  }
+
+  // Under the lock, so a reservation can't come in between and be undone.
+  cpu_set_t set;
+  pthread_mutex_lock(&cpu_lock);
+  cpu_mask affinity = floating ? cpu_floating_mask_locked() : settings->affinity;
+  cpu_mask_to_set(&affinity, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) == 0) {
+    granted |= THREAD_GRANTED_AFFINITY;
+  }
+  pthread_mutex_unlock(&cpu_lock);
+
+  // Realtime falls back to high, high to whatever we had.
+  bool high = settings->priority == THREAD_PRIORITY_HIGH;
+  if (settings->priority == THREAD_PRIORITY_REALTIME) {
+    struct sched_param param = {};
+    param.sched_priority = settings->fifo_priority ? (int)settings->fifo_priority : CPU_DEFAULT_FIFO_PRIORITY;
+    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) == 0) {
+      granted |= THREAD_GRANTED_REALTIME;
+    } else {
+      high = true;
+    }
+  }
+
+  if (high && setpriority(PRIO_PROCESS, (id_t)gettid(), CPU_HIGH_NICE) == 0) {
+    granted |= THREAD_GRANTED_NICE;
+  }
+
+  if (settings->priority == THREAD_PRIORITY_BACKGROUND) {
+    struct sched_param param = {};
+    sched_setscheduler(0, SCHED_BATCH, &param);
+    if (setpriority(PRIO_PROCESS, (id_t)gettid(), CPU_BACKGROUND_NICE) == 0) {
+      granted |= THREAD_GRANTED_NICE;
+    }
+  }
+
+  uint64_t slack = settings->timer_slack_ns;
+  if (!slack && (granted & THREAD_GRANTED_REALTIME)) {
+    slack = CPU_REALTIME_TIMER_SLACK_NS;
+  }
+  if (slack && prctl(PR_SET_TIMERSLACK, (unsigned long)slack, 0, 0, 0) == 0) {
+    granted |= THREAD_GRANTED_TIMER_SLACK;
+  }
+
+  return granted;
+}
+
+static bool cpu_mask_empty(const cpu_mask *mask) {
+  return cpu_mask_count(mask) == 0;
+}
+
+uint32_t cpu_thread_apply(const thread_settings *settings) {
+  thread_settings normal = {};
+  if (!settings) settings = &normal;
+  return cpu_place(settings, cpu_mask_empty(&settings->affinity));
+}
+
+static void *cpu_thread_main(void *arg) {
+  cpu_thread *thread = (cpu_thread *)arg;
+  thread->granted = cpu_place(&thread->settings, thread->floating);
+  sem_post(thread->started);
+  return thread->fn(thread->user);
+}
+
+// Says so when a thread that asked for more priority didn't get it, it
+// still runs.
+static void cpu_thread_report(const cpu_thread *thread) {
+  const char *name = thread->settings.name ? thread->settings.name : "thread";
+  if (thread->settings.priority == THREAD_PRIORITY_REALTIME && !(thread->granted & THREAD_GRANTED_REALTIME)) {
+    printf("%s: no SCHED_FIFO (RLIMIT_RTPRIO), %s\n", name,
+           (thread->granted & THREAD_GRANTED_NICE) ? "running at nice -10 instead" : "running at normal priority");
+  } else if (thread->settings.priority == THREAD_PRIORITY_HIGH && !(thread->granted & THREAD_GRANTED_NICE)) {
+    printf("%s: no nice -10 (RLIMIT_NICE), running at normal priority\n", name);
+  }
+}
+
+bool cpu_thread_start(cpu_thread *thread, thread_fn *fn, void *user, const thread_settings *settings) {
+  memset(thread, 0, sizeof(*thread));
+  thread->fn = fn;
+  thread->user = user;
+  if (settings) {
+    thread->settings = *settings;
+  }
+  if (thread->settings.name) {
+    snprintf(thread->name, sizeof(thread->name), "%s", thread->settings.name);
+    thread->settings.name = thread->name;
+  }
+  thread->floating = cpu_mask_empty(&thread->settings.affinity);
+
+  sem_t started;
+  sem_init(&started, 0, 0);
+  thread->started = &started;
+
+  // Registered before it can place itself, a reservation made after that
+  // moves it too.
+  pthread_mutex_lock(&cpu_lock);
+  int error = pthread_create(&thread->thread, 0, cpu_thread_main, thread);
+  if (error == 0 && thread->floating) {
+    if (cpu_floating_count < CPU_MAX_THREADS) {
+      cpu_floating[cpu_floating_count++] = thread;
+    } else {
+      thread->floating = false;
+    }
+  }
+  pthread_mutex_unlock(&cpu_lock);
+
+  if (error != 0) {
+    sem_destroy(&started);
+    thread->started = 0;
+    return false;
+  }
+
+  while (sem_wait(&started) != 0 && errno == EINTR) {
+  }
+  sem_destroy(&started);
+  thread->started = 0;
+  thread->running = true;
+
+  cpu_thread_report(thread);
+  return true;
+}
+
+void cpu_thread_join(cpu_thread *thread) {
+  if (!thread->running) {
+    return;
+  }
+
+  pthread_mutex_lock(&cpu_lock);
+  for (uint32_t Index = 0; Index < cpu_floating_count; Index++) {
+    if (cpu_floating[Index] == thread) {
+      cpu_floating[Index] = cpu_floating[--cpu_floating_count];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cpu_lock);
+
+  pthread_join(thread->thread, 0);
+  thread->running = false;
+}
+
+static void cpu_move_floating_locked() {
+  cpu_mask mask = cpu_floating_mask_locked();
+  cpu_set_t set;
+  cpu_mask_to_set(&mask, &set);
+  for (uint32_t Index = 0; Index < cpu_floating_count; Index++) {
+    pthread_setaffinity_np(cpu_floating[Index]->thread, sizeof(set), &set);
+  }
+}
+
+bool cpu_reserve_core(cpu_mask *cpus) {
+  const cpu_topology *topology = cpu_topology_get();
+  memset(cpus, 0, sizeof(*cpus));
+  if (topology->core_count < CPU_RESERVE_MIN_CORES) {
+    return false;
+  }
+
+  pthread_mutex_lock(&cpu_lock);
+  if (!cpu_mask_empty(&cpu_reserved)) {
+    pthread_mutex_unlock(&cpu_lock);
+    return false;
+  }
+
+  // The last performance core, away from CPU 0 where interrupts and
+  // housekeeping tend to land.
+  uint32_t cpu0_core = cpu_mask_has(&topology->online, 0) ? topology->cpus[0].core : UINT32_MAX;
+  uint32_t core = UINT32_MAX;
+  for (uint32_t cpu = CPU_MAX; cpu-- > 0;) {
+    const cpu_info *info = &topology->cpus[cpu];
+    if (cpu_mask_has(&topology->online, cpu) && info->kind == CPU_KIND_PERFORMANCE && info->core != cpu0_core) {
+      core = info->core;
+      break;
+    }
+  }
+
+  if (core != UINT32_MAX) {
+    for (uint32_t cpu = 0; cpu < CPU_MAX; cpu++) {
+      if (cpu_mask_has(&topology->online, cpu) && topology->cpus[cpu].core == core) {
+        cpu_mask_set(cpus, cpu);
+      }
+    }
+    cpu_reserved = *cpus;
+    cpu_move_floating_locked();
+  }
+  pthread_mutex_unlock(&cpu_lock);
+
+  return core != UINT32_MAX;
+}
+
+void cpu_release_core() {
+  pthread_mutex_lock(&cpu_lock);
+  memset(&cpu_reserved, 0, sizeof(cpu_reserved));
+  cpu_move_floating_locked();
+  pthread_mutex_unlock(&cpu_lock);
+}
@@ -0,0 +1,78 @@
+#ifndef JAM_CPU_TOPOLOGY_H
+#define JAM_CPU_TOPOLOGY_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+
+#include "../platform.h"
+
+// What the CPUs are and where the platform's threads go on them.
+//
+// The topology is read from sysfs once: SMT siblings from each CPU's
+// thread_siblings_list, L3 domains from the cache index with level 3, and
+// on hybrid parts which CPUs are efficiency cores, from the cpu_atom PMU
+// on Intel or a cpu_capacity below the biggest on ARM. Clock speed alone
+// doesn't say it, preferred cores on a regular part differ in that too.
+//
+// Threads are started through a trampoline that places the thread from
+// the inside before running it (name, affinity, policy, nice, timer slack)
+// and records what it was actually allowed. Each step that isn't permitted
+// is skipped: SCHED_FIFO falls back to a negative nice, that to a normal
+// thread, and the thread runs either way.
+//
+// One physical core can be reserved (all its SMT siblings with it) for the
+// audio thread, so nothing else is scheduled next to it. Threads started
+// without an affinity of their own float on the rest, and are moved off it
+// when it's taken after they started.
+
+#define CPU_SYSFS_ROOT "/sys/devices"
+
+// Below this many physical cores reserving one costs the rest too much.
+#define CPU_RESERVE_MIN_CORES 4
+
+#define CPU_MAX_THREADS 64 // Floating threads moved when the reservation changes.
+#define CPU_DEFAULT_FIFO_PRIORITY 10
+#define CPU_HIGH_NICE -10
+#define CPU_BACKGROUND_NICE 10
+#define CPU_REALTIME_TIMER_SLACK_NS 1 // The kernel's floor, what the default 50us becomes.
+
+struct cpu_thread {
+  pthread_t thread;
+  bool running;
+
+  thread_fn *fn;
+  void *user;
+  thread_settings settings;
+  char name[16];
+  bool floating; // No affinity of its own, follows the reservation.
+
+  uint32_t granted; // thread_granted, set before cpu_thread_start returns.
+  sem_t *started;
+};
+
+// Reads sysfs under root into topology, only the CPUs in allowed when
+// that's given. False when there's nothing there.
+bool cpu_topology_read(cpu_topology *topology, const char *root, const cpu_mask *allowed);
+
+// Read from CPU_SYSFS_ROOT on first use, the same from then on.
+const cpu_topology *cpu_topology_get();
+
+// Starts fn(user) on its own thread placed by settings (0 is a normal
+// floating thread). thread has to stay put until it's joined.
+bool cpu_thread_start(cpu_thread *thread, thread_fn *fn, void *user, const thread_settings *settings);
+void cpu_thread_join(cpu_thread *thread);
+
+// Places the calling thread, returns thread_granted. Empty affinity is the
+// CPUs outside the reservation as of now, the thread isn't moved later.
+uint32_t cpu_thread_apply(const thread_settings *settings);
+
+// Reserves a physical core, its CPUs go in *cpus. False when there are too
+// few cores to give one up or one is already reserved.
+bool cpu_reserve_core(cpu_mask *cpus);
+void cpu_release_core();
+
+// The CPUs a floating thread may run on right now.
+cpu_mask cpu_floating_mask();
+
+#endif // !JAM_CPU_TOPOLOGY_H
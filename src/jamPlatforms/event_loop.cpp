@@ -0,0 +1,391 @@
+#include "event_loop.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+uint64_t event_loop_now_ns() {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+const char *event_loop_engine_name(event_loop_engine engine) {
+  switch (engine) {
+    case EVENT_LOOP_EPOLL: return "epoll";
+    case EVENT_LOOP_IO_URING: return "io_uring";
+    default: return "auto";
+  }
+}
+
+bool event_loop_init(event_loop *loop, event_loop_engine engine) {
+  memset(loop, 0, sizeof(*loop));
+  loop->epoll_fd = -1;
+  loop->uring.fd = -1;
+
+  const char *forced = getenv("JAM_EVENT_LOOP");
+  if (forced) {
+    if (strcmp(forced, "epoll") == 0) engine = EVENT_LOOP_EPOLL;
+    else if (strcmp(forced, "io_uring") == 0) engine = EVENT_LOOP_IO_URING;
+    else printf("Unknown JAM_EVENT_LOOP %s\n", forced);
+  }
+
+  // No name, room for a handful of fds.
+  loop->recv_msg.msg_controllen = CMSG_SPACE(sizeof(int) * EVENT_LOOP_MAX_FDS);
+
+  if (engine != EVENT_LOOP_EPOLL) {
+    if (event_uring_init(loop)) {
+      loop->engine = EVENT_LOOP_IO_URING;
+      return true;
+    }
+
+    // Old kernels and seccomp'd sandboxes say no.
+    printf("io_uring isn't available, using epoll\n");
+    event_uring_free(loop);
+  }
+
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd < 0) {
+    printf("Failed to create the epoll instance\n");
+    return false;
+  }
+
+  loop->engine = EVENT_LOOP_EPOLL;
+  return true;
+}
+
+void event_loop_free(event_loop *loop) {
+  for (uint32_t Index = 0; Index < EVENT_LOOP_MAX_SOURCES; Index++) {
+    free(loop->sources[Index].buffer);
+  }
+
+  if (loop->engine == EVENT_LOOP_IO_URING) {
+    event_uring_free(loop);
+  }
+
+  if (loop->epoll_fd >= 0) {
+    close(loop->epoll_fd);
+  }
+
+  memset(loop, 0, sizeof(*loop));
+  loop->epoll_fd = -1;
+  loop->uring.fd = -1;
+}
+
+// Low 16 bits the slot, high 16 its generation.
+uint32_t event_loop_source_key(event_loop *loop, uint32_t index) {
+  return ((uint32_t)loop->sources[index].generation << 16) | index;
+}
+
+event_source *event_loop_find_source(event_loop *loop, uint32_t key) {
+  uint32_t index = key & 0xffff;
+  if (index >= loop->source_count) {
+    return 0;
+  }
+
+  event_source *source = &loop->sources[index];
+  if (source->type == EVENT_SOURCE_NONE || source->generation != (uint16_t)(key >> 16)) {
+    return 0;
+  }
+
+  return source;
+}
+
+static int event_loop_add(event_loop *loop, event_source_type type, int fd, void *user) {
+  uint32_t index = 0;
+  while (index < loop->source_count && loop->sources[index].type != EVENT_SOURCE_NONE) {
+    index++;
+  }
+
+  if (index == EVENT_LOOP_MAX_SOURCES) {
+    printf("Out of event loop sources\n");
+    return -1;
+  }
+
+  // The generation survives the slot being reused, and so does an inotify
+  // buffer, a cancelled read might still land in it.
+  event_source *source = &loop->sources[index];
+  uint16_t generation = source->generation;
+  uint8_t *buffer = source->buffer;
+  memset(source, 0, sizeof(*source));
+  source->generation = generation;
+  source->buffer = buffer;
+  source->type = type;
+  source->fd = fd;
+  source->user = user;
+
+  if (type == EVENT_SOURCE_INOTIFY && !source->buffer) {
+    source->buffer = (uint8_t *)aligned_alloc(8, EVENT_LOOP_INOTIFY_BUFFER_SIZE);
+    if (!source->buffer) {
+      source->type = EVENT_SOURCE_NONE;
+      return -1;
+    }
+  }
+
+  if (index == loop->source_count) {
+    loop->source_count++;
+  }
+
+  bool armed = false;
+  if (loop->engine == EVENT_LOOP_IO_URING) {
+    armed = event_uring_arm(loop, index);
+  } else {
+    struct epoll_event event = {};
+    event.events = type == EVENT_SOURCE_WRITABLE ? EPOLLOUT : EPOLLIN;
+    event.data.u32 = event_loop_source_key(loop, index);
+    armed = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+  }
+
+  if (!armed) {
+    printf("Failed to add fd %d to the event loop\n", fd);
+    event_loop_remove(loop, (int)index);
+    return -1;
+  }
+
+  return (int)index;
+}
+
+int event_loop_add_socket(event_loop *loop, int fd, event_socket_fn *on_data, void *user) {
+  int index = event_loop_add(loop, EVENT_SOURCE_SOCKET, fd, user);
+  if (index >= 0) loop->sources[index].on_data = on_data;
+  return index;
+}
+
+int event_loop_add_readable(event_loop *loop, int fd, event_readable_fn *on_readable, void *user) {
+  int index = event_loop_add(loop, EVENT_SOURCE_READABLE, fd, user);
+  if (index >= 0) loop->sources[index].on_readable = on_readable;
+  return index;
+}
+
+int event_loop_add_writable(event_loop *loop, int fd, event_readable_fn *on_writable, void *user) {
+  int index = event_loop_add(loop, EVENT_SOURCE_WRITABLE, fd, user);
+  if (index >= 0) loop->sources[index].on_readable = on_writable;
+  return index;
+}
+
+int event_loop_add_inotify(event_loop *loop, int inotify_fd, event_inotify_fn *on_inotify, void *user) {
+  int index = event_loop_add(loop, EVENT_SOURCE_INOTIFY, inotify_fd, user);
+  if (index >= 0) loop->sources[index].on_inotify = on_inotify;
+  return index;
+}
+
+void event_loop_remove(event_loop *loop, int index) {
+  if (index < 0 || (uint32_t)index >= loop->source_count) {
+    return;
+  }
+
+  event_source *source = &loop->sources[index];
+  if (source->type == EVENT_SOURCE_NONE) {
+    return;
+  }
+
+  if (loop->engine == EVENT_LOOP_IO_URING) {
+    if (source->armed) {
+      event_uring_cancel(loop, (uint32_t)index);
+    }
+  } else if (!source->hung_up) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, 0);
+    loop->stats.syscalls++;
+  }
+
+  source->type = EVENT_SOURCE_NONE;
+  source->armed = false;
+  source->generation++;
+
+  while (loop->source_count > 0 &&
+         loop->sources[loop->source_count - 1].type == EVENT_SOURCE_NONE) {
+    loop->source_count--;
+  }
+}
+
+bool event_loop_read_file(event_loop *loop, int fd, uint8_t *buffer, uint32_t size, uint64_t offset,
+                          event_read_fn *on_done, void *user) {
+  for (uint32_t Index = 0; Index < EVENT_LOOP_MAX_READS; Index++) {
+    event_file_read *read = &loop->reads[Index];
+    if (read->active) continue;
+
+    memset(read, 0, sizeof(*read));
+    read->active = true;
+    read->fd = fd;
+    read->buffer = buffer;
+    read->size = size;
+    read->offset = offset;
+    read->user = user;
+    read->on_done = on_done;
+
+    if (loop->engine == EVENT_LOOP_IO_URING) {
+      if (!event_uring_read_file(loop, Index)) {
+        read->active = false;
+        return false;
+      }
+      return true;
+    }
+
+    // epoll can't wait on regular files, the read happens now and the
+    // callback with the next pump like it would with io_uring.
+    int64_t result = pread(fd, buffer, size, (off_t)offset);
+    loop->stats.syscalls++;
+    read->result = result < 0 ? -errno : result;
+    read->done = true;
+    return true;
+  }
+
+  printf("Too many file reads in flight\n");
+  return false;
+}
+
+// Hands one received message to the source, fds first pulled out of its
+// control messages.
+void event_loop_deliver_socket(event_loop *loop, event_source *source, struct msghdr *msg,
+                               uint8_t *data, uint32_t size) {
+  int fds[EVENT_LOOP_MAX_FDS];
+  uint32_t fd_count = 0;
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      uint32_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (uint32_t Index = 0; Index < count; Index++) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg) + Index * sizeof(int), sizeof(int));
+        if (fd_count < EVENT_LOOP_MAX_FDS) {
+          fds[fd_count++] = fd;
+        } else {
+          close(fd);
+        }
+      }
+    }
+  }
+
+  if (size == 0) {
+    source->hung_up = true;
+  }
+
+  source->on_data(source->user, data, size, fds, fd_count);
+  loop->stats.events++;
+}
+
+void event_loop_deliver_inotify(event_loop *loop, event_source *source, uint8_t *data, int64_t size) {
+  int64_t offset = 0;
+  while (offset + (int64_t)sizeof(struct inotify_event) <= size) {
+    struct inotify_event *event = (struct inotify_event *)(data + offset);
+    source->on_inotify(source->user, event);
+    loop->stats.events++;
+    offset += sizeof(struct inotify_event) + event->len;
+  }
+}
+
+static int event_epoll_pump(event_loop *loop, int timeout_ms) {
+  int dispatched = 0;
+
+  // Reads finished when they were started, don't sleep on top of them.
+  for (uint32_t Index = 0; Index < EVENT_LOOP_MAX_READS; Index++) {
+    if (loop->reads[Index].active && loop->reads[Index].done) {
+      timeout_ms = 0;
+      break;
+    }
+  }
+
+  struct epoll_event events[EVENT_LOOP_MAX_SOURCES];
+  uint64_t wait_start = event_loop_now_ns();
+  int ready = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_SOURCES, timeout_ms);
+  loop->stats.syscalls++;
+  loop->stats.wait_ns += event_loop_now_ns() - wait_start;
+
+  if (ready < 0 && errno != EINTR) {
+    printf("epoll_wait failed\n");
+    return -1;
+  }
+
+  for (int Index = 0; Index < ready; Index++) {
+    // Gone if an earlier callback in this batch removed it.
+    event_source *source = event_loop_find_source(loop, events[Index].data.u32);
+    if (!source) continue;
+
+    switch (source->type) {
+      case EVENT_SOURCE_SOCKET: {
+        if (source->hung_up) break;
+
+        struct iovec io = {.iov_base = loop->scratch, .iov_len = sizeof(loop->scratch)};
+        alignas(8) char control[CMSG_SPACE(sizeof(int) * EVENT_LOOP_MAX_FDS)];
+        struct msghdr msg = {};
+        msg.msg_iov = &io;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        int64_t received = recvmsg(source->fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+        loop->stats.syscalls++;
+        if (received < 0 && (errno == EAGAIN || errno == EINTR)) break;
+
+        if (received <= 0) {
+          msg.msg_controllen = 0;
+          received = 0;
+          epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, 0);
+        }
+
+        event_loop_deliver_socket(loop, source, &msg, loop->scratch, (uint32_t)received);
+        dispatched++;
+      } break;
+
+      case EVENT_SOURCE_READABLE:
+      case EVENT_SOURCE_WRITABLE: {
+        source->on_readable(source->user);
+        loop->stats.events++;
+        dispatched++;
+      } break;
+
+      case EVENT_SOURCE_INOTIFY: {
+        int64_t size = read(source->fd, source->buffer, EVENT_LOOP_INOTIFY_BUFFER_SIZE);
+        loop->stats.syscalls++;
+        if (size > 0) {
+          event_loop_deliver_inotify(loop, source, source->buffer, size);
+          dispatched++;
+        }
+      } break;
+
+      default: break;
+    }
+  }
+
+  for (uint32_t Index = 0; Index < EVENT_LOOP_MAX_READS; Index++) {
+    event_file_read *read = &loop->reads[Index];
+    if (read->active && read->done) {
+      read->active = false;
+      read->on_done(read->user, read->buffer, read->result);
+      loop->stats.events++;
+      dispatched++;
+    }
+  }
+
+  return dispatched;
+}
+
+int pump_events(event_loop *loop, int timeout_ms) {
+  uint64_t wait_ns = loop->stats.wait_ns;
+  uint64_t start = event_loop_now_ns();
+
+  int dispatched = loop->engine == EVENT_LOOP_IO_URING ? event_uring_pump(loop, timeout_ms)
+                                                       : event_epoll_pump(loop, timeout_ms);
+
+  loop->stats.pumps++;
+  loop->stats.dispatch_ns += event_loop_now_ns() - start - (loop->stats.wait_ns - wait_ns);
+  return dispatched;
+}
+
+void event_loop_print_stats(event_loop *loop) {
+  event_loop_stats *stats = &loop->stats;
+  uint64_t pumps = stats->pumps ? stats->pumps : 1;
+
+  printf("event loop: engine=%s pumps=%llu events=%llu syscalls=%llu syscalls_per_pump=%.2f dispatch_us_per_pump=%.2f\n",
+         event_loop_engine_name(loop->engine),
+         (unsigned long long)stats->pumps,
+         (unsigned long long)stats->events,
+         (unsigned long long)stats->syscalls,
+         (double)stats->syscalls / pumps,
+         stats->dispatch_ns / 1e3 / pumps);
+}
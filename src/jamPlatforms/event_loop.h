@@ -0,0 +1,177 @@
+#ifndef JAM_EVENT_LOOP_H
+#define JAM_EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+
+#include "../platform.h"
+
+// The platform's event loop, one pump_events call per wakeup. Sources are
+// the display socket (bytes plus any fds that came with them), plain
+// readable or writable fds like eventfds and pipes, inotify watches and
+// async file reads.
+// Deadlines are just the timeout passed to pump_events.
+//
+// Two engines behind the same calls (event_loop_engine in platform.h),
+// picked at init or with JAM_EVENT_LOOP=epoll|io_uring:
+//
+//  - epoll: epoll_wait, then a recvmsg/read per ready source.
+//  - io_uring: the socket has a multishot recvmsg into a provided buffer
+//    ring, eventfds and pipes a multishot poll, inotify and file reads are plain
+//    reads in the same ring. Waiting and collecting everything that came
+//    in is a single io_uring_enter.
+
+#define EVENT_LOOP_MAX_SOURCES 32
+#define EVENT_LOOP_MAX_READS 16
+#define EVENT_LOOP_MAX_FDS 8 // Per received message.
+#define EVENT_LOOP_RECV_BUFFERS 16
+#define EVENT_LOOP_RECV_BUFFER_SIZE 16384
+#define EVENT_LOOP_INOTIFY_BUFFER_SIZE 4096
+#define EVENT_LOOP_RING_ENTRIES 64
+
+enum event_source_type {
+  EVENT_SOURCE_NONE,
+  EVENT_SOURCE_SOCKET,
+  EVENT_SOURCE_READABLE,
+  EVENT_SOURCE_WRITABLE,
+  EVENT_SOURCE_INOTIFY,
+};
+
+// size 0 means the other end hung up or the socket failed. The fds are
+// the callee's to keep or close.
+typedef void event_socket_fn(void *user, uint8_t *data, uint32_t size, int *fds, uint32_t fd_count);
+typedef void event_readable_fn(void *user); // Writable sources too.
+typedef void event_inotify_fn(void *user, const struct inotify_event *event);
+// result is the byte count or -errno.
+typedef void event_read_fn(void *user, uint8_t *buffer, int64_t result);
+
+struct event_source {
+  event_source_type type;
+  int fd;
+  void *user;
+  event_socket_fn *on_data;
+  event_readable_fn *on_readable;
+  event_inotify_fn *on_inotify;
+
+  uint8_t *buffer; // inotify reads land here.
+  bool armed; // io_uring: the request for it is in the ring.
+  bool hung_up;
+
+  // Bumped when the slot is removed, completions and epoll events carry
+  // it so nothing that was still in flight reaches the next owner.
+  uint16_t generation;
+};
+
+struct event_file_read {
+  bool active;
+  bool done; // epoll: read already, delivered on the next pump.
+  int fd;
+  uint8_t *buffer;
+  uint32_t size;
+  uint64_t offset;
+  int64_t result;
+  void *user;
+  event_read_fn *on_done;
+};
+
+struct event_loop_stats {
+  uint64_t pumps;
+  uint64_t syscalls; // Made by the loop itself, sends don't go through it.
+  uint64_t events; // Callbacks run.
+  uint64_t wait_ns; // Blocked in the kernel.
+  uint64_t dispatch_ns; // Running callbacks.
+};
+
+struct event_uring {
+  int fd;
+  uint32_t features;
+
+  void *sq_ring;
+  void *cq_ring;
+  uint64_t sq_ring_size;
+  uint64_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  uint64_t sqes_size;
+
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t *sq_array;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+
+  uint32_t sq_local_tail; // Written but not published to the kernel yet.
+
+  // Provided buffers for the multishot recvmsg, each one ends up holding
+  // an io_uring_recvmsg_out, the control messages and the payload.
+  struct io_uring_buf_ring *buf_ring;
+  uint64_t buf_ring_size;
+  uint8_t *recv_buffers;
+  uint16_t buf_tail;
+};
+
+struct event_loop {
+  event_loop_engine engine;
+
+  event_source sources[EVENT_LOOP_MAX_SOURCES];
+  uint32_t source_count; // Highest slot in use + 1, removed ones are EVENT_SOURCE_NONE.
+  event_file_read reads[EVENT_LOOP_MAX_READS];
+
+  int epoll_fd;
+  event_uring uring;
+
+  // The msghdr the socket is received with, the multishot recvmsg only
+  // takes its name and control lengths.
+  struct msghdr recv_msg;
+  alignas(8) uint8_t scratch[EVENT_LOOP_RECV_BUFFER_SIZE];
+
+  event_loop_stats stats;
+};
+
+bool event_loop_init(event_loop *loop, event_loop_engine engine);
+void event_loop_free(event_loop *loop);
+const char *event_loop_engine_name(event_loop_engine engine);
+
+// Return a source index or -1.
+int event_loop_add_socket(event_loop *loop, int fd, event_socket_fn *on_data, void *user);
+int event_loop_add_readable(event_loop *loop, int fd, event_readable_fn *on_readable, void *user);
+int event_loop_add_writable(event_loop *loop, int fd, event_readable_fn *on_writable, void *user);
+int event_loop_add_inotify(event_loop *loop, int inotify_fd, event_inotify_fn *on_inotify, void *user);
+
+// Safe from inside a callback, its own source included. The fd is still
+// the caller's to close; with io_uring the poll on it is only cancelled
+// by the next pump, until then the ring holds a reference to the file.
+void event_loop_remove(event_loop *loop, int index);
+
+// Reads size bytes at offset into buffer, which has to stay put until
+// on_done runs from a later pump_events.
+bool event_loop_read_file(event_loop *loop, int fd, uint8_t *buffer, uint32_t size, uint64_t offset,
+                          event_read_fn *on_done, void *user);
+
+// Waits up to timeout_ms (-1 forever, 0 not at all) for something to
+// happen and runs the callbacks for everything that did.
+// Returns how many ran, -1 when the loop itself failed.
+int pump_events(event_loop *loop, int timeout_ms);
+
+void event_loop_print_stats(event_loop *loop);
+
+// event_loop_uring.cpp.
+bool event_uring_init(event_loop *loop);
+void event_uring_free(event_loop *loop);
+bool event_uring_arm(event_loop *loop, uint32_t source_index);
+void event_uring_cancel(event_loop *loop, uint32_t source_index);
+bool event_uring_read_file(event_loop *loop, uint32_t read_index);
+int event_uring_pump(event_loop *loop, int timeout_ms);
+
+// Shared by both engines.
+uint64_t event_loop_now_ns();
+uint32_t event_loop_source_key(event_loop *loop, uint32_t index);
+event_source *event_loop_find_source(event_loop *loop, uint32_t key);
+void event_loop_deliver_socket(event_loop *loop, event_source *source, struct msghdr *msg,
+                               uint8_t *data, uint32_t size);
+void event_loop_deliver_inotify(event_loop *loop, event_source *source, uint8_t *data, int64_t size);
+
+#endif // !JAM_EVENT_LOOP_H
@@ -0,0 +1,409 @@
+#include "event_loop.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// io_uring spoken through the raw syscalls and the shared rings, there's
+// no liburing here either. Submissions are written to a local tail and
+// only published right before the io_uring_enter that also waits, so
+// arming a source never costs a syscall of its own.
+
+#define EVENT_URING_SOURCE 1ull
+#define EVENT_URING_READ 2ull
+#define EVENT_URING_CANCEL 3ull
+#define EVENT_URING_BUFFER_GROUP 0
+
+static uint64_t event_uring_user_data(uint64_t kind, uint32_t index) {
+  return (kind << 32) | index;
+}
+
+static int event_uring_enter(event_uring *uring, uint32_t to_submit, uint32_t min_complete,
+                             uint32_t flags, void *arg, uint64_t arg_size) {
+  return (int)syscall(__NR_io_uring_enter, uring->fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+// Everything published that the kernel hasn't consumed yet, without
+// SQPOLL it consumes exactly what the next enter is told to submit.
+static uint32_t event_uring_publish(event_uring *uring) {
+  __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+  return uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static struct io_uring_sqe *event_uring_get_sqe(event_loop *loop) {
+  event_uring *uring = &loop->uring;
+  uint32_t head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+  uint32_t tail = uring->sq_local_tail;
+
+  if (tail - head > uring->sq_mask) {
+    // Full, hand what's there to the kernel without waiting on anything.
+    uint32_t to_submit = event_uring_publish(uring);
+    int submitted = event_uring_enter(uring, to_submit, 0, 0, 0, 0);
+    loop->stats.syscalls++;
+
+    head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    if (submitted < 0 || tail - head > uring->sq_mask) {
+      return 0;
+    }
+  }
+
+  uint32_t index = tail & uring->sq_mask;
+  struct io_uring_sqe *sqe = &uring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  uring->sq_array[index] = index;
+  uring->sq_local_tail++;
+
+  return sqe;
+}
+
+// Only addr, len and bid: the first entry's resv is where the ring's tail
+// lives. Indexed by hand, in C++ the header's flex array member sits
+// behind an empty struct that takes up space and throws the offsets off.
+static void event_uring_recycle_buffer(event_uring *uring, uint16_t bid) {
+  struct io_uring_buf *bufs = (struct io_uring_buf *)uring->buf_ring;
+  struct io_uring_buf *buf = &bufs[uring->buf_tail & (EVENT_LOOP_RECV_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uring->recv_buffers + (uint64_t)bid * EVENT_LOOP_RECV_BUFFER_SIZE);
+  buf->len = EVENT_LOOP_RECV_BUFFER_SIZE;
+  buf->bid = bid;
+  uring->buf_tail++;
+}
+
+static void event_uring_publish_buffers(event_uring *uring) {
+  __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+bool event_uring_init(event_loop *loop) {
+  event_uring *uring = &loop->uring;
+
+  // Only this thread ever touches the ring, and completions are only
+  // needed when we ask for them, which saves the kernel interrupting us
+  // with task work in the middle of a frame.
+  struct io_uring_params params = {};
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  uring->fd = (int)syscall(__NR_io_uring_setup, EVENT_LOOP_RING_ENTRIES, &params);
+
+  if (uring->fd < 0 && errno == EINVAL) {
+    memset(&params, 0, sizeof(params));
+    uring->fd = (int)syscall(__NR_io_uring_setup, EVENT_LOOP_RING_ENTRIES, &params);
+  }
+
+  if (uring->fd < 0) {
+    return false;
+  }
+
+  uring->features = params.features;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    printf("io_uring is too old, it needs single mmap and the extended enter argument\n");
+    return false;
+  }
+
+  uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (uring->cq_ring_size > uring->sq_ring_size) {
+    uring->sq_ring_size = uring->cq_ring_size;
+  }
+  uring->cq_ring_size = uring->sq_ring_size;
+
+  uring->sq_ring = mmap(0, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+  if (uring->sq_ring == MAP_FAILED) {
+    uring->sq_ring = 0;
+    return false;
+  }
+  uring->cq_ring = uring->sq_ring;
+
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = (struct io_uring_sqe *)mmap(0, uring->sqes_size, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED) {
+    uring->sqes = 0;
+    return false;
+  }
+
+  uint8_t *sq = (uint8_t *)uring->sq_ring;
+  uring->sq_head = (uint32_t *)(sq + params.sq_off.head);
+  uring->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+  uring->sq_local_tail = *uring->sq_tail;
+  uring->sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+  uring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+
+  uint8_t *cq = (uint8_t *)uring->cq_ring;
+  uring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+  uring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+  uring->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  // The buffer ring has to be page aligned, the buffers themselves don't.
+  uring->buf_ring_size = EVENT_LOOP_RECV_BUFFERS * sizeof(struct io_uring_buf);
+  uring->buf_ring = (struct io_uring_buf_ring *)mmap(0, uring->buf_ring_size, PROT_READ | PROT_WRITE,
+                                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (uring->buf_ring == MAP_FAILED) {
+    uring->buf_ring = 0;
+    return false;
+  }
+
+  uint64_t buffers_size = (uint64_t)EVENT_LOOP_RECV_BUFFERS * EVENT_LOOP_RECV_BUFFER_SIZE;
+  uring->recv_buffers = (uint8_t *)aligned_alloc(64, buffers_size);
+  if (!uring->recv_buffers) {
+    return false;
+  }
+  memset(uring->recv_buffers, 0, buffers_size);
+
+  struct io_uring_buf_reg reg = {};
+  reg.ring_addr = (uint64_t)uring->buf_ring;
+  reg.ring_entries = EVENT_LOOP_RECV_BUFFERS;
+  reg.bgid = EVENT_URING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    printf("io_uring has no provided buffer rings\n");
+    return false;
+  }
+
+  for (uint16_t Index = 0; Index < EVENT_LOOP_RECV_BUFFERS; Index++) {
+    event_uring_recycle_buffer(uring, Index);
+  }
+  event_uring_publish_buffers(uring);
+
+  return true;
+}
+
+void event_uring_free(event_loop *loop) {
+  event_uring *uring = &loop->uring;
+
+  // Closing the ring cancels whatever is still armed.
+  if (uring->fd >= 0) close(uring->fd);
+  if (uring->sqes) munmap(uring->sqes, uring->sqes_size);
+  if (uring->sq_ring) munmap(uring->sq_ring, uring->sq_ring_size);
+  if (uring->buf_ring) munmap(uring->buf_ring, uring->buf_ring_size);
+  free(uring->recv_buffers);
+
+  memset(uring, 0, sizeof(*uring));
+  uring->fd = -1;
+}
+
+bool event_uring_arm(event_loop *loop, uint32_t source_index) {
+  event_source *source = &loop->sources[source_index];
+  struct io_uring_sqe *sqe = event_uring_get_sqe(loop);
+  if (!sqe) {
+    return false;
+  }
+
+  sqe->fd = source->fd;
+  sqe->user_data = event_uring_user_data(EVENT_URING_SOURCE, event_loop_source_key(loop, source_index));
+
+  switch (source->type) {
+    case EVENT_SOURCE_SOCKET: {
+      // One request for the life of the socket, each message picks a
+      // buffer from the group and comes back as its own completion.
+      sqe->opcode = IORING_OP_RECVMSG;
+      sqe->addr = (uint64_t)&loop->recv_msg;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = EVENT_URING_BUFFER_GROUP;
+      sqe->msg_flags = MSG_CMSG_CLOEXEC;
+    } break;
+
+    case EVENT_SOURCE_READABLE: {
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->len = IORING_POLL_ADD_MULTI;
+      sqe->poll32_events = POLLIN;
+    } break;
+
+    case EVENT_SOURCE_WRITABLE: {
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->len = IORING_POLL_ADD_MULTI;
+      sqe->poll32_events = POLLOUT;
+    } break;
+
+    case EVENT_SOURCE_INOTIFY: {
+      sqe->opcode = IORING_OP_READ;
+      sqe->addr = (uint64_t)source->buffer;
+      sqe->len = EVENT_LOOP_INOTIFY_BUFFER_SIZE;
+      sqe->off = (uint64_t)-1; // Not seekable, read from wherever it is.
+    } break;
+
+    default: {
+      return false;
+    }
+  }
+
+  source->armed = true;
+  return true;
+}
+
+// Goes out with the next pump's enter. Has to run before the slot's
+// generation moves on, the cancel matches on the request's user_data.
+void event_uring_cancel(event_loop *loop, uint32_t source_index) {
+  struct io_uring_sqe *sqe = event_uring_get_sqe(loop);
+  if (!sqe) {
+    printf("No room in the ring to cancel fd %d\n", loop->sources[source_index].fd);
+    return;
+  }
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = event_uring_user_data(EVENT_URING_SOURCE, event_loop_source_key(loop, source_index));
+  sqe->user_data = event_uring_user_data(EVENT_URING_CANCEL, 0);
+}
+
+bool event_uring_read_file(event_loop *loop, uint32_t read_index) {
+  event_file_read *read = &loop->reads[read_index];
+  struct io_uring_sqe *sqe = event_uring_get_sqe(loop);
+  if (!sqe) {
+    return false;
+  }
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = read->fd;
+  sqe->addr = (uint64_t)read->buffer;
+  sqe->len = read->size;
+  sqe->off = read->offset;
+  sqe->user_data = event_uring_user_data(EVENT_URING_READ, read_index);
+
+  return true;
+}
+
+static int event_uring_complete_source(event_loop *loop, event_source *source, struct io_uring_cqe *cqe) {
+  event_uring *uring = &loop->uring;
+
+  // Multishot requests that stop (out of buffers, errors) get re-armed after the batch.
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    source->armed = false;
+  }
+
+  switch (source->type) {
+    case EVENT_SOURCE_SOCKET: {
+      if (cqe->res == -ENOBUFS) {
+        return 0;
+      }
+
+      if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+        struct msghdr empty = {};
+        event_loop_deliver_socket(loop, source, &empty, 0, 0);
+        return 1;
+      }
+
+      uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      uint8_t *buffer = uring->recv_buffers + (uint64_t)bid * EVENT_LOOP_RECV_BUFFER_SIZE;
+      struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+
+      uint8_t *control = buffer + sizeof(*out) + loop->recv_msg.msg_namelen;
+      uint8_t *payload = control + loop->recv_msg.msg_controllen;
+
+      struct msghdr msg = {};
+      msg.msg_control = control;
+      msg.msg_controllen = out->controllen;
+
+      event_loop_deliver_socket(loop, source, &msg, payload, out->payloadlen);
+
+      event_uring_recycle_buffer(uring, bid);
+      event_uring_publish_buffers(uring);
+      return 1;
+    }
+
+    case EVENT_SOURCE_READABLE:
+    case EVENT_SOURCE_WRITABLE: {
+      if (cqe->res < 0) {
+        printf("io_uring poll on fd %d failed: %d\n", source->fd, cqe->res);
+        return 0;
+      }
+
+      source->on_readable(source->user);
+      loop->stats.events++;
+      return 1;
+    }
+
+    case EVENT_SOURCE_INOTIFY: {
+      source->armed = false;
+      if (cqe->res > 0) {
+        event_loop_deliver_inotify(loop, source, source->buffer, cqe->res);
+        return 1;
+      }
+      return 0;
+    }
+
+    default: {
+      return 0;
+    }
+  }
+}
+
+int event_uring_pump(event_loop *loop, int timeout_ms) {
+  event_uring *uring = &loop->uring;
+
+  uint32_t ready = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE) - *uring->cq_head;
+
+  // One enter submits whatever got armed since the last pump, runs the
+  // deferred completions and sleeps until one arrives or the timeout hits.
+  struct __kernel_timespec timeout = {};
+  timeout.tv_sec = timeout_ms > 0 ? timeout_ms / 1000 : 0;
+  timeout.tv_nsec = timeout_ms > 0 ? (long long)(timeout_ms % 1000) * 1000000 : 0;
+
+  struct io_uring_getevents_arg arg = {};
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = timeout_ms >= 0 ? (uint64_t)&timeout : 0;
+
+  uint32_t min_complete = (timeout_ms == 0 || ready > 0) ? 0 : 1;
+
+  uint32_t to_submit = event_uring_publish(uring);
+  uint64_t wait_start = event_loop_now_ns();
+  int submitted = event_uring_enter(uring, to_submit, min_complete,
+                                    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  loop->stats.syscalls++;
+  loop->stats.wait_ns += event_loop_now_ns() - wait_start;
+
+  if (submitted < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+    printf("io_uring_enter failed\n");
+    return -1;
+  }
+
+  int dispatched = 0;
+  uint32_t head = *uring->cq_head;
+  uint32_t tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail) {
+    struct io_uring_cqe cqe = uring->cqes[head & uring->cq_mask];
+    head++;
+    // Hand the slot back before the callback, it might queue more work.
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+    uint64_t kind = cqe.user_data >> 32;
+    uint32_t index = (uint32_t)cqe.user_data;
+
+    if (kind == EVENT_URING_SOURCE) {
+      // Removed sources still have their cancelled request come back.
+      event_source *source = event_loop_find_source(loop, index);
+      if (source) {
+        dispatched += event_uring_complete_source(loop, source, &cqe);
+      } else if (cqe.flags & IORING_CQE_F_BUFFER) {
+        event_uring_recycle_buffer(uring, (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+        event_uring_publish_buffers(uring);
+      }
+    } else if (kind == EVENT_URING_READ && index < EVENT_LOOP_MAX_READS) {
+      event_file_read *read = &loop->reads[index];
+      read->active = false;
+      read->on_done(read->user, read->buffer, cqe.res);
+      loop->stats.events++;
+      dispatched++;
+    }
+
+    tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+  }
+
+  // Goes out with the next pump's enter.
+  for (uint32_t Index = 0; Index < loop->source_count; Index++) {
+    event_source *source = &loop->sources[Index];
+    if (source->type != EVENT_SOURCE_NONE && !source->armed && !source->hung_up) {
+      event_uring_arm(loop, Index);
+    }
+  }
+
+  return dispatched;
+}
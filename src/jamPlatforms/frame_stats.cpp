@@ -0,0 +1,165 @@
+#include "frame_stats.h"
+#include "pixel_convert.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Copied a word at a time with relaxed atomics, the reader may be halfway
+// through while the next copy is written and retries when it was.
+static_assert(sizeof(window_frame_stats) % sizeof(uint64_t) == 0, "published as words");
+#define FRAME_STATS_WORDS (sizeof(window_frame_stats) / sizeof(uint64_t))
+
+void frame_stats_input_latency(frame_stats_recorder *recorder, uint64_t latency_ns) {
+  window_frame_stats *stats = &recorder->stats;
+  recorder->latency[stats->input_latency_samples % WINDOW_INPUT_LATENCY_WINDOW] = latency_ns;
+  recorder->latency_changed = true;
+
+  stats->input_latency_samples++;
+  stats->input_latency_last_ns = latency_ns;
+  if (latency_ns > stats->input_latency_max_ns) {
+    stats->input_latency_max_ns = latency_ns;
+  }
+}
+
+static int frame_stats_compare(const void *a, const void *b) {
+  uint64_t left = *(const uint64_t *)a;
+  uint64_t right = *(const uint64_t *)b;
+  return left < right ? -1 : left > right;
+}
+
+// Nearest rank over the samples in the ring, at most once a frame.
+static void frame_stats_latency_percentiles(frame_stats_recorder *recorder) {
+  window_frame_stats *stats = &recorder->stats;
+  uint64_t count = stats->input_latency_samples;
+  if (count > WINDOW_INPUT_LATENCY_WINDOW) count = WINDOW_INPUT_LATENCY_WINDOW;
+
+  uint64_t sorted[WINDOW_INPUT_LATENCY_WINDOW];
+  memcpy(sorted, recorder->latency, count * sizeof(sorted[0]));
+  qsort(sorted, count, sizeof(sorted[0]), frame_stats_compare);
+
+  stats->input_latency_p50_ns = sorted[(count * 50 + 99) / 100 - 1];
+  stats->input_latency_p90_ns = sorted[(count * 90 + 99) / 100 - 1];
+  stats->input_latency_p99_ns = sorted[(count * 99 + 99) / 100 - 1];
+  recorder->latency_changed = false;
+}
+
+void frame_stats_present(frame_stats_recorder *recorder, uint64_t now_ns) {
+  window_frame_stats *stats = &recorder->stats;
+
+  if (recorder->last_present_ns != 0) {
+    uint64_t frame_ns = now_ns - recorder->last_present_ns;
+    uint64_t bucket = frame_ns / WINDOW_FRAME_TIME_BUCKET_NS;
+    if (bucket >= WINDOW_FRAME_TIME_BUCKETS) bucket = WINDOW_FRAME_TIME_BUCKETS - 1;
+
+    stats->frame_time_histogram[bucket]++;
+    stats->frame_time_last_ns = frame_ns;
+    if (frame_ns > stats->frame_time_max_ns) {
+      stats->frame_time_max_ns = frame_ns;
+    }
+  }
+  recorder->last_present_ns = now_ns;
+
+  uint64_t syscalls = stats->syscalls - recorder->syscalls_at_present;
+  recorder->syscalls_at_present = stats->syscalls;
+  stats->syscalls_last_frame = (uint32_t)syscalls;
+  frame_stats_high_water(&stats->syscalls_max_frame, syscalls);
+
+  frame_stats_high_water(&stats->input_events_high_water, recorder->input_events);
+  recorder->input_events = 0;
+
+  if (recorder->latency_changed) {
+    frame_stats_latency_percentiles(recorder);
+  }
+
+  uint64_t sequence = recorder->sequence;
+  __atomic_store_n(&recorder->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  const uint64_t *src = (const uint64_t *)stats;
+  uint64_t *dst = (uint64_t *)&recorder->published;
+  for (uint32_t Index = 0; Index < FRAME_STATS_WORDS; Index++) {
+    __atomic_store_n(&dst[Index], src[Index], __ATOMIC_RELAXED);
+  }
+
+  __atomic_store_n(&recorder->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+window_frame_stats frame_stats_read(frame_stats_recorder *recorder, const window_frame_stats *drawn) {
+  window_frame_stats result;
+  uint64_t *dst = (uint64_t *)&result;
+  const uint64_t *src = (const uint64_t *)&recorder->published;
+
+  for (;;) {
+    uint64_t sequence = __atomic_load_n(&recorder->sequence, __ATOMIC_ACQUIRE);
+    if (sequence & 1) continue;
+
+    for (uint32_t Index = 0; Index < FRAME_STATS_WORDS; Index++) {
+      dst[Index] = __atomic_load_n(&src[Index], __ATOMIC_RELAXED);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&recorder->sequence, __ATOMIC_RELAXED) == sequence) {
+      break;
+    }
+  }
+
+  result.frames = drawn->frames;
+  result.page_faults_last = drawn->page_faults_last;
+  result.page_faults_max = drawn->page_faults_max;
+  result.page_faults_total = drawn->page_faults_total;
+  return result;
+}
+
+static uint32_t frame_stats_color(uint64_t frame_ns, uint64_t interval_ns) {
+  if (frame_ns <= interval_ns) return 0xFF40D040; // Little endian RGBA.
+  if (frame_ns <= interval_ns * 2) return 0xFF30D0E0;
+  return 0xFF3030E0;
+}
+
+void frame_stats_draw_overlay(const window_frame_stats *stats, uint64_t interval_ns,
+                              uint8_t *pixels, uint32_t stride, uint32_t width, uint32_t height) {
+  uint32_t x = FRAME_STATS_OVERLAY_MARGIN;
+  uint32_t y = FRAME_STATS_OVERLAY_MARGIN;
+  uint32_t box_width = WINDOW_FRAME_TIME_BUCKETS * FRAME_STATS_OVERLAY_BAR_WIDTH;
+  uint32_t box_height = FRAME_STATS_OVERLAY_HEIGHT + 6; // The last frame's bar under it.
+  if (x + box_width > width || y + box_height > height) {
+    return;
+  }
+  if (interval_ns == 0) {
+    interval_ns = 1000000000ull / 60; // Unthrottled, or no refresh rate yet.
+  }
+
+  uint8_t *origin = pixels + (uint64_t)y * stride + x * 4;
+  pixel_fill_rect(origin, stride, box_width, box_height, 0xE0181818);
+
+  uint64_t most = 1;
+  for (uint32_t Index = 0; Index < WINDOW_FRAME_TIME_BUCKETS; Index++) {
+    if (stats->frame_time_histogram[Index] > most) most = stats->frame_time_histogram[Index];
+  }
+
+  // Bucket counts scaled to the fullest one, anything at all gets a pixel.
+  for (uint32_t Index = 0; Index < WINDOW_FRAME_TIME_BUCKETS; Index++) {
+    uint64_t count = stats->frame_time_histogram[Index];
+    if (count == 0) continue;
+
+    uint32_t bar = (uint32_t)(count * FRAME_STATS_OVERLAY_HEIGHT / most);
+    if (bar == 0) bar = 1;
+
+    uint8_t *top = origin + (uint64_t)(FRAME_STATS_OVERLAY_HEIGHT - bar) * stride + Index * FRAME_STATS_OVERLAY_BAR_WIDTH * 4;
+    uint64_t bucket_ns = Index * WINDOW_FRAME_TIME_BUCKET_NS;
+    pixel_fill_rect(top, stride, FRAME_STATS_OVERLAY_BAR_WIDTH - 1, bar, frame_stats_color(bucket_ns, interval_ns));
+  }
+
+  // The last frame on the same scale, a bucket's width per millisecond.
+  uint64_t last = stats->frame_time_last_ns * FRAME_STATS_OVERLAY_BAR_WIDTH / WINDOW_FRAME_TIME_BUCKET_NS;
+  if (last > box_width) last = box_width;
+  if (last > 0) {
+    pixel_fill_rect(origin + (uint64_t)(FRAME_STATS_OVERLAY_HEIGHT + 2) * stride, stride, (uint32_t)last, 3,
+                    frame_stats_color(stats->frame_time_last_ns, interval_ns));
+  }
+}
+
+bool frame_stats_overlay_wanted(const window_settings *settings) {
+  const char *overlay = getenv("JAM_STATS_OVERLAY");
+  return overlay ? strcmp(overlay, "1") == 0 : settings->stats_overlay;
+}
@@ -0,0 +1,61 @@
+#ifndef JAM_FRAME_STATS_H
+#define JAM_FRAME_STATS_H
+
+#include <stdint.h>
+
+#include "../platform.h"
+
+// window_frame_stats as the backends keep them. The thread talking to the
+// display counts into stats as it goes and publishes a copy after every
+// present under sequence (odd while it's written, like the audio clock),
+// so get_frame_stats on the game thread never waits on it.
+
+#define FRAME_STATS_OVERLAY_MARGIN 8
+#define FRAME_STATS_OVERLAY_BAR_WIDTH 4 // Per histogram bucket, a pixel of it is the gap.
+#define FRAME_STATS_OVERLAY_HEIGHT 48
+
+struct frame_stats_recorder {
+  // The display thread's.
+  window_frame_stats stats;
+  uint64_t last_present_ns;
+  uint64_t syscalls_at_present;
+  uint32_t input_events; // Since the last present.
+
+  // Input latency, the last WINDOW_INPUT_LATENCY_WINDOW samples in a ring.
+  // Percentiles are worked out again when it's published after a new one.
+  uint64_t latency[WINDOW_INPUT_LATENCY_WINDOW];
+  bool latency_changed;
+
+  uint64_t sequence;
+  window_frame_stats published;
+};
+
+// A frame went out at now_ns, publishes everything counted so far.
+void frame_stats_present(frame_stats_recorder *recorder, uint64_t now_ns);
+
+// The last published stats. Frames and page faults come from drawn
+// instead, those are counted by the thread drawing.
+window_frame_stats frame_stats_read(frame_stats_recorder *recorder, const window_frame_stats *drawn);
+
+inline void frame_stats_high_water(uint32_t *mark, uint64_t value) {
+  if (value > *mark) {
+    *mark = (uint32_t)value;
+  }
+}
+
+inline void frame_stats_input(frame_stats_recorder *recorder) {
+  recorder->input_events++;
+}
+
+// A frame that had input was shown latency_ns after the oldest of it.
+void frame_stats_input_latency(frame_stats_recorder *recorder, uint64_t latency_ns);
+
+// Histogram bars and the last frame's time into the corner of an RGBA8
+// frame. Green within interval_ns, yellow within two, red past that.
+void frame_stats_draw_overlay(const window_frame_stats *stats, uint64_t interval_ns,
+                              uint8_t *pixels, uint32_t stride, uint32_t width, uint32_t height);
+
+// window_settings.stats_overlay or JAM_STATS_OVERLAY=1.
+bool frame_stats_overlay_wanted(const window_settings *settings);
+
+#endif // !JAM_FRAME_STATS_H
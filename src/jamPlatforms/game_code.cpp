@@ -0,0 +1,266 @@
+#include "game_code.h"
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t game_code_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t game_code_mtime_ns(const struct stat *buf) {
+  return (uint64_t)buf->st_mtim.tv_sec * 1000000000ull + (uint64_t)buf->st_mtim.tv_nsec;
+}
+
+// A private copy of the file, so the loader sees a new object every time.
+static int game_code_copy(int fd, uint64_t size) {
+  int copy = memfd_create("jam_game", MFD_CLOEXEC);
+  if (copy < 0) {
+    return -1;
+  }
+
+  off_t offset = 0;
+  while ((uint64_t)offset < size) {
+    ssize_t sent = sendfile(copy, fd, &offset, size - (uint64_t)offset);
+    if (sent <= 0) {
+      close(copy);
+      return -1;
+    }
+  }
+
+  return copy;
+}
+
+static bool game_code_load(game_code_state *game) {
+  uint64_t start = game_code_now_ns();
+
+  int fd = open(game->path, O_RDONLY | O_CLOEXEC);
+  struct stat buf = {};
+  if (fd < 0 || fstat(fd, &buf) == -1) {
+    printf("Couldn't open the game code %s\n", game->path);
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  game->loaded_mtime_ns = game_code_mtime_ns(&buf);
+  game->loaded_size = (uint64_t)buf.st_size;
+
+  // The loader goes by name before inode, the copy stays open while its
+  // code is loaded so the next one's /proc path can't be the same. No
+  // memfd (or no /proc to open it through), the file itself is loaded,
+  // a linker writes a new inode each time so that mostly works too.
+  void *handle = 0;
+  int copy = game_code_copy(fd, (uint64_t)buf.st_size);
+  close(fd);
+  if (copy >= 0) {
+    char copy_path[64];
+    snprintf(copy_path, sizeof(copy_path), "/proc/self/fd/%d", copy);
+    handle = dlopen(copy_path, RTLD_NOW | RTLD_LOCAL);
+  }
+  if (!handle) {
+    handle = dlopen(game->path, RTLD_NOW | RTLD_LOCAL);
+  }
+
+  if (!handle) {
+    printf("Couldn't load the game code: %s\n", dlerror());
+    if (copy >= 0) close(copy);
+    return false;
+  }
+
+  // Same soname, or an object that never unloaded, gets the old code back.
+  game_frame_fn *frame = (game_frame_fn *)dlsym(handle, GAME_FRAME_SYMBOL);
+  if (!frame || handle == game->handle) {
+    if (!frame) {
+      printf("%s has no %s\n", game->path, GAME_FRAME_SYMBOL);
+    } else {
+      printf("%s loaded as the code already running, does it have a soname?\n", game->path);
+    }
+    dlclose(handle);
+    if (copy >= 0) close(copy);
+    return false;
+  }
+
+  if (game->handle) {
+    dlclose(game->handle);
+  }
+  if (game->code_fd >= 0) {
+    close(game->code_fd);
+  }
+  game->handle = handle;
+  game->code_fd = copy;
+  game->frame = frame;
+
+  game->reload_ns_last = game_code_now_ns() - start;
+  if (game->reload_ns_last > game->reload_ns_max) {
+    game->reload_ns_max = game->reload_ns_last;
+  }
+  return true;
+}
+
+static void game_code_watch(game_code_state *game) {
+  char directory[PATH_MAX];
+  const char *slash = strrchr(game->path, '/');
+  if (slash) {
+    size_t length = (size_t)(slash - game->path);
+    memcpy(directory, game->path, length);
+    directory[length] = 0;
+    if (length == 0) {
+      strcpy(directory, "/");
+    }
+    game->name = slash + 1;
+  } else {
+    strcpy(directory, ".");
+    game->name = game->path;
+  }
+
+  game->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (game->watch_fd >= 0 && inotify_add_watch(game->watch_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(game->watch_fd);
+    game->watch_fd = -1;
+  }
+
+  if (game->watch_fd < 0) {
+    printf("No inotify for %s, checking the game code every frame\n", directory);
+  }
+}
+
+bool game_code_open(game_code_state *game, const char *path, uint64_t permanent_size, uint64_t transient_size) {
+  memset(game, 0, sizeof(*game));
+  game->watch_fd = -1;
+  game->code_fd = -1;
+
+  if (strlen(path) >= sizeof(game->path)) {
+    printf("Game code path too long\n");
+    return false;
+  }
+  strcpy(game->path, path);
+
+  // Reserved, not committed: pages come in zeroed as the game touches them.
+  uint64_t size = permanent_size + transient_size;
+  if (size) {
+    void *base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+      printf("Couldn't reserve %llu bytes of game memory\n", (unsigned long long)size);
+      return false;
+    }
+    game->memory.permanent = (uint8_t *)base;
+    game->memory.permanent_size = permanent_size;
+    game->memory.transient = (uint8_t *)base + permanent_size;
+    game->memory.transient_size = transient_size;
+  }
+
+  // Watched first, a build finishing while this loads isn't missed.
+  game_code_watch(game);
+  game->seen_since_ns = game_code_now_ns();
+
+  // The reservation and the watch go again, game is left as if closed.
+  if (!game_code_load(game)) {
+    game_code_close(game);
+    return false;
+  }
+  game->seen_mtime_ns = game->loaded_mtime_ns;
+  game->seen_size = game->loaded_size;
+
+  printf("Game code %s loaded in %.2f ms\n", game->path, game->reload_ns_last / 1e6);
+  return true;
+}
+
+void game_code_close(game_code_state *game) {
+  if (game->memory.reloads || game->failed_reloads) {
+    printf("Game code: %u reloads, %llu failed, slowest %.2f ms\n", game->memory.reloads,
+           (unsigned long long)game->failed_reloads, game->reload_ns_max / 1e6);
+  }
+
+  if (game->handle) {
+    dlclose(game->handle);
+  }
+  if (game->code_fd >= 0) {
+    close(game->code_fd);
+  }
+  if (game->watch_fd >= 0) {
+    close(game->watch_fd);
+  }
+  if (game->memory.permanent) {
+    munmap(game->memory.permanent, game->memory.permanent_size + game->memory.transient_size);
+  }
+
+  memset(game, 0, sizeof(*game));
+  game->watch_fd = -1;
+  game->code_fd = -1;
+}
+
+static void game_code_poll_inotify(game_code_state *game) {
+  alignas(struct inotify_event) uint8_t buffer[GAME_CODE_INOTIFY_BUFFER_SIZE];
+
+  for (;;) {
+    ssize_t size = read(game->watch_fd, buffer, sizeof(buffer));
+    if (size <= 0) {
+      return;
+    }
+
+    for (ssize_t offset = 0; offset < size;) {
+      const struct inotify_event *event = (const struct inotify_event *)(buffer + offset);
+      if ((event->mask & IN_Q_OVERFLOW) || (event->len && strcmp(event->name, game->name) == 0)) {
+        game->changed = true;
+      }
+      offset += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+// Reloads once the file has looked the same for a while, a build still
+// writing it keeps pushing that out.
+static void game_code_poll_stat(game_code_state *game) {
+  struct stat buf = {};
+  if (stat(game->path, &buf) == -1) {
+    return;
+  }
+
+  uint64_t now = game_code_now_ns();
+  uint64_t mtime = game_code_mtime_ns(&buf);
+  if (mtime != game->seen_mtime_ns || (uint64_t)buf.st_size != game->seen_size) {
+    game->seen_mtime_ns = mtime;
+    game->seen_size = (uint64_t)buf.st_size;
+    game->seen_since_ns = now;
+    return;
+  }
+
+  if ((mtime != game->loaded_mtime_ns || game->seen_size != game->loaded_size) &&
+      now - game->seen_since_ns >= GAME_CODE_SETTLE_NS) {
+    game->changed = true;
+  }
+}
+
+bool game_code_reload(game_code_state *game) {
+  if (game->watch_fd >= 0) {
+    game_code_poll_inotify(game);
+  } else {
+    game_code_poll_stat(game);
+  }
+
+  if (!game->changed) {
+    return false;
+  }
+  game->changed = false;
+
+  if (!game_code_load(game)) {
+    // Waits for the next build, stat polling included.
+    game->loaded_mtime_ns = game->seen_mtime_ns;
+    game->loaded_size = game->seen_size;
+    game->failed_reloads++;
+    printf("Kept the old game code running\n");
+    return false;
+  }
+
+  game->memory.reloads++;
+  printf("Reloaded %s in %.2f ms\n", game->path, game->reload_ns_last / 1e6);
+  return true;
+}
@@ -0,0 +1,59 @@
+#ifndef JAM_GAME_CODE_H
+#define JAM_GAME_CODE_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "../platform.h"
+
+// The game as a shared object that gets swapped for its rebuild between
+// two frames, while the window, the display connection, the swapchain and
+// the game's memory stay where they are. Nothing is saved or restored, the
+// state was never in the code to begin with.
+//
+// The directory the object is in has an inotify watch on it, a linker
+// closing the file after writing it (or a build renaming it into place)
+// is what triggers a reload. Without inotify it's a stat per frame and a
+// reload once the file stops changing for GAME_CODE_SETTLE_NS.
+//
+// Each build is copied into a memfd and dlopened from there: the loader
+// never sees the same file twice, so it can't hand back the old object, and
+// a build writing over the file can't change the code while it runs. The
+// new code is opened before the old one is closed, a build that fails to
+// load (a missing symbol, a half written file) keeps the old one running.
+
+#define GAME_CODE_SETTLE_NS 100000000ull
+#define GAME_CODE_INOTIFY_BUFFER_SIZE 4096
+
+struct game_code_state {
+  char path[PATH_MAX];
+  const char *name; // The file name part of path, what inotify reports.
+
+  int watch_fd; // Non-blocking inotify, -1 when stat is polled instead.
+  bool changed; // The file was rewritten since it was last loaded.
+
+  // stat polling: the file as of the last check and since when it's been that way.
+  uint64_t seen_mtime_ns;
+  uint64_t seen_size;
+  uint64_t seen_since_ns;
+  uint64_t loaded_mtime_ns;
+  uint64_t loaded_size;
+
+  void *handle;
+  int code_fd; // The memfd copy it was loaded from, -1 when it's the file itself.
+  game_frame_fn *frame;
+  game_memory memory;
+
+  uint64_t failed_reloads;
+  uint64_t reload_ns_last;
+  uint64_t reload_ns_max;
+};
+
+bool game_code_open(game_code_state *game, const char *path, uint64_t permanent_size, uint64_t transient_size);
+void game_code_close(game_code_state *game);
+
+// Swaps in a rebuild if there is one, true when it did. Cheap otherwise,
+// one read that comes back empty.
+bool game_code_reload(game_code_state *game);
+
+#endif // !JAM_GAME_CODE_H
@@ -0,0 +1,524 @@
+#include "headless_client.h"
+
+#include <assert.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+static uint64_t headless_now_ns() {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static bool headless_write_all(int fd, const uint8_t *src, uint64_t size) {
+  while (size > 0) {
+    int64_t written = write(fd, src, size);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    src += written;
+    size -= (uint64_t)written;
+  }
+
+  return true;
+}
+
+// Rows without the stride padding, the way raw video readers expect them.
+static bool headless_write_rows(int fd, uint8_t *pixels, uint32_t stride, uint32_t row_bytes, uint32_t height) {
+  if (stride == row_bytes) {
+    return headless_write_all(fd, pixels, (uint64_t)stride * height);
+  }
+
+  struct iovec rows[64];
+  uint32_t Row = 0;
+  while (Row < height) {
+    uint32_t count = 0;
+    uint64_t total = 0;
+    for (; count < 64 && Row + count < height; count++) {
+      rows[count].iov_base = pixels + (uint64_t)(Row + count) * stride;
+      rows[count].iov_len = row_bytes;
+      total += row_bytes;
+    }
+
+    int64_t written = writev(fd, rows, count);
+    if (written == -1 && errno == EINTR) continue;
+    if (written < 0) return false;
+
+    // Short writev, finish the batch a row at a time.
+    if ((uint64_t)written < total) {
+      uint64_t skip = (uint64_t)written;
+      for (uint32_t Index = 0; Index < count; Index++) {
+        if (skip >= row_bytes) {
+          skip -= row_bytes;
+          continue;
+        }
+        if (!headless_write_all(fd, (uint8_t *)rows[Index].iov_base + skip, row_bytes - skip)) return false;
+        skip = 0;
+      }
+    }
+
+    Row += count;
+  }
+
+  return true;
+}
+
+// The PPM path goes to snprintf as the format, it has to take exactly the
+// one frame number: a single %llu, optionally zero padded (%06llu), and
+// nothing else but %%.
+static bool headless_ppm_pattern_valid(const char *pattern) {
+  uint32_t conversions = 0;
+  for (const char *c = pattern; *c; c++) {
+    if (*c != '%') continue;
+    c++;
+    if (*c == '%') continue;
+
+    if (*c == '0') c++;
+    for (uint32_t digits = 0; *c >= '0' && *c <= '9'; c++) {
+      if (++digits > 2) return false;
+    }
+    if (strncmp(c, "llu", 3) != 0) return false;
+    c += 2;
+    conversions++;
+  }
+
+  return conversions == 1;
+}
+
+static bool headless_write_ppm(headless_windowState *state, uint8_t *pixels, uint64_t frame, uint8_t *staging) {
+  char path[HEADLESS_PATH_SIZE + 32];
+  snprintf(path, sizeof(path), state->settings.path, (unsigned long long)frame);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+
+  // P6 is packed RGB, the swapchain is XRGB8888 for this sink.
+  char header[64];
+  int header_len = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", state->swapchain.width, state->swapchain.height);
+
+  uint8_t *out = staging;
+  for (uint32_t Row = 0; Row < state->swapchain.height; Row++) {
+    uint32_t *src = (uint32_t *)(pixels + (uint64_t)Row * state->swapchain.stride);
+    for (uint32_t Index = 0; Index < state->swapchain.width; Index++) {
+      uint32_t p = src[Index];
+      out[0] = (uint8_t)(p >> 16);
+      out[1] = (uint8_t)(p >> 8);
+      out[2] = (uint8_t)p;
+      out += 3;
+    }
+  }
+
+  struct iovec parts[2] = {
+    {.iov_base = header, .iov_len = (size_t)header_len},
+    {.iov_base = staging, .iov_len = (size_t)(out - staging)},
+  };
+
+  bool result = writev(fd, parts, 2) == (int64_t)(parts[0].iov_len + parts[1].iov_len);
+  close(fd);
+
+  return result;
+}
+
+// Drains the write queue, each buffer goes back to the swapchain once it's on disk.
+static void *headless_writer(void *arg) {
+  headless_windowState *state = (headless_windowState *)arg;
+
+  uint8_t *staging = 0;
+  if (state->settings.sink == HEADLESS_SINK_PPM) {
+    staging = (uint8_t *)malloc((uint64_t)state->swapchain.width * state->swapchain.height * 3);
+  }
+
+  uint64_t frame = 0;
+
+  pthread_mutex_lock(&state->lock);
+  while (1) {
+    while (state->write_count == 0 && !state->writer_stop) {
+      pthread_cond_wait(&state->frame_queued, &state->lock);
+    }
+
+    if (state->write_count == 0) {
+      break;
+    }
+
+    int32_t index = state->write_queue[state->write_head];
+    state->write_head = (state->write_head + 1) % HEADLESS_WRITE_QUEUE;
+    state->write_count--;
+    pthread_mutex_unlock(&state->lock);
+
+    uint8_t *pixels = shm_swapchain_pixels(&state->swapchain, index);
+    bool written = false;
+
+    if (state->settings.sink == HEADLESS_SINK_RAW) {
+      uint32_t row_bytes = state->swapchain.width * pixel_format_bytes((pixel_format)state->swapchain.format);
+      written = headless_write_rows(state->raw_fd, pixels, state->swapchain.stride, row_bytes, state->swapchain.height);
+    } else if (staging) {
+      written = headless_write_ppm(state, pixels, frame, staging);
+    }
+    frame++;
+
+    pthread_mutex_lock(&state->lock);
+    if (!written) {
+      state->write_errors++;
+    }
+    state->swapchain.buffers[index].busy = false;
+    pthread_cond_signal(&state->buffer_released);
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  free(staging);
+  return 0;
+}
+
+static bool headless_ring_create(headless_windowState *state) {
+  uint32_t slot_size = sizeof(headless_ring_slot) + state->swapchain.stride * state->swapchain.height;
+  slot_size = roundup_row(slot_size);
+  state->ring_size = sizeof(headless_ring_header) + (uint64_t)slot_size * HEADLESS_RING_SLOTS;
+
+  state->ring_fd = open(state->settings.path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (state->ring_fd == -1) {
+    printf("failed to open the frame ring %s\n", state->settings.path);
+    return false;
+  }
+
+  if (ftruncate(state->ring_fd, state->ring_size) == -1) {
+    printf("failed to size the frame ring\n");
+    return false;
+  }
+
+  state->ring = (uint8_t *)mmap(NULL, state->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, state->ring_fd, 0);
+  if (state->ring == MAP_FAILED) {
+    state->ring = 0;
+    printf("failed to map the frame ring\n");
+    return false;
+  }
+
+  headless_ring_header *header = (headless_ring_header *)state->ring;
+  header->width = state->swapchain.width;
+  header->height = state->swapchain.height;
+  header->stride = state->swapchain.stride;
+  header->format = state->swapchain.format;
+  header->slot_count = HEADLESS_RING_SLOTS;
+  header->slot_size = slot_size;
+  header->version = HEADLESS_RING_VERSION;
+
+  // Magic last, readers that see it can trust the rest.
+  __atomic_store_n(&header->magic, HEADLESS_RING_MAGIC, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+static void headless_ring_write(headless_windowState *state, uint8_t *pixels) {
+  headless_ring_header *header = (headless_ring_header *)state->ring;
+  uint64_t frame = header->frames_written;
+
+  uint8_t *slot_base = state->ring + sizeof(headless_ring_header) + (uint64_t)header->slot_size * (frame % header->slot_count);
+  headless_ring_slot *slot = (headless_ring_slot *)slot_base;
+
+  uint64_t sequence = slot->sequence;
+  __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  slot->frame = frame;
+  slot->present_ns = headless_now_ns();
+  memcpy(slot_base + sizeof(headless_ring_slot), pixels, (uint64_t)state->swapchain.stride * state->swapchain.height);
+
+  __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->frames_written, frame + 1, __ATOMIC_RELEASE);
+}
+
+static bool headless_file_sink(headless_windowState *state) {
+  return state->settings.sink == HEADLESS_SINK_RAW || state->settings.sink == HEADLESS_SINK_PPM;
+}
+
+bool headless_window_set_up(headless_windowState *state, uint32_t Width, uint32_t Height, window_settings *settings) {
+  state->raw_fd = -1;
+  state->ring_fd = -1;
+
+  pthread_mutex_init(&state->lock, 0);
+  pthread_cond_init(&state->buffer_released, 0);
+  pthread_cond_init(&state->frame_queued, 0);
+
+  if (settings) {
+    state->settings = settings->headless;
+  }
+
+  window_settings defaults = {};
+  state->stats_overlay = frame_stats_overlay_wanted(settings ? settings : &defaults);
+
+  // Lets CI change the sink and pacing without rebuilding the app.
+  if (const char *refresh = getenv("JAM_HEADLESS_REFRESH")) {
+    double hz = atof(refresh);
+    state->settings.unthrottled = hz <= 0.0;
+    state->settings.refresh_mhz = (uint32_t)(hz * 1000.0);
+  }
+  if (const char *frames = getenv("JAM_HEADLESS_FRAMES")) {
+    state->settings.frame_limit = strtoull(frames, 0, 10);
+  }
+  if (const char *sink = getenv("JAM_HEADLESS_SINK")) {
+    if (strcmp(sink, "discard") == 0) state->settings.sink = HEADLESS_SINK_DISCARD;
+    else if (strcmp(sink, "raw") == 0) state->settings.sink = HEADLESS_SINK_RAW;
+    else if (strcmp(sink, "ppm") == 0) state->settings.sink = HEADLESS_SINK_PPM;
+    else if (strcmp(sink, "ring") == 0) state->settings.sink = HEADLESS_SINK_SHM_RING;
+    else printf("Unknown JAM_HEADLESS_SINK %s\n", sink);
+  }
+  if (const char *path = getenv("JAM_HEADLESS_PATH")) {
+    state->settings.path = path;
+  }
+
+  if (!state->settings.path) {
+    switch (state->settings.sink) {
+      case HEADLESS_SINK_RAW: state->settings.path = "frames.raw"; break;
+      case HEADLESS_SINK_PPM: state->settings.path = "frame_%06llu.ppm"; break;
+      case HEADLESS_SINK_SHM_RING: state->settings.path = "/dev/shm/jam_headless_ring"; break;
+      default: break;
+    }
+  }
+
+  if (state->settings.path && strlen(state->settings.path) >= HEADLESS_PATH_SIZE) {
+    printf("headless sink path is too long\n");
+    return false;
+  }
+
+  if (state->settings.sink == HEADLESS_SINK_PPM && !headless_ppm_pattern_valid(state->settings.path)) {
+    printf("headless PPM path %s needs exactly one %%llu for the frame number\n", state->settings.path);
+    return false;
+  }
+
+  state->Width = Width ? Width : 800;
+  state->Height = Height ? Height : 600;
+
+  uint32_t buffer_width = state->Width;
+  uint32_t buffer_height = state->Height;
+  if (settings && settings->render_width && settings->render_height) {
+    buffer_width = settings->render_width;
+    buffer_height = settings->render_height;
+  }
+
+  // No server to negotiate with, anything convert_rgba8 writes is fine,
+  // except PPM which wants 8 bits per channel.
+  state->format = settings ? settings->format : PIXEL_FORMAT_XRGB8888;
+  if (state->settings.sink == HEADLESS_SINK_PPM) {
+    state->format = PIXEL_FORMAT_XRGB8888;
+  }
+
+  if (state->settings.unthrottled) {
+    state->frame_interval_ns = 0;
+  } else {
+    uint32_t refresh_mhz = state->settings.refresh_mhz ? state->settings.refresh_mhz : 60000;
+    state->frame_interval_ns = 1000000000000ull / refresh_mhz;
+  }
+
+  uint32_t flags = SHM_SWAPCHAIN_DEFAULT;
+  if (settings && settings->huge_pages) {
+    flags |= SHM_SWAPCHAIN_HUGE_PAGES;
+  }
+
+  if (!shm_swapchain_allocate(&state->swapchain, buffer_width, buffer_height,
+                              pixel_format_stride(state->format, buffer_width), state->format,
+                              SWAPCHAIN_MAX_BUFFERS, flags)) {
+    return false;
+  }
+
+  if (!render_target_resize(&state->target, buffer_width, buffer_height)) {
+    printf("failed to allocate the render target\n");
+    return false;
+  }
+
+  if (state->settings.sink == HEADLESS_SINK_SHM_RING && !headless_ring_create(state)) {
+    return false;
+  }
+
+  if (state->settings.sink == HEADLESS_SINK_RAW) {
+    state->raw_fd = open(state->settings.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (state->raw_fd == -1) {
+      printf("failed to open %s\n", state->settings.path);
+      return false;
+    }
+  }
+
+  if (headless_file_sink(state)) {
+    thread_settings thread = {};
+    thread.name = "jam-headless";
+    if (!cpu_thread_start(&state->writer, headless_writer, state, &thread)) {
+      printf("failed to start the frame writer\n");
+      return false;
+    }
+    state->writer_running = true;
+  }
+
+  printf("headless %ux%u, %s, sink %u\n", buffer_width, buffer_height,
+         state->frame_interval_ns ? "throttled" : "unthrottled", state->settings.sink);
+
+  return true;
+}
+
+void headless_present(headless_windowState *state, int32_t index) {
+  switch (state->settings.sink) {
+    case HEADLESS_SINK_DISCARD: {
+      state->swapchain.buffers[index].busy = false;
+    } break;
+
+    case HEADLESS_SINK_SHM_RING: {
+      headless_ring_write(state, shm_swapchain_pixels(&state->swapchain, index));
+      state->swapchain.buffers[index].busy = false;
+    } break;
+
+    case HEADLESS_SINK_RAW:
+    case HEADLESS_SINK_PPM: {
+      pthread_mutex_lock(&state->lock);
+      uint32_t tail = (state->write_head + state->write_count) % HEADLESS_WRITE_QUEUE;
+      state->write_queue[tail] = index;
+      state->write_count++;
+      pthread_cond_signal(&state->frame_queued);
+      pthread_mutex_unlock(&state->lock);
+    } break;
+  }
+}
+
+void headless_draw_frame(headless_windowState *state) {
+  int32_t index = -1;
+  uint64_t faults = shm_thread_minor_faults();
+
+  if (headless_file_sink(state)) {
+    // Batch output can't drop frames, wait for the writer instead.
+    pthread_mutex_lock(&state->lock);
+    while ((index = shm_swapchain_acquire(&state->swapchain)) < 0) {
+      state->recorder.stats.buffer_stalls++;
+      pthread_cond_wait(&state->buffer_released, &state->lock);
+    }
+    state->swapchain.buffers[index].busy = true;
+    pthread_mutex_unlock(&state->lock);
+  } else {
+    index = shm_swapchain_acquire(&state->swapchain);
+    assert(index >= 0);
+    state->swapchain.buffers[index].busy = true;
+  }
+
+  uint32_t gray = (uint32_t)state->blue * 0x010101u;
+  pixel_fill_rect(state->target.pixels, state->target.stride, state->target.width, state->target.height,
+                  gray | 0xff000000u);
+
+  if (state->stats_overlay) {
+    frame_stats_draw_overlay(&state->recorder.stats, state->frame_interval_ns,
+                             state->target.pixels, state->target.stride, state->target.width, state->target.height);
+  }
+
+  convert_rgba8(state->format,
+                state->target.pixels, state->target.stride,
+                shm_swapchain_pixels(&state->swapchain, index), state->swapchain.stride,
+                state->swapchain.width, state->swapchain.height);
+
+  headless_present(state, index);
+  state->blue++;
+
+  state->recorder.stats.shm_bytes = state->swapchain.pool_size;
+  frame_stats_present(&state->recorder, headless_now_ns());
+
+  shm_record_frame_faults(&state->frame_stats, shm_thread_minor_faults() - faults);
+}
+
+void headless_run(headless_windowState *state) {
+  state->start_ns = headless_now_ns();
+  state->next_frame_ns = state->start_ns;
+
+  while (state->settings.frame_limit == 0 || state->frames < state->settings.frame_limit) {
+    // The virtual vblank, sleeps to an absolute deadline so pacing doesn't drift.
+    if (state->frame_interval_ns) {
+      struct timespec deadline = {
+        .tv_sec = (time_t)(state->next_frame_ns / 1000000000ull),
+        .tv_nsec = (long)(state->next_frame_ns % 1000000000ull),
+      };
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, 0) == EINTR) {}
+
+      state->present_ns = state->next_frame_ns;
+      state->next_frame_ns += state->frame_interval_ns;
+      uint64_t now = headless_now_ns();
+      if (state->next_frame_ns < now) {
+        state->next_frame_ns = now + state->frame_interval_ns;
+      }
+    }
+
+    uint64_t frame_start = headless_now_ns();
+    if (state->frame_interval_ns == 0) {
+      state->present_ns = frame_start;
+    }
+    headless_draw_frame(state);
+    uint64_t frame_ns = headless_now_ns() - frame_start;
+
+    state->frame_ns_total += frame_ns;
+    if (frame_ns > state->frame_ns_max) {
+      state->frame_ns_max = frame_ns;
+    }
+    state->frames++;
+  }
+
+  headless_print_stats(state);
+}
+
+void headless_print_stats(headless_windowState *state) {
+  uint64_t elapsed_ns = headless_now_ns() - state->start_ns;
+  if (state->frames == 0 || elapsed_ns == 0) {
+    return;
+  }
+
+  // One line, easy for a CI job to grep.
+  printf("headless: frames=%llu elapsed_ms=%.3f avg_frame_us=%.2f max_frame_us=%.2f fps=%.1f write_errors=%llu page_faults=%llu max_frame_faults=%llu\n",
+         (unsigned long long)state->frames,
+         elapsed_ns / 1e6,
+         state->frame_ns_total / 1e3 / state->frames,
+         state->frame_ns_max / 1e3,
+         state->frames * 1e9 / elapsed_ns,
+         (unsigned long long)state->write_errors,
+         (unsigned long long)state->frame_stats.page_faults_total,
+         (unsigned long long)state->frame_stats.page_faults_max);
+  fflush(stdout);
+}
+
+void headless_disconnect(headless_windowState *state) {
+  if (state->writer_running) {
+    pthread_mutex_lock(&state->lock);
+    state->writer_stop = true;
+    pthread_cond_signal(&state->frame_queued);
+    pthread_mutex_unlock(&state->lock);
+
+    cpu_thread_join(&state->writer);
+    state->writer_running = false;
+  }
+
+  pthread_mutex_destroy(&state->lock);
+  pthread_cond_destroy(&state->buffer_released);
+  pthread_cond_destroy(&state->frame_queued);
+
+  if (state->raw_fd != -1) {
+    close(state->raw_fd);
+    state->raw_fd = -1;
+  }
+
+  if (state->ring) {
+    munmap(state->ring, state->ring_size);
+    state->ring = 0;
+  }
+
+  if (state->ring_fd != -1) {
+    close(state->ring_fd);
+    state->ring_fd = -1;
+  }
+
+  shm_swapchain_free(&state->swapchain);
+  render_target_free(&state->target);
+}
@@ -0,0 +1,110 @@
+#ifndef JAM_HEADLESS_CLIENT_H
+#define JAM_HEADLESS_CLIENT_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../platform.h"
+#include "../shm_swapchain.h"
+#include "../pixel_convert.h"
+#include "../cpu_topology.h"
+#include "../frame_stats.h"
+
+// A window with no display server behind it. Frames go through the same
+// render target -> convert -> swapchain path as the real backends and are
+// handed to a sink instead of a compositor. The sink plays the compositor's
+// part and marks buffers free again once it's done with them.
+
+#define HEADLESS_PATH_SIZE 256
+#define HEADLESS_WRITE_QUEUE SWAPCHAIN_MAX_BUFFERS
+
+// Layout of the shared memory ring (HEADLESS_SINK_SHM_RING), for whatever
+// external encoder maps it. The header is followed by slot_count slots of
+// slot_size bytes, each a headless_ring_slot and then the pixels. A slot is
+// being written while its sequence is odd, read it when it's even and still
+// the same after copying the pixels out.
+#define HEADLESS_RING_MAGIC 0x474e4952 // "RING"
+#define HEADLESS_RING_VERSION 1
+#define HEADLESS_RING_SLOTS 4
+
+struct headless_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t format; // A pixel_format.
+  uint32_t slot_count;
+  uint32_t slot_size;
+  uint64_t frames_written; // The newest frame is in slot (frames_written - 1) % slot_count.
+  uint8_t padding[24];
+};
+
+struct headless_ring_slot {
+  uint64_t sequence;
+  uint64_t frame;
+  uint64_t present_ns;
+  uint8_t padding[40];
+};
+
+struct headless_windowState {
+  headless_settings settings;
+
+  uint32_t Width;
+  uint32_t Height;
+  pixel_format format;
+
+  render_target target;
+  shm_swapchain swapchain;
+
+  // 0 runs unthrottled.
+  uint64_t frame_interval_ns;
+  uint64_t next_frame_ns;
+  uint64_t present_ns; // The vblank the frame being drawn is for.
+
+  // The file sinks write from their own thread so the frame loop never
+  // blocks on the disk, it only waits when every swapchain buffer is queued.
+  cpu_thread writer;
+  pthread_mutex_t lock;
+  pthread_cond_t buffer_released;
+  pthread_cond_t frame_queued;
+  int32_t write_queue[HEADLESS_WRITE_QUEUE];
+  uint32_t write_head;
+  uint32_t write_count;
+  bool writer_running;
+  bool writer_stop;
+  int raw_fd;
+
+  // HEADLESS_SINK_SHM_RING.
+  int ring_fd;
+  uint8_t *ring;
+  uint64_t ring_size;
+
+  // Frame loop timings.
+  uint64_t frames;
+  uint64_t start_ns;
+  uint64_t frame_ns_total;
+  uint64_t frame_ns_max;
+  uint64_t write_errors;
+  window_frame_stats frame_stats;
+  frame_stats_recorder recorder;
+  bool stats_overlay;
+
+  uint8_t blue;
+};
+
+bool headless_window_set_up(headless_windowState *state, uint32_t Width, uint32_t Height, window_settings *settings);
+void headless_run(headless_windowState *state);
+void headless_disconnect(headless_windowState *state);
+
+void headless_draw_frame(headless_windowState *state);
+void headless_present(headless_windowState *state, int32_t index);
+void headless_print_stats(headless_windowState *state);
+
+#endif // !JAM_HEADLESS_CLIENT_H
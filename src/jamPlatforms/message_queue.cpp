@@ -0,0 +1,115 @@
+#include "message_queue.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool spsc_queue_init(spsc_queue *queue, uint32_t capacity) {
+  assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+  memset(queue, 0, sizeof(*queue));
+  queue->messages = (platform_message *)calloc(capacity, sizeof(platform_message));
+  queue->mask = capacity - 1;
+
+  return queue->messages != 0;
+}
+
+void spsc_queue_free(spsc_queue *queue) {
+  free(queue->messages);
+  memset(queue, 0, sizeof(*queue));
+}
+
+bool spsc_queue_push(spsc_queue *queue, const platform_message *message) {
+  uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+  uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+  if (head - tail > queue->mask) {
+    return false;
+  }
+
+  queue->messages[head & queue->mask] = *message;
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+bool spsc_queue_pop(spsc_queue *queue, platform_message *message) {
+  uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+  if (tail == head) {
+    return false;
+  }
+
+  *message = queue->messages[tail & queue->mask];
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+bool mpsc_queue_init(mpsc_queue *queue, uint32_t capacity) {
+  assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+  memset(queue, 0, sizeof(*queue));
+  queue->cells = (mpsc_queue_cell *)calloc(capacity, sizeof(mpsc_queue_cell));
+  if (!queue->cells) {
+    return false;
+  }
+
+  queue->mask = capacity - 1;
+  for (uint32_t Index = 0; Index < capacity; Index++) {
+    queue->cells[Index].sequence = Index;
+  }
+
+  return true;
+}
+
+void mpsc_queue_free(mpsc_queue *queue) {
+  free(queue->cells);
+  memset(queue, 0, sizeof(*queue));
+}
+
+bool mpsc_queue_push(mpsc_queue *queue, const platform_message *message) {
+  uint64_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+  mpsc_queue_cell *cell;
+
+  while (1) {
+    cell = &queue->cells[pos & queue->mask];
+    uint64_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t)sequence - (int64_t)pos;
+
+    if (diff == 0) {
+      // Our turn for this cell if nobody else claimed it first, a failed CAS reloads pos.
+      if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The consumer hasn't freed this cell yet, full.
+      return false;
+    } else {
+      pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->message = *message;
+  __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+bool mpsc_queue_pop(mpsc_queue *queue, platform_message *message) {
+  uint64_t pos = queue->dequeue_pos;
+  mpsc_queue_cell *cell = &queue->cells[pos & queue->mask];
+  uint64_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+  if ((int64_t)sequence - (int64_t)(pos + 1) < 0) {
+    return false;
+  }
+
+  *message = cell->message;
+  queue->dequeue_pos = pos + 1;
+  __atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
@@ -0,0 +1,52 @@
+#ifndef JAM_MESSAGE_QUEUE_H
+#define JAM_MESSAGE_QUEUE_H
+
+#include <stdint.h>
+
+// Bounded lock-free queues for passing small fixed size messages between
+// the game thread and the platform's own threads. Capacity is a power of
+// two and a full queue refuses the push instead of blocking, sleeping and
+// waking is up to the caller (an eventfd next to each queue).
+
+struct platform_message {
+  uint32_t type;
+  uint32_t args[7];
+};
+
+// One producer, one consumer.
+struct spsc_queue {
+  platform_message *messages;
+  uint64_t mask;
+
+  // Own cache lines, the two sides don't bounce each other's.
+  alignas(64) uint64_t head; // Written by the producer.
+  alignas(64) uint64_t tail; // Written by the consumer.
+};
+
+bool spsc_queue_init(spsc_queue *queue, uint32_t capacity);
+void spsc_queue_free(spsc_queue *queue);
+bool spsc_queue_push(spsc_queue *queue, const platform_message *message);
+bool spsc_queue_pop(spsc_queue *queue, platform_message *message);
+
+// Any number of producers, one consumer. Each cell carries a sequence
+// number that says whose turn it is, producers claim cells with a CAS on
+// enqueue_pos (Vyukov's bounded queue).
+struct mpsc_queue_cell {
+  uint64_t sequence;
+  platform_message message;
+};
+
+struct mpsc_queue {
+  mpsc_queue_cell *cells;
+  uint64_t mask;
+
+  alignas(64) uint64_t enqueue_pos;
+  alignas(64) uint64_t dequeue_pos;
+};
+
+bool mpsc_queue_init(mpsc_queue *queue, uint32_t capacity);
+void mpsc_queue_free(mpsc_queue *queue);
+bool mpsc_queue_push(mpsc_queue *queue, const platform_message *message);
+bool mpsc_queue_pop(mpsc_queue *queue, platform_message *message);
+
+#endif // !JAM_MESSAGE_QUEUE_H
@@ -0,0 +1,316 @@
+#include "asset_pack.h"
+#include "lz4_block.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t asset_now_ns() {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void asset_load_free(asset_load_slot *slot) {
+  free(slot->chunk_offsets);
+  free(slot->chunk_ready);
+  memset(slot, 0, sizeof(*slot));
+}
+
+static bool asset_decode_chunk(asset_load_slot *slot, uint32_t chunk) {
+  uint64_t out_offset = (uint64_t)chunk * slot->chunk_size;
+  uint64_t out_size = slot->raw_size - out_offset;
+  if (out_size > slot->chunk_size) out_size = slot->chunk_size;
+
+  const uint8_t *src = slot->src + slot->chunk_offsets[chunk];
+  if (!slot->chunk_sizes) {
+    memcpy(slot->dst + out_offset, src, out_size);
+    return true;
+  }
+
+  uint32_t stored = slot->chunk_sizes[chunk];
+  if (stored & ASSET_CHUNK_STORED) {
+    if ((stored & ~ASSET_CHUNK_STORED) != out_size) return false;
+    memcpy(slot->dst + out_offset, src, out_size);
+    return true;
+  }
+
+  return lz4_decompress_block(src, stored, slot->dst + out_offset, out_size);
+}
+
+static void *asset_loader_thread(void *arg) {
+  asset_loader_state *loader = (asset_loader_state *)arg;
+
+  pthread_mutex_lock(&loader->lock);
+  for (;;) {
+    while (!loader->stop && loader->queue_count == 0) {
+      pthread_cond_wait(&loader->work, &loader->lock);
+    }
+    if (loader->stop) {
+      break;
+    }
+
+    // The oldest load's next chunk. It leaves the queue once every chunk
+    // is taken, the other threads move on to the next one.
+    asset_load_slot *slot = &loader->loads[loader->queue[0]];
+    uint32_t chunk = slot->chunks_taken++;
+    if (slot->chunks_taken == slot->chunk_count) {
+      loader->queue_count--;
+      memmove(loader->queue, loader->queue + 1, loader->queue_count * sizeof(uint32_t));
+    }
+    pthread_mutex_unlock(&loader->lock);
+
+    uint64_t start = asset_now_ns();
+    bool ok = asset_decode_chunk(slot, chunk);
+    uint64_t decode_ns = asset_now_ns() - start;
+
+    uint64_t out_size = slot->raw_size - (uint64_t)chunk * slot->chunk_size;
+    if (out_size > slot->chunk_size) out_size = slot->chunk_size;
+    uint64_t in_size = slot->chunk_sizes ? (slot->chunk_sizes[chunk] & ~ASSET_CHUNK_STORED) : out_size;
+
+    if (!ok) {
+      __atomic_store_n(&slot->failed, true, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&slot->chunk_ready[chunk], (uint8_t)1, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&loader->lock);
+    loader->bytes_in += in_size;
+    loader->bytes_out += out_size;
+    loader->decode_ns += decode_ns;
+    if (++slot->chunks_done == slot->chunk_count) {
+      loader->loads_done++;
+      int32_t status = slot->failed ? ASSET_LOAD_FAILED : ASSET_LOAD_DONE;
+      __atomic_store_n(&slot->status, status, __ATOMIC_RELEASE);
+    }
+    pthread_cond_broadcast(&loader->progress);
+  }
+  pthread_mutex_unlock(&loader->lock);
+
+  return 0;
+}
+
+bool asset_loader_open(asset_loader_state *loader, uint32_t threads) {
+  memset(loader, 0, sizeof(*loader));
+  pthread_mutex_init(&loader->lock, 0);
+  pthread_cond_init(&loader->work, 0);
+  pthread_cond_init(&loader->progress, 0);
+
+  if (threads == 0) {
+    cpu_mask cpus = cpu_floating_mask();
+    uint32_t cores = cpu_mask_count(&cpus);
+    threads = cores > 1 ? cores - 1 : 1;
+  }
+  if (threads > ASSET_LOADER_MAX_THREADS) {
+    threads = ASSET_LOADER_MAX_THREADS;
+  }
+
+  for (uint32_t Index = 0; Index < threads; Index++) {
+    // Room for any uint32_t. With at most ASSET_LOADER_MAX_THREADS it's
+    // two digits, still inside the 15 characters a thread name gets.
+    static_assert(ASSET_LOADER_MAX_THREADS <= 100, "jam-asset-NN fits a thread name");
+    char name[24];
+    snprintf(name, sizeof(name), "jam-asset-%u", Index);
+    thread_settings thread = {};
+    thread.name = name;
+    if (!cpu_thread_start(&loader->threads[Index], asset_loader_thread, loader, &thread)) {
+      printf("Failed to start asset loader thread %u\n", Index);
+      return false;
+    }
+    loader->thread_count++;
+  }
+
+  printf("Asset loader: %u threads\n", loader->thread_count);
+  return true;
+}
+
+void asset_loader_close(asset_loader_state *loader) {
+  pthread_mutex_lock(&loader->lock);
+  loader->stop = true;
+  pthread_cond_broadcast(&loader->work);
+  pthread_mutex_unlock(&loader->lock);
+
+  for (uint32_t Index = 0; Index < loader->thread_count; Index++) {
+    cpu_thread_join(&loader->threads[Index]);
+  }
+
+  if (loader->loads_done) {
+    // decode_mb_per_s is per thread, bytes out over the time spent in decode.
+    printf("asset loader: threads=%u loads=%llu in_mb=%.1f out_mb=%.1f ratio=%.2f decode_mb_per_s=%.0f\n",
+           loader->thread_count, (unsigned long long)loader->loads_done,
+           loader->bytes_in / 1e6, loader->bytes_out / 1e6,
+           loader->bytes_in ? (double)loader->bytes_out / loader->bytes_in : 0.0,
+           loader->decode_ns ? loader->bytes_out * 1e3 / loader->decode_ns : 0.0);
+    fflush(stdout);
+  }
+
+  for (uint32_t Index = 0; Index < ASSET_LOADER_MAX_LOADS; Index++) {
+    asset_load_free(&loader->loads[Index]);
+  }
+  pthread_cond_destroy(&loader->progress);
+  pthread_cond_destroy(&loader->work);
+  pthread_mutex_destroy(&loader->lock);
+  loader->thread_count = 0;
+}
+
+uint64_t asset_raw_size(const asset_view *asset) {
+  if (!(asset->flags & ASSET_FLAG_LZ4)) {
+    return asset->size;
+  }
+  if (asset->size < sizeof(asset_chunk_header)) {
+    return 0;
+  }
+
+  asset_chunk_header header;
+  memcpy(&header, asset->data, sizeof(header));
+  return header.raw_size;
+}
+
+// Works out where every chunk is, refusing anything that points outside
+// the blob or doesn't add up to raw_size.
+static bool asset_load_layout(asset_load_slot *slot, const asset_view *asset) {
+  if (!(asset->flags & ASSET_FLAG_LZ4)) {
+    slot->src = asset->data;
+    slot->raw_size = asset->size;
+    slot->chunk_size = ASSET_PACK_CHUNK_SIZE;
+    slot->chunk_count = (uint32_t)((asset->size + ASSET_PACK_CHUNK_SIZE - 1) / ASSET_PACK_CHUNK_SIZE);
+  } else {
+    asset_chunk_header header;
+    if (asset->size < sizeof(header)) return false;
+    memcpy(&header, asset->data, sizeof(header));
+
+    uint64_t sizes_end = sizeof(header) + (uint64_t)header.chunk_count * sizeof(uint32_t);
+    if (header.chunk_size == 0 || sizes_end > asset->size ||
+        header.raw_size > (uint64_t)header.chunk_count * header.chunk_size ||
+        (header.chunk_count && header.raw_size <= (uint64_t)(header.chunk_count - 1) * header.chunk_size)) {
+      return false;
+    }
+
+    slot->src = asset->data + sizes_end;
+    slot->chunk_sizes = (const uint32_t *)(asset->data + sizeof(header));
+    slot->raw_size = header.raw_size;
+    slot->chunk_size = header.chunk_size;
+    slot->chunk_count = header.chunk_count;
+  }
+
+  // An empty asset is one empty chunk, so it still finishes like the rest.
+  if (slot->chunk_count == 0) {
+    slot->chunk_sizes = 0;
+  }
+  uint32_t count = slot->chunk_count ? slot->chunk_count : 1;
+  slot->chunk_offsets = (uint64_t *)calloc(count, sizeof(uint64_t));
+  slot->chunk_ready = (uint8_t *)calloc(count, 1);
+  if (!slot->chunk_offsets || !slot->chunk_ready) return false;
+
+  uint64_t offset = 0;
+  uint64_t available = asset->size - (uint64_t)(slot->src - asset->data);
+  for (uint32_t Index = 0; Index < slot->chunk_count; Index++) {
+    slot->chunk_offsets[Index] = offset;
+    uint64_t size = slot->chunk_size;
+    if (slot->chunk_sizes) {
+      size = slot->chunk_sizes[Index] & ~ASSET_CHUNK_STORED;
+    } else if (Index == slot->chunk_count - 1) {
+      size = slot->raw_size - offset;
+    }
+    offset += size;
+    if (offset > available) return false;
+  }
+
+  slot->chunk_count = count;
+  return true;
+}
+
+int32_t asset_loader_load(asset_loader_state *loader, const asset_view *asset, uint8_t *dst, uint64_t capacity) {
+  uint64_t raw_size = asset_raw_size(asset);
+  if (loader->thread_count == 0 || raw_size > capacity || (!dst && raw_size)) {
+    return -1;
+  }
+
+  for (uint32_t Index = 0; Index < ASSET_LOADER_MAX_LOADS; Index++) {
+    asset_load_slot *slot = &loader->loads[Index];
+    if (__atomic_load_n(&slot->status, __ATOMIC_ACQUIRE) != ASSET_LOAD_FREE) {
+      continue;
+    }
+
+    slot->dst = dst;
+    if (!asset_load_layout(slot, asset)) {
+      printf("Asset %.*s is malformed, not loading it\n", (int)asset->path_size, asset->path);
+      asset_load_free(slot);
+      return -1;
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    slot->status = ASSET_LOAD_ACTIVE;
+    loader->queue[loader->queue_count++] = Index;
+    pthread_cond_broadcast(&loader->work);
+    pthread_mutex_unlock(&loader->lock);
+    return (int32_t)Index;
+  }
+
+  printf("Every asset load slot is busy\n");
+  return -1;
+}
+
+static asset_load_slot *asset_get_slot(asset_loader_state *loader, int32_t load) {
+  if (load < 0 || load >= ASSET_LOADER_MAX_LOADS) return 0;
+  asset_load_slot *slot = &loader->loads[load];
+  return __atomic_load_n(&slot->status, __ATOMIC_ACQUIRE) == ASSET_LOAD_FREE ? 0 : slot;
+}
+
+// Bytes from the start that are decoded, the run of finished chunks.
+static uint64_t asset_load_ready(asset_load_slot *slot) {
+  while (slot->ready_chunks < slot->chunk_count &&
+         __atomic_load_n(&slot->chunk_ready[slot->ready_chunks], __ATOMIC_ACQUIRE)) {
+    slot->ready_chunks++;
+  }
+
+  uint64_t ready = (uint64_t)slot->ready_chunks * slot->chunk_size;
+  return ready < slot->raw_size ? ready : slot->raw_size;
+}
+
+asset_load_status asset_loader_get(asset_loader_state *loader, int32_t load, uint64_t *ready) {
+  asset_load_slot *slot = asset_get_slot(loader, load);
+  if (!slot) {
+    if (ready) *ready = 0;
+    return ASSET_LOAD_FREE;
+  }
+
+  asset_load_status status = (asset_load_status)__atomic_load_n(&slot->status, __ATOMIC_ACQUIRE);
+  if (ready) *ready = status == ASSET_LOAD_FAILED ? 0 : asset_load_ready(slot);
+  return status;
+}
+
+asset_load_status asset_loader_wait(asset_loader_state *loader, int32_t load, uint64_t bytes) {
+  asset_load_slot *slot = asset_get_slot(loader, load);
+  if (!slot) return ASSET_LOAD_FREE;
+
+  pthread_mutex_lock(&loader->lock);
+  while (slot->status == ASSET_LOAD_ACTIVE && asset_load_ready(slot) < bytes) {
+    pthread_cond_wait(&loader->progress, &loader->lock);
+  }
+  asset_load_status status = (asset_load_status)slot->status;
+  pthread_mutex_unlock(&loader->lock);
+  return status;
+}
+
+void asset_loader_release(asset_loader_state *loader, int32_t load) {
+  asset_load_slot *slot = asset_get_slot(loader, load);
+  if (!slot) return;
+
+  // Chunks nobody has taken yet are dropped, the ones being decoded are
+  // waited for, they're still writing to dst.
+  pthread_mutex_lock(&loader->lock);
+  for (uint32_t Index = 0; Index < loader->queue_count; Index++) {
+    if (loader->queue[Index] == (uint32_t)load) {
+      loader->queue_count--;
+      memmove(loader->queue + Index, loader->queue + Index + 1, (loader->queue_count - Index) * sizeof(uint32_t));
+      break;
+    }
+  }
+  while (slot->chunks_done < slot->chunks_taken) {
+    pthread_cond_wait(&loader->progress, &loader->lock);
+  }
+  pthread_mutex_unlock(&loader->lock);
+
+  asset_load_free(slot);
+}
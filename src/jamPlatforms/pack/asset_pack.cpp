@@ -0,0 +1,148 @@
+#include "asset_pack.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Everything the header says has to land inside the file, a truncated or
+// foreign pack is refused here instead of faulting on some later lookup.
+static bool asset_pack_validate(asset_pack_state *pack) {
+  if (pack->size < sizeof(asset_pack_header)) {
+    return false;
+  }
+
+  const asset_pack_header *header = (const asset_pack_header *)pack->base;
+  if (memcmp(header->magic, ASSET_PACK_MAGIC, sizeof(ASSET_PACK_MAGIC)) != 0 ||
+      header->version != ASSET_PACK_VERSION ||
+      header->file_size != pack->size ||
+      header->bucket_count == 0 || (header->bucket_count & (header->bucket_count - 1)) != 0) {
+    return false;
+  }
+
+  // Offsets and sizes are checked against what's left after the offset,
+  // a crafted header can't wrap a sum around past the end.
+  uint64_t buckets_size = (uint64_t)header->bucket_count * sizeof(asset_pack_bucket);
+  uint64_t entries_size = (uint64_t)header->entry_count * sizeof(asset_pack_entry);
+  if (header->buckets_offset % alignof(asset_pack_bucket) != 0 ||
+      header->buckets_offset > pack->size || buckets_size > pack->size - header->buckets_offset ||
+      header->entries_offset % alignof(asset_pack_entry) != 0 ||
+      header->entries_offset > pack->size || entries_size > pack->size - header->entries_offset ||
+      header->names_offset > pack->size || header->names_size > pack->size - header->names_offset) {
+    return false;
+  }
+
+  const asset_pack_entry *entries = (const asset_pack_entry *)(pack->base + header->entries_offset);
+  for (uint32_t Index = 0; Index < header->entry_count; Index++) {
+    const asset_pack_entry *entry = &entries[Index];
+    if (entry->offset > pack->size || entry->size > pack->size - entry->offset ||
+        entry->name_offset > header->names_size || entry->name_size > header->names_size - entry->name_offset) {
+      return false;
+    }
+  }
+
+  pack->header = header;
+  pack->buckets = (const asset_pack_bucket *)(pack->base + header->buckets_offset);
+  pack->entries = entries;
+  pack->names = (const char *)pack->base + header->names_offset;
+  return true;
+}
+
+bool asset_pack_open(asset_pack_state *pack, const char *path) {
+  memset(pack, 0, sizeof(*pack));
+  pack->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (pack->fd < 0) {
+    printf("Failed to open the asset pack %s\n", path);
+    return false;
+  }
+
+  // From here on a failure goes through asset_pack_close, it lets go of
+  // whatever was set up so far.
+  struct stat buf = {};
+  if (fstat(pack->fd, &buf) == -1 || buf.st_size <= 0) {
+    printf("Failed to stat the asset pack %s\n", path);
+    asset_pack_close(pack);
+    return false;
+  }
+
+  pack->size = (uint64_t)buf.st_size;
+  void *base = mmap(0, pack->size, PROT_READ, MAP_PRIVATE, pack->fd, 0);
+  if (base == MAP_FAILED) {
+    printf("Failed to map the asset pack %s\n", path);
+    asset_pack_close(pack);
+    return false;
+  }
+  pack->base = (uint8_t *)base;
+
+  if (!asset_pack_validate(pack)) {
+    printf("%s isn't an asset pack this build can read\n", path);
+    asset_pack_close(pack);
+    return false;
+  }
+
+  // The index is what every lookup touches, ask for it up front. Blobs
+  // page in when they're used.
+  madvise(pack->base, pack->header->data_offset < pack->size ? pack->header->data_offset : pack->size,
+          MADV_WILLNEED);
+
+  printf("Asset pack %s: %u assets, %u buckets, %llu bytes\n", path,
+         pack->header->entry_count, pack->header->bucket_count, (unsigned long long)pack->size);
+  return true;
+}
+
+void asset_pack_close(asset_pack_state *pack) {
+  if (pack->base) {
+    munmap(pack->base, pack->size);
+  }
+  if (pack->fd >= 0) {
+    close(pack->fd);
+  }
+
+  memset(pack, 0, sizeof(*pack));
+  pack->fd = -1;
+}
+
+bool asset_pack_get(const asset_pack_state *pack, uint32_t index, asset_view *asset) {
+  if (!pack->header || index >= pack->header->entry_count) {
+    return false;
+  }
+
+  const asset_pack_entry *entry = &pack->entries[index];
+  asset->data = pack->base + entry->offset;
+  asset->size = entry->size;
+  asset->flags = entry->flags;
+  asset->path = pack->names + entry->name_offset;
+  asset->path_size = entry->name_size;
+  return true;
+}
+
+bool asset_pack_find(const asset_pack_state *pack, const char *path, asset_view *asset) {
+  if (!pack->header) {
+    return false;
+  }
+
+  size_t length = strlen(path);
+  uint64_t hash = asset_pack_hash(path, length, pack->header->hash_seed);
+  uint32_t tag = asset_pack_tag(hash);
+  const asset_pack_bucket *bucket = &pack->buckets[hash & (pack->header->bucket_count - 1)];
+
+  for (uint32_t Index = 0; Index < ASSET_PACK_BUCKET_SLOTS; Index++) {
+    if (bucket->tags[Index] != tag) {
+      continue;
+    }
+
+    // Tags are 32 bits, the name settles it.
+    uint32_t entry_index = bucket->entries[Index];
+    if (entry_index >= pack->header->entry_count) {
+      continue;
+    }
+
+    const asset_pack_entry *entry = &pack->entries[entry_index];
+    if (entry->name_size == length && memcmp(pack->names + entry->name_offset, path, length) == 0) {
+      return asset_pack_get(pack, entry_index, asset);
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,179 @@
+#ifndef JAM_ASSET_PACK_H
+#define JAM_ASSET_PACK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../../platform.h"
+#include "../cpu_topology.h"
+
+// One file instead of thousands of loose ones. jam_pack (src/tools) builds
+// it offline, at runtime it's opened and mmapped once and nothing in it is
+// parsed or copied: lookups read the index in place and hand out pointers
+// straight into the mapping.
+//
+//   header
+//   buckets   bucket_count * 64 bytes, the hash index
+//   entries   entry_count * asset_pack_entry, sorted by path
+//   names     the paths, not terminated, entries point into them
+//   blobs     each starting on an ASSET_PACK_ALIGNMENT boundary
+//
+// A blob is the file as is, usable in place, unless its entry has
+// ASSET_FLAG_LZ4. Then it's an asset_chunk_header, the stored size of each
+// chunk and the chunks, every one an LZ4 block of ASSET_PACK_CHUNK_SIZE
+// bytes (the last one shorter) that decodes on its own. Chunks are what
+// the loader's threads share out and what a load streams in by.
+//
+// The index is open addressing with one cache line per bucket: eight tags
+// (the high half of the path's hash) and the entries they belong to. The
+// tool picks a seed and bucket count that fit every path into its home
+// bucket, so a lookup is one hash, one bucket and a compare of the name.
+//
+// Everything is little endian, which is everything we build for.
+
+#define ASSET_PACK_MAGIC "JAMPACK"
+#define ASSET_PACK_VERSION 1
+#define ASSET_PACK_ALIGNMENT 4096 // Blobs start on a page, usable in place.
+#define ASSET_PACK_BUCKET_SLOTS 8
+
+// Seeds tried for each bucket count before the tool doubles it.
+#define ASSET_PACK_SEED_ATTEMPTS 64
+
+#define ASSET_PACK_CHUNK_SIZE (256 * 1024)
+#define ASSET_CHUNK_STORED 0x80000000u // In a chunk's size, it didn't compress and is stored raw.
+
+#define ASSET_LOADER_MAX_LOADS 64
+#define ASSET_LOADER_MAX_THREADS 16
+
+struct asset_pack_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t alignment;
+  uint64_t hash_seed;
+  uint32_t bucket_count; // Power of two.
+  uint32_t entry_count;
+  uint64_t buckets_offset;
+  uint64_t entries_offset;
+  uint64_t names_offset;
+  uint64_t names_size;
+  uint64_t data_offset;
+  uint64_t file_size;
+};
+
+// Tag 0 is an empty slot, hashes that would make one are bumped to 1.
+struct alignas(64) asset_pack_bucket {
+  uint32_t tags[ASSET_PACK_BUCKET_SLOTS];
+  uint32_t entries[ASSET_PACK_BUCKET_SLOTS];
+};
+
+struct asset_pack_entry {
+  uint64_t offset; // From the start of the file.
+  uint64_t size;
+  uint32_t flags; // asset_flags, how the blob is stored.
+  uint32_t name_offset; // Into names.
+  uint32_t name_size;
+  uint32_t reserved;
+};
+
+struct asset_chunk_header {
+  uint64_t raw_size;
+  uint32_t chunk_size;
+  uint32_t chunk_count;
+  // uint32_t sizes[chunk_count], then the chunks back to back.
+};
+
+static_assert(sizeof(asset_pack_bucket) == 64, "a bucket is one cache line");
+static_assert(sizeof(asset_pack_entry) == 32, "entries are packed");
+
+// FNV-1a over the path, then a 64 bit finalizer so both halves are usable
+// (the low bits pick the bucket, the high ones are the tag). Shared by the
+// tool and the runtime, it's part of the format.
+inline uint64_t asset_pack_hash(const char *path, size_t length, uint64_t seed) {
+  uint64_t hash = 0xcbf29ce484222325ull ^ seed;
+  for (size_t Index = 0; Index < length; Index++) {
+    hash ^= (uint8_t)path[Index];
+    hash *= 0x100000001b3ull;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+inline uint32_t asset_pack_tag(uint64_t hash) {
+  uint32_t tag = (uint32_t)(hash >> 32);
+  return tag ? tag : 1;
+}
+
+struct asset_pack_state {
+  int fd;
+  uint8_t *base;
+  uint64_t size;
+  const asset_pack_header *header;
+  const asset_pack_bucket *buckets;
+  const asset_pack_entry *entries;
+  const char *names;
+};
+
+bool asset_pack_open(asset_pack_state *pack, const char *path);
+void asset_pack_close(asset_pack_state *pack);
+bool asset_pack_find(const asset_pack_state *pack, const char *path, asset_view *asset);
+bool asset_pack_get(const asset_pack_state *pack, uint32_t index, asset_view *asset);
+
+// The loader: a pool of threads decoding chunks into wherever the game
+// wants the asset. Loads are slots handed over like the data transfers,
+// claimed by the game thread, worked on by the pool and freed again by
+// release. Chunks go out in the order loads were queued, so the first
+// chunks of a load finish first and what's ready is read as the run of
+// finished chunks from the start.
+struct asset_load_slot {
+  int32_t status; // asset_load_status
+  const uint8_t *src; // The chunks, or the raw blob.
+  const uint32_t *chunk_sizes; // 0 for a raw blob.
+  uint64_t *chunk_offsets; // From src.
+  uint8_t *chunk_ready;
+  uint8_t *dst;
+  uint64_t raw_size;
+  uint32_t chunk_size;
+  uint32_t chunk_count;
+
+  uint32_t chunks_taken; // Under the lock.
+  uint32_t chunks_done;
+  bool failed;
+  uint32_t ready_chunks; // Game thread only, how far it's looked.
+};
+
+struct asset_loader_state {
+  pthread_mutex_t lock;
+  pthread_cond_t work; // Workers wait on it for chunks.
+  pthread_cond_t progress; // wait_asset_load and release wait on it.
+  bool stop;
+
+  cpu_thread threads[ASSET_LOADER_MAX_THREADS]; // Off the audio thread's core.
+  uint32_t thread_count;
+
+  asset_load_slot loads[ASSET_LOADER_MAX_LOADS];
+  uint32_t queue[ASSET_LOADER_MAX_LOADS]; // Loads with chunks left, oldest first.
+  uint32_t queue_count;
+
+  // Summed by the workers, printed on close.
+  uint64_t loads_done;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t decode_ns;
+};
+
+bool asset_loader_open(asset_loader_state *loader, uint32_t threads);
+void asset_loader_close(asset_loader_state *loader);
+uint64_t asset_raw_size(const asset_view *asset);
+int32_t asset_loader_load(asset_loader_state *loader, const asset_view *asset, uint8_t *dst, uint64_t capacity);
+asset_load_status asset_loader_get(asset_loader_state *loader, int32_t load, uint64_t *ready);
+asset_load_status asset_loader_wait(asset_loader_state *loader, int32_t load, uint64_t bytes);
+void asset_loader_release(asset_loader_state *loader, int32_t load);
+
+#endif // !JAM_ASSET_PACK_H
@@ -0,0 +1,187 @@
+#include "lz4_block.h"
+
+#include <string.h>
+
+static uint32_t lz4_read32(const uint8_t *src) {
+  uint32_t value;
+  memcpy(&value, src, sizeof(value));
+  return value;
+}
+
+static uint32_t lz4_hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Lengths past 15 carry on in bytes of 255 and a final one below it.
+static bool lz4_put_length(uint8_t **out, uint8_t *out_end, uint64_t length) {
+  while (length >= 255) {
+    if (*out >= out_end) return false;
+    *(*out)++ = 255;
+    length -= 255;
+  }
+  if (*out >= out_end) return false;
+  *(*out)++ = (uint8_t)length;
+  return true;
+}
+
+static bool lz4_get_length(const uint8_t **in, const uint8_t *in_end, uint64_t *length) {
+  uint8_t byte;
+  do {
+    if (*in >= in_end) return false;
+    byte = *(*in)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// One sequence: literals, then a match of match_length (4 already taken
+// off) offset back. The last sequence of a block is literals only.
+static bool lz4_put_sequence(uint8_t **out, uint8_t *out_end, const uint8_t *literals, uint64_t literal_length,
+                             uint64_t offset, uint64_t match_length, bool last) {
+  if (*out >= out_end) return false;
+  uint8_t *token = (*out)++;
+  *token = (uint8_t)((literal_length >= 15 ? 15 : literal_length) << 4);
+  if (!last) {
+    *token |= (uint8_t)(match_length >= 15 ? 15 : match_length);
+  }
+
+  if (literal_length >= 15 && !lz4_put_length(out, out_end, literal_length - 15)) return false;
+  if ((uint64_t)(out_end - *out) < literal_length) return false;
+  if (literal_length) memcpy(*out, literals, literal_length);
+  *out += literal_length;
+
+  if (last) {
+    return true;
+  }
+
+  if (out_end - *out < 2) return false;
+  *(*out)++ = (uint8_t)(offset & 0xFF);
+  *(*out)++ = (uint8_t)(offset >> 8);
+  return match_length < 15 || lz4_put_length(out, out_end, match_length - 15);
+}
+
+uint64_t lz4_compress_block(const uint8_t *src, uint64_t size, uint8_t *dst, uint64_t capacity) {
+  uint8_t *out = dst;
+  uint8_t *out_end = dst + capacity;
+  const uint8_t *end = src + size;
+  const uint8_t *anchor = src;
+
+  if (size > LZ4_MATCH_LIMIT) {
+    uint32_t table[1 << LZ4_HASH_BITS] = {};
+    const uint8_t *match_start_limit = end - LZ4_MATCH_LIMIT;
+    const uint8_t *match_end_limit = end - LZ4_LAST_LITERALS;
+    const uint8_t *ip = src;
+
+    while (ip <= match_start_limit) {
+      uint32_t sequence = lz4_read32(ip);
+      uint32_t hash = lz4_hash(sequence);
+      const uint8_t *ref = src + table[hash];
+      table[hash] = (uint32_t)(ip - src);
+
+      if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != sequence) {
+        // Data that doesn't compress gets skipped through faster and faster.
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+
+      const uint8_t *match_end = ip + LZ4_MIN_MATCH;
+      const uint8_t *ref_end = ref + LZ4_MIN_MATCH;
+      while (match_end < match_end_limit && *match_end == *ref_end) {
+        match_end++;
+        ref_end++;
+      }
+
+      if (!lz4_put_sequence(&out, out_end, anchor, (uint64_t)(ip - anchor), (uint64_t)(ip - ref),
+                            (uint64_t)(match_end - ip) - LZ4_MIN_MATCH, false)) {
+        return 0;
+      }
+
+      // The middle of a match is often where the next one starts from.
+      if (match_end - 2 > ip && match_end - 2 <= match_start_limit) {
+        table[lz4_hash(lz4_read32(match_end - 2))] = (uint32_t)(match_end - 2 - src);
+      }
+
+      ip = match_end;
+      anchor = match_end;
+    }
+  }
+
+  if (!lz4_put_sequence(&out, out_end, anchor, (uint64_t)(end - anchor), 0, 0, true)) {
+    return 0;
+  }
+  return (uint64_t)(out - dst);
+}
+
+bool lz4_decompress_block(const uint8_t *src, uint64_t size, uint8_t *dst, uint64_t dst_size) {
+  const uint8_t *ip = src;
+  const uint8_t *in_end = src + size;
+  uint8_t *op = dst;
+  uint8_t *out_end = dst + dst_size;
+
+  for (;;) {
+    if (ip >= in_end) return false;
+    uint8_t token = *ip++;
+
+    uint64_t literal_length = token >> 4;
+    if (literal_length == 15 && !lz4_get_length(&ip, in_end, &literal_length)) return false;
+    if (literal_length > (uint64_t)(in_end - ip) || literal_length > (uint64_t)(out_end - op)) return false;
+
+    // Most literal runs are short. With room to spare on both sides 16
+    // bytes go whatever the length, what's past it is overwritten later.
+    if (literal_length <= 16 && in_end - ip >= 16 && out_end - op >= 16) {
+      memcpy(op, ip, 16);
+    } else if (literal_length) {
+      memcpy(op, ip, literal_length);
+    }
+    op += literal_length;
+    ip += literal_length;
+
+    // Only the last sequence ends on its literals.
+    if (ip == in_end) {
+      return op == out_end;
+    }
+
+    if (in_end - ip < 2) return false;
+    uint64_t offset = (uint64_t)ip[0] | ((uint64_t)ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (uint64_t)(op - dst)) return false;
+
+    uint64_t match_length = token & 15;
+    if (match_length == 15 && !lz4_get_length(&ip, in_end, &match_length)) return false;
+    match_length += LZ4_MIN_MATCH;
+    if (match_length > (uint64_t)(out_end - op)) return false;
+
+    // In blocks of 16 (or 8) when the match is at least that far back, so
+    // a block never reads what it writes, overshooting into room that's
+    // overwritten later. Closer than that it repeats a short pattern.
+    const uint8_t *match = op - offset;
+    uint8_t *match_out_end = op + match_length;
+    if (offset >= 16 && out_end - match_out_end >= 16) {
+      do {
+        memcpy(op, match, 16);
+        op += 16;
+        match += 16;
+      } while (op < match_out_end);
+      op = match_out_end;
+    } else if (offset >= 8 && out_end - match_out_end >= 8) {
+      do {
+        memcpy(op, match, 8);
+        op += 8;
+        match += 8;
+      } while (op < match_out_end);
+      op = match_out_end;
+    } else if (offset == 1) {
+      memset(op, *match, match_length);
+      op = match_out_end;
+    } else {
+      while (op < match_out_end) {
+        *op++ = *match++;
+      }
+    }
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef JAM_LZ4_BLOCK_H
+#define JAM_LZ4_BLOCK_H
+
+#include <stdint.h>
+
+// The LZ4 block format (no frame around it), byte compatible with the
+// reference implementation: what lz4's LZ4_decompress_safe reads, this
+// reads, and the other way around. The compressor is the plain greedy one
+// with a 4K entry hash table, fast to pack with, and the decoder is the
+// part that matters, it's what asset loads spend their time in.
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // A block always ends with at least this many literals.
+#define LZ4_MATCH_LIMIT 12 // No match starts closer than this to the end.
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+inline uint64_t lz4_compress_bound(uint64_t size) {
+  return size + size / 255 + 16;
+}
+
+// Returns the compressed size, 0 when dst is too small.
+uint64_t lz4_compress_block(const uint8_t *src, uint64_t size, uint8_t *dst, uint64_t capacity);
+
+// Decodes exactly dst_size bytes. False on anything malformed, it never
+// reads or writes outside the two buffers.
+bool lz4_decompress_block(const uint8_t *src, uint64_t size, uint8_t *dst, uint64_t dst_size);
+
+#endif // !JAM_LZ4_BLOCK_H
@@ -0,0 +1,352 @@
+#include "pixel_convert.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXEL_HAVE_X86_TARGETS 1
+#define PIXEL_SSE41 __attribute__((target("sse4.1")))
+#define PIXEL_AVX2 __attribute__((target("avx2")))
+#endif
+
+bool render_target_resize(render_target *target, uint32_t width, uint32_t height) {
+  uint32_t stride = pixel_format_stride(PIXEL_FORMAT_RGBA8888, width);
+  uint64_t size = (uint64_t)stride * height;
+
+  if (size > target->capacity) {
+    // Geometric growth, a window being dragged bigger doesn't reallocate every frame.
+    uint64_t capacity = target->capacity + target->capacity / 2;
+    if (capacity < size) capacity = size;
+    capacity = roundup_row(capacity);
+
+    free(target->pixels);
+    target->pixels = (uint8_t *)aligned_alloc(PIXEL_ROW_ALIGNMENT, capacity);
+
+    if (!target->pixels) {
+      memset(target, 0, sizeof(*target));
+      return false;
+    }
+
+    // Touch it all now, not page by page in the first frame's pixel loop.
+    memset(target->pixels, 0, capacity);
+    target->capacity = capacity;
+  }
+
+  target->width = width;
+  target->height = height;
+  target->stride = stride;
+
+  return true;
+}
+
+void render_target_free(render_target *target) {
+  free(target->pixels);
+  memset(target, 0, sizeof(*target));
+}
+
+// All the kernels work on one row at a time, SIMD for the bulk and
+// scalar for whatever is left over at the end of the row. Which SIMD is
+// picked at runtime, see cpu_dispatch.h.
+
+// RGBA8 read as a little endian u32 is A B G R from the top byte down.
+static inline uint32_t rgba8_to_argb8888(uint32_t p) {
+  return (p & 0xFF00FF00) | ((p >> 16) & 0xFF) | ((p & 0xFF) << 16);
+}
+
+static inline uint16_t rgba8_to_rgb565(uint32_t p) {
+  uint32_t r = (p >> 3) & 0x1F;
+  uint32_t g = (p >> 10) & 0x3F;
+  uint32_t b = (p >> 19) & 0x1F;
+  return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static inline uint16_t rgba8_to_rgba4444(uint32_t p) {
+  uint32_t r = (p >> 4) & 0xF;
+  uint32_t g = (p >> 12) & 0xF;
+  uint32_t b = (p >> 20) & 0xF;
+  uint32_t a = (p >> 28) & 0xF;
+  return (uint16_t)((r << 12) | (g << 8) | (b << 4) | a);
+}
+
+static inline uint16_t rgba8_to_xrgb4444(uint32_t p) {
+  uint32_t r = (p >> 4) & 0xF;
+  uint32_t g = (p >> 12) & 0xF;
+  uint32_t b = (p >> 20) & 0xF;
+  return (uint16_t)((0xF << 12) | (r << 8) | (g << 4) | b);
+}
+
+// Scalar first, the SIMD versions call them for the end of the row.
+static void fill_scalar(uint32_t *dst, uint32_t count, uint32_t value) {
+  for (uint32_t Index = 0; Index < count; Index++) {
+    dst[Index] = value;
+  }
+}
+
+static void to_argb8888_scalar(const uint32_t *src, uint32_t *dst, uint32_t width, uint32_t alpha_or) {
+  for (uint32_t Index = 0; Index < width; Index++) {
+    dst[Index] = rgba8_to_argb8888(src[Index]) | alpha_or;
+  }
+}
+
+// R in the top byte, the exact reverse of our byte order.
+static void to_rgba8888_scalar(const uint32_t *src, uint32_t *dst, uint32_t width) {
+  for (uint32_t Index = 0; Index < width; Index++) {
+    dst[Index] = __builtin_bswap32(src[Index]);
+  }
+}
+
+static void to_rgb565_scalar(const uint32_t *src, uint16_t *dst, uint32_t width) {
+  for (uint32_t Index = 0; Index < width; Index++) {
+    dst[Index] = rgba8_to_rgb565(src[Index]);
+  }
+}
+
+#if defined(__SSE2__)
+static void fill_sse2(uint32_t *dst, uint32_t count, uint32_t value) {
+  __m128i v = _mm_set1_epi32((int)value);
+  uint32_t Index = 0;
+  for (; Index + 4 <= count; Index += 4) {
+    _mm_storeu_si128((__m128i *)(dst + Index), v);
+  }
+  fill_scalar(dst + Index, count - Index, value);
+}
+
+static void to_argb8888_sse2(const uint32_t *src, uint32_t *dst, uint32_t width, uint32_t alpha_or) {
+  __m128i ga_mask = _mm_set1_epi32((int)0xFF00FF00);
+  __m128i lo_mask = _mm_set1_epi32(0xFF);
+  __m128i alpha = _mm_set1_epi32((int)alpha_or);
+
+  uint32_t Index = 0;
+  for (; Index + 4 <= width; Index += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)(src + Index));
+    __m128i ga = _mm_and_si128(p, ga_mask);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(p, 16), lo_mask);
+    __m128i r = _mm_slli_epi32(_mm_and_si128(p, lo_mask), 16);
+    __m128i result = _mm_or_si128(_mm_or_si128(ga, alpha), _mm_or_si128(r, b));
+    _mm_storeu_si128((__m128i *)(dst + Index), result);
+  }
+
+  to_argb8888_scalar(src + Index, dst + Index, width - Index, alpha_or);
+}
+
+static void to_rgb565_sse2(const uint32_t *src, uint16_t *dst, uint32_t width) {
+  __m128i r_mask = _mm_set1_epi32(0x1F);
+  __m128i g_mask = _mm_set1_epi32(0x3F);
+
+  uint32_t Index = 0;
+  for (; Index + 8 <= width; Index += 8) {
+    __m128i result[2];
+
+    for (uint32_t Half = 0; Half < 2; Half++) {
+      __m128i p = _mm_loadu_si128((const __m128i *)(src + Index + Half * 4));
+      __m128i r = _mm_and_si128(_mm_srli_epi32(p, 3), r_mask);
+      __m128i g = _mm_and_si128(_mm_srli_epi32(p, 10), g_mask);
+      __m128i b = _mm_and_si128(_mm_srli_epi32(p, 19), r_mask);
+      __m128i v = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 11), _mm_slli_epi32(g, 5)), b);
+
+      // Sign extend the low 16 bits so the signed pack below doesn't saturate.
+      result[Half] = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+    }
+
+    _mm_storeu_si128((__m128i *)(dst + Index), _mm_packs_epi32(result[0], result[1]));
+  }
+
+  to_rgb565_scalar(src + Index, dst + Index, width - Index);
+}
+#endif
+
+#if defined(PIXEL_HAVE_X86_TARGETS)
+// A byte shuffle does the swap, SSE2 has none.
+PIXEL_SSE41 static void to_rgba8888_sse41(const uint32_t *src, uint32_t *dst, uint32_t width) {
+  __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  uint32_t Index = 0;
+  for (; Index + 4 <= width; Index += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)(src + Index));
+    _mm_storeu_si128((__m128i *)(dst + Index), _mm_shuffle_epi8(p, swap));
+  }
+  to_rgba8888_scalar(src + Index, dst + Index, width - Index);
+}
+
+// Same as the SSE versions a register twice as wide, upper halves cleared
+// before the scalar tail like the audio kernels.
+PIXEL_AVX2 static void fill_avx2(uint32_t *dst, uint32_t count, uint32_t value) {
+  __m256i v = _mm256_set1_epi32((int)value);
+  uint32_t Index = 0;
+  for (; Index + 8 <= count; Index += 8) {
+    _mm256_storeu_si256((__m256i *)(dst + Index), v);
+  }
+  _mm256_zeroupper();
+  fill_scalar(dst + Index, count - Index, value);
+}
+
+PIXEL_AVX2 static void to_argb8888_avx2(const uint32_t *src, uint32_t *dst, uint32_t width, uint32_t alpha_or) {
+  __m256i ga_mask = _mm256_set1_epi32((int)0xFF00FF00);
+  __m256i lo_mask = _mm256_set1_epi32(0xFF);
+  __m256i alpha = _mm256_set1_epi32((int)alpha_or);
+
+  uint32_t Index = 0;
+  for (; Index + 8 <= width; Index += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)(src + Index));
+    __m256i ga = _mm256_and_si256(p, ga_mask);
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 16), lo_mask);
+    __m256i r = _mm256_slli_epi32(_mm256_and_si256(p, lo_mask), 16);
+    __m256i result = _mm256_or_si256(_mm256_or_si256(ga, alpha), _mm256_or_si256(r, b));
+    _mm256_storeu_si256((__m256i *)(dst + Index), result);
+  }
+
+  _mm256_zeroupper();
+  to_argb8888_scalar(src + Index, dst + Index, width - Index, alpha_or);
+}
+
+PIXEL_AVX2 static void to_rgba8888_avx2(const uint32_t *src, uint32_t *dst, uint32_t width) {
+  __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                  3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  uint32_t Index = 0;
+  for (; Index + 8 <= width; Index += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)(src + Index));
+    _mm256_storeu_si256((__m256i *)(dst + Index), _mm256_shuffle_epi8(p, swap));
+  }
+  _mm256_zeroupper();
+  to_rgba8888_scalar(src + Index, dst + Index, width - Index);
+}
+
+PIXEL_AVX2 static void to_rgb565_avx2(const uint32_t *src, uint16_t *dst, uint32_t width) {
+  __m256i r_mask = _mm256_set1_epi32(0x1F);
+  __m256i g_mask = _mm256_set1_epi32(0x3F);
+
+  uint32_t Index = 0;
+  for (; Index + 16 <= width; Index += 16) {
+    __m256i result[2];
+
+    for (uint32_t Half = 0; Half < 2; Half++) {
+      __m256i p = _mm256_loadu_si256((const __m256i *)(src + Index + Half * 8));
+      __m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 3), r_mask);
+      __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 10), g_mask);
+      __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 19), r_mask);
+      result[Half] = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 11), _mm256_slli_epi32(g, 5)), b);
+    }
+
+    // Unsigned pack, the values are 16 bits already. It packs within 128
+    // bit lanes, a0-3 b0-3 a4-7 b4-7, put them back in order.
+    __m256i packed = _mm256_packus_epi32(result[0], result[1]);
+    packed = _mm256_permute4x64_epi64(packed, 0xD8);
+    _mm256_storeu_si256((__m256i *)(dst + Index), packed);
+  }
+
+  _mm256_zeroupper();
+  to_rgb565_scalar(src + Index, dst + Index, width - Index);
+}
+#endif
+
+// Best first, see cpu_dispatch.h.
+static const cpu_kernel_variant fill_variants[] = {
+#if defined(PIXEL_HAVE_X86_TARGETS)
+  CPU_KERNEL(CPU_FEATURE_AVX2, fill_avx2),
+#endif
+#if defined(__SSE2__)
+  CPU_KERNEL(CPU_FEATURE_SSE2, fill_sse2),
+#endif
+  CPU_KERNEL(0, fill_scalar),
+};
+
+static const cpu_kernel_variant to_argb8888_variants[] = {
+#if defined(PIXEL_HAVE_X86_TARGETS)
+  CPU_KERNEL(CPU_FEATURE_AVX2, to_argb8888_avx2),
+#endif
+#if defined(__SSE2__)
+  CPU_KERNEL(CPU_FEATURE_SSE2, to_argb8888_sse2),
+#endif
+  CPU_KERNEL(0, to_argb8888_scalar),
+};
+
+static const cpu_kernel_variant to_rgba8888_variants[] = {
+#if defined(PIXEL_HAVE_X86_TARGETS)
+  CPU_KERNEL(CPU_FEATURE_AVX2, to_rgba8888_avx2),
+  CPU_KERNEL(CPU_FEATURE_SSE41, to_rgba8888_sse41),
+#endif
+  CPU_KERNEL(0, to_rgba8888_scalar),
+};
+
+static const cpu_kernel_variant to_rgb565_variants[] = {
+#if defined(PIXEL_HAVE_X86_TARGETS)
+  CPU_KERNEL(CPU_FEATURE_AVX2, to_rgb565_avx2),
+#endif
+#if defined(__SSE2__)
+  CPU_KERNEL(CPU_FEATURE_SSE2, to_rgb565_sse2),
+#endif
+  CPU_KERNEL(0, to_rgb565_scalar),
+};
+
+void pixel_kernels_resolve(pixel_kernels *kernels, uint32_t features) {
+  CPU_KERNEL_RESOLVE(kernels->fill, fill_variants, features);
+  CPU_KERNEL_RESOLVE(kernels->to_argb8888, to_argb8888_variants, features);
+  CPU_KERNEL_RESOLVE(kernels->to_rgba8888, to_rgba8888_variants, features);
+  CPU_KERNEL_RESOLVE(kernels->to_rgb565, to_rgb565_variants, features);
+
+  const char *name = cpu_kernel_pick(to_argb8888_variants, sizeof(to_argb8888_variants) / sizeof(to_argb8888_variants[0]),
+                                     features)->name;
+  kernels->name = strrchr(name, '_') + 1;
+}
+
+void pixel_fill_rect(uint8_t *pixels, uint32_t stride, uint32_t width, uint32_t height, uint32_t value) {
+  const pixel_kernels *kernels = &cpu_kernels_get()->pixel;
+
+  // One run when the rows are back to back.
+  if (stride == width * 4) {
+    kernels->fill((uint32_t *)pixels, width * height, value);
+    return;
+  }
+
+  for (uint32_t Row = 0; Row < height; Row++) {
+    kernels->fill((uint32_t *)(pixels + (uint64_t)Row * stride), width, value);
+  }
+}
+
+void convert_rgba8(pixel_format dst_format,
+                   const uint8_t *src, uint32_t src_stride,
+                   uint8_t *dst, uint32_t dst_stride,
+                   uint32_t width, uint32_t height) {
+  const pixel_kernels *kernels = &cpu_kernels_get()->pixel;
+
+  for (uint32_t Row = 0; Row < height; Row++) {
+    const uint32_t *src_row = (const uint32_t *)(src + (uint64_t)Row * src_stride);
+    uint8_t *dst_row = dst + (uint64_t)Row * dst_stride;
+
+    switch (dst_format) {
+      case PIXEL_FORMAT_XRGB8888: {
+        kernels->to_argb8888(src_row, (uint32_t *)dst_row, width, 0xFF000000);
+      } break;
+
+      case PIXEL_FORMAT_ARGB8888: {
+        kernels->to_argb8888(src_row, (uint32_t *)dst_row, width, 0);
+      } break;
+
+      case PIXEL_FORMAT_RGBA8888: {
+        kernels->to_rgba8888(src_row, (uint32_t *)dst_row, width);
+      } break;
+
+      case PIXEL_FORMAT_RGB565: {
+        kernels->to_rgb565(src_row, (uint16_t *)dst_row, width);
+      } break;
+
+      case PIXEL_FORMAT_RGBA4444: {
+        uint16_t *out = (uint16_t *)dst_row;
+        for (uint32_t Index = 0; Index < width; Index++) {
+          out[Index] = rgba8_to_rgba4444(src_row[Index]);
+        }
+      } break;
+
+      case PIXEL_FORMAT_XRGB4444: {
+        uint16_t *out = (uint16_t *)dst_row;
+        for (uint32_t Index = 0; Index < width; Index++) {
+          out[Index] = rgba8_to_xrgb4444(src_row[Index]);
+        }
+      } break;
+    }
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef JAM_PIXEL_CONVERT_H
+#define JAM_PIXEL_CONVERT_H
+
+#include <stdint.h>
+
+#include "../platform.h"
+#include "cpu_dispatch.h"
+
+// Rows of every pixel buffer start on a cache line, keeps the
+// SIMD kernels on aligned loads and stores for the bulk of a row.
+#define PIXEL_ROW_ALIGNMENT 64
+#define roundup_row(n) (((n) + (PIXEL_ROW_ALIGNMENT - 1)) & ~(PIXEL_ROW_ALIGNMENT - 1))
+
+inline uint32_t pixel_format_bytes(pixel_format format) {
+  switch (format) {
+    case PIXEL_FORMAT_RGB565:
+    case PIXEL_FORMAT_XRGB4444:
+    case PIXEL_FORMAT_RGBA4444:
+      return 2;
+    default:
+      return 4;
+  }
+}
+
+inline uint32_t pixel_format_stride(pixel_format format, uint32_t width) {
+  return roundup_row(width * pixel_format_bytes(format));
+}
+
+// The app's canonical RGBA8 render target, backend independent.
+struct render_target {
+  uint8_t *pixels;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint64_t capacity; // Bytes allocated, only grows.
+};
+
+// Reallocates only when the new size doesn't fit what's already allocated.
+// Returns false when out of memory.
+bool render_target_resize(render_target *target, uint32_t width, uint32_t height);
+void render_target_free(render_target *target);
+
+// Converts from the app's canonical RGBA8 render target (bytes R, G, B, A)
+// into whatever format the swapchain ended up with.
+void convert_rgba8(pixel_format dst_format,
+                   const uint8_t *src, uint32_t src_stride,
+                   uint8_t *dst, uint32_t dst_stride,
+                   uint32_t width, uint32_t height);
+
+// value is one RGBA8 pixel as a little endian u32.
+void pixel_fill_rect(uint8_t *pixels, uint32_t stride, uint32_t width, uint32_t height, uint32_t value);
+
+#endif // !JAM_PIXEL_CONVERT_H
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -22,49 +23,542 @@
  source: https://gaultier.github.io/blog/wayland_from_scratch.html */
 
 #include "wayland/wayland_client.h"
+#include "x11/x11_client.h"
+#include "headless/headless_client.h"
+#include "audio/audio_mixer.h"
+#include "pack/asset_pack.h"
+#include "game_code.h"
+#include "cpu_dispatch.h"
+#include "pixel_convert.h"
+#include "cpu_topology.h"
 
-void create_a_window(void **memory, uint32_t Width, uint32_t Height) {
+// What *memory points at, the backend picked at runtime and its state.
+struct linux_windowState {
+  window_backend backend;
+  wayland_windowState *wayland;
+  x11_windowState *x11;
+  headless_windowState *headless;
+};
 
-  // FIXME: Query x11 or wayland.
-  // Then allocate a windowState object.
-  *memory = malloc(sizeof(wayland_windowState));
-  wayland_windowState *windowState = ((wayland_windowState *)*memory);
-  
-  if (connect_wayland_display(windowState)) {
-    wayland_wl_display_get_registry(windowState);
-    while (1) {
-      char read_buf[4096] = "";
-      int64_t read_bytes = recv(windowState->fd, read_buf, sizeof(read_buf), 0);
+static wayland_windowState *get_wayland(void **memory) {
+  linux_windowState *window = ((linux_windowState *)*memory);
+  return window->backend == WINDOW_BACKEND_WAYLAND ? window->wayland : 0;
+}
+
+static x11_windowState *get_x11(void **memory) {
+  linux_windowState *window = ((linux_windowState *)*memory);
+  return window->backend == WINDOW_BACKEND_X11 ? window->x11 : 0;
+}
+
+static headless_windowState *get_headless(void **memory) {
+  linux_windowState *window = ((linux_windowState *)*memory);
+  return window->backend == WINDOW_BACKEND_HEADLESS ? window->headless : 0;
+}
+
+// JAM_BACKEND=wayland|x11|headless wins over the settings, then whichever
+// display server the session advertises, wayland first.
+static window_backend pick_backend(window_settings *settings) {
+  const char *forced = getenv("JAM_BACKEND");
+  if (forced) {
+    if (strcmp(forced, "wayland") == 0) return WINDOW_BACKEND_WAYLAND;
+    if (strcmp(forced, "x11") == 0) return WINDOW_BACKEND_X11;
+    if (strcmp(forced, "headless") == 0) return WINDOW_BACKEND_HEADLESS;
+    printf("Unknown JAM_BACKEND %s\n", forced);
+  }
+
+  if (settings && settings->backend != WINDOW_BACKEND_AUTO) {
+    return settings->backend;
+  }
+
+  if (getenv("WAYLAND_DISPLAY") || !getenv("DISPLAY")) {
+    return WINDOW_BACKEND_WAYLAND;
+  }
+
+  return WINDOW_BACKEND_X11;
+}
+
+static bool run_x11_window(linux_windowState *window, uint32_t Width, uint32_t Height, window_settings *settings) {
+  window->x11 = (x11_windowState *)malloc(sizeof(x11_windowState));
+  x11_windowState *windowState = window->x11;
+  memset(windowState, 0, sizeof(x11_windowState));
+
+  if (!connect_x11_display(windowState)) {
+    free(window->x11);
+    window->x11 = 0;
+    return false;
+  }
+
+  window->backend = WINDOW_BACKEND_X11;
+  x11_window_set_up(windowState, Width, Height, settings);
+  x11_run(windowState);
+
+  return true;
+}
+
+static bool run_headless_window(linux_windowState *window, uint32_t Width, uint32_t Height, window_settings *settings) {
+  window->headless = (headless_windowState *)malloc(sizeof(headless_windowState));
+  headless_windowState *windowState = window->headless;
+  memset(windowState, 0, sizeof(headless_windowState));
+
+  window->backend = WINDOW_BACKEND_HEADLESS;
+  if (!headless_window_set_up(windowState, Width, Height, settings)) {
+    printf("Couldn't set up the headless window\n");
+    return false;
+  }
+
+  headless_run(windowState);
+
+  return true;
+}
+
+static bool run_wayland_window(linux_windowState *window, uint32_t Width, uint32_t Height, window_settings *settings) {
+  window->wayland = (wayland_windowState *)malloc(sizeof(wayland_windowState));
+  wayland_windowState *windowState = window->wayland;
+  memset(windowState, 0, sizeof(wayland_windowState));
+  windowState->current_output = -1;
+
+  if (settings) {
+    windowState->settings = *settings;
+  }
 
-      if (read_bytes == -1) {
-        printf("Wayland closed the socket\n");
-        exit(errno);
-      }
+  if (!connect_wayland_display(windowState)) {
+    free(window->wayland);
+    window->wayland = 0;
+    return false;
+  }
+
+  window->backend = WINDOW_BACKEND_WAYLAND;
+  wayland_window_set_up(windowState, Width, Height);
 
-      char *msg = read_buf;
-      uint64_t msg_len = (uint64_t)read_bytes;
+  const char *io_thread = getenv("JAM_IO_THREAD");
+  bool threaded = io_thread ? strcmp(io_thread, "1") == 0 : windowState->settings.io_thread;
 
-      int count;
+  // The app's thread comes back to draw with begin_frame/end_frame.
+  if (threaded && wayland_start_io_thread(windowState)) {
+    return true;
+  }
 
-      while (msg_len > 0) {
-        wayland_listen_to_events(windowState, &msg, &msg_len);
-      }
+  wayland_run(windowState);
 
-      wayland_window_set_up(windowState);
+  return true;
+}
 
-      fflush(stdout);   
+void create_a_window(void **memory, uint32_t Width, uint32_t Height, window_settings *settings) {
+  *memory = malloc(sizeof(linux_windowState));
+  linux_windowState *window = ((linux_windowState *)*memory);
+  memset(window, 0, sizeof(linux_windowState));
+
+  window_backend backend = pick_backend(settings);
+  bool running = false;
+
+  if (backend == WINDOW_BACKEND_HEADLESS) {
+    run_headless_window(window, Width, Height, settings);
+    return;
+  }
 
+  if (backend == WINDOW_BACKEND_X11) {
+    running = run_x11_window(window, Width, Height, settings);
+    if (!running) {
+      printf("No X11 display, trying wayland\n");
+      running = run_wayland_window(window, Width, Height, settings);
+    }
+  } else {
+    running = run_wayland_window(window, Width, Height, settings);
+    if (!running && getenv("DISPLAY")) {
+      printf("No wayland display, trying X11\n");
+      running = run_x11_window(window, Width, Height, settings);
     }
   }
 
+  // Servers without any display still get their frames rendered.
+  if (!running) {
+    printf("No display server, running headless\n");
+    run_headless_window(window, Width, Height, settings);
+  }
 }
 
 void destroy_a_window(void **memory) {
-  wayland_windowState *windowState = ((wayland_windowState *)*memory);
+  linux_windowState *window = ((linux_windowState *)*memory);
+
+  if (wayland_windowState *windowState = get_wayland(memory)) {
+    wayland_stop_io_thread(windowState);
+    wayland_flush(windowState);
+    wayland_cursor_shutdown(windowState);
+    pthread_mutex_destroy(&windowState->data_lock);
+    pthread_cond_destroy(&windowState->transfer_freed);
+    close(windowState->fd);
+    windowState->fd = 0;
+    free(windowState);
+  }
+
+  if (x11_windowState *windowState = get_x11(memory)) {
+    x11_disconnect(windowState);
+    free(windowState);
+  }
+
+  if (headless_windowState *windowState = get_headless(memory)) {
+    headless_disconnect(windowState);
+    free(windowState);
+  }
 
-  close(windowState->fd);
   printf("And the file descriptor is gone...\n");
-  windowState->fd = 0;
+  free(window);
+  *memory = 0;
+}
+
+window_backend get_window_backend(void **memory) {
+  linux_windowState *window = ((linux_windowState *)*memory);
+  return window->backend;
+}
+
+window_scale get_window_scale(void **memory) {
+  window_scale result = {};
+
+  if (wayland_windowState *windowState = get_wayland(memory)) {
+    if (windowState->threaded) {
+      return windowState->game_frame.scale;
+    }
+
+    result.density = wayland_surface_density(windowState);
+    result.width = windowState->Width;
+    result.height = windowState->Height;
+    result.buffer_width = windowState->BufferWidth;
+    result.buffer_height = windowState->BufferHeight;
+  } else if (x11_windowState *windowState = get_x11(memory)) {
+    result.density = 1.0f;
+    result.width = windowState->Width;
+    result.height = windowState->Height;
+    result.buffer_width = windowState->Width;
+    result.buffer_height = windowState->Height;
+  } else if (headless_windowState *windowState = get_headless(memory)) {
+    result.density = 1.0f;
+    result.width = windowState->Width;
+    result.height = windowState->Height;
+    result.buffer_width = windowState->swapchain.width;
+    result.buffer_height = windowState->swapchain.height;
+  }
+
+  return result;
+}
+
+uint8_t *get_render_target(void **memory, uint32_t *stride) {
+  render_target *target = 0;
+
+  if (wayland_windowState *windowState = get_wayland(memory)) {
+    target = &windowState->target;
+  } else if (x11_windowState *windowState = get_x11(memory)) {
+    target = &windowState->target;
+  } else if (headless_windowState *windowState = get_headless(memory)) {
+    target = &windowState->target;
+  }
+
+  if (stride) {
+    *stride = target ? target->stride : 0;
+  }
+
+  return target ? target->pixels : 0;
+}
+
+pixel_format get_window_format(void **memory) {
+  if (wayland_windowState *windowState = get_wayland(memory)) {
+    return windowState->threaded ? windowState->game_frame.format : windowState->format;
+  } else if (headless_windowState *windowState = get_headless(memory)) {
+    return windowState->format;
+  }
+
+  return PIXEL_FORMAT_XRGB8888;
+}
+
+uint32_t get_window_outputs(void **memory, window_output *outputs, uint32_t max_outputs) {
+  uint32_t count = 0;
+
+  // The X11 backend doesn't speak RandR, it reports the root screen.
+  if (x11_windowState *windowState = get_x11(memory)) {
+    if (max_outputs > 0) {
+      window_output *result = &outputs[count++];
+      memset(result, 0, sizeof(*result));
+      result->width = windowState->screen_width;
+      result->height = windowState->screen_height;
+      result->refresh_mhz = (uint32_t)(1000000000000ull / windowState->frame_interval_ns);
+      result->scale = 1;
+      result->has_window = true;
+      result->current = true;
+    }
+    return count;
+  }
+
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || windowState->threaded) {
+    return 0;
+  }
+
+  for (uint32_t Index = 0; Index < windowState->output_count && count < max_outputs; Index++) {
+    wayland_output *output = &windowState->outputs[Index];
+    window_output *result = &outputs[count++];
+    memset(result, 0, sizeof(*result));
+
+    memcpy(result->name, output->name, sizeof(result->name));
+    result->x = output->x;
+    result->y = output->y;
+    result->width = (uint32_t)output->width;
+    result->height = (uint32_t)output->height;
+    result->refresh_mhz = (uint32_t)output->refresh_mhz;
+    result->scale = output->scale;
+    result->has_window = output->window_entered;
+    result->current = windowState->current_output == (int32_t)Index;
+  }
+
+  return count;
+}
+
+uint64_t get_frame_interval_ns(void **memory) {
+  if (wayland_windowState *windowState = get_wayland(memory)) {
+    return windowState->threaded ? windowState->game_frame.frame_interval_ns : windowState->frame_interval_ns;
+  } else if (x11_windowState *windowState = get_x11(memory)) {
+    return windowState->frame_interval_ns;
+  } else if (headless_windowState *windowState = get_headless(memory)) {
+    return windowState->frame_interval_ns; // 0 when unthrottled.
+  }
+
+  return 0;
+}
+
+uint64_t get_frame_present_ns(void **memory) {
+  if (wayland_windowState *windowState = get_wayland(memory)) {
+    return windowState->threaded ? windowState->game_frame.present_ns : wayland_predict_present_ns(windowState);
+  } else if (x11_windowState *windowState = get_x11(memory)) {
+    return windowState->present_ns;
+  } else if (headless_windowState *windowState = get_headless(memory)) {
+    return windowState->present_ns;
+  }
+
+  return 0;
+}
+
+// Only Wayland has input timestamps on our clock, X server time isn't.
+uint64_t get_frame_input_ns(void **memory) {
+  if (wayland_windowState *windowState = get_wayland(memory)) {
+    if (windowState->threaded) return windowState->game_frame.input_ns;
+    return windowState->pending_input_ns;
+  }
+
+  return 0;
+}
+
+window_frame_stats get_frame_stats(void **memory) {
+  if (wayland_windowState *windowState = get_wayland(memory)) {
+    return frame_stats_read(&windowState->recorder, &windowState->frame_stats);
+  } else if (x11_windowState *windowState = get_x11(memory)) {
+    return frame_stats_read(&windowState->recorder, &windowState->frame_stats);
+  } else if (headless_windowState *windowState = get_headless(memory)) {
+    return frame_stats_read(&windowState->recorder, &windowState->frame_stats);
+  }
+
+  window_frame_stats result = {};
+  return result;
+}
+
+uint32_t get_window_flags(void **memory) {
+  if (wayland_windowState *windowState = get_wayland(memory)) {
+    return windowState->threaded ? windowState->game_frame.window_flags : windowState->window_flags;
+  } else if (x11_windowState *windowState = get_x11(memory)) {
+    return windowState->window_flags;
+  }
+
+  // Nobody to hide a headless window from.
+  return WINDOW_ACTIVATED;
+}
+
+uint8_t *begin_frame(void **memory, uint32_t *stride) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || !windowState->threaded) return 0;
+  return wayland_begin_frame(windowState, stride);
+}
+
+void end_frame(void **memory) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || !windowState->threaded) return;
+  wayland_end_frame(windowState);
+}
+
+void set_render_size(void **memory, uint32_t width, uint32_t height) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || !windowState->threaded) return;
+  wayland_set_render_size(windowState, width, height);
+}
+
+bool get_data_offer(void **memory, data_offer_kind kind, data_offer_info *info) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState) {
+    memset(info, 0, sizeof(*info));
+    return false;
+  }
+  return wayland_get_data_offer(windowState, kind, info);
+}
+
+int32_t receive_data_to_fd(void **memory, data_offer_kind kind, uint32_t serial,
+                           const char *mime_type, int fd, uint64_t offset) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || fd < 0) return -1;
+  return wayland_receive_data(windowState, kind, serial, mime_type, fd, offset, 0, 0);
+}
+
+int32_t receive_data_to_memory(void **memory, data_offer_kind kind, uint32_t serial,
+                               const char *mime_type, uint8_t *dst, uint64_t capacity) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState) return -1;
+  return wayland_receive_data(windowState, kind, serial, mime_type, -1, 0, dst, capacity);
+}
+
+data_transfer_status get_data_transfer(void **memory, int32_t transfer, uint64_t *bytes) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState) return DATA_TRANSFER_FAILED;
+  return wayland_get_data_transfer(windowState, transfer, bytes);
+}
+
+void release_data_transfer(void **memory, int32_t transfer) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState) return;
+  wayland_release_data_transfer(windowState, transfer);
+}
+
+bool set_clipboard_data(void **memory, const char *const *mime_types, uint32_t mime_count,
+                        const uint8_t *data, uint64_t size) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || mime_count == 0) return false;
+  return wayland_set_clipboard(windowState, mime_types, mime_count, data, -1, 0, size);
+}
+
+bool set_clipboard_file(void **memory, const char *const *mime_types, uint32_t mime_count,
+                        int fd, uint64_t offset, uint64_t size) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || mime_count == 0 || fd < 0) return false;
+  return wayland_set_clipboard(windowState, mime_types, mime_count, 0, fd, offset, size);
+}
+
+void clear_clipboard(void **memory) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState) return;
+  wayland_set_clipboard(windowState, 0, 0, 0, -1, 0, 0);
+}
+
+void set_cursor_shape(void **memory, cursor_shape shape) {
+  // X11 and headless keep whatever cursor they have.
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || shape >= CURSOR_SHAPE_COUNT) return;
+
+  if (windowState->threaded) {
+    wayland_send_command(windowState, WAYLAND_COMMAND_SET_CURSOR, shape);
+  } else {
+    wayland_apply_cursor_shape(windowState, shape);
+  }
+}
+
+uint32_t create_layer(void **memory, int32_t x, int32_t y, uint32_t width, uint32_t height, bool desync) {
+  // Subsurfaces are a wayland thing, X11 and headless get no layers.
+  // In threaded mode the socket is the I/O thread's.
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || windowState->threaded) return 0;
+  return wayland_create_layer(windowState, x, y, width, height, desync);
+}
+
+void move_layer(void **memory, uint32_t layer, int32_t x, int32_t y) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || windowState->threaded) return;
+  wayland_move_layer(windowState, layer, x, y);
+}
+
+uint32_t *begin_layer_frame(void **memory, uint32_t layer, uint32_t *stride) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || windowState->threaded) return 0;
+  return wayland_begin_layer_frame(windowState, layer, stride);
+}
+
+void present_layer(void **memory, uint32_t layer, int32_t x, int32_t y, int32_t width, int32_t height) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || windowState->threaded) return;
+  wayland_present_layer(windowState, layer, x, y, width, height);
+}
+
+void destroy_layer(void **memory, uint32_t layer) {
+  wayland_windowState *windowState = get_wayland(memory);
+  if (!windowState || windowState->threaded) return;
+  wayland_destroy_layer(windowState, layer);
+}
+
+// *audio is the audio_state, separate from the window so either can be
+// used without the other.
+bool open_audio(void **audio, audio_settings *settings) {
+  audio_state *state = (audio_state *)malloc(sizeof(audio_state));
+  if (!state) return false;
+  memset(state, 0, sizeof(audio_state));
+
+  if (!audio_open(state, settings)) {
+    audio_close(state);
+    free(state);
+    *audio = 0;
+    return false;
+  }
+
+  *audio = state;
+  return true;
+}
+
+void close_audio(void **audio) {
+  audio_state *state = (audio_state *)*audio;
+  if (!state) return;
+
+  audio_close(state);
+  free(state);
+  *audio = 0;
+}
+
+uint32_t play_sound(void **audio, const audio_sound *sound, float gain, float pan, bool loop) {
+  audio_state *state = (audio_state *)*audio;
+  if (!state || !sound) return 0;
+  return audio_play(state, sound, gain, pan, loop);
+}
+
+uint32_t play_sound_at(void **audio, const audio_sound *sound, float gain, float pan, bool loop, uint64_t time_ns) {
+  audio_state *state = (audio_state *)*audio;
+  if (!state || !sound) return 0;
+  return audio_play(state, sound, gain, pan, loop, audio_frame_at(state, time_ns));
+}
+
+void set_voice(void **audio, uint32_t voice, float gain, float pan, float pitch) {
+  audio_state *state = (audio_state *)*audio;
+  if (!state) return;
+  audio_set_voice(state, voice, gain, pan, pitch);
+}
+
+void stop_voice(void **audio, uint32_t voice) {
+  audio_state *state = (audio_state *)*audio;
+  if (!state) return;
+  audio_stop_voice(state, voice);
+}
+
+bool voice_playing(void **audio, uint32_t voice) {
+  audio_state *state = (audio_state *)*audio;
+  if (!state) return false;
+  return audio_voice_playing(state, voice);
+}
+
+audio_stats get_audio_stats(void **audio) {
+  audio_state *state = (audio_state *)*audio;
+  if (!state) return {};
+  return audio_get_stats(state);
+}
+
+audio_clock get_audio_clock(void **audio) {
+  audio_state *state = (audio_state *)*audio;
+  if (!state) return {};
+  return audio_get_clock(state);
+}
+
+uint64_t get_audio_frame_at(void **audio, uint64_t time_ns) {
+  audio_state *state = (audio_state *)*audio;
+  if (!state) return 0;
+  return audio_frame_at(state, time_ns);
 }
 
 bool DirectoryExist(const char *path) {
@@ -90,3 +584,191 @@ bool CreateDirectory(const char *path) {
 
   return result;
 }
+
+// *pack is the asset_pack_state.
+bool open_asset_pack(void **pack, const char *path) {
+  asset_pack_state *state = (asset_pack_state *)malloc(sizeof(asset_pack_state));
+  if (!state) return false;
+
+  if (!asset_pack_open(state, path)) {
+    asset_pack_close(state);
+    free(state);
+    *pack = 0;
+    return false;
+  }
+
+  *pack = state;
+  return true;
+}
+
+void close_asset_pack(void **pack) {
+  asset_pack_state *state = (asset_pack_state *)*pack;
+  if (!state) return;
+
+  asset_pack_close(state);
+  free(state);
+  *pack = 0;
+}
+
+bool find_asset(void **pack, const char *path, asset_view *asset) {
+  asset_pack_state *state = (asset_pack_state *)*pack;
+  if (!state || !path) return false;
+  return asset_pack_find(state, path, asset);
+}
+
+uint32_t get_asset_count(void **pack) {
+  asset_pack_state *state = (asset_pack_state *)*pack;
+  if (!state || !state->header) return 0;
+  return state->header->entry_count;
+}
+
+bool get_asset(void **pack, uint32_t index, asset_view *asset) {
+  asset_pack_state *state = (asset_pack_state *)*pack;
+  if (!state) return false;
+  return asset_pack_get(state, index, asset);
+}
+
+// *loader is the asset_loader_state, one can serve any number of packs.
+bool open_asset_loader(void **loader, uint32_t threads) {
+  asset_loader_state *state = (asset_loader_state *)malloc(sizeof(asset_loader_state));
+  if (!state) return false;
+
+  if (!asset_loader_open(state, threads)) {
+    asset_loader_close(state);
+    free(state);
+    *loader = 0;
+    return false;
+  }
+
+  *loader = state;
+  return true;
+}
+
+void close_asset_loader(void **loader) {
+  asset_loader_state *state = (asset_loader_state *)*loader;
+  if (!state) return;
+
+  asset_loader_close(state);
+  free(state);
+  *loader = 0;
+}
+
+uint64_t get_asset_size(const asset_view *asset) {
+  if (!asset) return 0;
+  return asset_raw_size(asset);
+}
+
+int32_t load_asset(void **loader, const asset_view *asset, uint8_t *dst, uint64_t capacity) {
+  asset_loader_state *state = (asset_loader_state *)*loader;
+  if (!state || !asset) return -1;
+  return asset_loader_load(state, asset, dst, capacity);
+}
+
+asset_load_status get_asset_load(void **loader, int32_t load, uint64_t *ready) {
+  asset_loader_state *state = (asset_loader_state *)*loader;
+  if (!state) return ASSET_LOAD_FREE;
+  return asset_loader_get(state, load, ready);
+}
+
+asset_load_status wait_asset_load(void **loader, int32_t load, uint64_t bytes) {
+  asset_loader_state *state = (asset_loader_state *)*loader;
+  if (!state) return ASSET_LOAD_FREE;
+  return asset_loader_wait(state, load, bytes);
+}
+
+void release_asset_load(void **loader, int32_t load) {
+  asset_loader_state *state = (asset_loader_state *)*loader;
+  if (!state) return;
+  asset_loader_release(state, load);
+}
+
+// *game is the game_code_state, its game_memory lives in there too.
+bool open_game_code(void **game, const char *path, uint64_t permanent_size, uint64_t transient_size) {
+  game_code_state *state = (game_code_state *)malloc(sizeof(game_code_state));
+  if (!state) return false;
+
+  if (!game_code_open(state, path, permanent_size, transient_size)) {
+    free(state);
+    *game = 0;
+    return false;
+  }
+
+  *game = state;
+  return true;
+}
+
+void close_game_code(void **game) {
+  game_code_state *state = (game_code_state *)*game;
+  if (!state) return;
+
+  game_code_close(state);
+  free(state);
+  *game = 0;
+}
+
+bool reload_game_code(void **game) {
+  game_code_state *state = (game_code_state *)*game;
+  if (!state) return false;
+  return game_code_reload(state);
+}
+
+game_frame_fn *get_game_frame(void **game) {
+  game_code_state *state = (game_code_state *)*game;
+  if (!state) return 0;
+  return state->frame;
+}
+
+game_memory *get_game_memory(void **game) {
+  game_code_state *state = (game_code_state *)*game;
+  if (!state) return 0;
+  return &state->memory;
+}
+
+bool get_cpu_topology(cpu_topology *topology) {
+  *topology = *cpu_topology_get();
+  return topology->cpu_count > 0;
+}
+
+// *thread is the cpu_thread, it has to stay put while the thread runs.
+bool create_thread(void **thread, thread_fn *fn, void *user, const thread_settings *settings) {
+  cpu_thread *state = (cpu_thread *)malloc(sizeof(cpu_thread));
+  if (!state) return false;
+
+  if (!cpu_thread_start(state, fn, user, settings)) {
+    free(state);
+    *thread = 0;
+    return false;
+  }
+
+  *thread = state;
+  return true;
+}
+
+void join_thread(void **thread) {
+  cpu_thread *state = (cpu_thread *)*thread;
+  if (!state) return;
+
+  cpu_thread_join(state);
+  free(state);
+  *thread = 0;
+}
+
+uint32_t get_thread_granted(void **thread) {
+  cpu_thread *state = (cpu_thread *)*thread;
+  if (!state) return 0;
+  return state->granted;
+}
+
+uint32_t set_thread_settings(const thread_settings *settings) {
+  return cpu_thread_apply(settings);
+}
+
+uint32_t get_cpu_features() {
+  return cpu_kernels_get()->features;
+}
+
+void fill_pixels(uint8_t *pixels, uint32_t stride, uint32_t width, uint32_t height,
+                 uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+  uint32_t value = (uint32_t)r | ((uint32_t)g << 8) | ((uint32_t)b << 16) | ((uint32_t)a << 24);
+  pixel_fill_rect(pixels, stride, width, height, value);
+}
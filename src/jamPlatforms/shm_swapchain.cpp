@@ -0,0 +1,274 @@
+#include "shm_swapchain.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+static uint64_t shm_swapchain_round_size(shm_swapchain *swapchain, uint64_t size) {
+  if (swapchain->flags & SHM_SWAPCHAIN_HUGE_PAGES) {
+    return (size + SWAPCHAIN_HUGE_PAGE_SIZE - 1) & ~(uint64_t)(SWAPCHAIN_HUGE_PAGE_SIZE - 1);
+  }
+
+  return size;
+}
+
+// Faults in [offset, offset + size) for writing. MADV_POPULATE_WRITE needs
+// 5.14, older kernels get a write per page instead.
+static void shm_swapchain_prefault(shm_swapchain *swapchain, uint64_t offset, uint64_t size) {
+  if (!(swapchain->flags & SHM_SWAPCHAIN_PREFAULT) || size == 0) {
+    return;
+  }
+
+  uint8_t *start = swapchain->data + offset;
+  if (madvise(start, size, MADV_POPULATE_WRITE) == 0) {
+    return;
+  }
+
+  uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+  for (uint64_t Offset = 0; Offset < size; Offset += page_size) {
+    ((volatile uint8_t *)start)[Offset] = 0;
+  }
+}
+
+bool shm_swapchain_allocate(shm_swapchain *swapchain, uint32_t width, uint32_t height,
+                            uint32_t stride, uint32_t format, uint32_t buffer_count,
+                            uint32_t flags) {
+  assert(buffer_count > 0 && buffer_count <= SWAPCHAIN_MAX_BUFFERS);
+  assert(stride >= width);
+
+  memset(swapchain, 0, sizeof(*swapchain));
+  swapchain->flags = flags;
+
+  uint64_t buffer_size = (uint64_t)stride * height;
+  uint64_t size = shm_swapchain_round_size(swapchain, buffer_size * buffer_count);
+  if (size > INT32_MAX) {
+    printf("swapchain of %ux%u is too big\n", width, height);
+    return false;
+  }
+
+  unsigned int memfd_flags = MFD_CLOEXEC;
+  if (flags & SHM_SWAPCHAIN_SEAL) {
+    memfd_flags |= MFD_ALLOW_SEALING;
+  }
+
+  int fd = -1;
+  if (flags & SHM_SWAPCHAIN_HUGE_PAGES) {
+    // Fails unless huge pages are reserved (vm.nr_hugepages), which is the
+    // usual case. The truncate is where a short reserve shows, so it's
+    // tried here and not again below.
+    fd = memfd_create("jam_swapchain", memfd_flags | MFD_HUGETLB);
+    if (fd != -1 && ftruncate(fd, size) == -1) {
+      close(fd);
+      fd = -1;
+    }
+    swapchain->hugetlb = fd != -1;
+  }
+
+  if (fd == -1) {
+    fd = memfd_create("jam_swapchain", memfd_flags);
+  }
+
+  if (fd == -1) {
+    printf("failed to create memory file\n");
+    return false;
+  }
+
+  if (!swapchain->hugetlb && ftruncate(fd, size) == -1) {
+    printf("failed to truncate memory file\n");
+    close(fd);
+    return false;
+  }
+
+  if (flags & SHM_SWAPCHAIN_SEAL) {
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == -1) {
+      printf("failed to seal memory file\n");
+    }
+  }
+
+  uint8_t *data = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    printf("failed to map memory file\n");
+    close(fd);
+    return false;
+  }
+
+  if ((flags & SHM_SWAPCHAIN_HUGE_PAGES) && !swapchain->hugetlb) {
+    madvise(data, size, MADV_HUGEPAGE);
+  }
+
+  swapchain->fd = fd;
+  swapchain->data = data;
+  swapchain->pool_size = (uint32_t)size;
+  swapchain->width = width;
+  swapchain->height = height;
+  swapchain->stride = stride;
+  swapchain->format = format;
+  swapchain->buffer_count = buffer_count;
+
+  for (uint32_t Index = 0; Index < buffer_count; Index++) {
+    swapchain->buffers[Index].offset = (uint32_t)(buffer_size * Index);
+  }
+
+  shm_swapchain_prefault(swapchain, 0, size);
+
+  return true;
+}
+
+void shm_swapchain_free(shm_swapchain *swapchain) {
+  if (swapchain->data) {
+    munmap(swapchain->data, swapchain->pool_size);
+  }
+
+  if (swapchain->fd > 0) {
+    close(swapchain->fd);
+  }
+
+  memset(swapchain, 0, sizeof(*swapchain));
+}
+
+// Where the new buffers start: the lowest offset whose run doesn't overlap
+// a retired buffer. Past each one in the way until nothing is.
+static uint64_t shm_swapchain_first_fit(shm_swapchain *swapchain, uint64_t size) {
+  uint64_t start = 0;
+  bool moved = true;
+  while (moved) {
+    moved = false;
+    for (uint32_t Index = 0; Index < swapchain->retired_count; Index++) {
+      shm_swapchain_retired *retired = &swapchain->retired[Index];
+      uint64_t end = (uint64_t)retired->offset + retired->size;
+      if (start < end && retired->offset < start + size) {
+        start = end;
+        moved = true;
+      }
+    }
+  }
+
+  return start;
+}
+
+bool shm_swapchain_resize(shm_swapchain *swapchain, uint32_t width, uint32_t height,
+                          uint32_t stride, uint32_t format, bool *grown) {
+  assert(swapchain->data != 0);
+  assert(stride >= width);
+
+  uint32_t busy = 0;
+  for (uint32_t Index = 0; Index < swapchain->buffer_count; Index++) {
+    if (swapchain->buffers[Index].busy) busy++;
+  }
+  if (swapchain->retired_count + busy > SWAPCHAIN_MAX_RETIRED) {
+    printf("too many swapchain buffers still with the display\n");
+    return false;
+  }
+
+  // The old buffers' bytes stay put while the display reads them.
+  uint64_t old_size = (uint64_t)swapchain->stride * swapchain->height;
+  for (uint32_t Index = 0; Index < swapchain->buffer_count; Index++) {
+    shm_swapchain_buffer *buffer = &swapchain->buffers[Index];
+    if (buffer->busy) {
+      shm_swapchain_retired *retired = &swapchain->retired[swapchain->retired_count++];
+      retired->offset = buffer->offset;
+      retired->size = (uint32_t)old_size;
+      retired->handle = buffer->handle;
+    }
+  }
+
+  uint64_t buffer_size = (uint64_t)stride * height;
+  uint64_t first = shm_swapchain_first_fit(swapchain, buffer_size * swapchain->buffer_count);
+  uint64_t needed = first + buffer_size * swapchain->buffer_count;
+  *grown = false;
+
+  // wl_shm_pool sizes are an int32.
+  if (needed > INT32_MAX) {
+    printf("swapchain of %ux%u is too big\n", width, height);
+    swapchain->retired_count -= busy;
+    return false;
+  }
+
+  if (needed > swapchain->pool_size) {
+    uint64_t size = (uint64_t)swapchain->pool_size + swapchain->pool_size / 2;
+    if (size < needed) size = needed;
+    size = shm_swapchain_round_size(swapchain, size);
+    if (size > INT32_MAX) size = INT32_MAX & ~(uint64_t)(SWAPCHAIN_HUGE_PAGE_SIZE - 1);
+    if (size < needed) {
+      // Within a huge page of the limit, whatever fits under it is too small.
+      printf("swapchain of %ux%u is too big\n", width, height);
+      swapchain->retired_count -= busy;
+      return false;
+    }
+
+    if (ftruncate(swapchain->fd, size) == -1) {
+      printf("failed to grow memory file\n");
+      swapchain->retired_count -= busy;
+      return false;
+    }
+
+    uint8_t *data = (uint8_t *)mremap(swapchain->data, swapchain->pool_size, size, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED) {
+      printf("failed to remap memory file\n");
+      swapchain->retired_count -= busy;
+      return false;
+    }
+
+    uint64_t old_size = swapchain->pool_size;
+    swapchain->data = data;
+    swapchain->pool_size = (uint32_t)size;
+    *grown = true;
+
+    if ((swapchain->flags & SHM_SWAPCHAIN_HUGE_PAGES) && !swapchain->hugetlb) {
+      madvise(data, size, MADV_HUGEPAGE);
+    }
+
+    // Only the new tail, the old pages are already in.
+    shm_swapchain_prefault(swapchain, old_size, size - old_size);
+  }
+
+  swapchain->width = width;
+  swapchain->height = height;
+  swapchain->stride = stride;
+  swapchain->format = format;
+
+  for (uint32_t Index = 0; Index < swapchain->buffer_count; Index++) {
+    swapchain->buffers[Index].offset = (uint32_t)(first + buffer_size * Index);
+    swapchain->buffers[Index].handle = 0;
+    swapchain->buffers[Index].busy = false;
+  }
+
+  return true;
+}
+
+bool shm_swapchain_release_retired(shm_swapchain *swapchain, uint32_t handle) {
+  for (uint32_t Index = 0; Index < swapchain->retired_count; Index++) {
+    if (swapchain->retired[Index].handle == handle) {
+      swapchain->retired[Index] = swapchain->retired[--swapchain->retired_count];
+      return true;
+    }
+  }
+
+  return false;
+}
+
+uint64_t shm_thread_minor_faults() {
+  struct rusage usage = {};
+  getrusage(RUSAGE_THREAD, &usage);
+  return (uint64_t)usage.ru_minflt;
+}
+
+int32_t shm_swapchain_acquire(shm_swapchain *swapchain) {
+  for (uint32_t Index = 0; Index < swapchain->buffer_count; Index++) {
+    if (!swapchain->buffers[Index].busy) {
+      return (int32_t)Index;
+    }
+  }
+
+  return -1;
+}
@@ -0,0 +1,108 @@
+#ifndef JAM_SHM_SWAPCHAIN_H
+#define JAM_SHM_SWAPCHAIN_H
+
+#include <stdint.h>
+
+#include "../platform.h"
+
+#define SWAPCHAIN_MAX_BUFFERS 3
+#define SWAPCHAIN_MAX_RETIRED 8
+#define SWAPCHAIN_HUGE_PAGE_SIZE (2u * 1024 * 1024)
+
+// How the memfd backing a swapchain is set up.
+enum shm_swapchain_flags {
+  // Fault every page in when the pool is created or grown, so the first
+  // frame at a new size doesn't take a fault per page in the pixel loop.
+  SHM_SWAPCHAIN_PREFAULT = 0x1,
+
+  // MFD_HUGETLB when the system has huge pages reserved, otherwise a 2MB
+  // rounded size and MADV_HUGEPAGE so transparent huge pages can back it.
+  SHM_SWAPCHAIN_HUGE_PAGES = 0x2,
+
+  // F_SEAL_SHRINK, the compositor can map the pool without worrying about
+  // us truncating it under it. Growing is still allowed.
+  SHM_SWAPCHAIN_SEAL = 0x4,
+
+  SHM_SWAPCHAIN_DEFAULT = SHM_SWAPCHAIN_PREFAULT | SHM_SWAPCHAIN_SEAL,
+};
+
+// Not wayland specific, a memfd cut into equally sized pixel buffers.
+// The display backend wraps the fd and each buffer in its own objects
+// (wl_shm_pool + wl_buffer for wayland) and flags buffers busy while the
+// display server may still be reading from them.
+
+struct shm_swapchain_buffer {
+  uint32_t offset; // Byte offset into the pool.
+  uint32_t handle; // Backend object for this buffer, a wl_buffer id on wayland.
+  bool busy;
+};
+
+// A buffer from before a resize that the display was still reading. Its
+// bytes are left alone, and new buffers are cut around them, until the
+// backend hears it's released.
+struct shm_swapchain_retired {
+  uint32_t offset;
+  uint32_t size;
+  uint32_t handle;
+};
+
+struct shm_swapchain {
+  int fd;
+  uint8_t *data;
+  uint32_t pool_size;
+
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t format; // A pixel_format, the backend maps it to its own.
+
+  uint32_t pool_handle; // Backend object for the whole pool, a wl_shm_pool id on wayland.
+
+  uint32_t flags; // shm_swapchain_flags asked for.
+  bool hugetlb; // Got MFD_HUGETLB, sizes have to stay huge page multiples.
+
+  uint32_t buffer_count;
+  shm_swapchain_buffer buffers[SWAPCHAIN_MAX_BUFFERS];
+
+  uint32_t retired_count;
+  shm_swapchain_retired retired[SWAPCHAIN_MAX_RETIRED];
+};
+
+bool shm_swapchain_allocate(shm_swapchain *swapchain, uint32_t width, uint32_t height,
+                            uint32_t stride, uint32_t format, uint32_t buffer_count,
+                            uint32_t flags = SHM_SWAPCHAIN_DEFAULT);
+void shm_swapchain_free(shm_swapchain *swapchain);
+
+// Re-cuts the pool into buffers of a new size, all free. Busy buffers are
+// retired with their handles instead, the new ones go past them. The
+// memfd only ever grows, geometrically, so a live resize doesn't allocate on
+// every step. *grown tells the backend to resize its side of the pool.
+// Fails without touching anything when there's no room to retire more.
+bool shm_swapchain_resize(shm_swapchain *swapchain, uint32_t width, uint32_t height,
+                          uint32_t stride, uint32_t format, bool *grown);
+
+// The display is done with a retired buffer, its bytes can be reused.
+// False when handle isn't one.
+bool shm_swapchain_release_retired(shm_swapchain *swapchain, uint32_t handle);
+
+// Returns the index of a buffer the display isn't reading from, -1 if all are busy.
+int32_t shm_swapchain_acquire(shm_swapchain *swapchain);
+
+inline uint8_t *shm_swapchain_pixels(shm_swapchain *swapchain, int32_t index) {
+  return swapchain->data + swapchain->buffers[index].offset;
+}
+
+// Minor faults taken by the calling thread so far, the backends sample it
+// around each frame for window_frame_stats.
+uint64_t shm_thread_minor_faults();
+
+inline void shm_record_frame_faults(window_frame_stats *stats, uint64_t faults) {
+  stats->frames++;
+  stats->page_faults_last = faults;
+  stats->page_faults_total += faults;
+  if (faults > stats->page_faults_max) {
+    stats->page_faults_max = faults;
+  }
+}
+
+#endif // !JAM_SHM_SWAPCHAIN_H
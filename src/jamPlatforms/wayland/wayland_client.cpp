@@ -18,16 +18,29 @@
 #include <sys/wait.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <time.h>
+
+static uint64_t wayland_now_ns() {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
 bool connect_wayland_display(wayland_windowState *state) {
+  state->startup.connect_ns = wayland_now_ns();
+
+  const char *debug = getenv("JAM_WAYLAND_DEBUG");
+  state->log_events = debug && strcmp(debug, "1") == 0;
+
   const char *xdg_runtime_dir = getenv("XDG_RUNTIME_DIR");
-  uint64_t xdg_path_length = strlen(xdg_runtime_dir);
 
   if (xdg_runtime_dir == NULL) {
     printf("No XDG_RUNTIME_DIR\n");
     return false;
   }
 
+  uint64_t xdg_path_length = strlen(xdg_runtime_dir);
+
   struct sockaddr_un address = {};
   address.sun_family = AF_UNIX;
   uint64_t socket_path_length = 0;
@@ -67,6 +80,7 @@ bool connect_wayland_display(wayland_windowState *state) {
   
   if (connect(fd, (struct sockaddr *)&address, sizeof(address))) {
     printf("Couldn't connect to the wayland socket\n");
+    close(fd);
     return false;
   }
 
@@ -103,7 +117,166 @@ void wayland_wl_display_get_registry(wayland_windowState *windowState) {
 
   SendMessage(windowState); 
 
-  printf("-> wl_display@%u.get_registry: wl_registry=%u\n", windowState->wl_display_id, windowState->wl_registry_id);
+  wayland_log(windowState, "-> wl_display@%u.get_registry: wl_registry=%u\n", windowState->wl_display_id, windowState->wl_registry_id);
+}
+
+// The compositor answers with wl_callback.done once it has handled every
+// request before this one, so it doubles as a barrier for startup.
+uint32_t wayland_wl_display_sync(wayland_windowState *windowState) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // New ID.
+  ++windowState->current_obj_id;
+  uint32_t new_id = windowState->current_obj_id;
+
+  // Sizing.
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(new_id);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header.
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_display_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_display.SYNC);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args.
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, new_id);
+
+  SendMessage(windowState);
+
+  wayland_log(windowState, "-> wl_display@%u.sync: wl_callback=%u\n", windowState->wl_display_id, new_id);
+
+  return new_id;
+}
+
+// The fd is duplicated so the caller can close its own copy before the
+// batch carrying it is flushed.
+void wayland_queue_fd(wayland_windowState *windowState, int fd) {
+  if (windowState->pending_fd_count == WAYLAND_MAX_PENDING_FDS) {
+    wayland_flush(windowState);
+  }
+
+  int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (copy == -1) {
+    printf("Couldn't duplicate a file descriptor\n");
+    exit(errno);
+  }
+
+  windowState->pending_fds[windowState->pending_fd_count++] = copy;
+}
+
+void wayland_flush(wayland_windowState *state) {
+  uint64_t sent = 0;
+  bool fds_sent = false;
+
+  while (sent < state->out_len) {
+    struct iovec io = {.iov_base = state->out + sent, .iov_len = state->out_len - sent};
+    struct msghdr socket_msg = {
+     .msg_iov = &io,
+     .msg_iovlen = 1,
+    };
+
+    // Send the file descriptors as ancillary data, with the first chunk.
+    char buf[CMSG_SPACE(sizeof(int) * WAYLAND_MAX_PENDING_FDS)] = "";
+    if (!fds_sent && state->pending_fd_count > 0) {
+      socket_msg.msg_control = buf;
+      socket_msg.msg_controllen = CMSG_SPACE(sizeof(int) * state->pending_fd_count);
+
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&socket_msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int) * state->pending_fd_count);
+      memcpy(CMSG_DATA(cmsg), state->pending_fds, sizeof(int) * state->pending_fd_count);
+    }
+
+    int64_t sent_bytes = sendmsg(state->fd, &socket_msg, MSG_NOSIGNAL);
+    if (sent_bytes == -1) {
+      if (errno == EINTR) continue;
+      printf("Error sending message.\n");
+      event_loop_print_stats(&state->loop);
+      exit(errno);
+    }
+
+    sent += (uint64_t)sent_bytes;
+    fds_sent = true;
+    state->recorder.stats.syscalls++;
+    state->recorder.stats.bytes_sent += (uint64_t)sent_bytes;
+  }
+
+  if (fds_sent) {
+    for (uint32_t Index = 0; Index < state->pending_fd_count; Index++) {
+      close(state->pending_fds[Index]);
+    }
+    state->pending_fd_count = 0;
+  }
+
+  state->out_len = 0;
+}
+
+// One recv, then every whole message in the buffer is dispatched. A partial
+// message at the end stays put until the rest of it arrives.
+// Bytes from the socket, whichever event loop engine read them.
+void wayland_receive(wayland_windowState *state, const uint8_t *data, uint32_t size) {
+  if (state->stage != STATE_SURFACE_ATTACHED) {
+    state->startup.reads++;
+  }
+  state->recorder.stats.bytes_received += size;
+
+  while (size > 0) {
+    // Whatever's left over is less than a message, there's always room.
+    uint64_t chunk = WAYLAND_IN_BUFFER_SIZE - state->in_len;
+    if (chunk > size) chunk = size;
+
+    memcpy(state->in + state->in_len, data, chunk);
+    state->in_len += chunk;
+    data += chunk;
+    size -= (uint32_t)chunk;
+
+    uint64_t parsed = 0;
+    while (state->in_len - parsed >= WAYLAND_HEADER_SIZE) {
+      uint16_t announced_size = *(uint16_t *)(state->in + parsed + 6);
+      if (announced_size < WAYLAND_HEADER_SIZE) {
+        printf("Malformed message from the compositor\n");
+        exit(EPROTO);
+      }
+
+      if (announced_size > state->in_len - parsed) {
+        break;
+      }
+
+      char *msg = state->in + parsed;
+      uint64_t msg_len = announced_size;
+      wayland_listen_to_events(state, &msg, &msg_len);
+      state->recorder.stats.messages_received++;
+
+      parsed += roundup_4(announced_size);
+    }
+
+    memmove(state->in, state->in + parsed, state->in_len - parsed);
+    state->in_len -= parsed;
+  }
+
+  wayland_apply_configure(state);
+}
+
+static void wayland_on_socket_data(void *user, uint8_t *data, uint32_t size, int *fds, uint32_t fd_count) {
+  wayland_windowState *state = (wayland_windowState *)user;
+
+  // Kept for the keymap or wl_data_source.send they came with.
+  wayland_keep_fds(state, fds, fd_count);
+
+  if (size == 0) {
+    printf("Wayland closed the socket\n");
+    event_loop_print_stats(&state->loop);
+    exit(errno);
+  }
+
+  wayland_receive(state, data, size);
+}
+
+static void wayland_on_commands(void *user) {
+  wayland_run_commands((wayland_windowState *)user);
 }
 
 int wayland_wl_registry_bind(wayland_windowState *windowState, uint32_t name, char *interface, uint32_t interface_len, uint32_t version) {
@@ -252,7 +425,7 @@ void unhandled_opcode(wayland_windowState *state, uint32_t remaining_bytes, char
   
 }
 
-void wayland_wl_surface_commit(wayland_windowState *windowState) {
+void wayland_wl_surface_commit(wayland_windowState *windowState, uint32_t surface_id) {
   ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
   // Make sure it is cleared.
   assert(windowState->message_pos == 0);
@@ -262,15 +435,15 @@ void wayland_wl_surface_commit(wayland_windowState *windowState) {
   assert(roundup_4(msg_announced_size) == msg_announced_size);
 
   // Header 
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_surface_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, surface_id);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_surface.COMMIT);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
 
   SendMessage(windowState);
 }
 
-void wayland_wl_shm_create_pool(wayland_windowState *windowState) {
-  assert(windowState->shm_pool_size != 0);
+int wayland_wl_shm_create_pool(wayland_windowState *windowState, shm_swapchain *swapchain) {
+  assert(swapchain->pool_size != 0);
   assert(windowState->fd != 0);
 
   ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
@@ -278,15 +451,13 @@ void wayland_wl_shm_create_pool(wayland_windowState *windowState) {
   assert(windowState->message_pos == 0);
 
   // New ID.
-  if (windowState->wl_shm_pool_id == 0) {
-    ++windowState->current_obj_id;
-    windowState->wl_shm_pool_id = windowState->current_obj_id;
-  }
+  ++windowState->current_obj_id;
+  uint32_t new_id = windowState->current_obj_id;
 
   // Sizing.
   uint16_t msg_announced_size = WAYLAND_HEADER_SIZE+
-                             sizeof(windowState->wl_shm_pool_id) +
-                             sizeof(windowState->shm_pool_size);
+                             sizeof(new_id) +
+                             sizeof(swapchain->pool_size);
   assert(roundup_4(msg_announced_size) == msg_announced_size);
 
   // Header
@@ -295,34 +466,15 @@ void wayland_wl_shm_create_pool(wayland_windowState *windowState) {
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
 
   // Args
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_shm_pool_id);
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->shm_pool_size);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, new_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, swapchain->pool_size);
   assert(roundup_4(windowState->message_pos) == windowState->message_pos);
 
-  // Send the file descriptor as ancillary data.
-  // UNIX/Macros monstrosities ahead.
-  char buf[CMSG_SPACE(sizeof(windowState->shm_fd))] = "";
-
-  struct iovec io = {.iov_base = windowState->message, .iov_len = windowState->message_pos};
-  struct msghdr socket_msg = {
-   .msg_iov = &io,
-   .msg_iovlen = 1,
-   .msg_control = buf,
-   .msg_controllen = sizeof(buf),
-  };
-
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&socket_msg);
-  cmsg->cmsg_level = SOL_SOCKET;
-  cmsg->cmsg_type = SCM_RIGHTS;
-  cmsg->cmsg_len = CMSG_LEN(sizeof(windowState->shm_fd));
-
-  *((int *)CMSG_DATA(cmsg)) = windowState->shm_fd;
-  socket_msg.msg_controllen = CMSG_SPACE(sizeof(windowState->shm_fd));
-
-  if (sendmsg(windowState->fd, &socket_msg, 0) == -1) {
-    exit(errno);
-  }
+  // The memfd rides along with the batch this message goes out in.
+  wayland_queue_fd(windowState, swapchain->fd);
+  SendMessage(windowState);
 
+  return new_id;
 }
 
 void wayland_wl_surface_frame(wayland_windowState *windowState) {
@@ -335,15 +487,9 @@ void wayland_wl_surface_frame(wayland_windowState *windowState) {
   if (windowState->frame_callback_id == 0) {
     ++windowState->current_obj_id;
     windowState->frame_callback_id = windowState->current_obj_id;
-    printf("Creating a frame callback ID\n");
-    printf("Creating a frame callback ID\n");
-    printf("Creating a frame callback ID\n");
-    printf("Creating a frame callback ID\n");
-    printf("Creating a frame callback ID\n");
-    printf("Creating a frame callback ID\n");
-    printf("Creating a frame callback ID\n");
+    wayland_log(windowState, "Creating a frame callback ID\n");
   } else {
-    printf("Frame callback is %u\n", windowState->frame_callback_id);
+    wayland_log(windowState, "Frame callback is %u\n", windowState->frame_callback_id);
   }
 
   // Sizing.
@@ -360,13 +506,12 @@ void wayland_wl_surface_frame(wayland_windowState *windowState) {
   
   SendMessage(windowState);
 
-  printf("Asking for frame hinting\n");
+  wayland_log(windowState, "Asking for frame hinting\n");
 }
 
-void wayland_wl_surface_attach(wayland_windowState *windowState) {
+void wayland_wl_surface_attach(wayland_windowState *windowState, uint32_t surface_id, uint32_t buffer_id) {
   ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
   // Make sure it is cleared.
-  printf("CHECKPOINT\n");
   assert(windowState->message_pos == 0);
 
   // Sizing.
@@ -374,12 +519,12 @@ void wayland_wl_surface_attach(wayland_windowState *windowState) {
   assert(roundup_4(msg_announced_size) == msg_announced_size);
 
   // Header
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_surface_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, surface_id);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_surface.ATTACH);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
 
   // Args
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_buffer_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, buffer_id);
   buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, 0);
   buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, 0);
 
@@ -387,7 +532,8 @@ void wayland_wl_surface_attach(wayland_windowState *windowState) {
   
 }
 
-void wayland_wl_surface_damage(wayland_windowState *windowState) {
+void wayland_wl_surface_damage(wayland_windowState *windowState, uint32_t surface_id,
+                               int32_t x, int32_t y, int32_t width, int32_t height) {
   ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
   // Make sure it is cleared.
   assert(windowState->message_pos == 0);
@@ -397,20 +543,33 @@ void wayland_wl_surface_damage(wayland_windowState *windowState) {
   assert(roundup_4(msg_announced_size) == msg_announced_size);
 
   // Header.
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_surface_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, surface_id);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_surface.DAMAGE);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
   
   // Args.
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, 0);
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, 0);
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->Width);
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->Height);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)x);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)y);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)width);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)height);
 
   SendMessage(windowState);
 }
 
-int wayland_wl_shm_pool_create_buffer(wayland_windowState *windowState) {
+int wayland_wl_shm_pool_create_buffer(wayland_windowState *windowState, shm_swapchain *swapchain, uint32_t index) {
+  assert(swapchain->pool_handle != 0);
+  assert(index < swapchain->buffer_count);
+
+  wayland_log(windowState, "\nWidth: %u Height: %u Stride: %u\n", swapchain->width, swapchain->height, swapchain->stride);
+
+  return wayland_wl_shm_pool_create_buffer_at(windowState, swapchain->pool_handle, swapchain->buffers[index].offset,
+                                              swapchain->width, swapchain->height, swapchain->stride,
+                                              wayland_shm_format((pixel_format)swapchain->format));
+}
+
+// A buffer anywhere in a pool, shm_format is the wl_shm one.
+int wayland_wl_shm_pool_create_buffer_at(wayland_windowState *windowState, uint32_t pool_id, uint32_t offset,
+                                         uint32_t width, uint32_t height, uint32_t stride, uint32_t shm_format) {
   ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
   // Make sure it is cleared.
   assert(windowState->message_pos == 0);
@@ -425,26 +584,24 @@ int wayland_wl_shm_pool_create_buffer(wayland_windowState *windowState) {
   assert(roundup_4(msg_announced_size) == msg_announced_size);
 
   // Header
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_shm_pool_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, pool_id);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_shm_pool.CREATE_BUFFER);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
-  // Args
-  
-  printf("\nWidth: %u Height: %u Stride: %u\n", windowState->Width, windowState->Height, windowState->stride);
 
+  // Args
   buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, new_id);
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, 0);
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->Width);
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->Height);
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->Width * COLOR_CHANNELS);
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, 1);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, offset);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, width);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, height);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, stride);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, shm_format);
 
   SendMessage(windowState);
 
   return new_id;
 }
 
-void wayland_wl_shm_pool_destroy(wayland_windowState *windowState) {
+void wayland_wl_shm_pool_destroy(wayland_windowState *windowState, uint32_t pool_id) {
   ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
   // Make sure it is cleared.
   assert(windowState->message_pos == 0);
@@ -454,14 +611,35 @@ void wayland_wl_shm_pool_destroy(wayland_windowState *windowState) {
   assert(roundup_4(msg_announced_size) == msg_announced_size);
 
   // Header 
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_shm_pool_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, pool_id);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_shm_pool.DESTROY);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
 
   SendMessage(windowState);
 }
 
-void wayland_wl_buffer_destroy(wayland_windowState *windowState) {
+// Pools can only grow, the compositor remaps the memfd at the new size.
+void wayland_wl_shm_pool_resize(wayland_windowState *windowState, uint32_t pool_id, int32_t size) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(size);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header 
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, pool_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_shm_pool.RESIZE);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)size);
+
+  SendMessage(windowState);
+}
+
+void wayland_wl_buffer_destroy(wayland_windowState *windowState, uint32_t buffer_id) {
 
   ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
   // Make sure it is cleared.
@@ -472,7 +650,7 @@ void wayland_wl_buffer_destroy(wayland_windowState *windowState) {
   assert(roundup_4(msg_announced_size) == msg_announced_size);
 
   // Header 
-  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_buffer_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, buffer_id);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_buffer.DESTROY);
   buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
 
@@ -499,182 +677,1238 @@ void wayland_xdg_surface_ack_configure(wayland_windowState *windowState, uint32_
   buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, configure);
   
   SendMessage(windowState);
-  printf("-> xdg_surface@%u.ack_configure: configure=%u\n", windowState->xdg_surface_id, configure);
+  wayland_log(windowState, "-> xdg_surface@%u.ack_configure: configure=%u\n", windowState->xdg_surface_id, configure);
 }
 
-void wayland_window_set_up(wayland_windowState *state) {
-  if (state->wl_compositor_id !=  0 &&
-      state->xdg_wm_base_id != 0 &&
-      state->xdg_surface_id == 0 &&
-      state->wl_surface_id == 0) {
-      
+int wayland_wp_viewporter_get_viewport(wayland_windowState *windowState) {
+  assert(windowState->wp_viewporter_id > 0);
+  assert(windowState->wl_surface_id > 0);
 
-    state->wl_surface_id = wayland_wl_compositor_create_surface(state);
-    state->xdg_surface_id = wayland_xdg_wm_base_get_xdg_surface(state);
-    state->xdg_toplevel_id = wayland_xdg_surface_get_toplevel(state);
-    wayland_wl_surface_commit(state);
-    PrintBoundInterfaces(state);
-  }
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
 
-  if (state->Width != 0 &&
-      state->Height != 0 &&
-      state->wl_shm_id != 0 &&
-      state->wl_shm_pool_id == 0) {
+  // New ID.
+  ++windowState->current_obj_id;
+  uint32_t new_id = windowState->current_obj_id;
 
-    int fd = memfd_create("wayland_shared_memory", MFD_CLOEXEC);
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(new_id) + sizeof(windowState->wl_surface_id);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
 
-    uint32_t size = state->stride * state->Height;
-    printf("Size %u\n", size);
-    if (ftruncate(fd, size) == -1) {
-      printf("failed to truncate memory file\n");
-      exit(errno);
-    }
+  // Header 
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wp_viewporter_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wp_viewporter.GET_VIEWPORT);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
 
-    state->shm_pool_data = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    state->shm_pool_size = size;
-    state->shm_fd = fd;
-    
-    if (state->shm_pool_data != 0 &&
-        state->shm_pool_size > 0) {
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, new_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_surface_id);
 
-      wayland_wl_shm_create_pool(state);
-      state->wl_buffer_id = wayland_wl_shm_pool_create_buffer(state);
-      wayland_wl_shm_pool_destroy(state);
+  SendMessage(windowState);
 
-      memset(state->shm_pool_data, 0xFF0000FF, state->shm_pool_size); 
+  return new_id;
+}
 
-      wayland_wl_surface_attach(state);
-      wayland_wl_surface_frame(state);
-      wayland_wl_surface_commit(state);
+void wayland_wp_viewport_set_destination(wayland_windowState *windowState, int32_t width, int32_t height) {
+  assert(windowState->wp_viewport_id > 0);
 
-    }
-  }
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
 
-  state->blue++;
-}
+  // Sizing.
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(width) + sizeof(height);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
 
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wp_viewport_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wp_viewport.SET_DESTINATION);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
 
-void wayland_listen_to_events(wayland_windowState *state, char **msg, uint64_t *msg_len) {
-  assert(*msg_len >= 0);
-  
-  uint32_t object_id = buf_read_u32(msg, msg_len);
-  uint16_t opcode = buf_read_u16(msg, msg_len);
-  uint16_t announced_size = buf_read_u16(msg, msg_len);
+  // Args. -1, -1 unsets the destination and the surface goes back to buffer size.
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)width);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)height);
 
-  printf("OBJ_ID: %u, OPCODE: %u, SIZE: %u\n", object_id, opcode, announced_size);
-  assert(roundup_4(announced_size) <= announced_size);
+  SendMessage(windowState);
+  wayland_log(windowState, "-> wp_viewport@%u.set_destination: %d x %d\n", windowState->wp_viewport_id, width, height);
+}
 
-  uint32_t header_size = sizeof(object_id) + sizeof(opcode) + sizeof(announced_size);
-  assert(announced_size <= header_size + *msg_len);
+void wayland_wl_surface_set_buffer_scale(wayland_windowState *windowState, uint32_t surface_id, int32_t scale) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
 
-  uint32_t bytes_to_read_out = announced_size - header_size;
-  uint32_t bytes_read_out = *msg_len;
+  // Sizing.
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(scale);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
 
-  if (object_id == state->wl_display_id) {
-    printf("Event recieved from wl_display ");
-    if (state->opcodes.wl_display.ERROR == opcode) {
-      uint32_t target_object_id = buf_read_u32(msg, msg_len);
-      uint32_t error_code = buf_read_u32(msg, msg_len);
-      uint32_t error_length = buf_read_u32(msg, msg_len); 
-      
-      char buffer[4096] = "";
-      buf_read_n(msg, msg_len, buffer, roundup_4(error_length));
-      printf("fatel error: target_object_id@%u: error_code %u: error: %s\n",
-              target_object_id, error_code, buffer);
-      
-      exit(errno);
-    } else {
-      unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
-    } 
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, surface_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_surface.SET_BUFFER_SCALE);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
 
-  } else if (object_id == state->wl_registry_id) {
-    printf("Event recieved from wl_registry ");
+  // Args.
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)scale);
 
-    if (state->opcodes.wl_registery.GLOBAL_EVENT == opcode) {
+  SendMessage(windowState);
+  wayland_log(windowState, "-> wl_surface@%u.set_buffer_scale: scale=%d\n", surface_id, scale);
+}
 
-      uint32_t name = buf_read_u32(msg, msg_len);
-      uint32_t interface_len = buf_read_u32(msg, msg_len);
+int wayland_wp_fractional_scale_manager_get_fractional_scale(wayland_windowState *windowState) {
+  assert(windowState->wp_fractional_scale_manager_id > 0);
+  assert(windowState->wl_surface_id > 0);
 
-      char buffer[4096] = "";
-      buf_read_n(msg, msg_len, buffer, roundup_4(interface_len));
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
 
-      uint32_t version_number = buf_read_u32(msg, msg_len);
+  // New ID.
+  ++windowState->current_obj_id;
+  uint32_t new_id = windowState->current_obj_id;
 
-      printf("\nEvent: Registry Global recieved numeric name: %u: name %s, version %u\n",
-              name, buffer, version_number);
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(new_id) + sizeof(windowState->wl_surface_id);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
 
-      char wl_shm_interface[] = "wl_shm";
-      if (strcmp(wl_shm_interface, buffer) == 0) {
-        state->wl_shm_id = wayland_wl_registry_bind(state, name, buffer, interface_len, version_number);
-        printf("Action: Registry.bind@%u Interface bound %s@%u\n", state->wl_registry_id, wl_shm_interface, state->wl_shm_id);
-      }
+  // Header 
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wp_fractional_scale_manager_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wp_fractional_scale_manager.GET_FRACTIONAL_SCALE);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
 
-      char xdg_wm_base[] = "xdg_wm_base";
-      if (strcmp(xdg_wm_base, buffer) == 0) {
-        state->xdg_wm_base_id = wayland_wl_registry_bind(state, name, buffer, interface_len, version_number);
-        printf("Action: Registry.bind@%u Interface bound %s@%u\n", state->wl_registry_id, xdg_wm_base, state->xdg_wm_base_id);
-      }
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, new_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_surface_id);
 
-      char wl_compositor_interface[] = "wl_compositor";
-      if (strcmp(wl_compositor_interface, buffer) == 0) {
-        state->wl_compositor_id = wayland_wl_registry_bind(state, name, buffer, interface_len, version_number);
-        printf("Action: Registry.bind@%u Interface bound %s@%u\n", state->wl_registry_id, wl_compositor_interface, state->wl_compositor_id);
+  SendMessage(windowState);
 
-      }
+  return new_id;
+}
 
-      char wl_output_interface[] = "wl_ouput";
-      if (strcmp(wl_compositor_interface, buffer) == 0) {
-        state->wl_output_id = wayland_wl_registry_bind(state, name, buffer, interface_len, version_number);
-        printf("Action: Registry.bind@%u Interface bound %s@%u\n", state->wl_registry_id, wl_output_interface, state->wl_output_id);
+wayland_output *wayland_find_output(wayland_windowState *windowState, uint32_t id) {
+  if (id == 0) {
+    return 0;
+  }
 
-      }
+  for (uint32_t Index = 0; Index < windowState->output_count; Index++) {
+    if (windowState->outputs[Index].id == id) {
+      return &windowState->outputs[Index];
+    }
+  }
 
+  return 0;
+}
 
-    } else {
-      unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
-    }
+void wayland_wl_output_release(wayland_windowState *windowState, uint32_t output_id) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
 
-  } else if (object_id == state->wl_output_id) {
-    if (state->opcodes.wl_output.MODE == opcode) {
-      uint32_t flags = buf_read_u32(msg, msg_len);
-      uint32_t width = buf_read_u32(msg, msg_len);
-      uint32_t height = buf_read_u32(msg, msg_len);
-      uint32_t refresh = buf_read_u32(msg, msg_len);
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE; 
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
 
-      printf("Screen Width: %u, Screen Height: %u, Refressh Rate: %u\n", width, height, refresh);
-    } else {
-      unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
-    }
-  } else if (object_id == state->wl_shm_id) {
-    printf("Event recieved from wl_shm \n");
-    if (state->opcodes.wl_shm.WL_SHM_FORMAT_EVENT == opcode) {
-      uint32_t format = buf_read_u32(msg, msg_len);
-      
-      printf("[FORMAT]: shared memory format %u is supported\n", format);
+  // Header 
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, output_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_output.RELEASE);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
 
+  SendMessage(windowState);
+}
+
+// Called whenever an output's properties or the set of outputs the surface
+// is on changes. Re-picks the output we follow and pushes its refresh rate
+// and density into the frame pacing and buffer sizing.
+void wayland_output_changed(wayland_windowState *windowState) {
+  if (windowState->current_output < 0) {
+    // Fall back to any other output we are still on.
+    for (uint32_t Index = 0; Index < windowState->output_count; Index++) {
+      if (windowState->outputs[Index].window_entered) {
+        windowState->current_output = (int32_t)Index;
+        break;
+      }
+    }
+  }
+
+  if (windowState->current_output < 0) {
+    return;
+  }
+
+  wayland_output *output = &windowState->outputs[windowState->current_output];
+  if (!output->done) {
+    return;
+  }
+
+  windowState->ScreenWidth = output->width;
+  windowState->ScreenHeight = output->height;
+
+  uint64_t frame_interval_ns = 0;
+  if (output->refresh_mhz > 0) {
+    frame_interval_ns = 1000000000000ull / (uint64_t)output->refresh_mhz;
+  }
+
+  if (frame_interval_ns != windowState->frame_interval_ns) {
+    wayland_log(windowState, "Pacing against %s at %d mHz\n", output->name, output->refresh_mhz);
+    windowState->frame_interval_ns = frame_interval_ns;
+    av_clock_init(&windowState->present_clock,
+                  frame_interval_ns ? frame_interval_ns : WAYLAND_DEFAULT_FRAME_INTERVAL_NS);
+  }
+
+  // Only matters when the compositor doesn't tell the surface directly.
+  if (windowState->preferred_buffer_scale == 0 &&
+      windowState->Width != 0 && windowState->Height != 0) {
+    uint32_t buffer_width = windowState->BufferWidth;
+    uint32_t buffer_height = windowState->BufferHeight;
+    wayland_update_buffer_size(windowState);
+
+    if (buffer_width != windowState->BufferWidth || buffer_height != windowState->BufferHeight) {
+      wayland_log(windowState, "Output density changed, buffer is now %u x %u\n", windowState->BufferWidth, windowState->BufferHeight);
+    }
+  }
+}
+
+// Pixels per surface unit on the output we are shown on.
+// Older compositors don't send wl_surface.preferred_buffer_scale,
+// then the scale of the output we're on is the best guess.
+float wayland_surface_density(wayland_windowState *windowState) {
+  if (windowState->fractional_scale_120 != 0 && windowState->wp_viewport_id != 0) {
+    return (float)windowState->fractional_scale_120 / 120.0f;
+  }
+
+  if (windowState->preferred_buffer_scale > 1) {
+    return (float)windowState->preferred_buffer_scale;
+  }
+
+  if (windowState->preferred_buffer_scale == 0 && windowState->current_output >= 0) {
+    int32_t output_scale = windowState->outputs[windowState->current_output].scale;
+    if (output_scale > 1) {
+      return (float)output_scale;
+    }
+  }
+
+  return 1.0f;
+}
+
+int32_t wayland_integer_buffer_scale(wayland_windowState *windowState) {
+  // set_buffer_scale is wl_compositor version 3.
+  if (windowState->wl_compositor_version < 3) {
+    return 1;
+  }
+
+  if (windowState->preferred_buffer_scale != 0) {
+    return windowState->preferred_buffer_scale;
+  }
+
+  if (windowState->current_output >= 0) {
+    return windowState->outputs[windowState->current_output].scale;
+  }
+
+  return 1;
+}
+
+// Works out how big the pixel buffer should be for the current window size.
+// With a viewport the destination does all the scaling (density and render
+// scale) so the buffer scale stays at 1. Without one we can only match integer
+// scales through wl_surface.set_buffer_scale.
+void wayland_update_buffer_size(wayland_windowState *windowState) {
+  uint32_t buffer_width = windowState->Width;
+  uint32_t buffer_height = windowState->Height;
+  int32_t buffer_scale = 1;
+
+  if (windowState->wp_viewport_id != 0) {
+    window_settings *settings = &windowState->settings;
+    float scale = wayland_surface_density(windowState);
+
+    if (settings->render_width != 0 && settings->render_height != 0) {
+      buffer_width = settings->render_width;
+      buffer_height = settings->render_height;
+      scale = 0.0f;
+    } else if (settings->render_scale > 0.0f && settings->render_scale < 1.0f) {
+      scale *= settings->render_scale;
+    }
+
+    if (scale != 0.0f) {
+      buffer_width = (uint32_t)((float)windowState->Width * scale + 0.5f);
+      buffer_height = (uint32_t)((float)windowState->Height * scale + 0.5f);
+    }
+
+    if (buffer_width == 0) buffer_width = 1;
+    if (buffer_height == 0) buffer_height = 1;
+
+    int32_t destination_width = -1;
+    int32_t destination_height = -1;
+    if (buffer_width != windowState->Width || buffer_height != windowState->Height) {
+      destination_width = (int32_t)windowState->Width;
+      destination_height = (int32_t)windowState->Height;
+    }
+
+    // Double buffered state too, only sent when it changes.
+    if (destination_width != windowState->destination_width ||
+        destination_height != windowState->destination_height) {
+      wayland_wp_viewport_set_destination(windowState, destination_width, destination_height);
+      windowState->destination_width = destination_width;
+      windowState->destination_height = destination_height;
+    }
+  } else if (wayland_integer_buffer_scale(windowState) > 1) {
+    buffer_scale = wayland_integer_buffer_scale(windowState);
+    buffer_width = windowState->Width * buffer_scale;
+    buffer_height = windowState->Height * buffer_scale;
+  }
+
+  // Applied on the next commit together with the buffer of the new size.
+  if (buffer_scale != windowState->applied_buffer_scale &&
+      windowState->wl_surface_id != 0) {
+    wayland_wl_surface_set_buffer_scale(windowState, windowState->wl_surface_id, buffer_scale);
+    windowState->applied_buffer_scale = buffer_scale;
+  }
+
+  windowState->BufferWidth = buffer_width;
+  windowState->BufferHeight = buffer_height;
+}
+
+uint32_t wayland_shm_format(pixel_format format) {
+  switch (format) {
+    case PIXEL_FORMAT_ARGB8888: return WL_SHM::WL_SHM_FORMAT_ARGB8888;
+    case PIXEL_FORMAT_RGBA8888: return WL_SHM::WL_SHM_FORMAT_RGBA8888;
+    case PIXEL_FORMAT_RGB565: return WL_SHM::WL_SHM_FORMAT_RGB565;
+    case PIXEL_FORMAT_XRGB4444: return WL_SHM::WL_SHM_FORMAT_XRGB4444;
+    case PIXEL_FORMAT_RGBA4444: return WL_SHM::WL_SHM_FORMAT_RGBA4444;
+    default: return WL_SHM::WL_SHM_FORMAT_XRGB8888;
+  }
+}
+
+bool wayland_shm_format_supported(wayland_windowState *windowState, pixel_format format) {
+  WL_SHM *shm = &windowState->opcodes.wl_shm;
+
+  switch (format) {
+    case PIXEL_FORMAT_RGBA8888: return shm->RGBA8888_supported;
+    case PIXEL_FORMAT_RGB565: return shm->RGB565_supported;
+    case PIXEL_FORMAT_XRGB4444: return shm->XRGB4444_supported;
+    case PIXEL_FORMAT_RGBA4444: return shm->RGBA4444_supported;
+    // Required by the protocol.
+    default: return true;
+  }
+}
+
+// The settings say what we'd like, wl_shm.format events say what we can have.
+pixel_format wayland_choose_format(wayland_windowState *windowState) {
+  pixel_format wanted = windowState->settings.format;
+
+  if (wayland_shm_format_supported(windowState, wanted)) {
+    return wanted;
+  }
+
+  printf("Pixel format %u isn't supported by the compositor, using XRGB8888\n", wanted);
+  return PIXEL_FORMAT_XRGB8888;
+}
+
+// Creates the wayland side of a swapchain: one pool over the memfd and a
+// wl_buffer per slot. The pool stays around so it can be resized later.
+bool wayland_swapchain_create(wayland_windowState *windowState, shm_swapchain *swapchain,
+                              uint32_t width, uint32_t height, pixel_format format, uint32_t buffer_count) {
+  assert(windowState->wl_shm_id != 0);
+
+  uint32_t flags = SHM_SWAPCHAIN_DEFAULT;
+  if (windowState->settings.huge_pages) {
+    flags |= SHM_SWAPCHAIN_HUGE_PAGES;
+  }
+
+  uint32_t stride = pixel_format_stride(format, width);
+  if (!shm_swapchain_allocate(swapchain, width, height, stride, format, buffer_count, flags)) {
+    return false;
+  }
+
+  swapchain->pool_handle = wayland_wl_shm_create_pool(windowState, swapchain);
+  for (uint32_t Index = 0; Index < swapchain->buffer_count; Index++) {
+    swapchain->buffers[Index].handle = wayland_wl_shm_pool_create_buffer(windowState, swapchain, Index);
+  }
+
+  return true;
+}
+
+void wayland_swapchain_destroy(wayland_windowState *windowState, shm_swapchain *swapchain) {
+  // Busy ones included. The compositor's mapping keeps the memfd alive for
+  // as long as it reads, and nothing writes to it after this: a new
+  // swapchain gets a memfd of its own.
+  for (uint32_t Index = 0; Index < swapchain->buffer_count; Index++) {
+    if (swapchain->buffers[Index].handle != 0) {
+      wayland_wl_buffer_destroy(windowState, swapchain->buffers[Index].handle);
+    }
+  }
+  for (uint32_t Index = 0; Index < swapchain->retired_count; Index++) {
+    wayland_wl_buffer_destroy(windowState, swapchain->retired[Index].handle);
+  }
+
+  if (swapchain->pool_handle != 0) {
+    wayland_wl_shm_pool_destroy(windowState, swapchain->pool_handle);
+  }
+
+  shm_swapchain_free(swapchain);
+}
+
+// A new size for an existing swapchain, same memfd and wl_shm_pool. The
+// pool grows with wl_shm_pool.resize and only the wl_buffers are remade.
+// The compositor can read an shm buffer until it's released, destroyed or
+// not, so busy ones are kept (retired) until their release comes in and
+// the new buffers are cut around them.
+bool wayland_swapchain_resize(wayland_windowState *windowState, shm_swapchain *swapchain,
+                              uint32_t width, uint32_t height, pixel_format format) {
+  assert(swapchain->pool_handle != 0);
+
+  uint32_t idle[SWAPCHAIN_MAX_BUFFERS];
+  uint32_t idle_count = 0;
+  for (uint32_t Index = 0; Index < swapchain->buffer_count; Index++) {
+    if (swapchain->buffers[Index].handle != 0 && !swapchain->buffers[Index].busy) {
+      idle[idle_count++] = swapchain->buffers[Index].handle;
+    }
+  }
+
+  bool grown = false;
+  uint32_t stride = pixel_format_stride(format, width);
+  if (!shm_swapchain_resize(swapchain, width, height, stride, format, &grown)) {
+    return false;
+  }
+
+  for (uint32_t Index = 0; Index < idle_count; Index++) {
+    wayland_wl_buffer_destroy(windowState, idle[Index]);
+  }
+
+  if (grown) {
+    wayland_log(windowState, "Growing the shm pool to %u bytes\n", swapchain->pool_size);
+    wayland_wl_shm_pool_resize(windowState, swapchain->pool_handle, (int32_t)swapchain->pool_size);
+  }
+
+  for (uint32_t Index = 0; Index < swapchain->buffer_count; Index++) {
+    swapchain->buffers[Index].handle = wayland_wl_shm_pool_create_buffer(windowState, swapchain, Index);
+  }
+
+  return true;
+}
+
+// Finds which swapchain buffer a wl_buffer id belongs to, main surface or layer.
+shm_swapchain_buffer *wayland_find_swapchain_buffer(wayland_windowState *windowState, uint32_t id) {
+  if (id == 0) {
+    return 0;
+  }
+
+  shm_swapchain *swapchains[1 + MAX_LAYERS];
+  uint32_t swapchain_count = 0;
+  swapchains[swapchain_count++] = &windowState->swapchain;
+  for (uint32_t Index = 0; Index < MAX_LAYERS; Index++) {
+    if (windowState->layers[Index].active) {
+      swapchains[swapchain_count++] = &windowState->layers[Index].swapchain;
+    }
+  }
+
+  for (uint32_t Index = 0; Index < swapchain_count; Index++) {
+    shm_swapchain *swapchain = swapchains[Index];
+    for (uint32_t BufferIndex = 0; BufferIndex < swapchain->buffer_count; BufferIndex++) {
+      if (swapchain->buffers[BufferIndex].handle == id) {
+        return &swapchain->buffers[BufferIndex];
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Keeps the main swapchain at the current buffer size.
+void wayland_prepare_swapchain(wayland_windowState *state) {
+  shm_swapchain *swapchain = &state->swapchain;
+
+  if (swapchain->width != state->BufferWidth ||
+      swapchain->height != state->BufferHeight) {
+    state->format = wayland_choose_format(state);
+
+    uint64_t needed = (uint64_t)pixel_format_stride(state->format, state->BufferWidth) *
+                      state->BufferHeight * SWAPCHAIN_MAX_BUFFERS;
+
+    // Reuse the pool while it's there, unless a finished drag left it
+    // far bigger than the window now is.
+    bool oversized = !state->resizing && needed * 4 <= swapchain->pool_size;
+
+    // A pool that can't take another resize starts over, a new memfd is
+    // always safe to draw into.
+    if (swapchain->pool_handle == 0 || oversized ||
+        !wayland_swapchain_resize(state, swapchain, state->BufferWidth, state->BufferHeight, state->format)) {
+      wayland_swapchain_destroy(state, swapchain);
+
+      if (!wayland_swapchain_create(state, swapchain, state->BufferWidth, state->BufferHeight,
+                                    state->format, SWAPCHAIN_MAX_BUFFERS)) {
+        printf("Failed to create the swapchain\n");
+        exit(errno);
+      }
+    }
+  }
+}
+
+// Presents a filled buffer and asks for the next callback with the same
+// commit, it's what paces us.
+void wayland_commit_buffer(wayland_windowState *state, int32_t index) {
+  shm_swapchain *swapchain = &state->swapchain;
+
+  wayland_wl_surface_frame(state);
+
+  swapchain->buffers[index].busy = true;
+  wayland_wl_surface_attach(state, state->wl_surface_id, swapchain->buffers[index].handle);
+  wayland_wl_surface_damage(state, state->wl_surface_id, 0, 0, state->Width, state->Height);
+  wayland_wl_surface_commit(state, state->wl_surface_id);
+}
+
+// Fills and presents whichever buffer the compositor has given back.
+// Returns false when every buffer is still with the compositor, nothing was committed then.
+bool wayland_draw_frame(wayland_windowState *state) {
+  shm_swapchain *swapchain = &state->swapchain;
+  uint64_t faults = shm_thread_minor_faults();
+
+  wayland_prepare_swapchain(state);
+
+  if (!render_target_resize(&state->target, state->BufferWidth, state->BufferHeight)) {
+    printf("Failed to allocate the render target\n");
+    exit(errno);
+  }
+
+  int32_t index = shm_swapchain_acquire(swapchain);
+  if (index < 0) {
+    wayland_log(state, "Every buffer is still held by the compositor, skipping a frame\n");
+    state->recorder.stats.buffer_stalls++;
+    return false;
+  }
+
+  uint32_t gray = (uint32_t)state->blue * 0x010101u;
+  pixel_fill_rect(state->target.pixels, state->target.stride, state->target.width, state->target.height,
+                  gray | 0xff000000u);
+
+  if (state->stats_overlay) {
+    frame_stats_draw_overlay(&state->recorder.stats, state->frame_interval_ns,
+                             state->target.pixels, state->target.stride, state->target.width, state->target.height);
+  }
+
+  convert_rgba8(state->format,
+                state->target.pixels, state->target.stride,
+                shm_swapchain_pixels(swapchain, index), swapchain->stride,
+                swapchain->width, swapchain->height);
+
+  state->committed_input_ns = state->pending_input_ns;
+  state->pending_input_ns = 0;
+  wayland_commit_buffer(state, index);
+
+  shm_record_frame_faults(&state->frame_stats, shm_thread_minor_faults() - faults);
+  return true;
+}
+
+void wayland_request_frame(wayland_windowState *state) {
+  state->frame_deferred = false;
+
+  // The game thread draws it, the callback is asked for once it's presented.
+  if (state->threaded) {
+    if (!state->frame_offered) {
+      state->waiting_for_buffer = !wayland_offer_frame(state);
+    }
+    return;
+  }
+
+  if (!wayland_draw_frame(state)) {
+    // Picked up again when a buffer is released.
+    state->waiting_for_buffer = true;
+    return;
+  }
+
+  wayland_frame_committed(state);
+}
+
+// A frame went out with a frame callback attached, start waiting on it.
+void wayland_frame_committed(wayland_windowState *state) {
+  uint64_t now = wayland_now_ns();
+  state->waiting_for_buffer = false;
+  state->frame_callback_pending = true;
+  state->frame_requested_ns = now;
+  state->last_frame_ns = now;
+
+  window_frame_stats *stats = &state->recorder.stats;
+  stats->syscalls += state->loop.stats.syscalls - state->loop_syscalls_counted;
+  state->loop_syscalls_counted = state->loop.stats.syscalls;
+
+  uint64_t shm_bytes = state->swapchain.pool_size + state->cursor_atlas.pool_size;
+  for (uint32_t Index = 0; Index < MAX_LAYERS; Index++) {
+    if (state->layers[Index].active) shm_bytes += state->layers[Index].swapchain.pool_size;
+  }
+  stats->shm_bytes = shm_bytes;
+
+  frame_stats_present(&state->recorder, now);
+}
+
+// Event and frame callback timestamps are milliseconds on the compositor's
+// clock, which is CLOCK_MONOTONIC everywhere that matters. When it agrees
+// with ours it beats the arrival time (no wakeup jitter in it), otherwise
+// it's an unknown base and arrival time is all there is.
+uint64_t wayland_compositor_time_ns(uint32_t time_ms, uint64_t now) {
+  int32_t behind_ms = (int32_t)((uint32_t)(now / 1000000) - time_ms);
+  if (behind_ms >= 0 && behind_ms < 1000) {
+    return (now / 1000000 - (uint64_t)behind_ms) * 1000000 + 500000;
+  }
+  return now;
+}
+
+// A frame drawn now goes out at the first vblank after it's committed,
+// which is about as soon as it's drawn.
+uint64_t wayland_predict_present_ns(wayland_windowState *state) {
+  return av_clock_next_after(&state->present_clock, wayland_now_ns());
+}
+
+// The compositor wants a new frame. Whether it gets one depends on the
+// window's state: nothing while suspended, and at most unfocused_fps while
+// another window has focus.
+void wayland_frame_done(wayland_windowState *state) {
+  state->frame_callback_pending = false;
+
+  if (state->window_flags & WINDOW_OCCLUDED) {
+    wayland_log(state, "Frame callbacks are back, the window is visible again\n");
+    state->window_flags &= ~WINDOW_OCCLUDED;
+  }
+
+  if (state->window_flags & WINDOW_SUSPENDED) {
+    return;
+  }
+
+  uint64_t now = wayland_now_ns();
+  if (!(state->window_flags & WINDOW_ACTIVATED) &&
+      now - state->last_frame_ns < state->unfocused_interval_ns) {
+    state->window_flags |= WINDOW_THROTTLED;
+    state->frame_deferred = true;
+    state->deferred_until_ns = state->last_frame_ns + state->unfocused_interval_ns;
+    return;
+  }
+
+  if (state->window_flags & WINDOW_ACTIVATED) {
+    state->window_flags &= ~WINDOW_THROTTLED;
+  }
+
+  wayland_request_frame(state);
+}
+
+// Input, focus or coming back from suspended: draw now instead of waiting out the cap.
+void wayland_wake(wayland_windowState *state) {
+  if (state->stage != STATE_SURFACE_ATTACHED ||
+      (state->window_flags & WINDOW_SUSPENDED)) {
+    return;
+  }
+
+  if (state->frame_deferred ||
+      (!state->frame_callback_pending && !state->waiting_for_buffer && !state->frame_offered)) {
+    wayland_request_frame(state);
+  }
+}
+
+// How long the event loop can sleep, -1 for until the compositor says something.
+int wayland_timeout_ms(wayland_windowState *state) {
+  uint64_t now = wayland_now_ns();
+  uint64_t deadline = 0;
+
+  if (state->frame_deferred) {
+    deadline = state->deferred_until_ns;
+  } else if (state->frame_callback_pending && !(state->window_flags & WINDOW_OCCLUDED)) {
+    deadline = state->frame_requested_ns + WAYLAND_OCCLUDED_AFTER_NS;
+  } else {
+    return -1;
+  }
+
+  if (deadline <= now) {
+    return 0;
+  }
+
+  return (int)((deadline - now + 999999) / 1000000);
+}
+
+void wayland_run_timers(wayland_windowState *state) {
+  uint64_t now = wayland_now_ns();
+
+  if (state->frame_deferred && now >= state->deferred_until_ns) {
+    wayland_request_frame(state);
+  }
+
+  // Compositors stop sending frame callbacks for hidden surfaces, from
+  // here on the loop sleeps until one shows up again.
+  if (state->frame_callback_pending &&
+      !(state->window_flags & WINDOW_OCCLUDED) &&
+      now - state->frame_requested_ns >= WAYLAND_OCCLUDED_AFTER_NS) {
+    wayland_log(state, "No frame callback for a second, the window is occluded\n");
+    state->window_flags |= WINDOW_OCCLUDED;
+  }
+}
+
+// Sleeps for as long as nothing needs drawing, forever while occluded or
+// suspended. In threaded mode this is the I/O thread's whole life and the
+// game thread's commands wake it up too.
+void wayland_run(wayland_windowState *state) {
+  // Set up on the thread that runs it, io_uring rings belong to one thread.
+  if (!event_loop_init(&state->loop, state->settings.event_loop) ||
+      event_loop_add_socket(&state->loop, state->fd, wayland_on_socket_data, state) < 0) {
+    printf("Failed to set up the event loop\n");
+    exit(errno);
+  }
+
+  if (state->threaded &&
+      event_loop_add_readable(&state->loop, state->io_wake_fd, wayland_on_commands, state) < 0) {
+    printf("Failed to add the command eventfd to the event loop\n");
+    exit(errno);
+  }
+
+  while (!state->closed) {
+    wayland_flush(state);
+
+    if (pump_events(&state->loop, wayland_timeout_ms(state)) < 0) {
+      exit(errno);
+    }
+
+    wayland_run_timers(state);
+    fflush(stdout);
+  }
+
+  wayland_data_device_shutdown(state);
+  event_loop_print_stats(&state->loop);
+  event_loop_free(&state->loop);
+}
+
+// wl_seat.get_pointer and get_keyboard, both just take the new id.
+int wayland_wl_seat_get_device(wayland_windowState *windowState, uint16_t opcode) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // New ID.
+  ++windowState->current_obj_id;
+  uint32_t new_id = windowState->current_obj_id;
+
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(new_id);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_seat_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, opcode);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, new_id);
+
+  SendMessage(windowState);
+
+  return new_id;
+}
+
+int wayland_wl_subcompositor_get_subsurface(wayland_windowState *windowState, uint32_t surface_id, uint32_t parent_id) {
+  assert(windowState->wl_subcompositor_id > 0);
+
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // New ID.
+  ++windowState->current_obj_id;
+  uint32_t new_id = windowState->current_obj_id;
+
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(new_id) + sizeof(surface_id) + sizeof(parent_id);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header 
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_subcompositor_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_subcompositor.GET_SUBSURFACE);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, new_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, surface_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, parent_id);
+
+  SendMessage(windowState);
+
+  return new_id;
+}
+
+void wayland_wl_subsurface_set_position(wayland_windowState *windowState, uint32_t subsurface_id, int32_t x, int32_t y) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // Sizing.
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(x) + sizeof(y);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, subsurface_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_subsurface.SET_POSITION);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args.
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)x);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)y);
+
+  SendMessage(windowState);
+}
+
+// Requests without arguments on an object, wl_subsurface.set_desync,
+// wl_subsurface.destroy, wl_surface.destroy and the like.
+void wayland_send_no_args(wayland_windowState *windowState, uint32_t object_id, uint16_t opcode) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE; 
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header 
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, object_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, opcode);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  SendMessage(windowState);
+}
+
+// Layer handles are the slot index + 1 so 0 can mean failure.
+wayland_layer *wayland_get_layer(wayland_windowState *windowState, uint32_t layer) {
+  if (layer == 0 || layer > MAX_LAYERS) {
+    return 0;
+  }
+
+  wayland_layer *result = &windowState->layers[layer - 1];
+  return result->active ? result : 0;
+}
+
+uint32_t wayland_create_layer(wayland_windowState *windowState, int32_t x, int32_t y,
+                              uint32_t width, uint32_t height, bool desync) {
+  if (windowState->wl_subcompositor_id == 0 ||
+      windowState->wl_surface_id == 0 ||
+      windowState->wl_shm_id == 0) {
+    printf("Can't create a layer before the window is set up\n");
+    return 0;
+  }
+
+  for (uint32_t Index = 0; Index < MAX_LAYERS; Index++) {
+    wayland_layer *layer = &windowState->layers[Index];
+    if (layer->active) {
+      continue;
+    }
+
+    memset(layer, 0, sizeof(*layer));
+
+    // Overlays need alpha, ARGB8888 is one of the two formats every compositor has.
+    if (!wayland_swapchain_create(windowState, &layer->swapchain, width, height,
+                                  PIXEL_FORMAT_ARGB8888, 2)) {
+      return 0;
+    }
+
+    layer->active = true;
+    layer->x = x;
+    layer->y = y;
+    layer->desync = desync;
+    layer->drawing = -1;
+    layer->wl_surface_id = wayland_wl_compositor_create_surface(windowState);
+    layer->wl_subsurface_id = wayland_wl_subcompositor_get_subsurface(windowState, layer->wl_surface_id, windowState->wl_surface_id);
+
+    wayland_wl_subsurface_set_position(windowState, layer->wl_subsurface_id, x, y);
+    if (desync) {
+      wayland_send_no_args(windowState, layer->wl_subsurface_id, windowState->opcodes.wl_subsurface.SET_DESYNC);
+    }
+
+    wayland_log(windowState, "Created layer %u: wl_surface@%u wl_subsurface@%u\n", Index + 1, layer->wl_surface_id, layer->wl_subsurface_id);
+    return Index + 1;
+  }
+
+  printf("Out of layer slots\n");
+  return 0;
+}
+
+// The position is parent state, it shows up with the window's next commit.
+void wayland_move_layer(wayland_windowState *windowState, uint32_t layer_handle, int32_t x, int32_t y) {
+  wayland_layer *layer = wayland_get_layer(windowState, layer_handle);
+  if (layer && (layer->x != x || layer->y != y)) {
+    layer->x = x;
+    layer->y = y;
+    wayland_wl_subsurface_set_position(windowState, layer->wl_subsurface_id, x, y);
+  }
+}
+
+uint32_t *wayland_begin_layer_frame(wayland_windowState *windowState, uint32_t layer_handle, uint32_t *stride) {
+  wayland_layer *layer = wayland_get_layer(windowState, layer_handle);
+  if (!layer) {
+    return 0;
+  }
+
+  layer->drawing = shm_swapchain_acquire(&layer->swapchain);
+  if (layer->drawing < 0) {
+    return 0;
+  }
+
+  if (stride) {
+    *stride = layer->swapchain.stride;
+  }
+
+  return (uint32_t *)shm_swapchain_pixels(&layer->swapchain, layer->drawing);
+}
+
+// Only the damaged part gets recomposited. A desync layer shows up right
+// away, a synced one waits for the window's next commit.
+void wayland_present_layer(wayland_windowState *windowState, uint32_t layer_handle,
+                           int32_t x, int32_t y, int32_t width, int32_t height) {
+  wayland_layer *layer = wayland_get_layer(windowState, layer_handle);
+  if (!layer || layer->drawing < 0) {
+    return;
+  }
+
+  shm_swapchain_buffer *buffer = &layer->swapchain.buffers[layer->drawing];
+  buffer->busy = true;
+  layer->drawing = -1;
+
+  wayland_wl_surface_attach(windowState, layer->wl_surface_id, buffer->handle);
+  wayland_wl_surface_damage(windowState, layer->wl_surface_id, x, y, width, height);
+  wayland_wl_surface_commit(windowState, layer->wl_surface_id);
+}
+
+void wayland_destroy_layer(wayland_windowState *windowState, uint32_t layer_handle) {
+  wayland_layer *layer = wayland_get_layer(windowState, layer_handle);
+  if (!layer) {
+    return;
+  }
+
+  wayland_send_no_args(windowState, layer->wl_subsurface_id, windowState->opcodes.wl_subsurface.DESTROY);
+  wayland_send_no_args(windowState, layer->wl_surface_id, windowState->opcodes.wl_surface.DESTROY);
+  wayland_swapchain_destroy(windowState, &layer->swapchain);
+
+  memset(layer, 0, sizeof(*layer));
+}
+
+// Startup in as few round trips as the protocol allows. get_registry and a
+// sync go out together, the binds are queued as the globals come in and the
+// sync's done means every global has been seen.
+void wayland_window_set_up(wayland_windowState *state, uint32_t Width, uint32_t Height) {
+  state->RequestedWidth = Width ? Width : 800;
+  state->RequestedHeight = Height ? Height : 600;
+  state->Width = state->RequestedWidth;
+  state->Height = state->RequestedHeight;
+
+  uint32_t unfocused_fps = state->settings.unfocused_fps ? state->settings.unfocused_fps : DEFAULT_UNFOCUSED_FPS;
+  state->unfocused_interval_ns = 1000000000ull / unfocused_fps;
+  state->stats_overlay = frame_stats_overlay_wanted(&state->settings);
+
+  pthread_mutex_init(&state->data_lock, 0);
+  pthread_cond_init(&state->transfer_freed, 0);
+  state->selection.fd = -1;
+  state->pending_selection.fd = -1;
+
+  wayland_wl_display_get_registry(state);
+  state->registry_sync_id = wayland_wl_display_sync(state);
+  state->stage = STATE_REGISTRY_SYNC;
+
+  wayland_flush(state);
+}
+
+// Everything up to the first configure goes out in one batch with the binds:
+// the surface and its roles, the scale objects, the initial commit and, when
+// the format doesn't depend on wl_shm.format events, the swapchain too.
+void wayland_registry_done(wayland_windowState *state) {
+  state->startup.registry_done_ns = wayland_now_ns();
+
+  if (const char *missing = wayland_registry_missing(state)) {
+    printf("The compositor doesn't have %s, or not at a version we can use\n", missing);
+    exit(EPROTO);
+  }
+
+  state->wl_surface_id = wayland_wl_compositor_create_surface(state);
+
+  if (state->wp_fractional_scale_manager_id != 0) {
+    state->wp_fractional_scale_id = wayland_wp_fractional_scale_manager_get_fractional_scale(state);
+  }
+
+  if (state->wp_viewporter_id != 0) {
+    state->wp_viewport_id = wayland_wp_viewporter_get_viewport(state);
+    state->destination_width = -1;
+    state->destination_height = -1;
+  }
+
+  state->xdg_surface_id = wayland_xdg_wm_base_get_xdg_surface(state);
+  state->xdg_toplevel_id = wayland_xdg_surface_get_toplevel(state);
+
+  // Clipboard and drag and drop, optional.
+  if (state->wl_data_device_manager_id != 0 && state->wl_seat_id != 0) {
+    state->wl_data_device_id = wayland_wl_data_device_manager_get_data_device(state);
+  }
+
+  wayland_update_buffer_size(state);
+
+  // XRGB8888 and ARGB8888 are always supported, so the pool doesn't have to
+  // wait for the format events. If the configure picks another size it gets
+  // recreated like on any resize.
+  if (state->settings.format == PIXEL_FORMAT_XRGB8888 ||
+      state->settings.format == PIXEL_FORMAT_ARGB8888) {
+    state->format = state->settings.format;
+    if (!wayland_swapchain_create(state, &state->swapchain, state->BufferWidth, state->BufferHeight,
+                                  state->format, SWAPCHAIN_MAX_BUFFERS)) {
+      printf("Failed to create the swapchain\n");
+      exit(errno);
+    }
+
+    if (!render_target_resize(&state->target, state->BufferWidth, state->BufferHeight)) {
+      printf("Failed to allocate the render target\n");
+      exit(errno);
+    }
+  }
+
+  wayland_wl_surface_commit(state, state->wl_surface_id);
+  state->stage = STATE_CONFIGURE_WAIT;
+
+  if (state->log_events) {
+    PrintBoundInterfaces(state);
+  }
+}
+
+// Acks and applies only the newest configure seen in a read batch.
+void wayland_apply_configure(wayland_windowState *state) {
+  if (!state->configure_pending) {
+    return;
+  }
+
+  state->configure_pending = false;
+  wayland_xdg_surface_ack_configure(state, state->configure_serial);
+
+  // 0x0 leaves the size up to us.
+  if (state->pending_width != 0 && state->pending_height != 0) {
+    state->Width = state->pending_width;
+    state->Height = state->pending_height;
+  }
+  state->resizing = state->pending_resizing;
+  wayland_update_buffer_size(state);
+
+  // Our own flags (occluded, throttled) survive, the compositor's are replaced.
+  uint32_t compositor_flags = WINDOW_MAXIMIZED | WINDOW_FULLSCREEN | WINDOW_RESIZING |
+                              WINDOW_ACTIVATED | WINDOW_TILED | WINDOW_SUSPENDED;
+  uint32_t previous_flags = state->window_flags;
+  state->window_flags = (state->window_flags & ~compositor_flags) | state->pending_flags;
+
+  if (state->window_flags & WINDOW_ACTIVATED) {
+    state->window_flags &= ~WINDOW_THROTTLED;
+  }
+
+  // The first frame goes out right behind the ack, later ones at the new
+  // size come with the next frame callback.
+  if (state->stage == STATE_CONFIGURE_WAIT) {
+    state->startup.configure_ns = wayland_now_ns();
+
+    wayland_request_frame(state);
+    state->drawOnce = true;
+
+    state->stage = STATE_SURFACE_ATTACHED;
+    state->startup.first_commit_ns = wayland_now_ns();
+    // frame_stats is the game thread's when it draws, and it hasn't yet.
+    if (!state->threaded) {
+      state->startup.first_frame_faults = state->frame_stats.page_faults_last;
+    }
+    return;
+  }
+
+  bool resumed = (previous_flags & WINDOW_SUSPENDED) && !(state->window_flags & WINDOW_SUSPENDED);
+  bool focused = !(previous_flags & WINDOW_ACTIVATED) && (state->window_flags & WINDOW_ACTIVATED);
+  if (resumed || focused) {
+    wayland_wake(state);
+  }
+}
+
+void wayland_print_startup(wayland_windowState *state) {
+  wayland_startup_timing *startup = &state->startup;
+
+  printf("startup: registry_ms=%.3f configure_ms=%.3f first_commit_ms=%.3f first_frame_ms=%.3f reads=%u first_frame_faults=%llu\n",
+         (startup->registry_done_ns - startup->connect_ns) / 1e6,
+         (startup->configure_ns - startup->connect_ns) / 1e6,
+         (startup->first_commit_ns - startup->connect_ns) / 1e6,
+         (startup->first_frame_done_ns - startup->connect_ns) / 1e6,
+         startup->reads,
+         (unsigned long long)startup->first_frame_faults);
+  fflush(stdout);
+}
+
+
+void wayland_listen_to_events(wayland_windowState *state, char **msg, uint64_t *msg_len) {
+  assert(*msg_len >= 0);
+  
+  uint32_t object_id = buf_read_u32(msg, msg_len);
+  uint16_t opcode = buf_read_u16(msg, msg_len);
+  uint16_t announced_size = buf_read_u16(msg, msg_len);
+
+  wayland_log(state, "OBJ_ID: %u, OPCODE: %u, SIZE: %u\n", object_id, opcode, announced_size);
+  assert(roundup_4(announced_size) <= announced_size);
+
+  uint32_t header_size = sizeof(object_id) + sizeof(opcode) + sizeof(announced_size);
+  assert(announced_size <= header_size + *msg_len);
+
+  uint32_t bytes_to_read_out = announced_size - header_size;
+  uint32_t bytes_read_out = *msg_len;
+
+  wayland_output *event_output = wayland_find_output(state, object_id);
+  shm_swapchain_buffer *event_buffer = wayland_find_swapchain_buffer(state, object_id);
+
+  if (object_id == state->wl_display_id) {
+    wayland_log(state, "Event recieved from wl_display ");
+    if (state->opcodes.wl_display.ERROR == opcode) {
+      uint32_t target_object_id = buf_read_u32(msg, msg_len);
+      uint32_t error_code = buf_read_u32(msg, msg_len);
+      uint32_t error_length = buf_read_u32(msg, msg_len); 
+      
+      char buffer[4096] = "";
+      buf_read_n(msg, msg_len, buffer, roundup_4(error_length));
+      printf("fatel error: target_object_id@%u: error_code %u: error: %s\n",
+              target_object_id, error_code, buffer);
+      
+      exit(errno);
+    } else {
+      unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
+    } 
+
+  } else if (object_id == state->wl_registry_id) {
+    wayland_log(state, "Event recieved from wl_registry ");
+
+    if (state->opcodes.wl_registery.GLOBAL_EVENT == opcode) {
+      // name, interface_len, the interface and the version. The interface
+      // is used where it is in the message, so it has to fit in it.
+      uint32_t interface_len = bytes_to_read_out >= 12 ? *(uint32_t *)(*msg + 4) : 0;
+      if (interface_len == 0 || roundup_4((uint64_t)interface_len) > bytes_to_read_out - 12) {
+        printf("Malformed wl_registry.global, skipping it\n");
+        unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
+        return;
+      }
+
+      uint32_t name = buf_read_u32(msg, msg_len);
+      buf_read_u32(msg, msg_len);
+
+      char *interface = *msg;
+      buf_read_n(msg, msg_len, 0, roundup_4(interface_len));
+
+      uint32_t version_number = buf_read_u32(msg, msg_len);
+
+      wayland_log(state, "\nEvent: Registry Global recieved numeric name: %u: name %.*s, version %u\n",
+              name, (int)interface_len, interface, version_number);
+
+      wayland_registry_global(state, name, interface, interface_len, version_number);
+
+    } else if (state->opcodes.wl_registery.GLOBAL_REMOVE == opcode) {
+      uint32_t name = buf_read_u32(msg, msg_len);
+      wayland_log(state, "\nEvent: Registry Global removed numeric name: %u\n", name);
+
+      // Outputs are the only globals that come and go in practice (hotplug).
+      for (uint32_t Index = 0; Index < state->output_count; Index++) {
+        wayland_output *output = &state->outputs[Index];
+        if (output->global_name != name) {
+          continue;
+        }
+
+        if (output->version >= 3) {
+          wayland_wl_output_release(state, output->id);
+        }
+
+        bool was_current = state->current_output == (int32_t)Index;
+        state->outputs[Index] = state->outputs[--state->output_count];
+        if (state->current_output == (int32_t)state->output_count) {
+          state->current_output = (int32_t)Index;
+        }
+        if (was_current) {
+          state->current_output = -1;
+        }
+        wayland_output_changed(state);
+        break;
+      }
 
     } else {
       unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
     }
 
-  } else if (object_id == state->wl_shm_pool_id) {
-    printf("Event recieved from wl_shm_pool ");
-    switch (opcode) {
-      default: {
+  } else if (event_output) {
+    wayland_log(state, "Event recieved from wl_output ");
+    if (state->opcodes.wl_output.GEOMETRY == opcode) {
+      event_output->x = buf_read_s32(msg, msg_len);
+      event_output->y = buf_read_s32(msg, msg_len);
+      event_output->physical_width = buf_read_s32(msg, msg_len);
+      event_output->physical_height = buf_read_s32(msg, msg_len);
+      buf_read_s32(msg, msg_len); // subpixel
+      buf_read_string(msg, msg_len, 0, 0); // make
+      buf_read_string(msg, msg_len, 0, 0); // model
+      event_output->transform = buf_read_s32(msg, msg_len);
+
+      wayland_log(state, "geometry %d,%d %dmm x %dmm\n", event_output->x, event_output->y,
+             event_output->physical_width, event_output->physical_height);
+    } else if (state->opcodes.wl_output.MODE == opcode) {
+      uint32_t flags = buf_read_u32(msg, msg_len);
+      int32_t width = buf_read_s32(msg, msg_len);
+      int32_t height = buf_read_s32(msg, msg_len);
+      int32_t refresh = buf_read_s32(msg, msg_len);
+
+      // Only the current mode matters, the rest are what it could switch to.
+      if (flags & 0x1) {
+        event_output->width = width;
+        event_output->height = height;
+        event_output->refresh_mhz = refresh;
+      }
+
+      wayland_log(state, "Screen Width: %d, Screen Height: %d, Refressh Rate: %d\n", width, height, refresh);
+    } else if (state->opcodes.wl_output.SCALE == opcode) {
+      event_output->scale = buf_read_s32(msg, msg_len);
+      wayland_log(state, "scale %d\n", event_output->scale);
+    } else if (state->opcodes.wl_output.NAME == opcode) {
+      buf_read_string(msg, msg_len, event_output->name, sizeof(event_output->name));
+      wayland_log(state, "name %s\n", event_output->name);
+    } else if (state->opcodes.wl_output.DONE == opcode) {
+      // Everything above is atomic up to here.
+      event_output->done = true;
+      wayland_log(state, "done\n");
+      wayland_output_changed(state);
+    } else {
+      unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
+    }
+  } else if (object_id == state->wl_shm_id) {
+    wayland_log(state, "Event recieved from wl_shm \n");
+    if (state->opcodes.wl_shm.WL_SHM_FORMAT_EVENT == opcode) {
+      uint32_t format = buf_read_u32(msg, msg_len);
+      
+      wayland_log(state, "[FORMAT]: shared memory format %u is supported\n", format);
+
+      WL_SHM *shm = &state->opcodes.wl_shm;
+      switch (format) {
+        case WL_SHM::WL_SHM_FORMAT_RGB565: shm->RGB565_supported = true; break;
+        case WL_SHM::WL_SHM_FORMAT_XRGB4444: shm->XRGB4444_supported = true; break;
+        case WL_SHM::WL_SHM_FORMAT_RGBA4444: shm->RGBA4444_supported = true; break;
+        case WL_SHM::WL_SHM_FORMAT_XRGB8888: shm->XRGB8888_supported = true; break;
+        case WL_SHM::WL_SHM_FORMAT_RGBA8888: shm->RGBA8888_supported = true; break;
+        default: break;
+      }
+
+    } else {
       unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
-      } break;
-    
     }
-  } else if (object_id == state->wl_buffer_id) {
-    printf("Event recieved from wl_buffer ");
+
+  } else if (event_buffer) {
+    wayland_log(state, "Event recieved from wl_buffer ");
     switch (opcode) {
+      case WL_BUFFER::RELEASE_EVENT: {
+        // The compositor is done reading, we can draw into it again.
+        event_buffer->busy = false;
+        wayland_log(state, "release\n");
+
+        if (state->waiting_for_buffer) {
+          wayland_request_frame(state);
+        }
+      } break;
+
       default: {
       unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
       } break;
     
     }
+  } else if (opcode == WL_BUFFER::RELEASE_EVENT &&
+             shm_swapchain_release_retired(&state->swapchain, object_id)) {
+    // From before a resize, it was only kept for this.
+    wayland_wl_buffer_destroy(state, object_id);
   } else if (object_id == state->wl_compositor_id) {
-    printf("Event recieved from wl_compositor ");
+    wayland_log(state, "Event recieved from wl_compositor ");
     switch (opcode) {
       default: {
       unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
@@ -682,52 +1916,114 @@ void wayland_listen_to_events(wayland_windowState *state, char **msg, uint64_t *
     
     }
   } else if (object_id == state->wl_surface_id) {
-    printf("Event recieved from wl_surface ");
+    wayland_log(state, "Event recieved from wl_surface ");
     switch (opcode) {
+      case WL_SURFACE::ENTER: {
+        uint32_t output_id = buf_read_u32(msg, msg_len);
+        wayland_output *output = wayland_find_output(state, output_id);
+        wayland_log(state, "enter wl_output@%u\n", output_id);
+
+        if (output) {
+          output->window_entered = true;
+          state->current_output = (int32_t)(output - state->outputs);
+          wayland_output_changed(state);
+        }
+      } break;
+
+      case WL_SURFACE::LEAVE: {
+        uint32_t output_id = buf_read_u32(msg, msg_len);
+        wayland_output *output = wayland_find_output(state, output_id);
+        wayland_log(state, "leave wl_output@%u\n", output_id);
+
+        if (output) {
+          output->window_entered = false;
+          if (state->current_output == (int32_t)(output - state->outputs)) {
+            state->current_output = -1;
+          }
+          wayland_output_changed(state);
+        }
+      } break;
+
+      case WL_SURFACE::PREFERRED_BUFFER_SCALE: {
+        int32_t factor = buf_read_s32(msg, msg_len);
+        wayland_log(state, "preferred buffer scale %d\n", factor);
+
+        if (factor != state->preferred_buffer_scale) {
+          state->preferred_buffer_scale = factor;
+          if (state->Width != 0 && state->Height != 0) {
+            wayland_update_buffer_size(state);
+          }
+        }
+      } break;
+
       default: {
       unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
       } break;
     
     }
+  } else if (object_id == state->wp_fractional_scale_id) {
+    wayland_log(state, "Event recieved from wp_fractional_scale_v1 ");
+    if (state->opcodes.wp_fractional_scale.PREFERRED_SCALE == opcode) {
+      uint32_t scale = buf_read_u32(msg, msg_len);
+      wayland_log(state, "preferred scale %u/120\n", scale);
+
+      if (scale != state->fractional_scale_120) {
+        state->fractional_scale_120 = scale;
+        if (state->Width != 0 && state->Height != 0) {
+          wayland_update_buffer_size(state);
+        }
+      }
+    } else {
+      unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
+    }
   } else if (object_id == state->xdg_wm_base_id) {
-    printf("Event recieved from xdg_wm_base ");
+    wayland_log(state, "Event recieved from xdg_wm_base ");
     if (state->opcodes.xdg_wm_base.PING_EVENT == opcode) {
-      printf("PING \n");
+      wayland_log(state, "PING \n");
       uint32_t ping_serial = buf_read_u32(msg, msg_len);
       wayland_xdg_wm_base_pong(state, ping_serial);
-      printf("PONG \n");
+      wayland_log(state, "PONG \n");
       
     } else {
       unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
     }
   } else if (object_id == state->xdg_surface_id) {
-    printf("Event recieved from xdg_surface ");
+    wayland_log(state, "Event recieved from xdg_surface ");
     if (state->opcodes.xdg_surface.CONFIGURE_EVENT == opcode) {
       uint32_t serial = buf_read_u32(msg, msg_len);
 
-      printf("Recieved an configure serial of %u\n", serial);
+      wayland_log(state, "Recieved an configure serial of %u\n", serial);
 
-      wayland_xdg_surface_ack_configure(state, serial);
+      // Acked with whatever configure is latest at the end of this batch.
+      if (state->configure_pending) {
+        state->configures_coalesced++;
+      }
+      state->configure_serial = serial;
+      state->configure_pending = true;
       return;
     } else {
       unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
     }
   } else if (object_id == state->xdg_toplevel_id) {
-    printf("Event recieved from xdg_toplevel ");
+    wayland_log(state, "Event recieved from xdg_toplevel ");
     if (state->opcodes.xdg_toplevel.WM_CAPABILITIES_EVENT == opcode) {
       uint32_t length = buf_read_u32(msg, msg_len);
       uint32_t array_count = length / sizeof(uint32_t);
-      printf("length: %u, array_count: %u\n", length, array_count);
+      wayland_log(state, "length: %u, array_count: %u\n", length, array_count);
       for (uint32_t Index = 0; Index < array_count; Index++) {
         uint32_t array_element = buf_read_u32(msg, msg_len);
 
-        printf("Xdg_toplevel has capability: %u\n", array_element);
+        wayland_log(state, "Xdg_toplevel has capability: %u\n", array_element);
       }
 
       if (array_count == 0) {
-        printf("This xdg_toplevel object has no capabilities\n");
+        wayland_log(state, "This xdg_toplevel object has no capabilities\n");
       }
 
+    } else if (state->opcodes.xdg_toplevel.CLOSE_EVENT == opcode) {
+      wayland_log(state, "close\n");
+      state->closed = true;
+
     } else if (state->opcodes.xdg_toplevel.CONFIGURE_EVENT == opcode) {
       
       uint32_t new_width = buf_read_u32(msg, msg_len);
@@ -736,70 +2032,168 @@ void wayland_listen_to_events(wayland_windowState *state, char **msg, uint64_t *
       uint32_t length = buf_read_u32(msg, msg_len);
       uint32_t array_count = length / sizeof(uint32_t);
       
-      state->Width = new_width;
-      state->Height = new_height;
-      state->stride = new_width * COLOR_CHANNELS;
+      // Staged until the xdg_surface.configure that closes this sequence.
+      state->pending_width = new_width;
+      state->pending_height = new_height;
+      state->pending_resizing = false;
+      state->pending_flags = 0;
       
-      uint32_t size = state->stride * state->Height;
-      printf("Width: %u, Height %u, and Size %u\n", new_width, new_height, size);
-      printf("length: %u, array_count: %u\n", length, array_count);
+      wayland_log(state, "Width: %u, Height %u\n", new_width, new_height);
+      wayland_log(state, "length: %u, array_count: %u\n", length, array_count);
       for (uint32_t Index = 0; Index < array_count; Index++) {
         uint32_t array_element = buf_read_u32(msg, msg_len);
 
-        printf("Xdg_toplevel has state: %u\n", array_element);
+        switch (array_element) {
+          case XDG_TOPLEVEL::MAXIMIZED: state->pending_flags |= WINDOW_MAXIMIZED; break;
+          case XDG_TOPLEVEL::FULLSCREEN: state->pending_flags |= WINDOW_FULLSCREEN; break;
+          case XDG_TOPLEVEL::RESIZING: {
+            state->pending_flags |= WINDOW_RESIZING;
+            state->pending_resizing = true;
+          } break;
+          case XDG_TOPLEVEL::ACTIVATED: state->pending_flags |= WINDOW_ACTIVATED; break;
+          case XDG_TOPLEVEL::TILED_LEFT:
+          case XDG_TOPLEVEL::TILED_RIGHT:
+          case XDG_TOPLEVEL::TILED_TOP:
+          case XDG_TOPLEVEL::TILED_BOTTOM: state->pending_flags |= WINDOW_TILED; break;
+          case XDG_TOPLEVEL::SUSPENDED: state->pending_flags |= WINDOW_SUSPENDED; break;
+          default: break;
+        }
+
+        wayland_log(state, "Xdg_toplevel has state: %u\n", array_element);
       }
 
       if (array_count == 0) {
-        printf("This xdg_toplevel object has no states\n");
+        wayland_log(state, "This xdg_toplevel object has no states\n");
       }
 
     } else {
       unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
     }
+  } else if (state->registry_sync_id != 0 && object_id == state->registry_sync_id) {
+    if (state->opcodes.wl_callback.DONE_EVENT == opcode) {
+      buf_read_u32(msg, msg_len); // callback_data
+      state->registry_sync_id = 0;
+      wayland_registry_done(state);
+    } else {
+      unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
+    }
+
   } else if (object_id == state->frame_callback_id) {
     uint32_t current_time = buf_read_u32(msg, msg_len);
-    printf("Current_time %u\n", current_time);
-    wayland_wl_surface_frame(state);
+    wayland_log(state, "Current_time %u\n", current_time);
 
-    int fd = memfd_create("wayland_shared_memory", MFD_CLOEXEC);
+    uint64_t done_ns = wayland_compositor_time_ns(current_time, wayland_now_ns());
 
-    uint32_t size = state->stride * state->Height;
-    printf("Size %u\n", size);
-    if (ftruncate(fd, size) == -1) {
-      printf("failed to truncate memory file\n");
-      exit(errno);
+    if (state->present_clock.nominal_ns == 0) {
+      av_clock_init(&state->present_clock,
+                    state->frame_interval_ns ? state->frame_interval_ns : WAYLAND_DEFAULT_FRAME_INTERVAL_NS);
     }
+    av_clock_observe(&state->present_clock, done_ns, 0);
+
+    // Refreshes that went by since the last one, unless we held the frame
+    // back on purpose. What a late frame cost, or the compositor skipping us.
+    uint64_t interval_ns = state->frame_interval_ns ? state->frame_interval_ns : WAYLAND_DEFAULT_FRAME_INTERVAL_NS;
+    if (state->last_frame_done_ns != 0 && done_ns > state->last_frame_done_ns &&
+        !(state->window_flags & (WINDOW_THROTTLED | WINDOW_SUSPENDED | WINDOW_OCCLUDED))) {
+      uint64_t refreshes = (done_ns - state->last_frame_done_ns + interval_ns / 2) / interval_ns;
+      if (refreshes > 1) {
+        state->recorder.stats.missed_frame_callbacks += refreshes - 1;
+      }
+    }
+    state->last_frame_done_ns = done_ns;
 
-    munmap(state->shm_pool_data, state->shm_pool_size);
+    // The frame carrying the oldest input since the one before it is on
+    // screen, as far as a frame callback tells.
+    if (state->committed_input_ns != 0) {
+      if (done_ns >= state->committed_input_ns) {
+        frame_stats_input_latency(&state->recorder, done_ns - state->committed_input_ns);
+      }
+      state->committed_input_ns = 0;
+    }
 
-    state->shm_pool_data = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    state->shm_pool_size = size;
-    state->shm_fd = fd;
-    
-    if (state->shm_pool_data != 0 &&
-        state->shm_pool_size > 0) {
-
-      wayland_wl_shm_create_pool(state);
-      state->wl_buffer_id = wayland_wl_shm_pool_create_buffer(state);
-      wayland_wl_shm_pool_destroy(state);
-
-      uint32_t *pixels = (uint32_t *)state->shm_pool_data;
-      for (uint32_t Index = 0; Index < state->Width * state->Height; Index++) {
-        uint8_t r = state->blue;
-        uint8_t b = state->blue;
-        uint8_t g = state->blue;
-        uint8_t a = 0xff;
-        pixels[Index] = a << 24 | r << 16 | g << 8 | b;
+    if (state->startup.first_frame_done_ns == 0) {
+      state->startup.first_frame_done_ns = wayland_now_ns();
+      wayland_print_startup(state);
+
+      // Launch latency benchmarking, one window and out.
+      if (getenv("JAM_STARTUP_BENCH")) {
+        state->closed = true;
+        return;
       }
+    }
 
-      wayland_wl_surface_attach(state);
-      wayland_wl_surface_damage(state);
-      wayland_wl_surface_commit(state);
+    wayland_frame_done(state);
+
+  } else if (object_id == state->wl_seat_id) {
+    wayland_log(state, "Event recieved from wl_seat ");
+    if (state->opcodes.wl_seat.CAPABILITIES == opcode) {
+      uint32_t capabilities = buf_read_u32(msg, msg_len);
+      wayland_log(state, "capabilities %u\n", capabilities);
+
+      // Listened to for waking up the window and for setting the cursor,
+      // input handling itself is the app's.
+      if ((capabilities & WL_SEAT::POINTER) && state->wl_pointer_id == 0) {
+        state->wl_pointer_id = wayland_wl_seat_get_device(state, state->opcodes.wl_seat.GET_POINTER);
+        if (state->wp_cursor_shape_manager_id != 0) {
+          state->wp_cursor_shape_device_id = wayland_wp_cursor_shape_manager_get_pointer(state);
+        }
+      }
+      if ((capabilities & WL_SEAT::KEYBOARD) && state->wl_keyboard_id == 0) {
+        state->wl_keyboard_id = wayland_wl_seat_get_device(state, state->opcodes.wl_seat.GET_KEYBOARD);
+      }
+    } else {
+      unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
+    }
+
+  } else if (object_id != 0 &&
+             (object_id == state->wl_pointer_id || object_id == state->wl_keyboard_id)) {
+    bool keyboard = object_id == state->wl_keyboard_id;
+
+    // wl_keyboard.keymap carries an fd we have no use for.
+    if (keyboard && opcode == state->opcodes.wl_keyboard.KEYMAP) {
+      int fd = wayland_take_fd(state);
+      if (fd >= 0) close(fd);
+    }
 
+    // pointer enter and button, keyboard enter and key: the serials a
+    // clipboard selection can be set with.
+    if ((!keyboard && (opcode == state->opcodes.wl_pointer.ENTER || opcode == state->opcodes.wl_pointer.BUTTON)) ||
+        (keyboard && (opcode == state->opcodes.wl_keyboard.ENTER || opcode == state->opcodes.wl_keyboard.KEY))) {
+      state->input_serial = *(uint32_t *)(*msg);
     }
 
+    // Every enter needs the cursor set again, it's undefined until we do.
+    if (!keyboard && opcode == state->opcodes.wl_pointer.ENTER) {
+      wayland_cursor_pointer_enter(state, *(uint32_t *)(*msg));
+    } else if (!keyboard && opcode == state->opcodes.wl_pointer.LEAVE) {
+      state->pointer_inside = false;
+    }
+
+    // Motion, button, axis and key carry a timestamp, what the latency is
+    // measured from. Right after the serial when there is one.
+    int32_t time_at = -1;
+    if (!keyboard && (opcode == state->opcodes.wl_pointer.MOTION || opcode == state->opcodes.wl_pointer.AXIS)) {
+      time_at = 0;
+    } else if ((!keyboard && opcode == state->opcodes.wl_pointer.BUTTON) ||
+               (keyboard && opcode == state->opcodes.wl_keyboard.KEY)) {
+      time_at = 4;
+    }
+    if (time_at >= 0 && state->pending_input_ns == 0 && *msg_len >= (uint64_t)time_at + 4) {
+      uint32_t time_ms = *(uint32_t *)(*msg + time_at);
+      state->pending_input_ns = wayland_compositor_time_ns(time_ms, wayland_now_ns());
+    }
+
+    // Any input at all, a throttled window draws right away.
+    frame_stats_input(&state->recorder);
+    unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
+    wayland_wake(state);
+
+  } else if (wayland_data_device_event(state, object_id, opcode, announced_size, msg, msg_len)) {
+
   } else {
-    printf("Unkown object id.");
+    // Still has to be skipped or the rest of the batch is misread.
+    wayland_log(state, "Unkown object id.");
+    unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
   }
 }
 
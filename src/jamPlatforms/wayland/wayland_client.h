@@ -6,13 +6,49 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/socket.h>
 
+#include "../../platform.h"
+#include "../shm_swapchain.h"
+#include "../pixel_convert.h"
+#include "../message_queue.h"
+#include "../event_loop.h"
+#include "../av_clock.h"
+#include "../cpu_topology.h"
+#include "../frame_stats.h"
+
 #define MAX_MESSAGE_SIZE 4096
+#define WAYLAND_OUT_BUFFER_SIZE 65536
+#define WAYLAND_IN_BUFFER_SIZE 65536
+#define WAYLAND_MAX_PENDING_FDS 8
 #define WAYLAND_HEADER_SIZE 8
+
+// Protocol traffic and the per-frame chatter, only with JAM_WAYLAND_DEBUG=1.
+// Every line is a write, it would show up in the syscall counts.
+#define wayland_log(state, ...) do { if ((state)->log_events) printf(__VA_ARGS__); } while (0)
 #define COLOR_CHANNELS 4
+#define MAX_OUTPUTS 8
+#define OUTPUT_NAME_SIZE 64
+#define MAX_LAYERS 8
+#define MAX_DATA_OFFERS 4
+#define MAX_DATA_TRANSFERS 8
+#define MAX_DATA_SENDS 4
+#define MAX_INCOMING_FDS 8
+#define WAYLAND_DATA_DEVICE_VERSION 3
+#define WAYLAND_TRANSFER_CHUNK (4u << 20) // Moved per wakeup, so a big paste can't hold up a frame.
+#define CURSOR_ATLAS_WIDTH 256
+#define CURSOR_ATLAS_HEIGHT 2048 // Room for every shape at 2x with some to spare.
+#define CURSOR_MAX_THEME_DEPTH 4 // The theme itself and what it inherits from.
+#define DEFAULT_CURSOR_SIZE 24
+
+// A frame callback that takes this long means nothing of the window is on screen.
+#define WAYLAND_COMMAND_QUEUE_SIZE 64
+#define WAYLAND_EVENT_QUEUE_SIZE 16
+#define WAYLAND_OCCLUDED_AFTER_NS 1000000000ull
+#define WAYLAND_DEFAULT_FRAME_INTERVAL_NS (1000000000ull / 60)
 
 // One hundred percent wayland specific
 
@@ -31,6 +67,12 @@ struct WL_DISPLAY {
   };
 };
 
+struct WL_CALLBACK {
+  enum Events {
+    DONE_EVENT=0,
+  };
+};
+
 struct WL_REGISTERY {
   enum Methods {
     BIND=0,
@@ -51,6 +93,9 @@ struct WL_SHM {
   bool RGBA8888_supported;
 
   enum Formats {
+    // 32 bit color values, the two formats every compositor supports.
+	  WL_SHM_FORMAT_ARGB8888 = 0,
+
     // 16 bit color values without alpha.
 	  WL_SHM_FORMAT_RGB565 = 0x36314752,
 
@@ -91,7 +136,7 @@ struct WL_BUFFER {
   };
 
   enum Events {
-    DESTROY_EVENT=0 
+    RELEASE_EVENT=0 
   };
 };
 
@@ -121,6 +166,57 @@ struct WL_OUTPUT {
   };
 };
 
+struct WL_SEAT {
+  enum Methods {
+    GET_POINTER=0,
+    GET_KEYBOARD=1,
+    GET_TOUCH=2,
+    RELEASE=3,
+  };
+
+  enum Events {
+    CAPABILITIES=0,
+    NAME=1,
+  };
+
+  enum Capabilities {
+    POINTER=1,
+    KEYBOARD=2,
+    TOUCH=4,
+  };
+};
+
+struct WL_POINTER {
+  enum Methods {
+    SET_CURSOR=0,
+    RELEASE=1,
+  };
+
+  enum Events {
+    ENTER=0,
+    LEAVE=1,
+    MOTION=2,
+    BUTTON=3,
+    AXIS=4,
+    FRAME=5,
+  };
+};
+
+struct WL_KEYBOARD {
+  enum Methods {
+    RELEASE=0,
+  };
+
+  enum Events {
+    KEYMAP=0,
+    ENTER=1,
+    LEAVE=2,
+    KEY=3,
+    MODIFIERS=4,
+    REPEAT_INFO=5,
+  };
+};
+
 struct WL_SURFACE {
   enum Methods {
     DESTROY=0,
@@ -195,34 +291,406 @@ struct XDG_TOPLEVEL {
     CONFIGURE_BOUNDS=2,
     WM_CAPABILITIES_EVENT=3,
   };
+
+  enum States {
+    MAXIMIZED=1,
+    FULLSCREEN=2,
+    RESIZING=3,
+    ACTIVATED=4,
+    TILED_LEFT=5,
+    TILED_RIGHT=6,
+    TILED_TOP=7,
+    TILED_BOTTOM=8,
+    SUSPENDED=9,
+  };
+};
+
+struct WL_SUBCOMPOSITOR {
+  enum Methods {
+    DESTROY=0,
+    GET_SUBSURFACE=1,
+  };
+
+  enum Events {
+    NO_EVENTS=-1,
+  };
+};
+
+struct WL_SUBSURFACE {
+  enum Methods {
+    DESTROY=0,
+    SET_POSITION=1,
+    PLACE_ABOVE=2,
+    PLACE_BELOW=3,
+    SET_SYNC=4,
+    SET_DESYNC=5,
+  };
+
+  enum Events {
+    NO_EVENTS=-1,
+  };
+};
+
+struct WP_VIEWPORTER {
+  enum Methods {
+    DESTROY=0,
+    GET_VIEWPORT=1,
+  };
+
+  enum Events {
+    NO_EVENTS=-1,
+  };
+};
+
+struct WP_VIEWPORT {
+  enum Methods {
+    DESTROY=0,
+    SET_SOURCE=1,
+    SET_DESTINATION=2,
+  };
+
+  enum Events {
+    NO_EVENTS=-1,
+  };
+};
+
+struct WP_FRACTIONAL_SCALE_MANAGER_V1 {
+  enum Methods {
+    DESTROY=0,
+    GET_FRACTIONAL_SCALE=1,
+  };
+
+  enum Events {
+    NO_EVENTS=-1,
+  };
+};
+
+struct WP_FRACTIONAL_SCALE_V1 {
+  enum Methods {
+    DESTROY=0,
+  };
+
+  enum Events {
+    PREFERRED_SCALE=0,
+  };
+};
+
+struct WL_DATA_DEVICE_MANAGER {
+  enum Methods {
+    CREATE_DATA_SOURCE=0,
+    GET_DATA_DEVICE=1,
+  };
+
+  enum Events {
+    NO_EVENTS=-1,
+  };
+
+  enum Actions {
+    ACTION_NONE=0,
+    ACTION_COPY=1,
+    ACTION_MOVE=2,
+    ACTION_ASK=4,
+  };
+};
+
+struct WL_DATA_DEVICE {
+  enum Methods {
+    START_DRAG=0,
+    SET_SELECTION=1,
+    RELEASE=2,
+  };
+
+  enum Events {
+    DATA_OFFER=0,
+    ENTER=1,
+    LEAVE=2,
+    MOTION=3,
+    DROP=4,
+    SELECTION=5,
+  };
+};
+
+struct WL_DATA_OFFER {
+  enum Methods {
+    ACCEPT=0,
+    RECEIVE=1,
+    DESTROY=2,
+    FINISH=3,
+    SET_ACTIONS=4,
+  };
+
+  enum Events {
+    OFFER=0,
+    SOURCE_ACTIONS=1,
+    ACTION=2,
+  };
+};
+
+struct WL_DATA_SOURCE {
+  enum Methods {
+    OFFER=0,
+    DESTROY=1,
+    SET_ACTIONS=2,
+  };
+
+  enum Events {
+    TARGET=0,
+    SEND=1,
+    CANCELLED=2,
+    DND_DROP_PERFORMED=3,
+    DND_FINISHED=4,
+    ACTION=5,
+  };
+};
+
+struct WP_CURSOR_SHAPE_MANAGER_V1 {
+  enum Methods {
+    DESTROY=0,
+    GET_POINTER=1,
+    GET_TABLET_TOOL_V2=2,
+  };
+
+  enum Events {
+    NO_EVENTS=-1,
+  };
+};
+
+struct WP_CURSOR_SHAPE_DEVICE_V1 {
+  enum Methods {
+    DESTROY=0,
+    SET_SHAPE=1,
+  };
+
+  enum Events {
+    NO_EVENTS=-1,
+  };
+
+  // Only the ones cursor_shape maps to.
+  enum Shapes {
+    SHAPE_DEFAULT=1,
+    SHAPE_POINTER=4,
+    SHAPE_WAIT=6,
+    SHAPE_CROSSHAIR=8,
+    SHAPE_TEXT=9,
+    SHAPE_MOVE=13,
+    SHAPE_NOT_ALLOWED=15,
+    SHAPE_GRAB=16,
+    SHAPE_GRABBING=17,
+    SHAPE_EW_RESIZE=26,
+    SHAPE_NS_RESIZE=27,
+    SHAPE_NESW_RESIZE=28,
+    SHAPE_NWSE_RESIZE=29,
+  };
 };
 
 struct OP_CODES {
   WL_DISPLAY wl_display; 
   WL_REGISTERY wl_registery;
+  WL_CALLBACK wl_callback;
   WL_BUFFER wl_buffer;
   WL_SHM wl_shm;
   WL_SHM_POOL wl_shm_pool;
   WL_SURFACE wl_surface;
   WL_COMPOSITOR wl_compositor;
   WL_OUTPUT wl_output;
+  WL_SEAT wl_seat;
+  WL_POINTER wl_pointer;
+  WL_KEYBOARD wl_keyboard;
+  WL_SUBCOMPOSITOR wl_subcompositor;
+  WL_SUBSURFACE wl_subsurface;
   XDG_WM_BASE xdg_wm_base;
   XDG_SURFACE xdg_surface;
   XDG_TOPLEVEL xdg_toplevel;
+  WP_VIEWPORTER wp_viewporter;
+  WP_VIEWPORT wp_viewport;
+  WP_FRACTIONAL_SCALE_MANAGER_V1 wp_fractional_scale_manager;
+  WP_FRACTIONAL_SCALE_V1 wp_fractional_scale;
+  WL_DATA_DEVICE_MANAGER wl_data_device_manager;
+  WL_DATA_DEVICE wl_data_device;
+  WL_DATA_OFFER wl_data_offer;
+  WL_DATA_SOURCE wl_data_source;
+  WP_CURSOR_SHAPE_MANAGER_V1 wp_cursor_shape_manager;
+  WP_CURSOR_SHAPE_DEVICE_V1 wp_cursor_shape_device;
 };
 
+// Startup goes through these in order, each one waits on a single reply
+// from the compositor instead of polling for whatever got bound so far.
 enum window_stage {
   STATE_NONE,
+  STATE_REGISTRY_SYNC, // get_registry + sync sent, globals come in before the sync is done.
+  STATE_CONFIGURE_WAIT, // Surface roles created and committed, waiting for the first configure.
   STATE_PAUSED,
   STATE_SURFACE_ACKED_CONFIGURE,
   STATE_SURFACE_ATTACHED,
 };
 
+// Connect to first frame, for keeping an eye on launch latency.
+struct wayland_startup_timing {
+  uint64_t connect_ns;
+  uint64_t registry_done_ns;
+  uint64_t configure_ns;
+  uint64_t first_commit_ns;
+  uint64_t first_frame_done_ns; // The compositor's frame callback for it.
+  uint32_t reads; // recv calls before the first commit.
+  uint64_t first_frame_faults;
+};
+
+// Threaded mode, game thread -> I/O thread.
+enum wayland_command {
+  WAYLAND_COMMAND_PRESENT, // args: buffer index.
+  WAYLAND_COMMAND_SET_RENDER_SIZE, // args: width, height, 0 0 goes back to render_scale.
+  WAYLAND_COMMAND_CLOSE,
+  WAYLAND_COMMAND_RECEIVE, // args: transfer index.
+  WAYLAND_COMMAND_CANCEL_TRANSFER, // args: transfer index.
+  WAYLAND_COMMAND_SET_SELECTION, // What to offer is in pending_selection.
+  WAYLAND_COMMAND_SET_CURSOR, // args: cursor_shape.
+};
+
+// I/O thread -> game thread. There is at most one frame offered at a
+// time, so the queue can't fill up with these.
+enum wayland_event {
+  WAYLAND_EVENT_FRAME, // The buffer in wayland_windowState.offer is the game's to fill.
+  WAYLAND_EVENT_CLOSE,
+};
+
+struct wayland_frame_offer {
+  int32_t index; // -1 when there's no buffer.
+  uint8_t *pixels;
+  uint32_t stride;
+  pixel_format format;
+  uint32_t window_flags;
+  uint64_t frame_interval_ns;
+  uint64_t present_ns;
+  uint64_t input_ns; // The oldest input since the last offer, 0 for none.
+  window_scale scale;
+};
+
+struct wayland_windowState;
+
+// An offer from another client. Its mime types come in before the
+// selection or enter event that says what it's for.
+struct wayland_data_offer {
+  uint32_t id; // 0 when the slot is free.
+  uint32_t mime_count;
+  char mime_types[DATA_MAX_MIME_TYPES][DATA_MIME_TYPE_SIZE];
+  uint32_t transfers; // Receives still streaming from it.
+};
+
+// The receiving end of one transfer. The game thread fills it in and polls
+// status and bytes, the I/O thread owns the rest once it's queued.
+struct wayland_data_transfer {
+  wayland_windowState *state;
+  int32_t status; // data_transfer_status
+  uint64_t bytes;
+
+  data_offer_kind kind;
+  uint32_t serial;
+  char mime_type[DATA_MIME_TYPE_SIZE];
+
+  int fd; // -1 when receiving into dst.
+  uint64_t offset;
+  uint8_t *dst;
+  uint64_t capacity;
+
+  uint32_t offer_id;
+  int pipe_fd;
+  int source; // Event loop source for the pipe.
+};
+
+// Our copy of what set_clipboard_data was given, never written again once
+// it's made. Pastes vmsplice out of it and their pipes can keep referencing
+// its pages after that, so it's only ever unmapped (the pages live on in
+// the pipes), once the selection and every send using it are done.
+struct wayland_clipboard_copy {
+  uint8_t *data;
+  uint64_t size;
+  uint64_t map_size;
+  uint32_t refs; // The selection and each send of it, I/O thread only once it's handed over.
+};
+
+// What we put on the clipboard.
+struct wayland_data_selection {
+  uint32_t mime_count; // 0 clears it.
+  char mime_types[DATA_MAX_MIME_TYPES][DATA_MIME_TYPE_SIZE];
+  wayland_clipboard_copy *copy; // 0 for a file.
+  int fd; // -1 for data in memory.
+  uint64_t offset;
+  uint64_t size;
+};
+
+// One paste of our selection, written whenever the pipe has room.
+struct wayland_data_send {
+  wayland_windowState *state;
+  bool active;
+  wayland_clipboard_copy *copy; // A reference of its own.
+  int file_fd; // Our own dup, -1 for data in memory.
+  uint64_t offset;
+  uint64_t size;
+  uint64_t sent;
+  int pipe_fd;
+  int source;
+};
+
+// One cursor_shape for the wl_pointer.set_cursor fallback. The theme file
+// stays mapped so a scale change only has to pick another image out of it,
+// the image is uploaded once into the cursor atlas and its surface keeps
+// that buffer attached, switching to it is a single set_cursor.
+struct wayland_cursor {
+  bool tried; // Looked up already, found or not.
+  uint8_t *file;
+  uint64_t file_size;
+
+  uint32_t surface_id;
+  uint32_t buffer_id; // 0 when not uploaded at the current scale.
+  int32_t scale;
+  int32_t hot_x; // Surface coordinates.
+  int32_t hot_y;
+};
+
 struct wayland_object {
   uint32_t id;
   bool Alive;
 };
 
+struct wayland_output {
+  uint32_t id;
+  uint32_t global_name; // Registry name, used to match global_remove.
+  uint32_t version;
+
+  int32_t x;
+  int32_t y;
+  int32_t physical_width; // millimeters.
+  int32_t physical_height;
+  int32_t transform;
+
+  // Current mode.
+  int32_t width;
+  int32_t height;
+  int32_t refresh_mhz;
+
+  int32_t scale;
+  char name[OUTPUT_NAME_SIZE];
+
+  bool done; // Received the first wl_output.done, the fields above are usable.
+  bool window_entered; // Our surface is at least partly on this output.
+};
+
+// A subsurface above the window with its own small swapchain,
+// so overlays can update without touching the window's buffer.
+struct wayland_layer {
+  bool active;
+  bool desync;
+
+  uint32_t wl_surface_id;
+  uint32_t wl_subsurface_id;
+
+  int32_t x;
+  int32_t y;
+
+  shm_swapchain swapchain;
+  int32_t drawing; // Buffer handed out by begin_layer_frame, -1 when none.
+};
+
 struct wayland_windowState {
   int fd;
 
@@ -232,6 +700,21 @@ struct wayland_windowState {
   size_t message_len;
   uint64_t message_pos;
 
+  // SendMessage only queues, wayland_flush sends the whole batch in one
+  // sendmsg together with any fds the batch needs.
+  char out[WAYLAND_OUT_BUFFER_SIZE];
+  uint64_t out_len;
+  int pending_fds[WAYLAND_MAX_PENDING_FDS];
+  uint32_t pending_fd_count;
+
+  // What wayland_run waits in, the socket and in threaded mode the
+  // command eventfd are its sources.
+  event_loop loop;
+
+  // Bytes read but not parsed yet, a message can straddle two reads.
+  alignas(8) char in[WAYLAND_IN_BUFFER_SIZE];
+  uint64_t in_len;
+
   uint32_t current_obj_id; // 1 is reserved;
   
   OP_CODES opcodes;
@@ -246,29 +729,175 @@ struct wayland_windowState {
   uint32_t xdg_wm_base_id;
   uint32_t xdg_surface_id;
   uint32_t wl_compositor_id;
+  uint32_t wl_compositor_version;
+  uint32_t wl_subcompositor_id;
   uint32_t wl_surface_id;
   uint32_t xdg_toplevel_id;
-  uint32_t wl_output_id;
   uint32_t frame_callback_id;
+  uint32_t wp_viewporter_id;
+  uint32_t wp_viewport_id;
+  uint32_t wp_fractional_scale_manager_id;
+  uint32_t wp_fractional_scale_id;
+  uint32_t registry_sync_id;
+  uint32_t wl_seat_id;
+  uint32_t wl_pointer_id;
+  uint32_t wl_keyboard_id;
+  uint32_t wl_data_device_manager_id;
+  uint32_t wl_data_device_manager_version;
+  uint32_t wl_data_device_id;
+  uint32_t wp_cursor_shape_manager_id;
+  uint32_t wp_cursor_shape_device_id;
   
   uint8_t blue;
 
-  uint32_t wl_shm_pool_id;
-  uint32_t wl_buffer_id;
+  shm_swapchain swapchain;
+  wayland_layer layers[MAX_LAYERS];
 
-  // Pixel Buffer Information;
+  window_settings settings;
+  pixel_format format; // What the swapchain actually uses.
+
+  // The canonical RGBA8 target the frame is drawn into before conversion.
+  render_target target;
+
+  // Window size in surface coordinates.
   uint32_t Width;
   uint32_t Height;
-  uint32_t stride;
+
+  // Pixel Buffer Information;
+  // Smaller than the window when rendering below native resolution,
+  // the wp_viewport destination scales it back up.
+  uint32_t BufferWidth;
+  uint32_t BufferHeight;
+
+  // What the viewport destination was last set to, -1 -1 while it's unset.
+  int32_t destination_width;
+  int32_t destination_height;
+
+  // Output density, from wl_surface.preferred_buffer_scale and
+  // wp_fractional_scale_v1 (in 120ths), fractional wins when both are there.
+  int32_t preferred_buffer_scale;
+  int32_t applied_buffer_scale;
+  uint32_t fractional_scale_120;
   
+  // Every wl_output the compositor advertises, the one we follow for
+  // density and pacing is the one the surface most recently entered.
+  wayland_output outputs[MAX_OUTPUTS];
+  uint32_t output_count;
+  int32_t current_output; // -1 when the surface isn't on any output yet.
+  uint64_t frame_interval_ns;
+
   uint32_t ScreenHeight;
   uint32_t ScreenWidth;
 
   uint32_t configure_serial;
-  // Shared memory object
-  int shm_fd;
-  uint32_t shm_pool_size;
-  uint8_t *shm_pool_data;
+
+  // xdg_toplevel.configure only stages these, the latest ones are applied
+  // once per read batch so a resize storm costs one ack and one resize.
+  bool configure_pending;
+  uint32_t pending_width;
+  uint32_t pending_height;
+  bool pending_resizing;
+  uint32_t pending_flags;
+  bool resizing; // Interactive resize, the pool isn't shrunk while it lasts.
+  uint32_t configures_coalesced;
+
+  // What create_a_window asked for, used until the compositor picks a size.
+  uint32_t RequestedWidth;
+  uint32_t RequestedHeight;
+
+  // Throttling. Frames are drawn from frame callbacks, except while
+  // suspended, occluded (callbacks stopped) or held back by the unfocused cap.
+  uint32_t window_flags; // window_state_flags
+  uint64_t unfocused_interval_ns;
+  uint64_t last_frame_ns;
+  uint64_t frame_requested_ns;
+  uint64_t deferred_until_ns;
+  bool frame_callback_pending;
+  bool frame_deferred;
+  bool waiting_for_buffer;
+
+  // The vblank grid, filtered from the frame callbacks' timestamps. Before
+  // an output says its refresh rate it's assumed to be 60 Hz.
+  av_clock present_clock;
+
+  wayland_startup_timing startup;
+  window_frame_stats frame_stats;
+  bool closed;
+
+  // What get_frame_stats reads, counted where the socket is used and
+  // published after every commit. The loop counts its own syscalls, they're
+  // added in at each commit.
+  frame_stats_recorder recorder;
+  uint64_t loop_syscalls_counted;
+  uint64_t last_frame_done_ns; // For the refreshes missed in between.
+  bool stats_overlay;
+  bool log_events; // wayland_log.
+
+  // Input latency: the oldest input event no frame has been drawn after
+  // yet, then the one the frame in flight was, until its frame callback.
+  // Both on our clock, from the events' own timestamps.
+  uint64_t pending_input_ns;
+  uint64_t committed_input_ns;
+
+  // Threaded mode (window_settings.io_thread), see wayland_io_thread.cpp.
+  // The I/O thread owns everything above except the render target and
+  // frame_stats, which belong to the game thread. The two only talk
+  // through the queues, each with an eventfd for sleeping on.
+  bool threaded;
+  cpu_thread io_thread; // High priority, frame callbacks are answered from it.
+  mpsc_queue commands;
+  spsc_queue events;
+  int io_wake_fd;
+  int game_wake_fd;
+  bool frame_offered; // Until it's presented the swapchain can't change under the game thread.
+  wayland_frame_offer offer; // Filled in before WAYLAND_EVENT_FRAME is posted.
+  uint32_t events_dropped;
+
+  // Game thread side.
+  wayland_frame_offer game_frame;
+  bool game_closed;
+
+  // Clipboard and drag and drop, see wayland_data_device.cpp. Offers,
+  // sends and the selection belong to the I/O thread.
+  uint32_t input_serial; // Latest button, key or focus, set_selection needs a recent one.
+  int incoming_fds[MAX_INCOMING_FDS]; // Received, waiting for the event they came with.
+  uint32_t incoming_fd_count;
+  wayland_data_offer data_offers[MAX_DATA_OFFERS];
+  uint32_t selection_offer_id;
+  uint32_t drag_offer_id;
+  uint32_t drag_serial;
+  float drag_x;
+  float drag_y;
+  uint32_t drop_offer_id;
+  uint32_t data_source_id;
+  uint32_t retired_data_source_id; // Replaced, but sends for it may still be on their way.
+  wayland_data_selection selection;
+  wayland_data_send sends[MAX_DATA_SENDS];
+
+  // data_lock guards what the two threads share: the offer snapshots the
+  // game thread reads and the selection it hands over. Transfers are
+  // handed back and forth through their status instead, transfer_freed is
+  // signalled when a cancelled one is let go of (or the I/O thread is gone,
+  // data_shutdown) for release_data_transfer to wait on.
+  pthread_mutex_t data_lock;
+  pthread_cond_t transfer_freed;
+  bool data_shutdown;
+  data_offer_info clipboard_info;
+  data_offer_info drop_info;
+  uint32_t data_offer_serial;
+  wayland_data_selection pending_selection;
+  bool pending_selection_set;
+  wayland_data_transfer transfers[MAX_DATA_TRANSFERS];
+
+  // Cursor, see wayland_cursor.cpp. Applied on every wl_pointer.enter and
+  // whenever the shape changes while the pointer is over the window.
+  uint32_t pointer_serial; // From the latest enter, set_cursor needs it.
+  bool pointer_inside;
+  cursor_shape current_cursor;
+  wayland_cursor cursors[CURSOR_SHAPE_COUNT];
+  shm_swapchain cursor_atlas; // One pool, cut into rows by hand instead of equal buffers.
+  uint32_t cursor_atlas_rows_used;
+  uint32_t cursor_size; // XCURSOR_SIZE, in surface coordinates.
   
   bool drawOnce;
   
@@ -290,12 +919,17 @@ inline void ClearMessageBuffer(char *buf, uint64_t *size, uint64_t capacity) {
 
 }
 
+void wayland_flush(wayland_windowState *state);
+
+// Queues the message built in state->message, it goes out with the next wayland_flush.
 inline void SendMessage(wayland_windowState *state) {
-  if ((int64_t)state->message_pos != send(state->fd, state->message, state->message_pos, MSG_DONTWAIT)) {
-    printf("Error sending message.\n");
-    exit(errno);
+  if (state->out_len + state->message_pos > WAYLAND_OUT_BUFFER_SIZE) {
+    wayland_flush(state);
   }
-  printf("Succedded in sending message.\n");
+
+  memcpy(state->out + state->out_len, state->message, state->message_pos);
+  state->out_len += state->message_pos;
+  state->recorder.stats.messages_sent++;
 
   return;
 }
@@ -304,13 +938,17 @@ inline void PrintBoundInterfaces(wayland_windowState *state) {
   printf("wl_display: %u\n", state->wl_display_id);
   printf("wl_registry: %u\n", state->wl_registry_id);
   printf("wl_shm: %u\n", state->wl_shm_id);
-  printf("wl_shm_pool: %u\n", state->wl_shm_pool_id);
-  printf("wl_buffer: %u\n", state->wl_buffer_id);
+  printf("wl_shm_pool: %u\n", state->swapchain.pool_handle);
   printf("wl_surface: %u\n", state->wl_surface_id);
   printf("wl_compositor: %u\n", state->wl_compositor_id);
+  printf("wl_subcompositor: %u\n", state->wl_subcompositor_id);
   printf("wl_xdg_wm_base: %u\n", state->xdg_wm_base_id);
   printf("wl_xdg_surface: %u\n", state->xdg_surface_id);
   printf("wl_xdg_toplevel: %u\n", state->xdg_toplevel_id);
+  printf("wp_viewporter: %u\n", state->wp_viewporter_id);
+  printf("wp_viewport: %u\n", state->wp_viewport_id);
+  printf("wp_fractional_scale_manager_v1: %u\n", state->wp_fractional_scale_manager_id);
+  printf("wp_fractional_scale_v1: %u\n", state->wp_fractional_scale_id);
 
 }
 // Not wayland specific
@@ -322,8 +960,13 @@ int CreateSharedMemory(uint32_t size);
 
 bool connect_wayland_display(wayland_windowState *state); // Returns true on a successful connection
 void wayland_wl_display_get_registry(wayland_windowState *windowState);
-void wayland_window_set_up(wayland_windowState *state);
+void wayland_window_set_up(wayland_windowState *state, uint32_t Width, uint32_t Height);
+void wayland_registry_done(wayland_windowState *state);
 void wayland_listen_to_events(wayland_windowState *state, char **msg, uint64_t *msg_len);
+uint32_t wayland_wl_display_sync(wayland_windowState *windowState);
+void wayland_queue_fd(wayland_windowState *windowState, int fd);
+void wayland_receive(wayland_windowState *state, const uint8_t *data, uint32_t size);
+void wayland_print_startup(wayland_windowState *state);
 
 // Done
 void wayland_xdg_wm_base_pong(wayland_windowState *windowState, uint32_t ping);
@@ -331,15 +974,118 @@ int wayland_wl_compositor_create_surface(wayland_windowState *windowState);
 int wayland_wl_registry_bind(wayland_windowState *windowState, uint32_t name, char *interface, uint32_t interface_len, uint32_t version);
 int wayland_xdg_wm_base_get_xdg_surface(wayland_windowState *windowState);
 int wayland_xdg_surface_get_toplevel(wayland_windowState *windowState);
-void wayland_wl_shm_create_pool(wayland_windowState *windowState);
-int wayland_wl_shm_pool_create_buffer(wayland_windowState *windowState);
+int wayland_wl_shm_create_pool(wayland_windowState *windowState, shm_swapchain *swapchain);
+int wayland_wl_shm_pool_create_buffer(wayland_windowState *windowState, shm_swapchain *swapchain, uint32_t index);
+int wayland_wl_shm_pool_create_buffer_at(wayland_windowState *windowState, uint32_t pool_id, uint32_t offset,
+                                         uint32_t width, uint32_t height, uint32_t stride, uint32_t shm_format);
+void wayland_wl_shm_pool_destroy(wayland_windowState *windowState, uint32_t pool_id);
+void wayland_wl_shm_pool_resize(wayland_windowState *windowState, uint32_t pool_id, int32_t size);
+void wayland_wl_buffer_destroy(wayland_windowState *windowState, uint32_t buffer_id);
+bool wayland_swapchain_create(wayland_windowState *windowState, shm_swapchain *swapchain,
+                              uint32_t width, uint32_t height, pixel_format format, uint32_t buffer_count);
+uint32_t wayland_shm_format(pixel_format format);
+bool wayland_shm_format_supported(wayland_windowState *windowState, pixel_format format);
+pixel_format wayland_choose_format(wayland_windowState *windowState);
+void wayland_swapchain_destroy(wayland_windowState *windowState, shm_swapchain *swapchain);
+bool wayland_swapchain_resize(wayland_windowState *windowState, shm_swapchain *swapchain,
+                              uint32_t width, uint32_t height, pixel_format format);
+void wayland_apply_configure(wayland_windowState *state);
+shm_swapchain_buffer *wayland_find_swapchain_buffer(wayland_windowState *windowState, uint32_t id);
+void wayland_prepare_swapchain(wayland_windowState *state);
+void wayland_commit_buffer(wayland_windowState *state, int32_t index);
+bool wayland_draw_frame(wayland_windowState *state);
+void wayland_request_frame(wayland_windowState *state);
+void wayland_frame_committed(wayland_windowState *state);
+void wayland_frame_done(wayland_windowState *state);
+uint64_t wayland_predict_present_ns(wayland_windowState *state);
+uint64_t wayland_compositor_time_ns(uint32_t time_ms, uint64_t now);
+void wayland_wake(wayland_windowState *state);
+int wayland_timeout_ms(wayland_windowState *state);
+void wayland_run_timers(wayland_windowState *state);
+void wayland_run(wayland_windowState *state);
+
+// Threaded mode.
+bool wayland_start_io_thread(wayland_windowState *state);
+void wayland_stop_io_thread(wayland_windowState *state);
+bool wayland_offer_frame(wayland_windowState *state);
+void wayland_post_event(wayland_windowState *state, uint32_t type);
+void wayland_send_command(wayland_windowState *state, wayland_command type, uint32_t arg0 = 0, uint32_t arg1 = 0);
+void wayland_run_commands(wayland_windowState *state);
+uint8_t *wayland_begin_frame(wayland_windowState *state, uint32_t *stride);
+void wayland_end_frame(wayland_windowState *state);
+void wayland_set_render_size(wayland_windowState *state, uint32_t width, uint32_t height);
+int wayland_wl_seat_get_device(wayland_windowState *windowState, uint16_t opcode);
+void unhandled_opcode(wayland_windowState *state, uint32_t remaining_bytes, char **msg, uint64_t *msg_len,
+                      uint16_t opcode, uint16_t announced_size, uint32_t object_id);
+
+// Clipboard and drag and drop (wayland_data_device.cpp).
+int wayland_wl_data_device_manager_get_data_device(wayland_windowState *windowState);
+int wayland_wl_data_device_manager_create_data_source(wayland_windowState *windowState);
+void wayland_wl_data_device_set_selection(wayland_windowState *windowState, uint32_t source_id, uint32_t serial);
+void wayland_wl_data_offer_accept(wayland_windowState *windowState, uint32_t offer_id, uint32_t serial, const char *mime_type);
+void wayland_wl_data_offer_receive(wayland_windowState *windowState, uint32_t offer_id, const char *mime_type, int fd);
+void wayland_wl_data_offer_set_actions(wayland_windowState *windowState, uint32_t offer_id,
+                                       uint32_t actions, uint32_t preferred_action);
+void wayland_wl_data_source_offer(wayland_windowState *windowState, uint32_t source_id, const char *mime_type);
+void wayland_keep_fds(wayland_windowState *state, int *fds, uint32_t fd_count);
+int wayland_take_fd(wayland_windowState *state);
+bool wayland_data_device_event(wayland_windowState *state, uint32_t object_id, uint16_t opcode,
+                               uint16_t announced_size, char **msg, uint64_t *msg_len);
+void wayland_data_start_receive(wayland_windowState *state, uint32_t transfer_index);
+void wayland_data_cancel_transfer(wayland_windowState *state, uint32_t transfer_index);
+void wayland_data_apply_selection(wayland_windowState *state);
+void wayland_data_device_shutdown(wayland_windowState *state);
+bool wayland_get_data_offer(wayland_windowState *state, data_offer_kind kind, data_offer_info *info);
+int32_t wayland_receive_data(wayland_windowState *state, data_offer_kind kind, uint32_t serial,
+                             const char *mime_type, int fd, uint64_t offset, uint8_t *dst, uint64_t capacity);
+data_transfer_status wayland_get_data_transfer(wayland_windowState *state, int32_t transfer, uint64_t *bytes);
+void wayland_release_data_transfer(wayland_windowState *state, int32_t transfer);
+bool wayland_set_clipboard(wayland_windowState *state, const char *const *mime_types, uint32_t mime_count,
+                           const uint8_t *data, int fd, uint64_t offset, uint64_t size);
+
+// Globals, see the table in wayland_registry.cpp.
+void wayland_registry_global(wayland_windowState *state, uint32_t name, char *interface,
+                             uint32_t interface_len, uint32_t version);
+const char *wayland_registry_missing(wayland_windowState *state);
+
+// Cursors (wayland_cursor.cpp).
+int wayland_wp_cursor_shape_manager_get_pointer(wayland_windowState *windowState);
+void wayland_cursor_pointer_enter(wayland_windowState *state, uint32_t serial);
+void wayland_apply_cursor_shape(wayland_windowState *state, cursor_shape shape);
+void wayland_cursor_shutdown(wayland_windowState *state);
 
 
 // Not Done
 void wayland_xdg_surface_ack_configure(wayland_windowState *windowState, uint32_t configure);
 void wayland_xdg_toplevel_setid(wayland_windowState *windowState, char *string);
-void wayland_wl_surface_commit(wayland_windowState *windowState);
-void wayland_wl_surface_attach(wayland_windowState *windowState);
+void wayland_wl_surface_commit(wayland_windowState *windowState, uint32_t surface_id);
+void wayland_wl_surface_attach(wayland_windowState *windowState, uint32_t surface_id, uint32_t buffer_id);
+void wayland_wl_surface_damage(wayland_windowState *windowState, uint32_t surface_id,
+                               int32_t x, int32_t y, int32_t width, int32_t height);
+void wayland_wl_surface_frame(wayland_windowState *windowState);
+void wayland_send_no_args(wayland_windowState *windowState, uint32_t object_id, uint16_t opcode);
+
+// Layers.
+int wayland_wl_subcompositor_get_subsurface(wayland_windowState *windowState, uint32_t surface_id, uint32_t parent_id);
+void wayland_wl_subsurface_set_position(wayland_windowState *windowState, uint32_t subsurface_id, int32_t x, int32_t y);
+wayland_layer *wayland_get_layer(wayland_windowState *windowState, uint32_t layer);
+uint32_t wayland_create_layer(wayland_windowState *windowState, int32_t x, int32_t y,
+                              uint32_t width, uint32_t height, bool desync);
+void wayland_move_layer(wayland_windowState *windowState, uint32_t layer_handle, int32_t x, int32_t y);
+uint32_t *wayland_begin_layer_frame(wayland_windowState *windowState, uint32_t layer_handle, uint32_t *stride);
+void wayland_present_layer(wayland_windowState *windowState, uint32_t layer_handle,
+                           int32_t x, int32_t y, int32_t width, int32_t height);
+void wayland_destroy_layer(wayland_windowState *windowState, uint32_t layer_handle);
+int wayland_wp_viewporter_get_viewport(wayland_windowState *windowState);
+void wayland_wp_viewport_set_destination(wayland_windowState *windowState, int32_t width, int32_t height);
+void wayland_update_buffer_size(wayland_windowState *windowState);
+wayland_output *wayland_find_output(wayland_windowState *windowState, uint32_t id);
+void wayland_output_changed(wayland_windowState *windowState);
+void wayland_wl_output_release(wayland_windowState *windowState, uint32_t output_id);
+void wayland_wl_surface_set_buffer_scale(wayland_windowState *windowState, uint32_t surface_id, int32_t scale);
+int wayland_wp_fractional_scale_manager_get_fractional_scale(wayland_windowState *windowState);
+float wayland_surface_density(wayland_windowState *windowState);
+int32_t wayland_integer_buffer_scale(wayland_windowState *windowState);
 
 // Not in use.
 void wayland_handle_message(wayland_windowState *state, char **msg, uint64_t *msg_len);
@@ -0,0 +1,458 @@
+#include "wayland_client.h"
+
+#include "../../platform.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Cursors. With wp_cursor_shape_v1 the compositor draws them itself and a
+// shape change is a single set_shape. Without it they come from the XCursor
+// theme: each file is mapped the first time its shape is asked for, the
+// image for the current scale is copied once into the cursor atlas (one
+// shm pool, rows handed out bump style) and gets its own surface with that
+// buffer attached for good. After that a change, or a wl_pointer.enter,
+// is a single set_cursor pointing at the right surface.
+
+#define XCURSOR_MAGIC 0x72756358 // "Xcur"
+#define XCURSOR_IMAGE_TYPE 0xfffd0002
+#define XCURSOR_IMAGE_HEADER_SIZE 36
+#define XCURSOR_MAX_IMAGE_SIZE 0x7fff
+#define CURSOR_PATH_SIZE 1024
+
+struct wayland_cursor_names {
+  uint32_t wp_shape;
+  const char *names[4]; // New name first, then what older themes call it.
+};
+
+static const wayland_cursor_names cursor_names[CURSOR_SHAPE_COUNT] = {
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_DEFAULT, {"default", "left_ptr", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_POINTER, {"pointer", "hand2", "hand1", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_TEXT, {"text", "xterm", "ibeam", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_CROSSHAIR, {"crosshair", "cross", "tcross", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_MOVE, {"move", "fleur", "size_all", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_GRAB, {"grab", "openhand", "hand1", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_GRABBING, {"grabbing", "closedhand", "fleur", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_NOT_ALLOWED, {"not-allowed", "crossed_circle", "forbidden", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_WAIT, {"wait", "watch", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_EW_RESIZE, {"ew-resize", "sb_h_double_arrow", "size_hor", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_NS_RESIZE, {"ns-resize", "sb_v_double_arrow", "size_ver", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_NWSE_RESIZE, {"nwse-resize", "bd_double_arrow", "size_fdiag", 0}},
+  {WP_CURSOR_SHAPE_DEVICE_V1::SHAPE_NESW_RESIZE, {"nesw-resize", "fd_double_arrow", "size_bdiag", 0}},
+  {0, {0}}, // CURSOR_HIDDEN, a null surface.
+};
+
+int wayland_wp_cursor_shape_manager_get_pointer(wayland_windowState *windowState) {
+  assert(windowState->wp_cursor_shape_manager_id > 0 && windowState->wl_pointer_id > 0);
+
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // New ID.
+  ++windowState->current_obj_id;
+  uint32_t new_id = windowState->current_obj_id;
+
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(new_id) + sizeof(windowState->wl_pointer_id);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wp_cursor_shape_manager_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wp_cursor_shape_manager.GET_POINTER);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, new_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_pointer_id);
+
+  SendMessage(windowState);
+
+  printf("-> wp_cursor_shape_manager_v1@%u.get_pointer: wp_cursor_shape_device_v1=%u\n",
+         windowState->wp_cursor_shape_manager_id, new_id);
+
+  return new_id;
+}
+
+static void wayland_wp_cursor_shape_device_set_shape(wayland_windowState *windowState, uint32_t serial, uint32_t shape) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(uint32_t) * 2;
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wp_cursor_shape_device_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wp_cursor_shape_device.SET_SHAPE);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, serial);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, shape);
+
+  SendMessage(windowState);
+}
+
+// surface_id 0 hides the cursor.
+static void wayland_wl_pointer_set_cursor(wayland_windowState *windowState, uint32_t serial, uint32_t surface_id,
+                                          int32_t hot_x, int32_t hot_y) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(uint32_t) * 4;
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_pointer_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_pointer.SET_CURSOR);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, serial);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, surface_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)hot_x);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, (uint32_t)hot_y);
+
+  SendMessage(windowState);
+}
+
+static bool wayland_cursor_map_file(const char *path, wayland_cursor *cursor) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) < 0 || info.st_size < 16) {
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  uint32_t magic;
+  memcpy(&magic, data, sizeof(magic));
+  if (magic != XCURSOR_MAGIC) {
+    munmap(data, info.st_size);
+    return false;
+  }
+
+  cursor->file = (uint8_t *)data;
+  cursor->file_size = info.st_size;
+  printf("Cursor theme file %s mapped, %lu bytes\n", path, (unsigned long)info.st_size);
+  return true;
+}
+
+// Same search path libXcursor uses. Every directory gets
+// <dir>/<theme>/cursors/<name>, then the themes index.theme inherits from.
+static bool wayland_cursor_find(const char *search_path, const char *theme, const char *name,
+                                uint32_t depth, wayland_cursor *cursor) {
+  if (depth >= CURSOR_MAX_THEME_DEPTH) {
+    return false;
+  }
+
+  const char *home = getenv("HOME");
+  char dirs[CURSOR_PATH_SIZE];
+  strncpy(dirs, search_path, sizeof(dirs) - 1);
+  dirs[sizeof(dirs) - 1] = 0;
+
+  char inherits[256] = "";
+  char *save = 0;
+  for (char *dir = strtok_r(dirs, ":", &save); dir; dir = strtok_r(0, ":", &save)) {
+    // A path that doesn't fit would name some other file, skip the entry.
+    char base[CURSOR_PATH_SIZE];
+    int base_len;
+    if (dir[0] == '~') {
+      if (!home) continue;
+      base_len = snprintf(base, sizeof(base), "%s%s/%s", home, dir + 1, theme);
+    } else {
+      base_len = snprintf(base, sizeof(base), "%s/%s", dir, theme);
+    }
+    if (base_len < 0 || base_len >= (int)sizeof(base)) continue;
+
+    char path[CURSOR_PATH_SIZE];
+    int path_len = snprintf(path, sizeof(path), "%s/cursors/%s", base, name);
+    if (path_len >= 0 && path_len < (int)sizeof(path) && wayland_cursor_map_file(path, cursor)) {
+      return true;
+    }
+
+    // First index.theme found for the theme decides what it inherits.
+    path_len = snprintf(path, sizeof(path), "%s/index.theme", base);
+    if (inherits[0] == 0 && path_len >= 0 && path_len < (int)sizeof(path)) {
+      FILE *index = fopen(path, "re");
+      if (index) {
+        char line[256];
+        while (fgets(line, sizeof(line), index)) {
+          if (strncmp(line, "Inherits", 8) != 0) continue;
+          char *value = strchr(line, '=');
+          if (!value) continue;
+          strncpy(inherits, value + 1, sizeof(inherits) - 1);
+          inherits[strcspn(inherits, "\r\n")] = 0;
+          break;
+        }
+        fclose(index);
+      }
+    }
+  }
+
+  char *inherit_save = 0;
+  for (char *parent = strtok_r(inherits, ",; \t", &inherit_save); parent;
+       parent = strtok_r(0, ",; \t", &inherit_save)) {
+    if (strcmp(parent, theme) == 0) continue;
+    if (wayland_cursor_find(search_path, parent, name, depth + 1, cursor)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static uint32_t xcursor_read_u32(const uint8_t *file, uint64_t offset) {
+  uint32_t value;
+  memcpy(&value, file + offset, sizeof(value));
+  return value;
+}
+
+// First frame of the image closest to the nominal size, pixels are
+// premultiplied ARGB just like WL_SHM_FORMAT_ARGB8888 wants them.
+static const uint32_t *xcursor_find_image(const uint8_t *file, uint64_t file_size, uint32_t size,
+                                          uint32_t *width, uint32_t *height, uint32_t *hot_x, uint32_t *hot_y) {
+  uint32_t header_size = xcursor_read_u32(file, 4);
+  uint32_t toc_count = xcursor_read_u32(file, 12);
+  if (header_size < 16 || (uint64_t)header_size + (uint64_t)toc_count * 12 > file_size) {
+    return 0;
+  }
+
+  uint64_t best_position = 0;
+  uint32_t best_distance = UINT32_MAX;
+  for (uint32_t Index = 0; Index < toc_count; Index++) {
+    uint64_t entry = header_size + (uint64_t)Index * 12;
+    if (xcursor_read_u32(file, entry) != XCURSOR_IMAGE_TYPE) continue;
+
+    uint32_t nominal = xcursor_read_u32(file, entry + 4);
+    uint32_t distance = nominal > size ? nominal - size : size - nominal;
+    if (distance < best_distance) {
+      best_distance = distance;
+      best_position = xcursor_read_u32(file, entry + 8);
+    }
+  }
+
+  if (best_distance == UINT32_MAX || best_position + XCURSOR_IMAGE_HEADER_SIZE > file_size) {
+    return 0;
+  }
+
+  const uint8_t *chunk = file + best_position;
+  uint32_t chunk_header = xcursor_read_u32(chunk, 0);
+  *width = xcursor_read_u32(chunk, 16);
+  *height = xcursor_read_u32(chunk, 20);
+  *hot_x = xcursor_read_u32(chunk, 24);
+  *hot_y = xcursor_read_u32(chunk, 28);
+
+  if (chunk_header < XCURSOR_IMAGE_HEADER_SIZE || xcursor_read_u32(chunk, 4) != XCURSOR_IMAGE_TYPE ||
+      *width == 0 || *height == 0 || *width > XCURSOR_MAX_IMAGE_SIZE || *height > XCURSOR_MAX_IMAGE_SIZE ||
+      *hot_x > *width || *hot_y > *height) {
+    return 0;
+  }
+
+  uint64_t pixels = best_position + chunk_header;
+  if (pixels + (uint64_t)*width * *height * sizeof(uint32_t) > file_size) {
+    return 0;
+  }
+
+  return (const uint32_t *)(file + pixels);
+}
+
+// Every cached image goes, their surfaces stay and get new buffers the
+// next time they are used. Only when the atlas is full, so practically
+// after a few scale changes.
+static void wayland_cursor_atlas_reset(wayland_windowState *state) {
+  for (uint32_t Index = 0; Index < CURSOR_SHAPE_COUNT; Index++) {
+    wayland_cursor *cursor = &state->cursors[Index];
+    if (cursor->buffer_id != 0) {
+      wayland_wl_buffer_destroy(state, cursor->buffer_id);
+      cursor->buffer_id = 0;
+    }
+  }
+  state->cursor_atlas_rows_used = 0;
+}
+
+static bool wayland_cursor_upload(wayland_windowState *state, wayland_cursor *cursor, int32_t scale) {
+  uint32_t width, height, hot_x, hot_y;
+  const uint32_t *pixels = xcursor_find_image(cursor->file, cursor->file_size, state->cursor_size * scale,
+                                              &width, &height, &hot_x, &hot_y);
+  if (!pixels) {
+    printf("No usable image in the cursor file\n");
+    return false;
+  }
+
+  if (width > CURSOR_ATLAS_WIDTH || height > CURSOR_ATLAS_HEIGHT) {
+    printf("Cursor image %ux%u doesn't fit the atlas\n", width, height);
+    return false;
+  }
+
+  shm_swapchain *atlas = &state->cursor_atlas;
+  if (atlas->data == 0) {
+    // Never resized and a few hundred KB, so no prefault or huge pages.
+    if (!shm_swapchain_allocate(atlas, CURSOR_ATLAS_WIDTH, CURSOR_ATLAS_HEIGHT,
+                                CURSOR_ATLAS_WIDTH * COLOR_CHANNELS, PIXEL_FORMAT_ARGB8888, 1,
+                                SHM_SWAPCHAIN_SEAL)) {
+      printf("Failed to allocate the cursor atlas\n");
+      return false;
+    }
+    atlas->pool_handle = wayland_wl_shm_create_pool(state, atlas);
+  }
+
+  if (state->cursor_atlas_rows_used + height > CURSOR_ATLAS_HEIGHT) {
+    wayland_cursor_atlas_reset(state);
+  }
+
+  uint32_t offset = state->cursor_atlas_rows_used * atlas->stride;
+  for (uint32_t Row = 0; Row < height; Row++) {
+    memcpy(atlas->data + offset + Row * atlas->stride, pixels + Row * width, width * sizeof(uint32_t));
+  }
+  state->cursor_atlas_rows_used += height;
+
+  if (cursor->buffer_id != 0) {
+    wayland_wl_buffer_destroy(state, cursor->buffer_id);
+  }
+  cursor->buffer_id = wayland_wl_shm_pool_create_buffer_at(state, atlas->pool_handle, offset, width, height,
+                                                           atlas->stride, wayland_shm_format(PIXEL_FORMAT_ARGB8888));
+
+  if (cursor->surface_id == 0) {
+    cursor->surface_id = wayland_wl_compositor_create_surface(state);
+  }
+
+  // An image the scale doesn't divide has to go out at scale 1, a bit
+  // bigger than it should be.
+  int32_t buffer_scale = (width % scale == 0 && height % scale == 0) ? scale : 1;
+  wayland_wl_surface_set_buffer_scale(state, cursor->surface_id, buffer_scale);
+  wayland_wl_surface_attach(state, cursor->surface_id, cursor->buffer_id);
+  wayland_wl_surface_damage(state, cursor->surface_id, 0, 0, width / buffer_scale, height / buffer_scale);
+  wayland_wl_surface_commit(state, cursor->surface_id);
+
+  cursor->scale = scale;
+  cursor->hot_x = hot_x / buffer_scale;
+  cursor->hot_y = hot_y / buffer_scale;
+
+  wayland_log(state, "Cursor uploaded %ux%u at scale %d, hotspot %d,%d\n", width, height, buffer_scale, cursor->hot_x, cursor->hot_y);
+  return true;
+}
+
+// The cached surface for a shape, 0 when the theme doesn't have it.
+static wayland_cursor *wayland_cursor_get(wayland_windowState *state, cursor_shape shape) {
+  wayland_cursor *cursor = &state->cursors[shape];
+
+  if (!cursor->tried) {
+    cursor->tried = true;
+
+    if (state->cursor_size == 0) {
+      const char *size = getenv("XCURSOR_SIZE");
+      state->cursor_size = size ? (uint32_t)atoi(size) : 0;
+      if (state->cursor_size == 0 || state->cursor_size > CURSOR_ATLAS_WIDTH) {
+        state->cursor_size = DEFAULT_CURSOR_SIZE;
+      }
+    }
+
+    const char *theme = getenv("XCURSOR_THEME");
+    if (!theme || !theme[0]) theme = "default";
+    const char *search_path = getenv("XCURSOR_PATH");
+    if (!search_path || !search_path[0]) {
+      search_path = "~/.local/share/icons:~/.icons:/usr/share/icons:/usr/share/pixmaps";
+    }
+
+    for (uint32_t Index = 0; Index < 4 && cursor_names[shape].names[Index]; Index++) {
+      if (wayland_cursor_find(search_path, theme, cursor_names[shape].names[Index], 0, cursor)) {
+        break;
+      }
+    }
+  }
+
+  if (!cursor->file) {
+    return 0;
+  }
+
+  int32_t scale = wayland_integer_buffer_scale(state);
+  if (scale < 1) scale = 1;
+
+  if (cursor->buffer_id == 0 || cursor->scale != scale) {
+    if (!wayland_cursor_upload(state, cursor, scale)) {
+      return 0;
+    }
+  }
+
+  return cursor;
+}
+
+static void wayland_cursor_apply(wayland_windowState *state) {
+  if (!state->pointer_inside || state->wl_pointer_id == 0) {
+    return;
+  }
+
+  cursor_shape shape = state->current_cursor;
+
+  if (shape == CURSOR_HIDDEN) {
+    wayland_wl_pointer_set_cursor(state, state->pointer_serial, 0, 0, 0);
+    return;
+  }
+
+  if (state->wp_cursor_shape_device_id != 0) {
+    wayland_wp_cursor_shape_device_set_shape(state, state->pointer_serial, cursor_names[shape].wp_shape);
+    return;
+  }
+
+  wayland_cursor *cursor = wayland_cursor_get(state, shape);
+  if (!cursor && shape != CURSOR_DEFAULT) {
+    cursor = wayland_cursor_get(state, CURSOR_DEFAULT);
+  }
+
+  // No theme at all, whatever the compositor shows is better than nothing.
+  if (!cursor) {
+    return;
+  }
+
+  wayland_wl_pointer_set_cursor(state, state->pointer_serial, cursor->surface_id, cursor->hot_x, cursor->hot_y);
+}
+
+void wayland_cursor_pointer_enter(wayland_windowState *state, uint32_t serial) {
+  state->pointer_serial = serial;
+  state->pointer_inside = true;
+  wayland_cursor_apply(state);
+}
+
+void wayland_apply_cursor_shape(wayland_windowState *state, cursor_shape shape) {
+  if (shape >= CURSOR_SHAPE_COUNT || shape == state->current_cursor) {
+    return;
+  }
+
+  state->current_cursor = shape;
+  wayland_cursor_apply(state);
+}
+
+// The protocol objects go with the connection.
+void wayland_cursor_shutdown(wayland_windowState *state) {
+  for (uint32_t Index = 0; Index < CURSOR_SHAPE_COUNT; Index++) {
+    wayland_cursor *cursor = &state->cursors[Index];
+    if (cursor->file) {
+      munmap(cursor->file, cursor->file_size);
+      cursor->file = 0;
+    }
+  }
+
+  if (state->cursor_atlas.data) {
+    shm_swapchain_free(&state->cursor_atlas);
+  }
+}
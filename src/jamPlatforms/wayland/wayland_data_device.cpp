@@ -0,0 +1,1008 @@
+#include "wayland_client.h"
+
+#include "../../platform.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+// Clipboard and drag and drop through wl_data_device. The data itself
+// never goes through the socket, the sending client writes it into a pipe
+// we hand over with wl_data_offer.receive (and the other way around for
+// wl_data_source.send). Both ends of that are event loop sources on the
+// I/O thread, moving at most WAYLAND_TRANSFER_CHUNK per wakeup:
+//
+//   pipe -> file: splice, the pages move from the pipe to the page cache.
+//   pipe -> memory: read straight into the destination.
+//   memory -> pipe: vmsplice out of our own copy, the pipe just references its pages.
+//   file -> pipe: splice again, sendfile when the file can't.
+//
+// Offers stay I/O thread state, what the game thread gets to see of them
+// is the data_offer_info snapshot published under data_lock.
+
+// Wayland strings count their terminator and are padded to 4 bytes,
+// buf_write_string copies the padding from the source too.
+static uint32_t wayland_mime_type_length(const char *mime_type) {
+  return (uint32_t)strnlen(mime_type, DATA_MIME_TYPE_SIZE - 1) + 1;
+}
+
+static void wayland_write_mime_type(wayland_windowState *windowState, const char *mime_type) {
+  char padded[DATA_MIME_TYPE_SIZE + 4] = "";
+  uint32_t length = wayland_mime_type_length(mime_type);
+  memcpy(padded, mime_type, length - 1);
+  buf_write_string(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, padded, length);
+}
+
+int wayland_wl_data_device_manager_get_data_device(wayland_windowState *windowState) {
+  assert(windowState->wl_data_device_manager_id > 0 && windowState->wl_seat_id > 0);
+
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // New ID.
+  ++windowState->current_obj_id;
+  uint32_t new_id = windowState->current_obj_id;
+
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(new_id) + sizeof(windowState->wl_seat_id);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_data_device_manager_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_data_device_manager.GET_DATA_DEVICE);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, new_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_seat_id);
+
+  SendMessage(windowState);
+
+  wayland_log(windowState, "-> wl_data_device_manager@%u.get_data_device: wl_data_device=%u\n",
+              windowState->wl_data_device_manager_id, new_id);
+
+  return new_id;
+}
+
+int wayland_wl_data_device_manager_create_data_source(wayland_windowState *windowState) {
+  assert(windowState->wl_data_device_manager_id > 0);
+
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // New ID.
+  ++windowState->current_obj_id;
+  uint32_t new_id = windowState->current_obj_id;
+
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(new_id);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_data_device_manager_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_data_device_manager.CREATE_DATA_SOURCE);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, new_id);
+
+  SendMessage(windowState);
+
+  return new_id;
+}
+
+// source_id 0 clears the selection.
+void wayland_wl_data_device_set_selection(wayland_windowState *windowState, uint32_t source_id, uint32_t serial) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(source_id) + sizeof(serial);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->wl_data_device_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_data_device.SET_SELECTION);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, source_id);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, serial);
+
+  SendMessage(windowState);
+}
+
+// mime_type 0 tells the source nothing here takes it.
+void wayland_wl_data_offer_accept(wayland_windowState *windowState, uint32_t offer_id, uint32_t serial, const char *mime_type) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // Sizing
+  uint32_t mime_type_length = mime_type ? wayland_mime_type_length(mime_type) : 0;
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(serial) + sizeof(mime_type_length) + roundup_4(mime_type_length);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, offer_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_data_offer.ACCEPT);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, serial);
+  if (mime_type) {
+    wayland_write_mime_type(windowState, mime_type);
+  } else {
+    buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, 0);
+  }
+
+  SendMessage(windowState);
+}
+
+// The fd is the write end of a pipe, the source writes the data into it
+// and closes it when it's done.
+void wayland_wl_data_offer_receive(wayland_windowState *windowState, uint32_t offer_id, const char *mime_type, int fd) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // Sizing
+  uint32_t mime_type_length = wayland_mime_type_length(mime_type);
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(mime_type_length) + roundup_4(mime_type_length);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, offer_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_data_offer.RECEIVE);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args, the fd goes as ancillary data.
+  wayland_write_mime_type(windowState, mime_type);
+
+  wayland_queue_fd(windowState, fd);
+  SendMessage(windowState);
+
+  wayland_log(windowState, "-> wl_data_offer@%u.receive: %s\n", offer_id, mime_type);
+}
+
+void wayland_wl_data_offer_set_actions(wayland_windowState *windowState, uint32_t offer_id,
+                                       uint32_t actions, uint32_t preferred_action) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // Sizing
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(actions) + sizeof(preferred_action);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, offer_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_data_offer.SET_ACTIONS);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, actions);
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, preferred_action);
+
+  SendMessage(windowState);
+}
+
+void wayland_wl_data_source_offer(wayland_windowState *windowState, uint32_t source_id, const char *mime_type) {
+  ClearMessageBuffer(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE);
+  // Make sure it is cleared.
+  assert(windowState->message_pos == 0);
+
+  // Sizing
+  uint32_t mime_type_length = wayland_mime_type_length(mime_type);
+  uint16_t msg_announced_size = WAYLAND_HEADER_SIZE + sizeof(mime_type_length) + roundup_4(mime_type_length);
+  assert(roundup_4(msg_announced_size) == msg_announced_size);
+
+  // Header
+  buf_write_u32(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, source_id);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, windowState->opcodes.wl_data_source.OFFER);
+  buf_write_u16(windowState->message, &windowState->message_pos, MAX_MESSAGE_SIZE, msg_announced_size);
+
+  // Args
+  wayland_write_mime_type(windowState, mime_type);
+
+  SendMessage(windowState);
+}
+
+// fds arrive with the bytes, not with the message they belong to, so they
+// wait here in order until the event that carries one is parsed.
+void wayland_keep_fds(wayland_windowState *state, int *fds, uint32_t fd_count) {
+  for (uint32_t Index = 0; Index < fd_count; Index++) {
+    if (state->incoming_fd_count < MAX_INCOMING_FDS) {
+      state->incoming_fds[state->incoming_fd_count++] = fds[Index];
+    } else {
+      printf("Too many fds from the compositor, dropping one\n");
+      close(fds[Index]);
+    }
+  }
+}
+
+int wayland_take_fd(wayland_windowState *state) {
+  if (state->incoming_fd_count == 0) {
+    printf("Expected an fd from the compositor, there's none\n");
+    return -1;
+  }
+
+  int fd = state->incoming_fds[0];
+  state->incoming_fd_count--;
+  memmove(state->incoming_fds, state->incoming_fds + 1, state->incoming_fd_count * sizeof(int));
+  return fd;
+}
+
+static wayland_data_offer *wayland_find_data_offer(wayland_windowState *state, uint32_t id) {
+  if (id == 0) {
+    return 0;
+  }
+
+  for (uint32_t Index = 0; Index < MAX_DATA_OFFERS; Index++) {
+    if (state->data_offers[Index].id == id) {
+      return &state->data_offers[Index];
+    }
+  }
+
+  return 0;
+}
+
+static bool wayland_offer_has_mime_type(wayland_data_offer *offer, const char *mime_type) {
+  for (uint32_t Index = 0; Index < offer->mime_count; Index++) {
+    if (strcmp(offer->mime_types[Index], mime_type) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Copies the offer (or nothing) into what the game thread reads.
+static void wayland_publish_offer(wayland_windowState *state, data_offer_info *info, wayland_data_offer *offer,
+                                  float x, float y) {
+  pthread_mutex_lock(&state->data_lock);
+
+  if (offer) {
+    info->serial = ++state->data_offer_serial;
+    info->mime_count = offer->mime_count;
+    memcpy(info->mime_types, offer->mime_types, sizeof(info->mime_types));
+  } else {
+    info->serial = 0;
+    info->mime_count = 0;
+  }
+  info->x = x;
+  info->y = y;
+
+  pthread_mutex_unlock(&state->data_lock);
+}
+
+// Transfers already streaming from it keep going, the pipe is theirs.
+static void wayland_destroy_data_offer(wayland_windowState *state, uint32_t id) {
+  wayland_data_offer *offer = wayland_find_data_offer(state, id);
+  if (!offer) {
+    return;
+  }
+
+  wayland_send_no_args(state, offer->id, state->opcodes.wl_data_offer.DESTROY);
+  memset(offer, 0, sizeof(*offer));
+}
+
+// A drop is done with once everything asked of it has been received.
+static void wayland_finish_drop(wayland_windowState *state) {
+  wayland_data_offer *offer = wayland_find_data_offer(state, state->drop_offer_id);
+  if (!offer || offer->transfers > 0) {
+    return;
+  }
+
+  if (state->wl_data_device_manager_version >= 3) {
+    wayland_send_no_args(state, offer->id, state->opcodes.wl_data_offer.FINISH);
+  }
+  wayland_destroy_data_offer(state, offer->id);
+  state->drop_offer_id = 0;
+
+  wayland_publish_offer(state, &state->drop_info, 0, 0, 0);
+}
+
+// Made on the game thread, so the app's memory is free to go as soon as
+// set_clipboard_data returns. Its own mapping, not the heap, so the pages
+// are never handed out again while a pipe still points at them.
+static wayland_clipboard_copy *wayland_clipboard_copy_make(const uint8_t *data, uint64_t size) {
+  wayland_clipboard_copy *copy = (wayland_clipboard_copy *)calloc(1, sizeof(wayland_clipboard_copy));
+  if (!copy) {
+    return 0;
+  }
+
+  if (size > 0) {
+    void *pages = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED) {
+      free(copy);
+      return 0;
+    }
+    memcpy(pages, data, size);
+    copy->data = (uint8_t *)pages;
+    copy->map_size = size;
+  }
+
+  copy->size = size;
+  copy->refs = 1;
+  return copy;
+}
+
+static void wayland_clipboard_copy_release(wayland_clipboard_copy *copy) {
+  if (!copy || --copy->refs > 0) {
+    return;
+  }
+
+  if (copy->data) {
+    munmap(copy->data, copy->map_size);
+  }
+  free(copy);
+}
+
+// Drops our end of the selection, sends of it hold their own.
+static void wayland_data_selection_free(wayland_data_selection *selection) {
+  if (selection->fd >= 0) {
+    close(selection->fd);
+  }
+  wayland_clipboard_copy_release(selection->copy);
+
+  memset(selection, 0, sizeof(*selection));
+  selection->fd = -1;
+}
+
+static void wayland_data_send_done(wayland_data_send *send) {
+  wayland_windowState *state = send->state;
+
+  event_loop_remove(&state->loop, send->source);
+  close(send->pipe_fd);
+  if (send->file_fd >= 0) {
+    close(send->file_fd);
+  }
+  wayland_clipboard_copy_release(send->copy);
+
+  wayland_log(state, "Sent %llu of %llu bytes from the selection\n",
+         (unsigned long long)send->sent, (unsigned long long)send->size);
+  memset(send, 0, sizeof(*send));
+}
+
+static void wayland_on_send_writable(void *user) {
+  wayland_data_send *send = (wayland_data_send *)user;
+  uint64_t budget = WAYLAND_TRANSFER_CHUNK;
+
+  while (send->sent < send->size && budget > 0) {
+    uint64_t left = send->size - send->sent;
+    if (left > budget) left = budget;
+
+    int64_t moved = 0;
+    if (send->file_fd >= 0) {
+      loff_t offset = (loff_t)(send->offset + send->sent);
+      moved = splice(send->file_fd, &offset, send->pipe_fd, 0, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (moved < 0 && errno == EINVAL) {
+        off_t file_offset = (off_t)(send->offset + send->sent);
+        moved = sendfile(send->pipe_fd, send->file_fd, &file_offset, left);
+      }
+    } else {
+      // Only references to the copy's pages go into the pipe, fine since
+      // nothing writes them again.
+      uint8_t *data = send->copy->data + send->sent;
+      struct iovec io = {.iov_base = data, .iov_len = left};
+      moved = vmsplice(send->pipe_fd, &io, 1, SPLICE_F_NONBLOCK);
+      if (moved < 0 && (errno == EBADF || errno == EINVAL)) {
+        // Not a pipe after all.
+        moved = write(send->pipe_fd, data, left);
+      }
+    }
+
+    if (moved < 0) {
+      if (errno == EAGAIN) return;
+      if (errno == EINTR) continue;
+
+      // EPIPE when the reader gave up, the I/O thread has SIGPIPE blocked.
+      printf("Sending the selection failed: %s\n", strerror(errno));
+      break;
+    }
+
+    if (moved == 0) {
+      break; // The file is shorter than it was said to be.
+    }
+
+    send->sent += (uint64_t)moved;
+    budget -= (uint64_t)moved;
+  }
+
+  if (budget == 0 && send->sent < send->size) {
+    return;
+  }
+
+  wayland_data_send_done(send);
+}
+
+static void wayland_data_start_send(wayland_windowState *state, const char *mime_type, int fd) {
+  wayland_data_selection *selection = &state->selection;
+
+  bool offered = false;
+  for (uint32_t Index = 0; Index < selection->mime_count; Index++) {
+    offered |= strcmp(selection->mime_types[Index], mime_type) == 0;
+  }
+
+  wayland_data_send *send = 0;
+  for (uint32_t Index = 0; Index < MAX_DATA_SENDS; Index++) {
+    if (!state->sends[Index].active) {
+      send = &state->sends[Index];
+      break;
+    }
+  }
+
+  // Closing it right away is how the other side hears there's nothing.
+  if (!offered || !send) {
+    printf("Nothing to send for %s\n", mime_type);
+    close(fd);
+    return;
+  }
+
+  memset(send, 0, sizeof(*send));
+  send->state = state;
+  send->file_fd = -1;
+  send->offset = selection->offset;
+  send->size = selection->size;
+  send->pipe_fd = fd;
+
+  if (selection->fd >= 0) {
+    send->file_fd = fcntl(selection->fd, F_DUPFD_CLOEXEC, 0);
+    if (send->file_fd < 0) {
+      close(fd);
+      return;
+    }
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  send->source = event_loop_add_writable(&state->loop, fd, wayland_on_send_writable, send);
+  if (send->source < 0) {
+    if (send->file_fd >= 0) close(send->file_fd);
+    close(fd);
+    return;
+  }
+
+  // Outlives the selection if it's replaced mid paste.
+  send->copy = selection->copy;
+  if (send->copy) {
+    send->copy->refs++;
+  }
+  send->active = true;
+}
+
+// Events for wl_data_device, wl_data_offer and wl_data_source objects.
+// Returns false when object_id is none of those.
+bool wayland_data_device_event(wayland_windowState *state, uint32_t object_id, uint16_t opcode,
+                               uint16_t announced_size, char **msg, uint64_t *msg_len) {
+  uint32_t bytes_to_read_out = announced_size - WAYLAND_HEADER_SIZE;
+
+  if (object_id != 0 && object_id == state->wl_data_device_id) {
+    wayland_log(state, "Event recieved from wl_data_device ");
+    switch (opcode) {
+      case WL_DATA_DEVICE::DATA_OFFER: {
+        uint32_t id = buf_read_u32(msg, msg_len);
+        wayland_log(state, "data_offer wl_data_offer@%u\n", id);
+
+        wayland_data_offer *offer = 0;
+        for (uint32_t Index = 0; Index < MAX_DATA_OFFERS && !offer; Index++) {
+          if (state->data_offers[Index].id == 0) {
+            offer = &state->data_offers[Index];
+          }
+        }
+
+        if (!offer) {
+          printf("Out of data offer slots, ignoring wl_data_offer@%u\n", id);
+          wayland_send_no_args(state, id, state->opcodes.wl_data_offer.DESTROY);
+          break;
+        }
+
+        memset(offer, 0, sizeof(*offer));
+        offer->id = id;
+      } break;
+
+      case WL_DATA_DEVICE::ENTER: {
+        uint32_t serial = buf_read_u32(msg, msg_len);
+        buf_read_u32(msg, msg_len); // surface
+        int32_t x = buf_read_s32(msg, msg_len);
+        int32_t y = buf_read_s32(msg, msg_len);
+        uint32_t id = buf_read_u32(msg, msg_len);
+        wayland_log(state, "enter wl_data_offer@%u\n", id);
+
+        if (state->drag_offer_id != state->drop_offer_id) {
+          wayland_destroy_data_offer(state, state->drag_offer_id);
+        }
+
+        state->drag_offer_id = id;
+        state->drag_serial = serial;
+        state->input_serial = serial;
+        state->drag_x = x / 256.0f;
+        state->drag_y = y / 256.0f;
+
+        // Anything the game might want, which one gets decided after the drop.
+        wayland_data_offer *offer = wayland_find_data_offer(state, id);
+        if (offer) {
+          wayland_wl_data_offer_accept(state, id, serial, offer->mime_count ? offer->mime_types[0] : 0);
+          if (state->wl_data_device_manager_version >= 3) {
+            uint32_t copy = WL_DATA_DEVICE_MANAGER::ACTION_COPY;
+            wayland_wl_data_offer_set_actions(state, id, copy, copy);
+          }
+        }
+      } break;
+
+      case WL_DATA_DEVICE::LEAVE: {
+        wayland_log(state, "leave\n");
+        if (state->drag_offer_id != state->drop_offer_id) {
+          wayland_destroy_data_offer(state, state->drag_offer_id);
+        }
+        state->drag_offer_id = 0;
+      } break;
+
+      case WL_DATA_DEVICE::MOTION: {
+        buf_read_u32(msg, msg_len); // time
+        state->drag_x = buf_read_s32(msg, msg_len) / 256.0f;
+        state->drag_y = buf_read_s32(msg, msg_len) / 256.0f;
+      } break;
+
+      case WL_DATA_DEVICE::DROP: {
+        wayland_log(state, "drop wl_data_offer@%u\n", state->drag_offer_id);
+        wayland_data_offer *offer = wayland_find_data_offer(state, state->drag_offer_id);
+        if (!offer) {
+          break;
+        }
+
+        // A previous drop nobody received from is dropped for this one.
+        if (state->drop_offer_id != 0 && state->drop_offer_id != offer->id) {
+          wayland_destroy_data_offer(state, state->drop_offer_id);
+        }
+
+        state->drop_offer_id = offer->id;
+        wayland_publish_offer(state, &state->drop_info, offer, state->drag_x, state->drag_y);
+        wayland_wake(state);
+      } break;
+
+      case WL_DATA_DEVICE::SELECTION: {
+        uint32_t id = buf_read_u32(msg, msg_len);
+        wayland_log(state, "selection wl_data_offer@%u\n", id);
+
+        if (state->selection_offer_id != id) {
+          wayland_destroy_data_offer(state, state->selection_offer_id);
+        }
+
+        state->selection_offer_id = id;
+        wayland_publish_offer(state, &state->clipboard_info, wayland_find_data_offer(state, id), 0, 0);
+      } break;
+
+      default: {
+        unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
+      } break;
+    }
+
+    return true;
+  }
+
+  if (wayland_data_offer *offer = wayland_find_data_offer(state, object_id)) {
+    wayland_log(state, "Event recieved from wl_data_offer ");
+    if (state->opcodes.wl_data_offer.OFFER == opcode) {
+      char mime_type[DATA_MIME_TYPE_SIZE] = "";
+      buf_read_string(msg, msg_len, mime_type, sizeof(mime_type));
+      wayland_log(state, "offer %s\n", mime_type);
+
+      if (offer->mime_count < DATA_MAX_MIME_TYPES) {
+        memcpy(offer->mime_types[offer->mime_count++], mime_type, sizeof(mime_type));
+      }
+    } else {
+      // source_actions and action, we only ever copy.
+      unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
+    }
+
+    return true;
+  }
+
+  if (object_id != 0 &&
+      (object_id == state->data_source_id || object_id == state->retired_data_source_id)) {
+    wayland_log(state, "Event recieved from wl_data_source ");
+    if (state->opcodes.wl_data_source.SEND == opcode) {
+      char mime_type[DATA_MIME_TYPE_SIZE] = "";
+      buf_read_string(msg, msg_len, mime_type, sizeof(mime_type));
+      int fd = wayland_take_fd(state);
+      wayland_log(state, "send %s\n", mime_type);
+
+      if (fd >= 0) {
+        if (object_id == state->data_source_id) {
+          wayland_data_start_send(state, mime_type, fd);
+        } else {
+          close(fd);
+        }
+      }
+    } else if (state->opcodes.wl_data_source.CANCELLED == opcode) {
+      // Someone else owns the clipboard now.
+      wayland_log(state, "cancelled\n");
+      wayland_send_no_args(state, object_id, state->opcodes.wl_data_source.DESTROY);
+      if (object_id == state->data_source_id) {
+        state->data_source_id = 0;
+        wayland_data_selection_free(&state->selection);
+      } else {
+        state->retired_data_source_id = 0;
+      }
+    } else {
+      unhandled_opcode(state, bytes_to_read_out, msg, msg_len, opcode, announced_size, object_id);
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+static void wayland_data_transfer_done(wayland_data_transfer *transfer, data_transfer_status status) {
+  wayland_windowState *state = transfer->state;
+
+  event_loop_remove(&state->loop, transfer->source);
+  close(transfer->pipe_fd);
+  transfer->pipe_fd = -1;
+
+  wayland_data_offer *offer = wayland_find_data_offer(state, transfer->offer_id);
+  if (offer && offer->transfers > 0) {
+    offer->transfers--;
+  }
+  if (transfer->offer_id == state->drop_offer_id) {
+    wayland_finish_drop(state);
+  }
+
+  wayland_log(state, "Received %llu bytes of %s\n", (unsigned long long)transfer->bytes, transfer->mime_type);
+  __atomic_store_n(&transfer->status, (int32_t)status, __ATOMIC_RELEASE);
+}
+
+static void wayland_on_transfer_readable(void *user) {
+  wayland_data_transfer *transfer = (wayland_data_transfer *)user;
+  uint64_t budget = WAYLAND_TRANSFER_CHUNK;
+  uint64_t bytes = transfer->bytes;
+
+  for (;;) {
+    int64_t moved = 0;
+
+    if (transfer->fd >= 0) {
+      loff_t offset = (loff_t)(transfer->offset + bytes);
+      moved = splice(transfer->pipe_fd, 0, transfer->fd, &offset, budget, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+      if (moved < 0 && errno == EINVAL) {
+        // Files opened for appending and some filesystems can't be spliced
+        // into, those go through a small bounce buffer.
+        char bounce[16384];
+        moved = read(transfer->pipe_fd, bounce, sizeof(bounce) < budget ? sizeof(bounce) : budget);
+        if (moved > 0 && pwrite(transfer->fd, bounce, (size_t)moved, (off_t)(transfer->offset + bytes)) != moved) {
+          moved = -1;
+          errno = EIO;
+        }
+      }
+    } else if (bytes < transfer->capacity) {
+      uint64_t left = transfer->capacity - bytes;
+      moved = read(transfer->pipe_fd, transfer->dst + bytes, left < budget ? left : budget);
+    } else {
+      // Full, one byte more tells a sender that's done from one that isn't.
+      uint8_t probe;
+      moved = read(transfer->pipe_fd, &probe, 1);
+      if (moved > 0) {
+        wayland_data_transfer_done(transfer, DATA_TRANSFER_TRUNCATED);
+        return;
+      }
+    }
+
+    if (moved < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) break;
+
+      printf("Receiving %s failed: %s\n", transfer->mime_type, strerror(errno));
+      wayland_data_transfer_done(transfer, DATA_TRANSFER_FAILED);
+      return;
+    }
+
+    if (moved == 0) {
+      wayland_data_transfer_done(transfer, DATA_TRANSFER_DONE);
+      return;
+    }
+
+    bytes += (uint64_t)moved;
+    __atomic_store_n(&transfer->bytes, bytes, __ATOMIC_RELAXED);
+
+    budget -= (uint64_t)moved;
+    if (budget == 0) {
+      break; // The rest comes with the next wakeup.
+    }
+  }
+}
+
+// I/O thread, WAYLAND_COMMAND_RECEIVE.
+void wayland_data_start_receive(wayland_windowState *state, uint32_t transfer_index) {
+  wayland_data_transfer *transfer = &state->transfers[transfer_index];
+  if (__atomic_load_n(&transfer->status, __ATOMIC_ACQUIRE) != DATA_TRANSFER_QUEUED) {
+    return;
+  }
+
+  // The game thread asked for the offer it last saw, which might be gone by now.
+  bool clipboard = transfer->kind == DATA_OFFER_CLIPBOARD;
+  data_offer_info *info = clipboard ? &state->clipboard_info : &state->drop_info;
+  uint32_t offer_id = clipboard ? state->selection_offer_id : state->drop_offer_id;
+  wayland_data_offer *offer = wayland_find_data_offer(state, offer_id);
+
+  if (!offer || info->serial != transfer->serial || !wayland_offer_has_mime_type(offer, transfer->mime_type)) {
+    printf("The offer for %s is gone\n", transfer->mime_type);
+    __atomic_store_n(&transfer->status, (int32_t)DATA_TRANSFER_FAILED, __ATOMIC_RELEASE);
+    return;
+  }
+
+  // Only our end is non-blocking, the sender gets a plain pipe.
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0 || fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0) {
+    printf("Failed to create a pipe for %s\n", transfer->mime_type);
+    __atomic_store_n(&transfer->status, (int32_t)DATA_TRANSFER_FAILED, __ATOMIC_RELEASE);
+    return;
+  }
+
+  // Bigger pipes mean fewer wakeups for big pastes, it's fine if the
+  // limit says no.
+  fcntl(fds[0], F_SETPIPE_SZ, 1 << 20);
+
+  transfer->state = state;
+  transfer->offer_id = offer->id;
+  transfer->pipe_fd = fds[0];
+  transfer->source = event_loop_add_readable(&state->loop, fds[0], wayland_on_transfer_readable, transfer);
+  if (transfer->source < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    __atomic_store_n(&transfer->status, (int32_t)DATA_TRANSFER_FAILED, __ATOMIC_RELEASE);
+    return;
+  }
+
+  // Our copy of the write end has to go, or the read end never sees EOF.
+  wayland_wl_data_offer_receive(state, offer->id, transfer->mime_type, fds[1]);
+  close(fds[1]);
+
+  offer->transfers++;
+  __atomic_store_n(&transfer->status, (int32_t)DATA_TRANSFER_ACTIVE, __ATOMIC_RELEASE);
+}
+
+// I/O thread, WAYLAND_COMMAND_CANCEL_TRANSFER. Commands are handled in
+// order, so the receive already ran. The game thread is waiting in
+// release_data_transfer until the destination is let go of.
+void wayland_data_cancel_transfer(wayland_windowState *state, uint32_t transfer_index) {
+  wayland_data_transfer *transfer = &state->transfers[transfer_index];
+
+  if (__atomic_load_n(&transfer->status, __ATOMIC_ACQUIRE) == DATA_TRANSFER_ACTIVE) {
+    wayland_data_transfer_done(transfer, DATA_TRANSFER_FAILED);
+  }
+
+  pthread_mutex_lock(&state->data_lock);
+  __atomic_store_n(&transfer->status, (int32_t)DATA_TRANSFER_FREE, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&state->transfer_freed);
+  pthread_mutex_unlock(&state->data_lock);
+}
+
+// I/O thread, WAYLAND_COMMAND_SET_SELECTION.
+void wayland_data_apply_selection(wayland_windowState *state) {
+  pthread_mutex_lock(&state->data_lock);
+  if (!state->pending_selection_set) {
+    // Taken by an earlier command already.
+    pthread_mutex_unlock(&state->data_lock);
+    return;
+  }
+
+  wayland_data_selection selection = state->pending_selection;
+  state->pending_selection_set = false;
+  state->pending_selection.fd = -1;
+  state->pending_selection.copy = 0;
+  pthread_mutex_unlock(&state->data_lock);
+
+  // Sends that already started hold their own reference to the copy or
+  // their own dup of the file.
+  wayland_data_selection_free(&state->selection);
+  state->selection = selection;
+
+  if (state->wl_data_device_id == 0) {
+    printf("The compositor has no wl_data_device_manager, no clipboard\n");
+    return;
+  }
+
+  uint32_t old_source_id = state->data_source_id;
+  if (old_source_id != 0) {
+    wayland_send_no_args(state, old_source_id, state->opcodes.wl_data_source.DESTROY);
+    state->retired_data_source_id = old_source_id;
+    state->data_source_id = 0;
+  }
+
+  if (selection.mime_count == 0) {
+    if (old_source_id != 0) {
+      wayland_wl_data_device_set_selection(state, 0, state->input_serial);
+    }
+    return;
+  }
+
+  state->data_source_id = wayland_wl_data_device_manager_create_data_source(state);
+  for (uint32_t Index = 0; Index < selection.mime_count; Index++) {
+    wayland_wl_data_source_offer(state, state->data_source_id, selection.mime_types[Index]);
+  }
+  wayland_wl_data_device_set_selection(state, state->data_source_id, state->input_serial);
+}
+
+// End of wayland_run, the event loop goes away with it.
+void wayland_data_device_shutdown(wayland_windowState *state) {
+  for (uint32_t Index = 0; Index < MAX_DATA_TRANSFERS; Index++) {
+    wayland_data_transfer *transfer = &state->transfers[Index];
+    if (__atomic_load_n(&transfer->status, __ATOMIC_ACQUIRE) == DATA_TRANSFER_ACTIVE) {
+      wayland_data_transfer_done(transfer, DATA_TRANSFER_FAILED);
+    }
+  }
+
+  for (uint32_t Index = 0; Index < MAX_DATA_SENDS; Index++) {
+    if (state->sends[Index].active) {
+      wayland_data_send_done(&state->sends[Index]);
+    }
+  }
+
+  for (uint32_t Index = 0; Index < state->incoming_fd_count; Index++) {
+    close(state->incoming_fds[Index]);
+  }
+  state->incoming_fd_count = 0;
+
+  wayland_data_selection_free(&state->selection);
+
+  // Nothing writes into a destination from here on, and nothing will
+  // answer a cancel.
+  pthread_mutex_lock(&state->data_lock);
+  state->data_shutdown = true;
+  if (state->pending_selection_set) {
+    wayland_data_selection_free(&state->pending_selection);
+    state->pending_selection_set = false;
+  }
+  pthread_cond_broadcast(&state->transfer_freed);
+  pthread_mutex_unlock(&state->data_lock);
+}
+
+// Game thread from here on.
+
+bool wayland_get_data_offer(wayland_windowState *state, data_offer_kind kind, data_offer_info *info) {
+  memset(info, 0, sizeof(*info));
+  if (!state->threaded) {
+    return false;
+  }
+
+  pthread_mutex_lock(&state->data_lock);
+  *info = kind == DATA_OFFER_CLIPBOARD ? state->clipboard_info : state->drop_info;
+  pthread_mutex_unlock(&state->data_lock);
+
+  return info->serial != 0;
+}
+
+// fd >= 0 splices into it at offset, otherwise it's read into dst.
+int32_t wayland_receive_data(wayland_windowState *state, data_offer_kind kind, uint32_t serial,
+                             const char *mime_type, int fd, uint64_t offset, uint8_t *dst, uint64_t capacity) {
+  if (!state->threaded || !mime_type || (fd < 0 && !dst)) {
+    return -1;
+  }
+
+  // Only this thread takes free slots, the I/O thread only ever frees them.
+  for (uint32_t Index = 0; Index < MAX_DATA_TRANSFERS; Index++) {
+    wayland_data_transfer *transfer = &state->transfers[Index];
+    if (__atomic_load_n(&transfer->status, __ATOMIC_ACQUIRE) != DATA_TRANSFER_FREE) {
+      continue;
+    }
+
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->kind = kind;
+    transfer->serial = serial;
+    strncpy(transfer->mime_type, mime_type, sizeof(transfer->mime_type) - 1);
+    transfer->fd = fd;
+    transfer->offset = offset;
+    transfer->dst = dst;
+    transfer->capacity = capacity;
+    transfer->pipe_fd = -1;
+    transfer->source = -1;
+    __atomic_store_n(&transfer->status, (int32_t)DATA_TRANSFER_QUEUED, __ATOMIC_RELEASE);
+
+    wayland_send_command(state, WAYLAND_COMMAND_RECEIVE, Index);
+    return (int32_t)Index;
+  }
+
+  printf("Too many data transfers at once\n");
+  return -1;
+}
+
+data_transfer_status wayland_get_data_transfer(wayland_windowState *state, int32_t transfer, uint64_t *bytes) {
+  if (transfer < 0 || transfer >= MAX_DATA_TRANSFERS) {
+    return DATA_TRANSFER_FAILED;
+  }
+
+  wayland_data_transfer *slot = &state->transfers[transfer];
+  data_transfer_status status = (data_transfer_status)__atomic_load_n(&slot->status, __ATOMIC_ACQUIRE);
+  if (bytes) {
+    *bytes = __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED);
+  }
+
+  return status;
+}
+
+void wayland_release_data_transfer(wayland_windowState *state, int32_t transfer) {
+  if (transfer < 0 || transfer >= MAX_DATA_TRANSFERS) {
+    return;
+  }
+
+  wayland_data_transfer *slot = &state->transfers[transfer];
+  int32_t status = __atomic_load_n(&slot->status, __ATOMIC_ACQUIRE);
+
+  if (status == DATA_TRANSFER_QUEUED || status == DATA_TRANSFER_ACTIVE) {
+    // The I/O thread may be in the middle of a read into dst, the caller
+    // gets it back once it has stopped.
+    wayland_send_command(state, WAYLAND_COMMAND_CANCEL_TRANSFER, (uint32_t)transfer);
+
+    pthread_mutex_lock(&state->data_lock);
+    while (__atomic_load_n(&slot->status, __ATOMIC_ACQUIRE) != DATA_TRANSFER_FREE && !state->data_shutdown) {
+      pthread_cond_wait(&state->transfer_freed, &state->data_lock);
+    }
+    pthread_mutex_unlock(&state->data_lock);
+  }
+
+  __atomic_store_n(&slot->status, (int32_t)DATA_TRANSFER_FREE, __ATOMIC_RELEASE);
+}
+
+// mime_count 0 clears our selection. fd >= 0 offers size bytes of the
+// file from offset, otherwise size bytes at data.
+bool wayland_set_clipboard(wayland_windowState *state, const char *const *mime_types, uint32_t mime_count,
+                           const uint8_t *data, int fd, uint64_t offset, uint64_t size) {
+  if (!state->threaded || mime_count > DATA_MAX_MIME_TYPES || (mime_count > 0 && fd < 0 && !data)) {
+    return false;
+  }
+
+  wayland_data_selection selection = {};
+  selection.mime_count = mime_count;
+  selection.fd = -1;
+  selection.offset = offset;
+  selection.size = size;
+
+  for (uint32_t Index = 0; Index < mime_count; Index++) {
+    strncpy(selection.mime_types[Index], mime_types[Index], DATA_MIME_TYPE_SIZE - 1);
+  }
+
+  if (fd >= 0) {
+    selection.fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (selection.fd < 0) {
+      return false;
+    }
+  } else if (mime_count > 0) {
+    selection.copy = wayland_clipboard_copy_make(data, size);
+    if (!selection.copy) {
+      printf("Failed to copy %llu bytes for the clipboard\n", (unsigned long long)size);
+      return false;
+    }
+  }
+
+  pthread_mutex_lock(&state->data_lock);
+  if (state->data_shutdown) {
+    pthread_mutex_unlock(&state->data_lock);
+    wayland_data_selection_free(&selection);
+    return false;
+  }
+
+  // One the I/O thread never picked up is still only ours.
+  if (state->pending_selection_set) {
+    wayland_data_selection_free(&state->pending_selection);
+  }
+  state->pending_selection = selection;
+  state->pending_selection_set = true;
+  pthread_mutex_unlock(&state->data_lock);
+
+  wayland_send_command(state, WAYLAND_COMMAND_SET_SELECTION);
+  return true;
+}
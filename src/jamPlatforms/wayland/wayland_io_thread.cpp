@@ -0,0 +1,305 @@
+#include "wayland_client.h"
+
+#include "../../platform.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// Threaded mode. The I/O thread owns the socket and runs the same event
+// loop the single threaded window does, so pings get their pong and
+// released buffers are noticed even while the game thread spends seconds
+// on one frame. The game thread only fills the buffer it's offered:
+//
+//   frame callback -> WAYLAND_EVENT_FRAME -> begin_frame, draw, end_frame
+//   -> WAYLAND_COMMAND_PRESENT -> attach, damage, frame, commit
+//
+// Only one buffer is offered at a time and the swapchain is never resized
+// while it's out, so the game thread can write into it without a lock.
+
+static void *wayland_io_thread(void *data) {
+  wayland_windowState *state = (wayland_windowState *)data;
+
+  // Writing a clipboard pipe whose reader went away should be an EPIPE,
+  // not the end of the process. Blocked for this thread only.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &signals, 0);
+
+  wayland_run(state);
+
+  wayland_flush(state);
+  wayland_post_event(state, WAYLAND_EVENT_CLOSE);
+  return 0;
+}
+
+static void wayland_wake_fd(int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    printf("Failed to wake the other thread\n");
+    exit(errno);
+  }
+}
+
+void wayland_send_command(wayland_windowState *state, wayland_command type, uint32_t arg0, uint32_t arg1) {
+  platform_message command = {};
+  command.type = type;
+  command.args[0] = arg0;
+  command.args[1] = arg1;
+
+  // Only full if the I/O thread is way behind, let it catch up.
+  while (!mpsc_queue_push(&state->commands, &command)) {
+    wayland_wake_fd(state->io_wake_fd);
+    sched_yield();
+  }
+
+  wayland_wake_fd(state->io_wake_fd);
+}
+
+// The startup messages are already queued by wayland_window_set_up, from
+// here on only the I/O thread touches the socket.
+bool wayland_start_io_thread(wayland_windowState *state) {
+  if (!mpsc_queue_init(&state->commands, WAYLAND_COMMAND_QUEUE_SIZE) ||
+      !spsc_queue_init(&state->events, WAYLAND_EVENT_QUEUE_SIZE)) {
+    printf("Failed to allocate the I/O thread queues\n");
+    return false;
+  }
+
+  state->io_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  state->game_wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (state->io_wake_fd < 0 || state->game_wake_fd < 0) {
+    printf("Failed to create the I/O thread eventfds\n");
+    return false;
+  }
+
+  state->offer.index = -1;
+  state->game_frame.index = -1;
+  state->threaded = true;
+
+  thread_settings thread = {};
+  thread.name = "jam-wayland-io";
+  thread.priority = THREAD_PRIORITY_HIGH;
+  if (!cpu_thread_start(&state->io_thread, wayland_io_thread, state, &thread)) {
+    printf("Failed to start the I/O thread\n");
+    state->threaded = false;
+    return false;
+  }
+
+  return true;
+}
+
+void wayland_stop_io_thread(wayland_windowState *state) {
+  if (!state->threaded) {
+    return;
+  }
+
+  wayland_send_command(state, WAYLAND_COMMAND_CLOSE);
+  cpu_thread_join(&state->io_thread);
+  state->threaded = false;
+
+  if (state->events_dropped) {
+    printf("The game thread missed %u events\n", state->events_dropped);
+  }
+
+  close(state->io_wake_fd);
+  close(state->game_wake_fd);
+  state->io_wake_fd = 0;
+  state->game_wake_fd = 0;
+
+  mpsc_queue_free(&state->commands);
+  spsc_queue_free(&state->events);
+}
+
+void wayland_post_event(wayland_windowState *state, uint32_t type) {
+  platform_message event = {};
+  event.type = type;
+
+  if (!spsc_queue_push(&state->events, &event)) {
+    state->events_dropped++;
+    return;
+  }
+
+  uint64_t waiting = __atomic_load_n(&state->events.head, __ATOMIC_RELAXED) - __atomic_load_n(&state->events.tail, __ATOMIC_RELAXED);
+  frame_stats_high_water(&state->recorder.stats.event_queue_high_water, waiting);
+
+  wayland_wake_fd(state->game_wake_fd);
+  state->recorder.stats.syscalls++;
+}
+
+// I/O thread: hands the next free buffer to the game thread instead of
+// drawing into it. Returns false when the compositor still has them all.
+bool wayland_offer_frame(wayland_windowState *state) {
+  wayland_prepare_swapchain(state);
+
+  int32_t index = shm_swapchain_acquire(&state->swapchain);
+  if (index < 0) {
+    state->recorder.stats.buffer_stalls++;
+    return false;
+  }
+
+  // Nobody else gets it until the game thread presents it.
+  state->swapchain.buffers[index].busy = true;
+  state->frame_offered = true;
+
+  wayland_frame_offer *offer = &state->offer;
+  offer->index = index;
+  offer->pixels = shm_swapchain_pixels(&state->swapchain, index);
+  offer->stride = state->swapchain.stride;
+  offer->format = state->format;
+  offer->window_flags = state->window_flags;
+  offer->frame_interval_ns = state->frame_interval_ns;
+  offer->present_ns = wayland_predict_present_ns(state);
+  offer->input_ns = state->pending_input_ns;
+  state->pending_input_ns = 0;
+  offer->scale.density = wayland_surface_density(state);
+  offer->scale.width = state->Width;
+  offer->scale.height = state->Height;
+  offer->scale.buffer_width = state->swapchain.width;
+  offer->scale.buffer_height = state->swapchain.height;
+
+  wayland_post_event(state, WAYLAND_EVENT_FRAME);
+  return true;
+}
+
+void wayland_run_commands(wayland_windowState *state) {
+  uint64_t count = 0;
+  if (read(state->io_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    printf("Failed to read the I/O thread eventfd\n");
+    exit(errno);
+  }
+
+  state->recorder.stats.syscalls++;
+
+  platform_message command;
+  uint32_t commands = 0;
+  while (mpsc_queue_pop(&state->commands, &command)) {
+    commands++;
+    switch (command.type) {
+      case WAYLAND_COMMAND_PRESENT: {
+        int32_t index = (int32_t)command.args[0];
+        assert(state->frame_offered && index == state->offer.index);
+
+        state->frame_offered = false;
+        state->offer.index = -1;
+        state->committed_input_ns = state->offer.input_ns;
+
+        wayland_commit_buffer(state, index);
+        wayland_frame_committed(state);
+      } break;
+
+      case WAYLAND_COMMAND_SET_RENDER_SIZE: {
+        state->settings.render_width = command.args[0];
+        state->settings.render_height = command.args[1];
+        wayland_update_buffer_size(state);
+      } break;
+
+      case WAYLAND_COMMAND_CLOSE: {
+        state->closed = true;
+      } break;
+
+      case WAYLAND_COMMAND_RECEIVE: {
+        wayland_data_start_receive(state, command.args[0]);
+      } break;
+
+      case WAYLAND_COMMAND_CANCEL_TRANSFER: {
+        wayland_data_cancel_transfer(state, command.args[0]);
+      } break;
+
+      case WAYLAND_COMMAND_SET_SELECTION: {
+        wayland_data_apply_selection(state);
+      } break;
+
+      case WAYLAND_COMMAND_SET_CURSOR: {
+        wayland_apply_cursor_shape(state, (cursor_shape)command.args[0]);
+      } break;
+
+      default: {
+        printf("Unknown I/O thread command %u\n", command.type);
+      } break;
+    }
+  }
+
+  frame_stats_high_water(&state->recorder.stats.command_queue_high_water, commands);
+}
+
+// Game thread: blocks until the compositor wants a frame. Returns the
+// render target to draw it into, 0 once the window is closed.
+uint8_t *wayland_begin_frame(wayland_windowState *state, uint32_t *stride) {
+  assert(state->game_frame.index < 0);
+
+  while (!state->game_closed) {
+    platform_message event;
+    if (!spsc_queue_pop(&state->events, &event)) {
+      // The eventfd counts every post, one that lands after the pop above
+      // still makes this read return.
+      uint64_t count = 0;
+      if (read(state->game_wake_fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+        printf("Failed to read the game thread eventfd\n");
+        exit(errno);
+      }
+      continue;
+    }
+
+    switch (event.type) {
+      case WAYLAND_EVENT_FRAME: {
+        state->game_frame = state->offer;
+
+        window_scale *scale = &state->game_frame.scale;
+        if (!render_target_resize(&state->target, scale->buffer_width, scale->buffer_height)) {
+          printf("Failed to allocate the render target\n");
+          exit(errno);
+        }
+
+        if (stride) {
+          *stride = state->target.stride;
+        }
+        return state->target.pixels;
+      }
+
+      case WAYLAND_EVENT_CLOSE: {
+        state->game_closed = true;
+      } break;
+    }
+  }
+
+  return 0;
+}
+
+// Game thread: converts the render target into the offered buffer and
+// hands it back to be committed.
+void wayland_end_frame(wayland_windowState *state) {
+  wayland_frame_offer *frame = &state->game_frame;
+  if (frame->index < 0) {
+    return;
+  }
+
+  uint64_t faults = shm_thread_minor_faults();
+
+  if (state->stats_overlay) {
+    window_frame_stats stats = frame_stats_read(&state->recorder, &state->frame_stats);
+    frame_stats_draw_overlay(&stats, frame->frame_interval_ns, state->target.pixels, state->target.stride,
+                             frame->scale.buffer_width, frame->scale.buffer_height);
+  }
+
+  convert_rgba8(frame->format,
+                state->target.pixels, state->target.stride,
+                frame->pixels, frame->stride,
+                frame->scale.buffer_width, frame->scale.buffer_height);
+
+  shm_record_frame_faults(&state->frame_stats, shm_thread_minor_faults() - faults);
+
+  wayland_send_command(state, WAYLAND_COMMAND_PRESENT, (uint32_t)frame->index);
+  frame->index = -1;
+}
+
+void wayland_set_render_size(wayland_windowState *state, uint32_t width, uint32_t height) {
+  wayland_send_command(state, WAYLAND_COMMAND_SET_RENDER_SIZE, width, height);
+}
@@ -0,0 +1,195 @@
+#include "wayland_client.h"
+
+#include "../../platform.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// The globals we bind, as a table. Each says which versions we can talk
+// (max is the newest whose requests and events we know the opcodes of, so
+// a newer compositor can't send us events we'd misread or have us use
+// requests it doesn't expect), whether the window can't work without it and
+// where the bound id and version go.
+//
+// wl_registry.global looks the name up in a perfect hash of the table's
+// interface names, built at compile time: the seed is searched for by the
+// compiler until every name lands in a slot of its own, so a global costs
+// one hash and one compare whatever it is. Compositors advertise 60+
+// globals and we want about ten of them.
+
+#define WAYLAND_GLOBAL_SLOTS 32 // Power of two, a few times the table so a seed is quick to find.
+#define WAYLAND_GLOBAL_MAX_SEED 100000
+
+struct wayland_global_binding {
+  const char *interface;
+  uint32_t min_version;
+  uint32_t max_version;
+  bool required;
+
+  // Offsets into wayland_windowState of the uint32_t id and version, 0 for
+  // none (fd is at 0, it's never one of these). Only bound once.
+  uint32_t id_offset;
+  uint32_t version_offset;
+
+  // Instead of the slot, for globals there can be several of.
+  uint32_t (*bind)(wayland_windowState *state, uint32_t name, char *interface,
+                   uint32_t interface_len, uint32_t version);
+};
+
+static uint32_t wayland_bind_output(wayland_windowState *state, uint32_t name, char *interface,
+                                    uint32_t interface_len, uint32_t version);
+
+#define WAYLAND_SLOT(field) (uint32_t)offsetof(wayland_windowState, field)
+
+static constexpr wayland_global_binding wayland_globals[] = {
+  // interface, min, max, required, id, version, bind.
+  {"wl_compositor", 1, 6, true, WAYLAND_SLOT(wl_compositor_id), WAYLAND_SLOT(wl_compositor_version), 0},
+  {"wl_shm", 1, 1, true, WAYLAND_SLOT(wl_shm_id), 0, 0},
+  {"xdg_wm_base", 1, 6, true, WAYLAND_SLOT(xdg_wm_base_id), 0, 0},
+  {"wl_subcompositor", 1, 1, false, WAYLAND_SLOT(wl_subcompositor_id), 0, 0},
+  {"wp_viewporter", 1, 1, false, WAYLAND_SLOT(wp_viewporter_id), 0, 0},
+  {"wp_fractional_scale_manager_v1", 1, 1, false, WAYLAND_SLOT(wp_fractional_scale_manager_id), 0, 0},
+  {"wl_seat", 1, 5, false, WAYLAND_SLOT(wl_seat_id), 0, 0},
+  {"wl_data_device_manager", 1, WAYLAND_DATA_DEVICE_VERSION, false,
+   WAYLAND_SLOT(wl_data_device_manager_id), WAYLAND_SLOT(wl_data_device_manager_version), 0},
+  {"wp_cursor_shape_manager_v1", 1, 1, false, WAYLAND_SLOT(wp_cursor_shape_manager_id), 0, 0},
+  {"wl_output", 2, 4, false, 0, 0, wayland_bind_output}, // 2 for wl_output.done.
+};
+
+#define WAYLAND_GLOBAL_COUNT (sizeof(wayland_globals) / sizeof(wayland_globals[0]))
+static_assert(WAYLAND_GLOBAL_COUNT < WAYLAND_GLOBAL_SLOTS, "the slots need room to spare");
+
+// FNV-1a, 32 bits is plenty for a table this size.
+static constexpr uint32_t wayland_global_hash(const char *interface, uint32_t length, uint32_t seed) {
+  uint32_t hash = 0x811c9dc5u ^ seed;
+  for (uint32_t Index = 0; Index < length; Index++) {
+    hash ^= (uint8_t)interface[Index];
+    hash *= 0x01000193u;
+  }
+  return hash ^ (hash >> 16);
+}
+
+static constexpr uint32_t wayland_global_length(const char *interface) {
+  uint32_t length = 0;
+  while (interface[length]) length++;
+  return length;
+}
+
+static constexpr bool wayland_global_seed_works(uint32_t seed) {
+  bool taken[WAYLAND_GLOBAL_SLOTS] = {};
+  for (uint32_t Index = 0; Index < WAYLAND_GLOBAL_COUNT; Index++) {
+    const char *interface = wayland_globals[Index].interface;
+    uint32_t slot = wayland_global_hash(interface, wayland_global_length(interface), seed) & (WAYLAND_GLOBAL_SLOTS - 1);
+    if (taken[slot]) return false;
+    taken[slot] = true;
+  }
+  return true;
+}
+
+static constexpr uint32_t wayland_global_find_seed() {
+  for (uint32_t seed = 0; seed < WAYLAND_GLOBAL_MAX_SEED; seed++) {
+    if (wayland_global_seed_works(seed)) return seed;
+  }
+  return WAYLAND_GLOBAL_MAX_SEED;
+}
+
+static constexpr uint32_t WAYLAND_GLOBAL_SEED = wayland_global_find_seed();
+static_assert(WAYLAND_GLOBAL_SEED < WAYLAND_GLOBAL_MAX_SEED, "no seed gives every interface its own slot");
+
+// Slot to table index + 1, 0 for empty.
+struct wayland_global_slots {
+  uint8_t index[WAYLAND_GLOBAL_SLOTS];
+};
+
+static constexpr wayland_global_slots wayland_global_build_slots() {
+  wayland_global_slots slots = {};
+  for (uint32_t Index = 0; Index < WAYLAND_GLOBAL_COUNT; Index++) {
+    const char *interface = wayland_globals[Index].interface;
+    uint32_t hash = wayland_global_hash(interface, wayland_global_length(interface), WAYLAND_GLOBAL_SEED);
+    slots.index[hash & (WAYLAND_GLOBAL_SLOTS - 1)] = (uint8_t)(Index + 1);
+  }
+  return slots;
+}
+
+static constexpr wayland_global_slots wayland_global_lookup = wayland_global_build_slots();
+
+static uint32_t *wayland_slot(wayland_windowState *state, uint32_t offset) {
+  return (uint32_t *)((char *)state + offset);
+}
+
+static uint32_t wayland_bind_output(wayland_windowState *state, uint32_t name, char *interface,
+                                    uint32_t interface_len, uint32_t version) {
+  if (state->output_count >= MAX_OUTPUTS) {
+    printf("Out of output slots, ignoring wl_output %u\n", name);
+    return 0;
+  }
+
+  wayland_output *output = &state->outputs[state->output_count++];
+  memset(output, 0, sizeof(*output));
+  output->global_name = name;
+  output->version = version;
+  output->scale = 1;
+  output->id = wayland_wl_registry_bind(state, name, interface, interface_len, version);
+  return output->id;
+}
+
+// interface_len counts the terminating 0, like on the wire.
+void wayland_registry_global(wayland_windowState *state, uint32_t name, char *interface,
+                             uint32_t interface_len, uint32_t version) {
+  if (interface_len == 0 || interface[interface_len - 1] != 0) {
+    return;
+  }
+
+  uint32_t hash = wayland_global_hash(interface, interface_len - 1, WAYLAND_GLOBAL_SEED);
+  uint8_t index = wayland_global_lookup.index[hash & (WAYLAND_GLOBAL_SLOTS - 1)];
+  if (index == 0) {
+    return;
+  }
+
+  // Names we don't want can land in a taken slot, and can be longer than
+  // the name that took it.
+  const wayland_global_binding *binding = &wayland_globals[index - 1];
+  if (strlen(binding->interface) + 1 != interface_len ||
+      memcmp(binding->interface, interface, interface_len) != 0) {
+    return;
+  }
+
+  if (version < binding->min_version) {
+    printf("Skipping %s version %u, need %u or later\n", interface, version, binding->min_version);
+    return;
+  }
+  uint32_t bound_version = version < binding->max_version ? version : binding->max_version;
+
+  uint32_t id = 0;
+  if (binding->bind) {
+    id = binding->bind(state, name, interface, interface_len, bound_version);
+  } else {
+    uint32_t *slot = wayland_slot(state, binding->id_offset);
+    if (*slot != 0) {
+      return;
+    }
+    id = *slot = wayland_wl_registry_bind(state, name, interface, interface_len, bound_version);
+    if (binding->version_offset) {
+      *wayland_slot(state, binding->version_offset) = bound_version;
+    }
+  }
+
+  if (id != 0) {
+    wayland_log(state, "Action: Registry.bind@%u Interface bound %s@%u version %u\n",
+                state->wl_registry_id, interface, id, bound_version);
+  }
+}
+
+// The first required global the compositor didn't have at a version we
+// can use, 0 when they're all there.
+const char *wayland_registry_missing(wayland_windowState *state) {
+  for (uint32_t Index = 0; Index < WAYLAND_GLOBAL_COUNT; Index++) {
+    const wayland_global_binding *binding = &wayland_globals[Index];
+    if (binding->required && !binding->bind && *wayland_slot(state, binding->id_offset) == 0) {
+      return binding->interface;
+    }
+  }
+  return 0;
+}
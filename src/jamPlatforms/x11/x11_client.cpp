@@ -0,0 +1,766 @@
+#include "x11_client.h"
+
+#include <assert.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+/* The core protocol is documented at
+ https://www.x.org/releases/X11R7.7/doc/xproto/x11protocol.html
+ and MIT-SHM in xorgproto/shmproto. */
+
+static inline void put_u16(uint8_t *dst, uint16_t value) { memcpy(dst, &value, sizeof(value)); }
+static inline void put_u32(uint8_t *dst, uint32_t value) { memcpy(dst, &value, sizeof(value)); }
+static inline uint16_t get_u16(uint8_t *src) { uint16_t value; memcpy(&value, src, sizeof(value)); return value; }
+static inline uint32_t get_u32(uint8_t *src) { uint32_t value; memcpy(&value, src, sizeof(value)); return value; }
+
+static uint64_t x11_now_ns() {
+  struct timespec ts = {};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static bool x11_read_exact(int fd, uint8_t *dst, uint32_t size) {
+  uint32_t read_total = 0;
+  while (read_total < size) {
+    int64_t read_bytes = recv(fd, dst + read_total, size - read_total, 0);
+    if (read_bytes <= 0) {
+      return false;
+    }
+    read_total += (uint32_t)read_bytes;
+  }
+
+  return true;
+}
+
+static uint32_t x11_new_id(x11_windowState *state) {
+  // Ids are base | n << lowest bit of the mask.
+  uint32_t step = state->resource_id_mask & (~state->resource_id_mask + 1);
+  uint32_t id = state->resource_id_base | ((state->next_resource_id * step) & state->resource_id_mask);
+  state->next_resource_id++;
+  return id;
+}
+
+// Finds a MIT-MAGIC-COOKIE-1 for our display in the Xauthority file.
+// Xvfb and most local sessions started without -auth don't need one.
+static uint32_t x11_read_cookie(int display_number, uint8_t *cookie, uint32_t cookie_size) {
+  char path[512] = "";
+  const char *xauthority = getenv("XAUTHORITY");
+  if (xauthority) {
+    snprintf(path, sizeof(path), "%s", xauthority);
+  } else {
+    const char *home = getenv("HOME");
+    if (!home) {
+      return 0;
+    }
+    snprintf(path, sizeof(path), "%s/.Xauthority", home);
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return 0;
+  }
+
+  uint8_t file[8192];
+  int64_t file_size = read(fd, file, sizeof(file));
+  close(fd);
+  if (file_size <= 0) {
+    return 0;
+  }
+
+  char display_string[16] = "";
+  snprintf(display_string, sizeof(display_string), "%d", display_number);
+  uint32_t display_string_len = strlen(display_string);
+
+  // Entries are family, then address, number, name and data as
+  // big endian length prefixed strings.
+  uint64_t pos = 0;
+  while (pos + 2 <= (uint64_t)file_size) {
+    pos += 2; // family, we only ever connect locally.
+
+    uint8_t *fields[4];
+    uint32_t lengths[4];
+    bool truncated = false;
+    for (uint32_t Index = 0; Index < 4; Index++) {
+      if (pos + 2 > (uint64_t)file_size) {
+        truncated = true;
+        break;
+      }
+      lengths[Index] = (uint32_t)file[pos] << 8 | file[pos + 1];
+      fields[Index] = file + pos + 2;
+      pos += 2 + lengths[Index];
+      if (pos > (uint64_t)file_size) {
+        truncated = true;
+        break;
+      }
+    }
+
+    if (truncated) {
+      break;
+    }
+
+    bool number_matches = lengths[1] == 0 ||
+                          (lengths[1] == display_string_len &&
+                           memcmp(fields[1], display_string, display_string_len) == 0);
+    bool is_cookie = lengths[2] == 18 && memcmp(fields[2], "MIT-MAGIC-COOKIE-1", 18) == 0;
+
+    if (number_matches && is_cookie && lengths[3] <= cookie_size) {
+      memcpy(cookie, fields[3], lengths[3]);
+      return lengths[3];
+    }
+  }
+
+  return 0;
+}
+
+static bool x11_setup_connection(x11_windowState *state, int display_number);
+
+bool connect_x11_display(x11_windowState *state) {
+  const char *display = getenv("DISPLAY");
+  if (display == NULL) {
+    printf("No DISPLAY\n");
+    return false;
+  }
+
+  // Only local displays, ":0", ":0.0" or "unix:0".
+  const char *colon = strrchr(display, ':');
+  if (colon == NULL ||
+      !(colon == display || (colon - display == 4 && memcmp(display, "unix", 4) == 0))) {
+    printf("Only local X11 displays are supported: %s\n", display);
+    return false;
+  }
+
+  int display_number = atoi(colon + 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    printf("Couldn't create a socket\n");
+    return false;
+  }
+
+  // The abstract socket first, it survives a cleaned out /tmp.
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  int path_length = snprintf(address.sun_path + 1, sizeof(address.sun_path) - 1, "/tmp/.X11-unix/X%d", display_number);
+  socklen_t address_length = offsetof(struct sockaddr_un, sun_path) + 1 + path_length;
+
+  if (connect(fd, (struct sockaddr *)&address, address_length)) {
+    memmove(address.sun_path, address.sun_path + 1, path_length);
+    address.sun_path[path_length] = 0;
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+      printf("Couldn't connect to the X11 socket %s\n", address.sun_path);
+      close(fd);
+      return false;
+    }
+  }
+
+  state->fd = fd;
+  if (!x11_setup_connection(state, display_number)) {
+    close(fd);
+    state->fd = 0;
+    return false;
+  }
+
+  state->frame_interval_ns = 1000000000ull / 60;
+
+  return true;
+}
+
+// The setup request and the server's reply, the socket is connected.
+static bool x11_setup_connection(x11_windowState *state, int display_number) {
+  int fd = state->fd;
+  uint8_t cookie[256];
+  uint32_t cookie_len = x11_read_cookie(display_number, cookie, sizeof(cookie));
+  const char auth_name[] = "MIT-MAGIC-COOKIE-1";
+  uint32_t auth_name_len = cookie_len ? sizeof(auth_name) - 1 : 0;
+
+  uint8_t setup[12 + 20 + 256] = {};
+  uint32_t setup_len = 12;
+  setup[0] = 'l'; // Little endian.
+  put_u16(setup + 2, 11);
+  put_u16(setup + 4, 0);
+  put_u16(setup + 6, auth_name_len);
+  put_u16(setup + 8, cookie_len);
+  memcpy(setup + setup_len, auth_name, auth_name_len);
+  setup_len += roundup_4(auth_name_len);
+  memcpy(setup + setup_len, cookie, cookie_len);
+  setup_len += roundup_4(cookie_len);
+
+  if ((int64_t)setup_len != send(fd, setup, setup_len, 0)) {
+    printf("Error sending the X11 setup.\n");
+    return false;
+  }
+
+  uint8_t header[8];
+  if (!x11_read_exact(fd, header, sizeof(header))) {
+    printf("X11 closed the socket during setup\n");
+    return false;
+  }
+
+  uint32_t additional_len = (uint32_t)get_u16(header + 6) * 4;
+  uint8_t *info = (uint8_t *)malloc(additional_len ? additional_len : 1);
+  if (!info || !x11_read_exact(fd, info, additional_len)) {
+    free(info);
+    return false;
+  }
+
+  if (header[0] != 1) {
+    int reason_len = header[1] < additional_len ? header[1] : (int)additional_len;
+    printf("X11 refused the connection: %.*s\n", reason_len, (char *)info);
+    free(info);
+    return false;
+  }
+
+  // Everything below is read at fixed offsets, all of it has to be there.
+  if (additional_len < 32) {
+    printf("X11 setup reply is too short\n");
+    free(info);
+    return false;
+  }
+
+  state->resource_id_base = get_u32(info + 4);
+  state->resource_id_mask = get_u32(info + 8);
+  uint16_t vendor_len = get_u16(info + 16);
+  state->max_request_bytes = (uint32_t)get_u16(info + 18) * 4;
+  uint8_t format_count = info[21];
+
+  // First screen, right after the vendor string and pixmap formats.
+  uint32_t screen_offset = 32 + roundup_4(vendor_len) + (uint32_t)format_count * 8;
+  if (screen_offset + X11_SCREEN_SIZE > additional_len) {
+    printf("X11 setup reply has no screen\n");
+    free(info);
+    return false;
+  }
+
+  uint8_t *screen = info + screen_offset;
+  state->root = get_u32(screen + 0);
+  state->screen_width = get_u16(screen + 20);
+  state->screen_height = get_u16(screen + 22);
+  state->root_visual = get_u32(screen + 32);
+  state->root_depth = screen[38];
+
+  printf("X11 root window %u, %ux%u depth %u\n", state->root, state->screen_width,
+         state->screen_height, state->root_depth);
+
+  free(info);
+
+  return true;
+}
+
+uint8_t *x11_begin_request(x11_windowState *state, uint8_t opcode, uint8_t data, uint16_t length_words) {
+  uint32_t size = (uint32_t)length_words * 4;
+  assert(size <= X11_OUT_BUFFER_SIZE);
+
+  if (state->out_len + size > X11_OUT_BUFFER_SIZE) {
+    x11_flush(state);
+  }
+
+  uint8_t *request = state->out + state->out_len;
+  memset(request, 0, size);
+  request[0] = opcode;
+  request[1] = data;
+  put_u16(request + 2, length_words);
+
+  state->out_len += size;
+  state->sequence++;
+  state->recorder.stats.messages_sent++;
+
+  return request;
+}
+
+// Everything batched since the last flush goes out in one sendmsg,
+// with any fds the requests in it refer to.
+void x11_flush(x11_windowState *state) {
+  uint32_t sent = 0;
+
+  while (sent < state->out_len) {
+    struct iovec io = {.iov_base = state->out + sent, .iov_len = state->out_len - sent};
+    struct msghdr socket_msg = {};
+    socket_msg.msg_iov = &io;
+    socket_msg.msg_iovlen = 1;
+
+    char buf[CMSG_SPACE(sizeof(int) * X11_MAX_PENDING_FDS)] = "";
+    if (state->pending_fd_count > 0) {
+      socket_msg.msg_control = buf;
+      socket_msg.msg_controllen = CMSG_SPACE(sizeof(int) * state->pending_fd_count);
+
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&socket_msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int) * state->pending_fd_count);
+      memcpy(CMSG_DATA(cmsg), state->pending_fds, sizeof(int) * state->pending_fd_count);
+    }
+
+    int64_t sent_bytes = sendmsg(state->fd, &socket_msg, 0);
+    if (sent_bytes == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error sending X11 requests.\n");
+      exit(errno);
+    }
+
+    state->pending_fd_count = 0;
+    sent += (uint32_t)sent_bytes;
+    state->recorder.stats.syscalls++;
+    state->recorder.stats.bytes_sent += (uint64_t)sent_bytes;
+  }
+
+  state->out_len = 0;
+}
+
+void x11_handle_packet(x11_windowState *state, uint8_t *packet) {
+  uint8_t type = packet[0] & 0x7F; // Top bit is set for SendEvent.
+  uint16_t sequence = get_u16(packet + 2);
+
+  if (type == X11_OPCODES::ERROR) {
+    printf("X11 error %u on request %u (major %u, minor %u) value %u\n",
+           packet[1], sequence, packet[10], get_u16(packet + 8), get_u32(packet + 4));
+
+    if (sequence == state->awaited_sequence) {
+      state->awaited_done = true;
+      state->awaited_error = true;
+    }
+  } else if (type == X11_OPCODES::REPLY) {
+    if (sequence == state->awaited_sequence) {
+      memcpy(state->reply, packet, X11_PACKET_SIZE);
+      state->awaited_done = true;
+    }
+  } else if (state->shm_available &&
+             type == state->shm_first_event + X11_MIT_SHM::COMPLETION) {
+    // The server is done reading the buffer at this offset. One for a
+    // segment from before a resize says nothing about the new buffers.
+    uint32_t shmseg = get_u32(packet + 12);
+    uint32_t offset = get_u32(packet + 16);
+    for (uint32_t Index = 0; shmseg == state->swapchain.pool_handle && Index < state->swapchain.buffer_count; Index++) {
+      if (state->swapchain.buffers[Index].offset == offset) {
+        state->swapchain.buffers[Index].busy = false;
+      }
+    }
+  } else if (type == X11_OPCODES::CONFIGURE_NOTIFY) {
+    uint16_t width = get_u16(packet + 20);
+    uint16_t height = get_u16(packet + 22);
+
+    if (width != state->Width || height != state->Height) {
+      printf("X11 window resized to %u x %u\n", width, height);
+      state->Width = width;
+      state->Height = height;
+    }
+  } else if (type == X11_OPCODES::CLIENT_MESSAGE) {
+    uint32_t message_type = get_u32(packet + 8);
+    uint32_t protocol = get_u32(packet + 12);
+
+    if (message_type == state->wm_protocols_atom &&
+        protocol == state->wm_delete_window_atom) {
+      printf("X11 window closed\n");
+      state->closed = true;
+    }
+  } else if (type == X11_OPCODES::EXPOSE) {
+    // We redraw every frame anyway.
+  } else if (type == X11_OPCODES::FOCUS_IN) {
+    state->window_flags |= WINDOW_ACTIVATED;
+    state->window_flags &= ~WINDOW_THROTTLED;
+    state->next_frame_ns = x11_now_ns();
+  } else if (type == X11_OPCODES::FOCUS_OUT) {
+    state->window_flags &= ~WINDOW_ACTIVATED;
+    state->window_flags |= WINDOW_THROTTLED;
+  } else if (type == X11_OPCODES::UNMAP_NOTIFY) {
+    printf("X11 window unmapped, not drawing\n");
+    state->window_flags |= WINDOW_SUSPENDED;
+  } else if (type == X11_OPCODES::MAP_NOTIFY) {
+    state->window_flags &= ~WINDOW_SUSPENDED;
+    state->next_frame_ns = x11_now_ns();
+  } else if (type >= X11_OPCODES::KEY_PRESS && type <= X11_OPCODES::MOTION_NOTIFY) {
+    // Input wakes a throttled window right away.
+    frame_stats_input(&state->recorder);
+    state->next_frame_ns = x11_now_ns();
+  }
+}
+
+// Reads whatever is on the socket and handles every whole packet in it.
+// Returns false when the server hung up.
+bool x11_read_events(x11_windowState *state, bool block) {
+  int64_t read_bytes = recv(state->fd, state->in + state->in_len,
+                            X11_IN_BUFFER_SIZE - state->in_len, block ? 0 : MSG_DONTWAIT);
+  state->recorder.stats.syscalls++;
+
+  if (read_bytes == 0) {
+    printf("X11 closed the socket\n");
+    return false;
+  }
+
+  if (read_bytes == -1) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+
+  state->in_len += (uint32_t)read_bytes;
+  state->recorder.stats.bytes_received += (uint64_t)read_bytes;
+
+  uint32_t pos = 0;
+  while (state->in_len - pos >= X11_PACKET_SIZE) {
+    uint8_t *packet = state->in + pos;
+    uint32_t size = X11_PACKET_SIZE;
+    if ((packet[0] & 0x7F) == X11_OPCODES::REPLY) {
+      size += get_u32(packet + 4) * 4;
+    }
+
+    if (size > X11_IN_BUFFER_SIZE) {
+      printf("X11 reply larger than the read buffer\n");
+      exit(EINVAL);
+    }
+
+    if (state->in_len - pos < size) {
+      break;
+    }
+
+    x11_handle_packet(state, packet);
+    state->recorder.stats.messages_received++;
+    pos += size;
+  }
+
+  memmove(state->in, state->in + pos, state->in_len - pos);
+  state->in_len -= pos;
+
+  return true;
+}
+
+// Flushes and blocks until the reply to one request arrives, handling
+// any events in front of it. Only used during set up.
+uint8_t *x11_round_trip(x11_windowState *state, uint16_t sequence) {
+  state->awaited_sequence = sequence;
+  state->awaited_done = false;
+  state->awaited_error = false;
+
+  x11_flush(state);
+
+  while (!state->awaited_done) {
+    if (!x11_read_events(state, true)) {
+      exit(errno);
+    }
+  }
+
+  return state->awaited_error ? 0 : state->reply;
+}
+
+uint32_t x11_intern_atom(x11_windowState *state, const char *name) {
+  uint16_t name_len = strlen(name);
+  uint8_t *request = x11_begin_request(state, X11_OPCODES::INTERN_ATOM, 0, 2 + roundup_4(name_len) / 4);
+  put_u16(request + 4, name_len);
+  memcpy(request + 8, name, name_len);
+
+  uint8_t *reply = x11_round_trip(state, state->sequence);
+  return reply ? get_u32(reply + 8) : 0;
+}
+
+bool x11_query_mit_shm(x11_windowState *state) {
+  const char name[] = "MIT-SHM";
+  uint16_t name_len = sizeof(name) - 1;
+
+  uint8_t *request = x11_begin_request(state, X11_OPCODES::QUERY_EXTENSION, 0, 2 + roundup_4(name_len) / 4);
+  put_u16(request + 4, name_len);
+  memcpy(request + 8, name, name_len);
+
+  uint8_t *reply = x11_round_trip(state, state->sequence);
+  if (!reply || !reply[8]) {
+    printf("No MIT-SHM, presenting through PutImage\n");
+    return false;
+  }
+
+  state->shm_major_opcode = reply[9];
+  state->shm_first_event = reply[10];
+
+  x11_begin_request(state, state->shm_major_opcode, X11_MIT_SHM::QUERY_VERSION, 1);
+  reply = x11_round_trip(state, state->sequence);
+  if (!reply) {
+    return false;
+  }
+
+  uint16_t major = get_u16(reply + 8);
+  uint16_t minor = get_u16(reply + 10);
+  printf("MIT-SHM %u.%u\n", major, minor);
+
+  // AttachFd is what lets us hand over the memfd, SysV segments need not apply.
+  return major > 1 || (major == 1 && minor >= 2);
+}
+
+bool x11_swapchain_create(x11_windowState *state, uint32_t width, uint32_t height) {
+  // Depth 24 ZPixmaps are 32 bits per pixel, B G R X in memory, XRGB8888 for us.
+  if (!shm_swapchain_allocate(&state->swapchain, width, height,
+                              pixel_format_stride(PIXEL_FORMAT_XRGB8888, width),
+                              PIXEL_FORMAT_XRGB8888, SWAPCHAIN_MAX_BUFFERS)) {
+    return false;
+  }
+
+  if (state->shm_available) {
+    assert(state->pending_fd_count < X11_MAX_PENDING_FDS);
+
+    state->swapchain.pool_handle = x11_new_id(state);
+    uint8_t *request = x11_begin_request(state, state->shm_major_opcode, X11_MIT_SHM::ATTACH_FD, 3);
+    put_u32(request + 4, state->swapchain.pool_handle);
+    request[8] = 1; // Read only.
+
+    state->pending_fds[state->pending_fd_count++] = state->swapchain.fd;
+  }
+
+  return true;
+}
+
+void x11_swapchain_destroy(x11_windowState *state) {
+  if (state->swapchain.pool_handle != 0) {
+    uint8_t *request = x11_begin_request(state, state->shm_major_opcode, X11_MIT_SHM::DETACH, 2);
+    put_u32(request + 4, state->swapchain.pool_handle);
+  }
+
+  // The fd could still be waiting to go out with the attach.
+  if (state->pending_fd_count > 0) {
+    x11_flush(state);
+  }
+
+  shm_swapchain_free(&state->swapchain);
+}
+
+void x11_present(x11_windowState *state, int32_t index) {
+  shm_swapchain *swapchain = &state->swapchain;
+  shm_swapchain_buffer *buffer = &swapchain->buffers[index];
+
+  if (state->shm_available) {
+    // The server reads straight out of our memfd, nothing but this
+    // request crosses the socket. send_event gets us a ShmCompletion.
+    uint8_t *request = x11_begin_request(state, state->shm_major_opcode, X11_MIT_SHM::PUT_IMAGE, 10);
+    put_u32(request + 4, state->window);
+    put_u32(request + 8, state->gc);
+    put_u16(request + 12, swapchain->stride / 4); // total width
+    put_u16(request + 14, swapchain->height);
+    put_u16(request + 16, 0);
+    put_u16(request + 18, 0);
+    put_u16(request + 20, swapchain->width);
+    put_u16(request + 22, swapchain->height);
+    put_u16(request + 24, 0);
+    put_u16(request + 26, 0);
+    request[28] = state->root_depth;
+    request[29] = 2; // ZPixmap
+    request[30] = 1; // send_event
+    put_u32(request + 32, swapchain->pool_handle);
+    put_u32(request + 36, buffer->offset);
+
+    buffer->busy = true;
+    return;
+  }
+
+  // Remote or ancient servers, the pixels have to go through the socket.
+  uint32_t row_bytes = swapchain->width * 4;
+  uint32_t max_bytes = state->max_request_bytes < X11_OUT_BUFFER_SIZE ? state->max_request_bytes : X11_OUT_BUFFER_SIZE;
+  uint32_t rows_per_request = (max_bytes - 24) / row_bytes;
+  if (rows_per_request == 0) {
+    printf("Window too wide for PutImage\n");
+    return;
+  }
+
+  uint8_t *pixels = shm_swapchain_pixels(swapchain, index);
+  for (uint32_t Row = 0; Row < swapchain->height; Row += rows_per_request) {
+    uint32_t rows = swapchain->height - Row < rows_per_request ? swapchain->height - Row : rows_per_request;
+
+    uint8_t *request = x11_begin_request(state, X11_OPCODES::PUT_IMAGE, 2, 6 + (rows * row_bytes) / 4);
+    put_u32(request + 4, state->window);
+    put_u32(request + 8, state->gc);
+    put_u16(request + 12, swapchain->width);
+    put_u16(request + 14, rows);
+    put_u16(request + 16, 0);
+    put_u16(request + 18, Row);
+    request[21] = state->root_depth;
+
+    for (uint32_t Index = 0; Index < rows; Index++) {
+      memcpy(request + 24 + Index * row_bytes, pixels + (uint64_t)(Row + Index) * swapchain->stride, row_bytes);
+    }
+  }
+}
+
+void x11_draw_frame(x11_windowState *state) {
+  if (state->Width == 0 || state->Height == 0) {
+    return;
+  }
+
+  uint64_t faults = shm_thread_minor_faults();
+
+  if (state->swapchain.width != state->Width ||
+      state->swapchain.height != state->Height) {
+    x11_swapchain_destroy(state);
+
+    if (!x11_swapchain_create(state, state->Width, state->Height)) {
+      printf("Failed to create the swapchain\n");
+      exit(errno);
+    }
+  }
+
+  if (!render_target_resize(&state->target, state->Width, state->Height)) {
+    printf("Failed to allocate the render target\n");
+    exit(errno);
+  }
+
+  int32_t index = shm_swapchain_acquire(&state->swapchain);
+  if (index < 0) {
+    state->recorder.stats.buffer_stalls++;
+    return;
+  }
+
+  uint32_t gray = (uint32_t)state->blue * 0x010101u;
+  pixel_fill_rect(state->target.pixels, state->target.stride, state->target.width, state->target.height,
+                  gray | 0xff000000u);
+
+  if (state->stats_overlay) {
+    frame_stats_draw_overlay(&state->recorder.stats, state->frame_interval_ns,
+                             state->target.pixels, state->target.stride, state->target.width, state->target.height);
+  }
+
+  convert_rgba8(PIXEL_FORMAT_XRGB8888,
+                state->target.pixels, state->target.stride,
+                shm_swapchain_pixels(&state->swapchain, index), state->swapchain.stride,
+                state->swapchain.width, state->swapchain.height);
+
+  x11_present(state, index);
+  state->blue++;
+
+  state->recorder.stats.shm_bytes = state->swapchain.pool_size;
+  frame_stats_present(&state->recorder, x11_now_ns());
+
+  shm_record_frame_faults(&state->frame_stats, shm_thread_minor_faults() - faults);
+}
+
+bool x11_window_set_up(x11_windowState *state, uint32_t Width, uint32_t Height, window_settings *settings) {
+  state->Width = Width ? Width : 800;
+  state->Height = Height ? Height : 600;
+
+  uint32_t unfocused_fps = settings && settings->unfocused_fps ? settings->unfocused_fps : DEFAULT_UNFOCUSED_FPS;
+  state->unfocused_interval_ns = 1000000000ull / unfocused_fps;
+
+  window_settings defaults = {};
+  state->stats_overlay = frame_stats_overlay_wanted(settings ? settings : &defaults);
+
+  // Until the window manager says otherwise, without one there's no FocusIn.
+  state->window_flags = WINDOW_ACTIVATED;
+
+  state->wm_protocols_atom = x11_intern_atom(state, "WM_PROTOCOLS");
+  state->wm_delete_window_atom = x11_intern_atom(state, "WM_DELETE_WINDOW");
+  state->shm_available = x11_query_mit_shm(state);
+
+  // Everything below is batched and goes out with the first frame.
+  state->window = x11_new_id(state);
+  uint8_t *request = x11_begin_request(state, X11_OPCODES::CREATE_WINDOW, state->root_depth, 8 + 2);
+  put_u32(request + 4, state->window);
+  put_u32(request + 8, state->root);
+  put_u16(request + 16, state->Width);
+  put_u16(request + 18, state->Height);
+  put_u16(request + 22, 1); // InputOutput
+  put_u32(request + 24, 0); // CopyFromParent visual
+  put_u32(request + 28, 0x2 | 0x800); // background pixel, event mask
+  put_u32(request + 32, 0);
+  put_u32(request + 36, X11_EXPOSURE_MASK | X11_STRUCTURE_NOTIFY_MASK | X11_KEY_PRESS_MASK |
+                        X11_KEY_RELEASE_MASK | X11_BUTTON_PRESS_MASK | X11_BUTTON_RELEASE_MASK |
+                        X11_POINTER_MOTION_MASK | X11_FOCUS_CHANGE_MASK);
+
+  // WM_PROTOCOLS = [WM_DELETE_WINDOW] so closing sends us a message instead of killing the connection.
+  request = x11_begin_request(state, X11_OPCODES::CHANGE_PROPERTY, 0, 6 + 1);
+  put_u32(request + 4, state->window);
+  put_u32(request + 8, state->wm_protocols_atom);
+  put_u32(request + 12, 4); // ATOM
+  request[16] = 32;
+  put_u32(request + 20, 1);
+  put_u32(request + 24, state->wm_delete_window_atom);
+
+  const char title[] = "jamPlatform";
+  uint32_t title_len = sizeof(title) - 1;
+  request = x11_begin_request(state, X11_OPCODES::CHANGE_PROPERTY, 0, 6 + roundup_4(title_len) / 4);
+  put_u32(request + 4, state->window);
+  put_u32(request + 8, 39); // WM_NAME
+  put_u32(request + 12, 31); // STRING
+  request[16] = 8;
+  put_u32(request + 20, title_len);
+  memcpy(request + 24, title, title_len);
+
+  state->gc = x11_new_id(state);
+  request = x11_begin_request(state, X11_OPCODES::CREATE_GC, 0, 4 + 1);
+  put_u32(request + 4, state->gc);
+  put_u32(request + 8, state->window);
+  put_u32(request + 12, 0x10000); // graphics-exposures
+  put_u32(request + 16, 0);
+
+  request = x11_begin_request(state, X11_OPCODES::MAP_WINDOW, 0, 2);
+  put_u32(request + 4, state->window);
+
+  return true;
+}
+
+void x11_run(x11_windowState *state) {
+  state->next_frame_ns = x11_now_ns();
+
+  while (!state->closed) {
+    uint64_t now = x11_now_ns();
+    int timeout_ms = 0;
+    if (state->window_flags & WINDOW_SUSPENDED) {
+      timeout_ms = -1; // Nothing to draw until MapNotify.
+    } else if (state->next_frame_ns > now) {
+      timeout_ms = (int)((state->next_frame_ns - now + 999999) / 1000000);
+    }
+
+    struct pollfd poll_fd = {.fd = state->fd, .events = POLLIN, .revents = 0};
+    if (poll(&poll_fd, 1, timeout_ms) > 0) {
+      if (!x11_read_events(state, false)) {
+        return;
+      }
+    }
+
+    now = x11_now_ns();
+    if (!(state->window_flags & WINDOW_SUSPENDED) && now >= state->next_frame_ns) {
+      state->present_ns = now;
+      x11_draw_frame(state);
+
+      uint64_t interval = state->frame_interval_ns;
+      if (!(state->window_flags & WINDOW_ACTIVATED)) {
+        interval = state->unfocused_interval_ns;
+      }
+
+      state->next_frame_ns += interval;
+      if (state->next_frame_ns < now) {
+        state->next_frame_ns = now + interval;
+      }
+    }
+
+    x11_flush(state);
+  }
+}
+
+void x11_disconnect(x11_windowState *state) {
+  if (state->fd <= 0) {
+    return;
+  }
+
+  x11_swapchain_destroy(state);
+  render_target_free(&state->target);
+
+  if (state->gc) {
+    uint8_t *request = x11_begin_request(state, X11_OPCODES::FREE_GC, 0, 2);
+    put_u32(request + 4, state->gc);
+  }
+
+  if (state->window) {
+    uint8_t *request = x11_begin_request(state, X11_OPCODES::DESTROY_WINDOW, 0, 2);
+    put_u32(request + 4, state->window);
+  }
+
+  x11_flush(state);
+  close(state->fd);
+  state->fd = 0;
+}
@@ -0,0 +1,170 @@
+#ifndef JAM_X11_CLIENT_H
+#define JAM_X11_CLIENT_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../platform.h"
+#include "../shm_swapchain.h"
+#include "../pixel_convert.h"
+#include "../frame_stats.h"
+
+// X11 spoken straight over the socket, same idea as the wayland client.
+// Requests are encoded into one outgoing buffer and flushed once per
+// frame, fds (the swapchain memfd for MIT-SHM) ride along with the flush.
+
+#define X11_OUT_BUFFER_SIZE 65536
+#define X11_IN_BUFFER_SIZE 65536
+#define X11_MAX_PENDING_FDS 4
+#define X11_PACKET_SIZE 32
+#define X11_SCREEN_SIZE 40 // A SCREEN in the setup reply, without its depths.
+
+struct X11_OPCODES {
+  enum Requests {
+    CREATE_WINDOW=1,
+    DESTROY_WINDOW=4,
+    MAP_WINDOW=8,
+    INTERN_ATOM=16,
+    CHANGE_PROPERTY=18,
+    CREATE_GC=55,
+    FREE_GC=60,
+    PUT_IMAGE=72,
+    QUERY_EXTENSION=98,
+  };
+
+  enum Events {
+    ERROR=0,
+    REPLY=1,
+    KEY_PRESS=2,
+    KEY_RELEASE=3,
+    BUTTON_PRESS=4,
+    BUTTON_RELEASE=5,
+    MOTION_NOTIFY=6,
+    FOCUS_IN=9,
+    FOCUS_OUT=10,
+    EXPOSE=12,
+    UNMAP_NOTIFY=18,
+    MAP_NOTIFY=19,
+    CONFIGURE_NOTIFY=22,
+    CLIENT_MESSAGE=33,
+  };
+};
+
+// Minor opcodes, the major one comes from QueryExtension.
+struct X11_MIT_SHM {
+  enum Requests {
+    QUERY_VERSION=0,
+    ATTACH=1,
+    DETACH=2,
+    PUT_IMAGE=3,
+    ATTACH_FD=6,
+  };
+
+  // Offset from the extension's first event.
+  enum Events {
+    COMPLETION=0,
+  };
+};
+
+// Only the bits we use.
+enum x11_event_mask {
+  X11_KEY_PRESS_MASK = 0x1,
+  X11_KEY_RELEASE_MASK = 0x2,
+  X11_BUTTON_PRESS_MASK = 0x4,
+  X11_BUTTON_RELEASE_MASK = 0x8,
+  X11_POINTER_MOTION_MASK = 0x40,
+  X11_EXPOSURE_MASK = 0x8000,
+  X11_STRUCTURE_NOTIFY_MASK = 0x20000,
+  X11_FOCUS_CHANGE_MASK = 0x200000,
+};
+
+struct x11_windowState {
+  int fd;
+
+  // Outgoing request batch.
+  uint8_t out[X11_OUT_BUFFER_SIZE];
+  uint32_t out_len;
+  int pending_fds[X11_MAX_PENDING_FDS];
+  uint32_t pending_fd_count;
+
+  // Incoming bytes not yet parsed into whole packets.
+  uint8_t in[X11_IN_BUFFER_SIZE];
+  uint32_t in_len;
+
+  uint16_t sequence; // Of the last request we encoded.
+
+  uint32_t resource_id_base;
+  uint32_t resource_id_mask;
+  uint32_t next_resource_id;
+  uint32_t max_request_bytes;
+
+  uint32_t root;
+  uint32_t root_visual;
+  uint8_t root_depth;
+  uint32_t screen_width;
+  uint32_t screen_height;
+
+  uint32_t window;
+  uint32_t gc;
+  uint32_t wm_protocols_atom;
+  uint32_t wm_delete_window_atom;
+
+  // MIT-SHM with AttachFd (1.2+), without it frames go through PutImage.
+  bool shm_available;
+  uint8_t shm_major_opcode;
+  uint8_t shm_first_event;
+
+  uint32_t Width;
+  uint32_t Height;
+
+  render_target target;
+  shm_swapchain swapchain;
+
+  uint64_t frame_interval_ns;
+  uint64_t next_frame_ns;
+  uint64_t present_ns; // No vsync, PutImage shows up about when it's drawn.
+  window_frame_stats frame_stats;
+  frame_stats_recorder recorder; // Same thread as everything else here, published anyway for get_frame_stats.
+  bool stats_overlay;
+
+  // Focus and map state, unmapped windows don't draw and unfocused ones
+  // are capped at unfocused_interval_ns until input comes in.
+  uint32_t window_flags; // window_state_flags
+  uint64_t unfocused_interval_ns;
+
+  // The replies we wait on (atoms, extension queries) all fit in one packet.
+  uint16_t awaited_sequence;
+  bool awaited_done;
+  bool awaited_error;
+  uint8_t reply[X11_PACKET_SIZE];
+
+  bool closed;
+  uint8_t blue;
+};
+
+bool connect_x11_display(x11_windowState *state); // Returns true on a successful connection
+bool x11_window_set_up(x11_windowState *state, uint32_t Width, uint32_t Height, window_settings *settings);
+void x11_run(x11_windowState *state);
+void x11_disconnect(x11_windowState *state);
+
+// Batching.
+uint8_t *x11_begin_request(x11_windowState *state, uint8_t opcode, uint8_t data, uint16_t length_words);
+void x11_flush(x11_windowState *state);
+bool x11_read_events(x11_windowState *state, bool block);
+uint8_t *x11_round_trip(x11_windowState *state, uint16_t sequence);
+void x11_handle_packet(x11_windowState *state, uint8_t *packet); // One event, error or reply, 32 bytes of it.
+
+// Requests.
+uint32_t x11_intern_atom(x11_windowState *state, const char *name);
+bool x11_query_mit_shm(x11_windowState *state);
+bool x11_swapchain_create(x11_windowState *state, uint32_t width, uint32_t height);
+void x11_swapchain_destroy(x11_windowState *state);
+void x11_present(x11_windowState *state, int32_t index);
+void x11_draw_frame(x11_windowState *state);
+
+#endif // !JAM_X11_CLIENT_H
@@ -5,6 +5,20 @@ int main() {
   
   void *memoryPtr = 0;
   create_a_window(&memoryPtr, 0, 0);
+
+  // Only loops when the window runs on its own I/O thread (JAM_IO_THREAD=1),
+  // otherwise create_a_window already ran it until it closed.
+  uint8_t blue = 0;
+  uint32_t stride = 0;
+  while (uint8_t *pixels = begin_frame(&memoryPtr, &stride)) {
+    window_scale scale = get_window_scale(&memoryPtr);
+
+    fill_pixels(pixels, stride, scale.buffer_width, scale.buffer_height, blue, blue, blue, 0xff);
+
+    end_frame(&memoryPtr);
+    blue++;
+  }
+
   destroy_a_window(&memoryPtr);
 
   return 0;
@@ -7,11 +7,571 @@
 #include <string.h>
 #include <stdint.h>
 
-void create_a_window(void **memory, uint32_t Width, uint32_t Height);
+#define DEFAULT_UNFOCUSED_FPS 10
+
+// Formats the window's pixel buffer can end up in. The app always renders
+// RGBA8 (bytes R, G, B, A) and the platform converts on present.
+enum pixel_format {
+  PIXEL_FORMAT_XRGB8888, // Default, supported everywhere.
+  PIXEL_FORMAT_ARGB8888,
+  PIXEL_FORMAT_RGBA8888,
+  PIXEL_FORMAT_RGB565, // Half the bytes per frame, for constrained bandwidth.
+  PIXEL_FORMAT_XRGB4444,
+  PIXEL_FORMAT_RGBA4444,
+};
+
+enum window_backend {
+  WINDOW_BACKEND_AUTO, // Wayland when the session has it, X11 otherwise.
+  WINDOW_BACKEND_WAYLAND,
+  WINDOW_BACKEND_X11,
+  WINDOW_BACKEND_HEADLESS, // No display server, frames go to a headless_sink.
+};
+
+enum headless_sink {
+  HEADLESS_SINK_DISCARD, // Render and convert, then drop. For benchmarking the frame loop.
+  HEADLESS_SINK_RAW, // Every frame appended to one file, tightly packed rows.
+  HEADLESS_SINK_PPM, // One P6 file per frame, path is a pattern with one %llu (or %06llu) for the frame number.
+  HEADLESS_SINK_SHM_RING, // A shared memory ring an external encoder can map, see headless_client.h.
+};
+
+struct headless_settings {
+  // Virtual refresh rate, 0 means 60Hz. Unthrottled renders as fast as the CPU goes.
+  uint32_t refresh_mhz;
+  bool unthrottled;
+
+  uint64_t frame_limit; // Stop after this many frames, 0 runs forever.
+
+  headless_sink sink;
+  const char *path;
+};
+
+// What the platform's event loop waits with.
+enum event_loop_engine {
+  EVENT_LOOP_AUTO, // io_uring when the kernel lets us, epoll otherwise.
+  EVENT_LOOP_EPOLL,
+  EVENT_LOOP_IO_URING,
+};
+
+struct window_settings {
+  // Fraction of the window size the pixel buffer is allocated at (0.5 - 1.0),
+  // the compositor scales it back up to the window size. 0 means native.
+  float render_scale;
+
+  // Fixed internal resolution, takes priority over render_scale when set.
+  uint32_t render_width;
+  uint32_t render_height;
+
+  // Preferred pixel buffer format, falls back to XRGB8888 when the
+  // display doesn't advertise it.
+  pixel_format format;
+
+  // Frame rate cap while the window isn't focused, 0 means 10.
+  // Input to the window wakes it up right away.
+  uint32_t unfocused_fps;
+
+  // Back the swapchain with huge pages where the system has them.
+  bool huge_pages;
+
+  // Can also be forced with JAM_BACKEND=wayland|x11|headless.
+  window_backend backend;
+
+  // Wayland only, also turned on with JAM_IO_THREAD=1. A thread of its own
+  // talks to the compositor and create_a_window returns right away, the
+  // app then draws with begin_frame/end_frame on its own thread. A long
+  // frame or an asset load doesn't get the window marked unresponsive.
+  bool io_thread;
+
+  // Wayland only for now, JAM_EVENT_LOOP=epoll|io_uring overrides it.
+  event_loop_engine event_loop;
+
+  // Draws get_frame_stats (the frame time histogram, stalls and the rest)
+  // into the corner of every frame. Also turned on with JAM_STATS_OVERLAY=1.
+  bool stats_overlay;
+
+  // The JAM_HEADLESS_REFRESH (Hz, 0 unthrottled), JAM_HEADLESS_FRAMES,
+  // JAM_HEADLESS_SINK (discard|raw|ppm|ring) and JAM_HEADLESS_PATH
+  // environment variables override these.
+  headless_settings headless;
+};
+
+enum audio_sink {
+  AUDIO_SINK_NULL, // Mixed and dropped, paced like a real device. For benchmarking the mixer.
+  AUDIO_SINK_WAV, // 16 bit stereo PCM appended to a WAV file at path.
+};
+
+struct audio_settings {
+  uint32_t sample_rate; // 0 means 48000.
+  uint32_t period_frames; // Mixed at a time, 0 means 256.
+
+  // Mixes as fast as the CPU goes instead of in real time, for offline
+  // rendering and benchmarks. frame_limit stops the device, 0 runs forever.
+  bool unthrottled;
+  uint64_t frame_limit;
+
+  // JAM_AUDIO_SINK (null|wav) and JAM_AUDIO_PATH override these.
+  audio_sink sink;
+  const char *path;
+
+  // The null and WAV sinks pace themselves on CLOCK_MONOTONIC, this runs
+  // their pretend device clock that many ppm slow (or fast, negative) like
+  // a real sound card's crystal. For testing what follows the clock.
+  int32_t clock_ppm;
+};
+
+// Float samples, interleaved when there are two channels. Has to stay
+// around for as long as a voice plays it.
+struct audio_sound {
+  const float *samples;
+  uint32_t frame_count;
+  uint32_t channels; // 1 or 2.
+  uint32_t sample_rate; // Resampled to the device rate when it differs.
+};
+
+struct audio_stats {
+  uint64_t periods;
+  uint64_t frames;
+  uint64_t voice_periods; // Voices mixed, summed over every period.
+  uint64_t mix_ns_total;
+  uint64_t mix_ns_max;
+  uint64_t late_periods; // Mixed after the device wanted them.
+  uint64_t late_starts; // play_sound_at times that had already gone by.
+  uint32_t voices_playing;
+};
+
+// Where the device is on the CLOCK_MONOTONIC timeline: frame comes out of
+// the speakers at time_ns, the frames after it ns_per_frame apart. Both
+// are filtered, so this is smooth from call to call and follows the
+// device's clock instead of drifting off it.
+struct audio_clock {
+  uint64_t frame;
+  uint64_t time_ns;
+  double ns_per_frame;
+};
+
+// What the window manager or compositor says about the window, and what
+// the platform is doing about it.
+enum window_state_flags {
+  WINDOW_MAXIMIZED = 0x1,
+  WINDOW_FULLSCREEN = 0x2,
+  WINDOW_RESIZING = 0x4,
+  WINDOW_ACTIVATED = 0x8, // Has keyboard focus.
+  WINDOW_TILED = 0x10,
+  WINDOW_SUSPENDED = 0x20, // Not shown at all (minimized, other workspace), nothing is drawn.
+  WINDOW_OCCLUDED = 0x40, // Frame callbacks stopped arriving, nothing is drawn until they're back.
+  WINDOW_THROTTLED = 0x80, // Not focused, drawing at window_settings.unfocused_fps.
+};
+
+#define WINDOW_FRAME_TIME_BUCKETS 32
+#define WINDOW_FRAME_TIME_BUCKET_NS 1000000ull // The last bucket takes everything longer.
+#define WINDOW_INPUT_LATENCY_WINDOW 128 // Frames the latency percentiles are over.
+
+// get_frame_stats. Kept by whichever thread talks to the display and
+// republished after every present, reading it any time is lock free.
+// Wayland logs its protocol traffic only with JAM_WAYLAND_DEBUG=1, the
+// counts include those writes.
+struct window_frame_stats {
+  uint64_t frames;
+
+  // Minor page faults taken while drawing and presenting a frame. Should sit
+  // at zero once the swapchain exists, buffers are prefaulted when created.
+  uint64_t page_faults_last;
+  uint64_t page_faults_max;
+  uint64_t page_faults_total;
+
+  // Present to present.
+  uint64_t frame_time_histogram[WINDOW_FRAME_TIME_BUCKETS];
+  uint64_t frame_time_last_ns;
+  uint64_t frame_time_max_ns;
+  uint64_t missed_frame_callbacks; // Refreshes that went by without one while we were drawing.
+
+  // The display connection, since it was opened.
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t messages_sent;
+  uint64_t messages_received;
+  uint64_t syscalls;
+  uint32_t syscalls_last_frame; // Between the last two presents.
+  uint32_t syscalls_max_frame;
+
+  uint64_t buffer_stalls; // A frame was due and the display still had every buffer.
+  uint64_t shm_bytes; // Shared memory the window's buffers (layers and cursors too) take up.
+
+  // The most there ever were at once.
+  uint32_t input_events_high_water; // Input events between two presents.
+  uint32_t event_queue_high_water; // Waiting for the game thread, threaded mode.
+  uint32_t command_queue_high_water; // From the game thread, handled in one go.
+
+  // Input to photon, Wayland only: from the oldest input a frame is the
+  // first to see (the event's own timestamp) to the frame callback saying
+  // it was shown. A new sample for every frame that had input.
+  uint64_t input_latency_samples;
+  uint64_t input_latency_last_ns;
+  uint64_t input_latency_max_ns;
+  uint64_t input_latency_p50_ns; // Over the last WINDOW_INPUT_LATENCY_WINDOW samples.
+  uint64_t input_latency_p90_ns;
+  uint64_t input_latency_p99_ns;
+};
+
+struct window_scale {
+  // Output pixels per window unit, 1.0 on a regular density screen,
+  // 1.25, 1.5, 2.0 and so on for HiDPI.
+  float density;
+
+  // Window size in window units.
+  uint32_t width;
+  uint32_t height;
+
+  // Size of the pixel buffer the app is rendering into.
+  uint32_t buffer_width;
+  uint32_t buffer_height;
+};
+
+#define DATA_MIME_TYPE_SIZE 64
+#define DATA_MAX_MIME_TYPES 16
+
+enum data_offer_kind {
+  DATA_OFFER_CLIPBOARD,
+  DATA_OFFER_DROP, // Something dropped onto the window.
+};
+
+struct data_offer_info {
+  uint32_t serial; // Changes whenever another offer takes its place, 0 while there's none.
+  uint32_t mime_count;
+  char mime_types[DATA_MAX_MIME_TYPES][DATA_MIME_TYPE_SIZE];
+
+  // Drops only, where it landed in window units.
+  float x;
+  float y;
+};
+
+// Pointer cursors, the CSS names most compositors and themes agree on.
+enum cursor_shape {
+  CURSOR_DEFAULT,
+  CURSOR_POINTER,
+  CURSOR_TEXT,
+  CURSOR_CROSSHAIR,
+  CURSOR_MOVE,
+  CURSOR_GRAB,
+  CURSOR_GRABBING,
+  CURSOR_NOT_ALLOWED,
+  CURSOR_WAIT,
+  CURSOR_EW_RESIZE,
+  CURSOR_NS_RESIZE,
+  CURSOR_NWSE_RESIZE,
+  CURSOR_NESW_RESIZE,
+  CURSOR_HIDDEN,
+  CURSOR_SHAPE_COUNT,
+};
+
+enum data_transfer_status {
+  DATA_TRANSFER_FREE,
+  DATA_TRANSFER_QUEUED, // Not picked up by the I/O thread yet.
+  DATA_TRANSFER_ACTIVE,
+  DATA_TRANSFER_DONE,
+  DATA_TRANSFER_TRUNCATED, // The memory filled up before the sender was done.
+  DATA_TRANSFER_FAILED,
+};
+
+struct window_output {
+  char name[64];
+
+  // Position in the compositor's global space and the current mode in pixels.
+  int32_t x;
+  int32_t y;
+  uint32_t width;
+  uint32_t height;
+
+  uint32_t refresh_mhz;
+  int32_t scale;
+
+  bool has_window; // The window is at least partly on this output.
+  bool current; // The output the window paces and scales against.
+};
+
+void create_a_window(void **memory, uint32_t Width, uint32_t Height, window_settings *settings = 0);
 void destroy_a_window(void **memory);
+window_backend get_window_backend(void **memory);
+window_scale get_window_scale(void **memory);
+
+// The RGBA8 buffer the app renders into, buffer_width x buffer_height.
+uint8_t *get_render_target(void **memory, uint32_t *stride);
+pixel_format get_window_format(void **memory);
+uint32_t get_window_outputs(void **memory, window_output *outputs, uint32_t max_outputs);
+uint64_t get_frame_interval_ns(void **memory);
+window_frame_stats get_frame_stats(void **memory);
+
+// When the frame being drawn will most likely be on screen, on the
+// CLOCK_MONOTONIC timeline, predicted from the compositor's frame callbacks
+// (the next vblank after now). Meant for play_sound_at, so a sound lands
+// with the frame that shows it.
+uint64_t get_frame_present_ns(void **memory);
+
+// When the oldest input since the last frame happened, on the same clock,
+// 0 when there was none (or on X11 and headless). Present minus this is
+// the input latency get_frame_stats measures.
+uint64_t get_frame_input_ns(void **memory);
+
+uint32_t get_window_flags(void **memory); // window_state_flags
+
+// Threaded mode (window_settings.io_thread). begin_frame blocks until the
+// compositor wants a frame and returns the render target for it, 0 once
+// the window is closed (and right away for windows that aren't threaded).
+// The scale, format and flags getters report what the frame was offered
+// with; outputs and layers aren't available in this mode.
+uint8_t *begin_frame(void **memory, uint32_t *stride);
+void end_frame(void **memory);
+void set_render_size(void **memory, uint32_t width, uint32_t height); // 0 0 goes back to render_scale.
+
+// Clipboard and drag and drop, Wayland in threaded mode only. Received data
+// streams in on the I/O thread while frames keep going: poll
+// get_data_transfer until it's no longer queued or active. To an fd it's
+// spliced pipe to file at offset without passing through user memory, to
+// memory (an mmap of the destination works) it's read straight in.
+// serial is the one get_data_offer returned, a newer offer fails it.
+// Destinations stay in use until the transfer is finished or released,
+// release_data_transfer waits for the I/O thread to stop using it.
+// Transfers are handles >= 0, -1 on failure.
+bool get_data_offer(void **memory, data_offer_kind kind, data_offer_info *info);
+int32_t receive_data_to_fd(void **memory, data_offer_kind kind, uint32_t serial,
+                           const char *mime_type, int fd, uint64_t offset);
+int32_t receive_data_to_memory(void **memory, data_offer_kind kind, uint32_t serial,
+                               const char *mime_type, uint8_t *dst, uint64_t capacity);
+data_transfer_status get_data_transfer(void **memory, int32_t transfer, uint64_t *bytes);
+void release_data_transfer(void **memory, int32_t transfer);
+
+// Puts data on the clipboard. set_clipboard_data copies it, the memory is
+// free to reuse once it returns, and pastes are vmspliced out of the copy.
+// set_clipboard_file duplicates the fd and pastes are spliced straight out
+// of the file, whose contents are read for as long as a paste runs, even
+// one that started before a later set/clear: replace the file (write a new
+// one and rename it over) instead of writing into it.
+bool set_clipboard_data(void **memory, const char *const *mime_types, uint32_t mime_count,
+                        const uint8_t *data, uint64_t size);
+bool set_clipboard_file(void **memory, const char *const *mime_types, uint32_t mime_count,
+                        int fd, uint64_t offset, uint64_t size);
+void clear_clipboard(void **memory);
+
+// Wayland only. Drawn by the compositor through wp_cursor_shape_v1 when it
+// has it, otherwise from the XCursor theme (XCURSOR_THEME, XCURSOR_SIZE),
+// uploaded once per shape. Either way a change is one small request.
+void set_cursor_shape(void **memory, cursor_shape shape);
+
+// Audio runs on its own thread, mixing up to AUDIO_MAX_VOICES voices a
+// period at a time. Voices are handles, 0 means none was free. Changes
+// are picked up at the start of the next period and ramped over it.
+// play_sound_at starts the voice on the exact frame that plays at time_ns
+// (get_frame_present_ns, or get_audio_clock for anything else), as long as
+// that's at least a period or so ahead, otherwise as soon as it can.
+#define AUDIO_MAX_VOICES 128
+
+bool open_audio(void **audio, audio_settings *settings = 0);
+void close_audio(void **audio);
+uint32_t play_sound(void **audio, const audio_sound *sound, float gain, float pan, bool loop);
+uint32_t play_sound_at(void **audio, const audio_sound *sound, float gain, float pan, bool loop, uint64_t time_ns);
+void set_voice(void **audio, uint32_t voice, float gain, float pan, float pitch); // pan -1 left to 1 right.
+void stop_voice(void **audio, uint32_t voice);
+bool voice_playing(void **audio, uint32_t voice);
+audio_stats get_audio_stats(void **audio);
+audio_clock get_audio_clock(void **audio);
+uint64_t get_audio_frame_at(void **audio, uint64_t time_ns);
+
+// Layers are small surfaces stacked over the window with their own premultiplied
+// ARGB8888 buffers, so a HUD or cursor can change without redrawing the window.
+// Desync layers show up as soon as they are presented, synced ones with the
+// window's next frame. Returns 0 on failure.
+uint32_t create_layer(void **memory, int32_t x, int32_t y, uint32_t width, uint32_t height, bool desync);
+void move_layer(void **memory, uint32_t layer, int32_t x, int32_t y);
+uint32_t *begin_layer_frame(void **memory, uint32_t layer, uint32_t *stride); // 0 while every buffer is busy.
+void present_layer(void **memory, uint32_t layer, int32_t x, int32_t y, int32_t width, int32_t height);
+void destroy_layer(void **memory, uint32_t layer);
 bool DirectoryExist(const char *path);
 bool CreateDirectory(const char *path);
 
+// Asset packs, built by jam_pack from a directory of loose files. Opening
+// one is a single mmap, finding an asset one hash and one probe of the
+// index, and what comes back points into the mapping: page aligned, read
+// only, valid until the pack is closed and paged in on first touch.
+// Paths are relative to the packed directory, with / separators.
+enum asset_flags {
+  ASSET_FLAG_LZ4 = 1 << 0, // Chunked LZ4, has to go through load_asset.
+};
+
+enum asset_load_status {
+  ASSET_LOAD_FREE,
+  ASSET_LOAD_ACTIVE,
+  ASSET_LOAD_DONE,
+  ASSET_LOAD_FAILED, // Malformed data, dst holds garbage.
+};
+
+struct asset_view {
+  const uint8_t *data;
+  uint64_t size;
+  uint32_t flags;
+  const char *path; // Not terminated.
+  uint32_t path_size;
+};
+
+bool open_asset_pack(void **pack, const char *path);
+void close_asset_pack(void **pack);
+bool find_asset(void **pack, const char *path, asset_view *asset);
+uint32_t get_asset_count(void **pack);
+bool get_asset(void **pack, uint32_t index, asset_view *asset); // In path order.
+
+// Packs built with jam_pack --lz4 store the files that compress in
+// ASSET_FLAG_LZ4 chunks. The loader decodes them on a pool of threads
+// (threads 0 is one per core but this one) straight into dst, which can
+// be anywhere, an arena for a level say, get_asset_size bytes of it.
+// Loads stream: chunks finish in order, *ready / wait_asset_load say how
+// much from the start is usable so far. Uncompressed assets load too (a
+// parallel copy) but are better used in place. Loads are handles >= 0,
+// -1 on failure, and dst is in use until they're released (which waits
+// for chunks already being decoded).
+bool open_asset_loader(void **loader, uint32_t threads = 0);
+void close_asset_loader(void **loader);
+uint64_t get_asset_size(const asset_view *asset);
+int32_t load_asset(void **loader, const asset_view *asset, uint8_t *dst, uint64_t capacity);
+asset_load_status get_asset_load(void **loader, int32_t load, uint64_t *ready);
+asset_load_status wait_asset_load(void **loader, int32_t load, uint64_t bytes); // Until that much is ready.
+void release_asset_load(void **loader, int32_t load);
+
+// Hot reload, linux. jam_host runs a game built as a shared object that
+// exports GAME_FRAME_SYMBOL and swaps in each rebuild between two frames,
+// the window and everything the platform holds stays up. What the game
+// wants kept goes in game_memory, which the platform owns: the handles
+// and two arenas, zeroed when first touched and never moved. Nothing in
+// there should point into the code or its statics (function pointers,
+// string literals, vtables), reloads changing is the cue to redo those.
+#define GAME_FRAME_SYMBOL "jam_game_frame"
+
+struct game_memory {
+  void *window; // &memory->window for the window calls.
+  void *audio; // 0 until the game opens it, closed by the host.
+
+  uint8_t *permanent;
+  uint64_t permanent_size;
+  uint8_t *transient; // Scratch, the game decides what survives in it.
+  uint64_t transient_size;
+
+  uint32_t reloads; // New code swapped in so far.
+};
+
+// Draws a frame into pixels (the begin_frame buffer), false to quit.
+// Declare it extern "C" so it's found under that name.
+typedef bool game_frame_fn(game_memory *memory, uint8_t *pixels, uint32_t stride);
+
+bool open_game_code(void **game, const char *path, uint64_t permanent_size, uint64_t transient_size);
+void close_game_code(void **game);
+bool reload_game_code(void **game); // True when a rebuild was swapped in, call it between frames.
+game_frame_fn *get_game_frame(void **game);
+game_memory *get_game_memory(void **game);
+
+// CPU topology and thread placement, linux. The platform's own threads go
+// through this too: the audio thread realtime on a core reserved for it
+// (when there are CPU_RESERVE_MIN_CORES cores to spare one), the wayland
+// I/O thread at high priority, asset loader workers and the rest on the
+// other cores. What the system doesn't permit is skipped, see
+// get_thread_granted.
+#define CPU_MAX 256
+
+struct cpu_mask {
+  uint64_t bits[CPU_MAX / 64];
+};
+
+inline void cpu_mask_set(cpu_mask *mask, uint32_t cpu) {
+  if (cpu < CPU_MAX) mask->bits[cpu / 64] |= 1ull << (cpu % 64);
+}
+
+inline bool cpu_mask_has(const cpu_mask *mask, uint32_t cpu) {
+  return cpu < CPU_MAX && ((mask->bits[cpu / 64] >> (cpu % 64)) & 1);
+}
+
+inline uint32_t cpu_mask_count(const cpu_mask *mask) {
+  uint32_t count = 0;
+  for (uint32_t Index = 0; Index < CPU_MAX / 64; Index++) {
+    count += (uint32_t)__builtin_popcountll(mask->bits[Index]);
+  }
+  return count;
+}
+
+enum cpu_kind {
+  CPU_KIND_PERFORMANCE, // Every CPU on a part that isn't hybrid.
+  CPU_KIND_EFFICIENCY,
+};
+
+struct cpu_info {
+  uint32_t core; // Physical core, SMT siblings share one. Numbered from 0.
+  uint32_t l3; // L3 domain, CPUs in one share a last level cache. Numbered from 0.
+  cpu_kind kind;
+  uint32_t capacity; // Relative throughput where the kernel says (1024 is the biggest), 0 otherwise.
+  uint32_t max_mhz;
+};
+
+struct cpu_topology {
+  uint32_t cpu_count;
+  uint32_t core_count;
+  uint32_t l3_count;
+  bool hybrid;
+
+  cpu_mask online; // Online and ones the process may run on (taskset, cgroups).
+  cpu_mask efficiency;
+  cpu_info cpus[CPU_MAX]; // By CPU number, only the online ones are filled in.
+};
+
+enum thread_priority {
+  THREAD_PRIORITY_NORMAL,
+  THREAD_PRIORITY_BACKGROUND, // SCHED_BATCH at nice 10, work nobody waits on frame to frame.
+  THREAD_PRIORITY_HIGH, // Nice -10, where RLIMIT_NICE or CAP_SYS_NICE allow it.
+  THREAD_PRIORITY_REALTIME, // SCHED_FIFO where RLIMIT_RTPRIO allows it, HIGH otherwise.
+};
+
+enum thread_granted {
+  THREAD_GRANTED_AFFINITY = 1 << 0,
+  THREAD_GRANTED_REALTIME = 1 << 1,
+  THREAD_GRANTED_NICE = 1 << 2, // The nice the priority asked for.
+  THREAD_GRANTED_TIMER_SLACK = 1 << 3,
+};
+
+struct thread_settings {
+  const char *name; // Shows in top and perf, 15 characters.
+  thread_priority priority;
+  uint32_t fifo_priority; // REALTIME only, 1-99, 0 means 10.
+
+  // Empty runs on any CPU outside the reserved core, and moves off it if
+  // it's reserved later.
+  cpu_mask affinity;
+
+  // How late the kernel may wake it from a sleep. 0 keeps the default
+  // 50us, realtime threads get the least there is.
+  uint64_t timer_slack_ns;
+};
+
+typedef void *thread_fn(void *user);
+
+bool get_cpu_topology(cpu_topology *topology);
+bool create_thread(void **thread, thread_fn *fn, void *user, const thread_settings *settings = 0);
+void join_thread(void **thread);
+uint32_t get_thread_granted(void **thread); // thread_granted.
+uint32_t set_thread_settings(const thread_settings *settings); // The calling thread, returns thread_granted.
+
+// What the platform's SIMD kernels (pixel conversion and fills, the audio
+// mix) were picked for. The library targets baseline x86-64 and dispatches
+// at runtime, JAM_CPU=scalar|sse2|sse4.1|avx2|avx512 caps it.
+enum cpu_feature_flags {
+  CPU_FEATURE_SSE2 = 1 << 0,
+  CPU_FEATURE_SSE41 = 1 << 1,
+  CPU_FEATURE_AVX2 = 1 << 2, // And the OS saving YMM state.
+  CPU_FEATURE_FMA = 1 << 3,
+  CPU_FEATURE_F16C = 1 << 4,
+  CPU_FEATURE_AVX512 = 1 << 5, // F, BW and VL, and the OS saving ZMM state.
+};
+
+uint32_t get_cpu_features();
+
+// Fills a width x height rectangle of an RGBA8 buffer (the render target
+// say) with one color, with the widest stores the CPU has.
+void fill_pixels(uint8_t *pixels, uint32_t stride, uint32_t width, uint32_t height,
+                 uint8_t r, uint8_t g, uint8_t b, uint8_t a);
+
 inline void buf_write_u32(char *buffer, uint64_t *buffer_pos, uint64_t buffer_size,
                          uint32_t value_toWrite) {
 
@@ -32,6 +592,32 @@ inline void buf_write_u16(char *buffer, uint64_t *buffer_pos, uint64_t buffer_si
 }
  
 
+// Reads a wayland string (length, then padded bytes) into dst, truncating
+// to dst_size but always moving past the whole string.
+inline void buf_read_string(char **buffer, uint64_t *buffer_pos, char *dst, uint64_t dst_size) {
+ uint32_t len = 0;
+ if (*buffer_pos >= sizeof(uint32_t)) {
+  len = *(uint32_t *)(*buffer);
+  *buffer += sizeof(len);
+  *buffer_pos -= sizeof(len);
+ }
+
+ uint64_t padded = roundup_4(len);
+ if (padded > *buffer_pos) {
+  padded = *buffer_pos;
+ }
+
+ if (dst && dst_size > 0) {
+  uint64_t copy = len < dst_size - 1 ? len : dst_size - 1;
+  if (copy > padded) copy = padded;
+  memcpy(dst, *buffer, copy);
+  dst[copy] = 0;
+ }
+
+ *buffer += padded;
+ *buffer_pos -= padded;
+}
+
 inline void buf_write_string(char *buffer, uint64_t *buffer_pos, uint64_t buffer_size,
                       char *src_buffer, uint32_t src_len) {
  assert(*buffer_pos + src_len <= buffer_size);
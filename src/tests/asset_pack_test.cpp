@@ -0,0 +1,166 @@
+#include "../jamPlatforms/pack/asset_pack.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Opens packs written out by hand: a good one to look assets up in, then
+// ones with a header that points outside the file, which have to be
+// refused without leaking the fd or the mapping.
+
+#define TEST_ENTRIES 2
+#define TEST_BUCKETS 2
+#define TEST_SEED 0x5eedull
+
+static const char *test_paths[TEST_ENTRIES] = {"sprites/hero.png", "sounds/jump.wav"};
+static const char *test_blobs[TEST_ENTRIES] = {"hero pixels", "jump samples"};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+  if (!ok) {
+    printf("FAIL %s\n", what);
+    failures++;
+  }
+}
+
+struct test_pack {
+  asset_pack_header header;
+  uint8_t pad[128 - sizeof(asset_pack_header)];
+  asset_pack_bucket buckets[TEST_BUCKETS];
+  asset_pack_entry entries[TEST_ENTRIES];
+  char names[64];
+  uint8_t pad_data[ASSET_PACK_ALIGNMENT - 128 - TEST_BUCKETS * 64 - TEST_ENTRIES * 32 - 64];
+  char data[ASSET_PACK_ALIGNMENT];
+};
+static_assert(sizeof(test_pack) == 2 * ASSET_PACK_ALIGNMENT, "blobs start on the second page");
+
+static void test_pack_build(test_pack *pack) {
+  memset(pack, 0, sizeof(*pack));
+  asset_pack_header *header = &pack->header;
+  memcpy(header->magic, ASSET_PACK_MAGIC, sizeof(ASSET_PACK_MAGIC));
+  header->version = ASSET_PACK_VERSION;
+  header->alignment = ASSET_PACK_ALIGNMENT;
+  header->hash_seed = TEST_SEED;
+  header->bucket_count = TEST_BUCKETS;
+  header->entry_count = TEST_ENTRIES;
+  header->buckets_offset = offsetof(test_pack, buckets);
+  header->entries_offset = offsetof(test_pack, entries);
+  header->names_offset = offsetof(test_pack, names);
+  header->data_offset = offsetof(test_pack, data);
+  header->file_size = sizeof(test_pack);
+
+  uint32_t name_offset = 0;
+  uint32_t data_offset = 0;
+  for (uint32_t Index = 0; Index < TEST_ENTRIES; Index++) {
+    uint32_t name_size = (uint32_t)strlen(test_paths[Index]);
+    uint32_t size = (uint32_t)strlen(test_blobs[Index]);
+    memcpy(pack->names + name_offset, test_paths[Index], name_size);
+    memcpy(pack->data + data_offset, test_blobs[Index], size);
+
+    asset_pack_entry *entry = &pack->entries[Index];
+    entry->offset = header->data_offset + data_offset;
+    entry->size = size;
+    entry->name_offset = name_offset;
+    entry->name_size = name_size;
+    name_offset += name_size;
+    data_offset += size;
+
+    uint64_t hash = asset_pack_hash(test_paths[Index], name_size, TEST_SEED);
+    asset_pack_bucket *bucket = &pack->buckets[hash & (TEST_BUCKETS - 1)];
+    for (uint32_t Slot = 0; Slot < ASSET_PACK_BUCKET_SLOTS; Slot++) {
+      if (bucket->tags[Slot] == 0) {
+        bucket->tags[Slot] = asset_pack_tag(hash);
+        bucket->entries[Slot] = Index;
+        break;
+      }
+    }
+  }
+  header->names_size = name_offset;
+}
+
+static char test_file[] = "/tmp/jam_asset_pack_XXXXXX";
+
+static bool test_pack_open(asset_pack_state *pack, const test_pack *contents, uint64_t size) {
+  FILE *file = fopen(test_file, "wb");
+  fwrite(contents, 1, size, file);
+  fclose(file);
+  return asset_pack_open(pack, test_file);
+}
+
+static uint32_t open_fds() {
+  uint32_t count = 0;
+  DIR *dir = opendir("/proc/self/fd");
+  while (dir && readdir(dir)) count++;
+  if (dir) closedir(dir);
+  return count;
+}
+
+int main() {
+  int fd = mkstemp(test_file);
+  if (fd < 0) {
+    printf("Couldn't make %s\n", test_file);
+    return 1;
+  }
+  close(fd);
+
+  static test_pack good;
+  test_pack_build(&good);
+
+  asset_pack_state pack;
+  check(test_pack_open(&pack, &good, sizeof(good)), "a good pack opens");
+
+  for (uint32_t Index = 0; Index < TEST_ENTRIES; Index++) {
+    asset_view asset = {};
+    bool found = asset_pack_find(&pack, test_paths[Index], &asset);
+    check(found, "every path is found");
+    check(found && asset.size == strlen(test_blobs[Index]) &&
+          memcmp(asset.data, test_blobs[Index], asset.size) == 0, "the blob is the one for the path");
+    check(found && asset.path_size == strlen(test_paths[Index]) &&
+          memcmp(asset.path, test_paths[Index], asset.path_size) == 0, "the path comes back");
+  }
+
+  asset_view missing = {};
+  check(!asset_pack_find(&pack, "sprites/villain.png", &missing), "a path that isn't there");
+  check(!asset_pack_find(&pack, "sprites/hero.pn", &missing), "a prefix of a path");
+  check(!asset_pack_find(&pack, "", &missing), "the empty path");
+  asset_pack_close(&pack);
+
+  // Each of these breaks one thing, none may open.
+  uint32_t fds_before = open_fds();
+  for (uint32_t Case = 0; Case < 9; Case++) {
+    static test_pack bad;
+    bad = good;
+    uint64_t size = sizeof(bad);
+    const char *what = "";
+    switch (Case) {
+      case 0: what = "bad magic"; bad.header.magic[0] = 'X'; break;
+      case 1: what = "newer version"; bad.header.version++; break;
+      case 2: what = "truncated file"; size -= 100; break;
+      case 3: what = "bucket count not a power of two"; bad.header.bucket_count = 3; break;
+      case 4: what = "names offset wrapping"; bad.header.names_offset = ~0ull - 8; bad.header.names_size = 64; break;
+      case 5: what = "entries offset wrapping"; bad.header.entries_offset = ~0ull & ~31ull; break;
+      case 6: what = "buckets past the end"; bad.header.bucket_count = 1u << 31; break;
+      case 7: what = "blob past the end"; bad.entries[1].size = ~0ull - 16; break;
+      case 8: what = "name past the names"; bad.entries[0].name_offset = ~0u - 4; break;
+    }
+
+    bool opened = test_pack_open(&pack, &bad, size);
+    if (opened) {
+      printf("FAIL opened a pack with %s\n", what);
+      failures++;
+      asset_pack_close(&pack);
+    }
+  }
+  check(open_fds() == fds_before, "refused packs don't keep their fd");
+
+  unlink(test_file);
+
+  if (failures) {
+    printf("asset_pack: %d failed\n", failures);
+    return 1;
+  }
+  printf("asset_pack: ok\n");
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include "../jamPlatforms/av_clock.h"
+
+#include <math.h>
+#include <stdio.h>
+
+// Drives av_clock with a made up 60 Hz device that runs 300 ppm fast and
+// is observed with up to a millisecond of jitter, the way frame callbacks
+// and audio wakeups are seen.
+
+#define TEST_NOMINAL_NS 16666667ull
+#define TEST_SKEW_PPM 300.0
+#define TEST_JITTER_NS 1000000ull
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, double got, double want) {
+  if (!ok) {
+    printf("FAIL %s: got %.1f, want %.1f\n", what, got, want);
+    failures++;
+  }
+}
+
+// Same numbers every run.
+static uint32_t random_state = 12345;
+static uint64_t jitter_ns() {
+  random_state = random_state * 1664525u + 1013904223u;
+  return (uint64_t)(random_state >> 8) % TEST_JITTER_NS;
+}
+
+int main() {
+  av_clock clock;
+  av_clock_init(&clock, TEST_NOMINAL_NS);
+
+  check(av_clock_next_after(&clock, 1234) == 1234, "next_after before any event", 0, 1234);
+
+  double true_period = TEST_NOMINAL_NS * (1.0 + TEST_SKEW_PPM * 1e-6);
+  double start = 1e12;
+  uint64_t event = 0;
+
+  // Ten seconds of the loop at 1 Hz is plenty to settle, the next ten are
+  // measured. The period still moves with the jitter from one event to the
+  // next, it's its average that has to match the device.
+  double period_sum = 0.0;
+  double next_error_max = 0.0;
+  for (; event < 1200; event++) {
+    double t = start + true_period * (double)event;
+    av_clock_observe(&clock, (uint64_t)t + jitter_ns(), 1);
+
+    // Observations come late by half the jitter on average, so that's
+    // where the grid settles.
+    if (event >= 600) {
+      period_sum += clock.period_ns;
+      double next_error = fabs(clock.next_ns - (t + true_period + TEST_JITTER_NS / 2.0));
+      next_error_max = next_error > next_error_max ? next_error : next_error_max;
+    }
+  }
+
+  double period_error_ppm = (period_sum / 600.0 - true_period) / true_period * 1e6;
+  check(fabs(period_error_ppm) < 20.0, "period converges to the skewed one (ppm off)", period_error_ppm, 0);
+  check(next_error_max < 500000.0, "next event stays close (ns off)", next_error_max, 0);
+  check(clock.resets == 0, "no resets while periodic", (double)clock.resets, 0);
+
+  // Frame callbacks that stop for a couple of frames aren't a stall.
+  event += 3;
+  av_clock_observe(&clock, (uint64_t)(start + true_period * (double)event) + jitter_ns(), 0);
+  event++;
+  check(clock.resets == 0, "no reset for skipped events", (double)clock.resets, 0);
+  check(fabs(clock.next_ns - (start + true_period * (double)event + TEST_JITTER_NS / 2.0)) < 500000.0,
+        "skipped events land on the grid", clock.next_ns, start + true_period * (double)event);
+
+  // A second without events is a stall, the loop starts over from the
+  // event after it.
+  double resumed = start + true_period * (double)event + 1e9 + 1234567.0;
+  av_clock_observe(&clock, (uint64_t)resumed, 1);
+  check(clock.resets == 1, "reset after a stall", (double)clock.resets, 1);
+  check(fabs(clock.next_ns - (resumed + clock.period_ns)) < 1.0, "restarts from the stalled event",
+        clock.next_ns, resumed + clock.period_ns);
+
+  // next_after lands on the grid, at or after the time, less than a period
+  // later, whichever side of next_ns the time is on.
+  double offsets[] = {-5.5, -1.0, -0.25, 0.0, 0.25, 1.0, 7.75};
+  for (double offset : offsets) {
+    uint64_t t = (uint64_t)(clock.next_ns + offset * clock.period_ns);
+    uint64_t next = av_clock_next_after(&clock, t);
+    check(next >= t && (double)(next - t) <= clock.period_ns, "next_after within a period", (double)next - (double)t, 0);
+
+    double periods = ((double)next - clock.next_ns) / clock.period_ns;
+    check(fabs(periods - round(periods)) * clock.period_ns < 2.0, "next_after on the grid (ns off)",
+          (periods - round(periods)) * clock.period_ns, 0);
+  }
+
+  if (failures) {
+    printf("av_clock: %d failed\n", failures);
+    return 1;
+  }
+  printf("av_clock: ok, period %.1f ppm off, next event at most %.0f ns off\n", period_error_ppm, next_error_max);
+  return 0;
+}
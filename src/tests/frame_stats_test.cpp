@@ -0,0 +1,89 @@
+#include "../jamPlatforms/frame_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Input latency percentiles as get_frame_stats sees them: nearest rank over
+// the last WINDOW_INPUT_LATENCY_WINDOW samples, worked out at present.
+
+#define TEST_MS 1000000ull
+
+static int failures = 0;
+
+static void check(uint64_t got, uint64_t want, const char *what) {
+  if (got != want) {
+    printf("FAIL %s: got %llu, want %llu\n", what, (unsigned long long)got, (unsigned long long)want);
+    failures++;
+  }
+}
+
+static frame_stats_recorder recorder;
+static uint64_t now_ns = 1000 * TEST_MS;
+
+static window_frame_stats present() {
+  now_ns += 16 * TEST_MS;
+  frame_stats_present(&recorder, now_ns);
+
+  window_frame_stats drawn = {};
+  return frame_stats_read(&recorder, &drawn);
+}
+
+int main() {
+  memset(&recorder, 0, sizeof(recorder));
+
+  window_frame_stats stats = present();
+  check(stats.input_latency_samples, 0, "no samples yet");
+  check(stats.input_latency_p50_ns, 0, "p50 with no samples");
+
+  // 1..100 ms, out of order, so the ranks are the values.
+  for (uint64_t Index = 0; Index < 100; Index++) {
+    frame_stats_input_latency(&recorder, ((Index * 37) % 100 + 1) * TEST_MS);
+  }
+
+  // Only published at present.
+  check(frame_stats_read(&recorder, &stats).input_latency_samples, 0, "samples before present");
+
+  stats = present();
+  check(stats.input_latency_samples, 100, "samples");
+  check(stats.input_latency_last_ns, (99 * 37 % 100 + 1) * TEST_MS, "last");
+  check(stats.input_latency_max_ns, 100 * TEST_MS, "max");
+  check(stats.input_latency_p50_ns, 50 * TEST_MS, "p50 of 1..100");
+  check(stats.input_latency_p90_ns, 90 * TEST_MS, "p90 of 1..100");
+  check(stats.input_latency_p99_ns, 99 * TEST_MS, "p99 of 1..100");
+
+  // A present without new samples keeps them as they were.
+  stats = present();
+  check(stats.input_latency_p50_ns, 50 * TEST_MS, "p50 kept");
+
+  // A whole window of new ones pushes every old one out.
+  for (uint64_t Index = 1; Index <= WINDOW_INPUT_LATENCY_WINDOW; Index++) {
+    frame_stats_input_latency(&recorder, (1000 + Index) * TEST_MS);
+  }
+  stats = present();
+  check(stats.input_latency_samples, 100 + WINDOW_INPUT_LATENCY_WINDOW, "samples after wrapping");
+  check(stats.input_latency_p50_ns, 1064 * TEST_MS, "p50 after wrapping");
+  check(stats.input_latency_p90_ns, 1116 * TEST_MS, "p90 after wrapping");
+  check(stats.input_latency_p99_ns, 1127 * TEST_MS, "p99 after wrapping");
+
+  // Part of one more: the oldest 28 (1001..1028 ms) go, the rest stay.
+  for (uint64_t Index = 0; Index < 28; Index++) {
+    frame_stats_input_latency(&recorder, 5000 * TEST_MS);
+  }
+  stats = present();
+  check(stats.input_latency_p50_ns, 1092 * TEST_MS, "p50 with the oldest replaced");
+  check(stats.input_latency_p90_ns, 5000 * TEST_MS, "p90 with the oldest replaced");
+  check(stats.input_latency_p99_ns, 5000 * TEST_MS, "p99 with the oldest replaced");
+  check(stats.input_latency_max_ns, 5000 * TEST_MS, "max with the oldest replaced");
+
+  // The 16 ms between presents lands in its bucket, five presents are
+  // four frame times.
+  check(stats.frame_time_last_ns, 16 * TEST_MS, "frame time");
+  check(stats.frame_time_histogram[16], 4, "frame time bucket");
+
+  if (failures) {
+    printf("frame_stats: %d failed\n", failures);
+    return 1;
+  }
+  printf("frame_stats: ok\n");
+  return 0;
+}
@@ -0,0 +1,117 @@
+#include "../jamPlatforms/pack/lz4_block.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Round trips through lz4_compress_block and lz4_decompress_block, then
+// blocks the decoder has to refuse: cut short, with more input than the
+// block needs, decoding to the wrong size, matches reaching back before
+// the start. Decodes go into buffers of exactly the asked size, so a
+// sanitizer build catches a write past them.
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, uint64_t size) {
+  if (!ok) {
+    printf("FAIL %s (%llu bytes)\n", what, (unsigned long long)size);
+    failures++;
+  }
+}
+
+// Same numbers every run.
+static uint32_t random_state = 12345;
+static uint8_t random_byte() {
+  random_state = random_state * 1664525u + 1013904223u;
+  return (uint8_t)(random_state >> 24);
+}
+
+static bool decode(const uint8_t *src, uint64_t size, const uint8_t *want, uint64_t dst_size) {
+  uint8_t *dst = (uint8_t *)malloc(dst_size ? dst_size : 1);
+  bool ok = lz4_decompress_block(src, size, dst, dst_size) && (!want || memcmp(dst, want, dst_size) == 0);
+  free(dst);
+  return ok;
+}
+
+static void test_round_trip(const uint8_t *raw, uint64_t size, bool compressible) {
+  uint64_t capacity = lz4_compress_bound(size);
+  uint8_t *packed = (uint8_t *)malloc(capacity);
+  uint64_t packed_size = lz4_compress_block(raw, size, packed, capacity);
+
+  check(packed_size > 0, "compresses", size);
+  if (compressible) {
+    check(packed_size < size / 4, "compressible data gets smaller", size);
+  }
+  check(decode(packed, packed_size, raw, size), "round trip", size);
+
+  // Whatever is missing, the block doesn't decode.
+  for (uint64_t cut = 0; cut < packed_size; cut += packed_size > 512 ? packed_size / 97 + 1 : 1) {
+    check(!decode(packed, cut, 0, size), "truncated block refused", cut);
+  }
+
+  // Asking for more or less than the block holds.
+  check(!decode(packed, packed_size, 0, size + 1), "too big a destination refused", size);
+  if (size > 0) {
+    check(!decode(packed, packed_size, 0, size - 1), "too small a destination refused", size);
+  }
+
+  // Bytes after the last literals read as another sequence that has
+  // nowhere to go.
+  uint8_t *longer = (uint8_t *)malloc(packed_size + 4);
+  memcpy(longer, packed, packed_size);
+  memset(longer + packed_size, 0xff, 4);
+  check(!decode(longer, packed_size + 4, 0, size), "trailing input refused", size);
+
+  free(longer);
+  free(packed);
+}
+
+int main() {
+  uint64_t sizes[] = {0, 1, 13, 100, 4096, 65536 + 17, 256 * 1024};
+
+  for (uint64_t size : sizes) {
+    uint8_t *raw = (uint8_t *)malloc(size ? size : 1);
+
+    // Text with a lot of repeats, and long runs of one byte.
+    const char text[] = "the quick brown fox jumps over the lazy dog ";
+    for (uint64_t Index = 0; Index < size; Index++) {
+      raw[Index] = (Index / 1000) % 3 == 0 ? 'a' : (uint8_t)text[Index % (sizeof(text) - 1)];
+    }
+    test_round_trip(raw, size, size >= 4096);
+
+    for (uint64_t Index = 0; Index < size; Index++) {
+      raw[Index] = random_byte();
+    }
+    test_round_trip(raw, size, false);
+
+    free(raw);
+  }
+
+  // Hand made blocks: 4 literals "abcd", then a match of 4.
+  uint8_t dst[64];
+  const uint8_t good[] = {0x40, 'a', 'b', 'c', 'd', 0x04, 0x00, 0x50, 'e', 'f', 'g', 'h', 'i'};
+  check(lz4_decompress_block(good, sizeof(good), dst, 13) && memcmp(dst, "abcdabcdefghi", 13) == 0,
+        "hand made block", sizeof(good));
+
+  const uint8_t offset_zero[] = {0x40, 'a', 'b', 'c', 'd', 0x00, 0x00, 0x50, 'e', 'f', 'g', 'h', 'i'};
+  check(!lz4_decompress_block(offset_zero, sizeof(offset_zero), dst, 13), "match offset 0 refused", 0);
+
+  const uint8_t before_start[] = {0x40, 'a', 'b', 'c', 'd', 0x05, 0x00, 0x50, 'e', 'f', 'g', 'h', 'i'};
+  check(!lz4_decompress_block(before_start, sizeof(before_start), dst, 13), "match before the start refused", 5);
+
+  // A literal length extension that never ends.
+  const uint8_t endless[] = {0xf0, 0xff, 0xff, 0xff};
+  check(!lz4_decompress_block(endless, sizeof(endless), dst, sizeof(dst)), "unterminated length refused", 0);
+
+  // A length that overflows when added up.
+  uint8_t huge[4096];
+  memset(huge, 0xff, sizeof(huge));
+  check(!lz4_decompress_block(huge, sizeof(huge), dst, sizeof(dst)), "huge length refused", sizeof(huge));
+
+  if (failures) {
+    printf("lz4_block: %d failed\n", failures);
+    return 1;
+  }
+  printf("lz4_block: ok\n");
+  return 0;
+}
@@ -0,0 +1,192 @@
+#include "../platform.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Frame loop benchmark against tools/mock_compositor.py, one run per event
+// loop engine, each in a process of its own with a compositor of its own.
+//
+//   jam_bench [frames] [epoll|io_uring ...]
+//
+// The window runs on its I/O thread and the game thread presents as fast as
+// the mock sends frame callbacks. Per frame it reports the syscalls and
+// messages get_frame_stats counted, and from the mock the time between a
+// frame callback going out and the commit answering it.
+
+#ifndef JAM_MOCK_COMPOSITOR
+#define JAM_MOCK_COMPOSITOR "tools/mock_compositor.py"
+#endif
+
+#define BENCH_DEFAULT_FRAMES 1000
+#define BENCH_WARMUP_FRAMES 30 // Startup, the first configure and pool setup.
+
+static bool bench_engine_from_name(const char *name, event_loop_engine *engine) {
+  if (strcmp(name, "epoll") == 0) *engine = EVENT_LOOP_EPOLL;
+  else if (strcmp(name, "io_uring") == 0) *engine = EVENT_LOOP_IO_URING;
+  else return false;
+  return true;
+}
+
+static pid_t bench_start_compositor(const char *socket_path, int *report_fd) {
+  int report[2];
+  if (pipe(report) == -1) {
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(report[1], STDOUT_FILENO);
+    close(report[0]);
+    close(report[1]);
+    execlp("python3", "python3", JAM_MOCK_COMPOSITOR, "--socket", socket_path, (char *)0);
+    _exit(127);
+  }
+
+  close(report[1]);
+  *report_fd = report[0];
+
+  // Up once it's listening, the socket shows up just before that.
+  struct stat info;
+  for (uint32_t Index = 0; Index < 500 && stat(socket_path, &info) == -1; Index++) {
+    usleep(10000);
+  }
+  usleep(50000);
+
+  return pid;
+}
+
+static int bench_run(const char *name, event_loop_engine engine, uint32_t frames) {
+  char dir[] = "/tmp/jam_bench_XXXXXX";
+  if (!mkdtemp(dir)) {
+    printf("Couldn't make a runtime dir\n");
+    return 1;
+  }
+
+  char socket_path[64];
+  snprintf(socket_path, sizeof(socket_path), "%s/mock", dir);
+
+  int report_fd = -1;
+  pid_t compositor = bench_start_compositor(socket_path, &report_fd);
+  if (compositor == -1) {
+    printf("Couldn't start %s\n", JAM_MOCK_COMPOSITOR);
+    return 1;
+  }
+
+  setenv("XDG_RUNTIME_DIR", dir, 1);
+  setenv("WAYLAND_DISPLAY", "mock", 1);
+
+  // The platform's own logging goes nowhere, the results go to stdout.
+  fflush(stdout);
+  int results_fd = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  dup2(null_fd, STDOUT_FILENO);
+  close(null_fd);
+
+  window_settings settings = {};
+  settings.io_thread = true;
+  settings.event_loop = engine;
+
+  void *window = 0;
+  create_a_window(&window, 640, 480, &settings);
+
+  window_frame_stats before = {};
+  uint32_t drawn = 0;
+  uint32_t stride = 0;
+  while (drawn < BENCH_WARMUP_FRAMES + frames) {
+    uint8_t *pixels = begin_frame(&window, &stride);
+    if (!pixels) {
+      break;
+    }
+
+    window_scale scale = get_window_scale(&window);
+    fill_pixels(pixels, stride, scale.buffer_width, scale.buffer_height, (uint8_t)drawn, 0x40, 0x80, 0xff);
+    end_frame(&window);
+
+    drawn++;
+    if (drawn == BENCH_WARMUP_FRAMES) {
+      before = get_frame_stats(&window);
+    }
+  }
+
+  window_frame_stats after = get_frame_stats(&window);
+  destroy_a_window(&window);
+
+  fflush(stdout);
+  dup2(results_fd, STDOUT_FILENO);
+  close(results_fd);
+
+  char report[512] = "";
+  int64_t report_len = 0;
+  for (int64_t got; (got = read(report_fd, report + report_len, sizeof(report) - 1 - report_len)) > 0;) {
+    report_len += got;
+  }
+  report[report_len] = 0;
+  if (report_len > 0 && report[report_len - 1] == '\n') report[report_len - 1] = 0;
+  close(report_fd);
+
+  int status = 0;
+  waitpid(compositor, &status, 0);
+  rmdir(dir);
+
+  if (drawn < BENCH_WARMUP_FRAMES + frames) {
+    printf("%-9s the window closed after %u frames\n", name, drawn);
+    return 1;
+  }
+
+  // Published at each commit, so over the same stretch of frames.
+  double counted = (double)(after.frames - before.frames);
+  printf("%-9s %u frames, %.2f syscalls/frame (max %u), %.2f messages sent/frame, %.2f received/frame\n",
+         name, frames,
+         (after.syscalls - before.syscalls) / counted, after.syscalls_max_frame,
+         (after.messages_sent - before.messages_sent) / counted,
+         (after.messages_received - before.messages_received) / counted);
+  printf("%-9s mock: %s\n", name, report);
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  uint32_t frames = BENCH_DEFAULT_FRAMES;
+  int first_engine = 1;
+  if (argc > 1 && argv[1][0] >= '0' && argv[1][0] <= '9') {
+    frames = (uint32_t)strtoul(argv[1], 0, 10);
+    first_engine = 2;
+  }
+
+  const char *default_engines[] = {"epoll", "io_uring"};
+  const char **engines = default_engines;
+  int engine_count = 2;
+  if (argc > first_engine) {
+    engines = (const char **)argv + first_engine;
+    engine_count = argc - first_engine;
+  }
+
+  int failed = 0;
+  for (int Index = 0; Index < engine_count; Index++) {
+    event_loop_engine engine;
+    if (!bench_engine_from_name(engines[Index], &engine)) {
+      printf("Unknown engine %s, epoll or io_uring\n", engines[Index]);
+      return 1;
+    }
+
+    // A window per process, the next engine starts from nothing.
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      return bench_run(engines[Index], engine, frames);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed++;
+    }
+  }
+
+  return failed ? 1 : 0;
+}
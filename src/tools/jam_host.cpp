@@ -0,0 +1,58 @@
+#include "../platform.h"
+
+#include <stdio.h>
+
+// Runs a game built as a shared object and swaps in every rebuild of it
+// without closing the window, see open_game_code in platform.h.
+//
+//   jam_host [game.so]
+//
+// jamGame.so from src/CMakeLists.txt is the example. The platform is linked
+// into the host whole and its symbols exported, that's what the game's
+// calls into it resolve against when it's loaded.
+
+#define HOST_DEFAULT_GAME "./jamGame.so"
+#define HOST_PERMANENT_SIZE (256ull << 20)
+#define HOST_TRANSIENT_SIZE (1ull << 30)
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : HOST_DEFAULT_GAME;
+
+  void *game = 0;
+  if (!open_game_code(&game, path, HOST_PERMANENT_SIZE, HOST_TRANSIENT_SIZE)) {
+    close_game_code(&game);
+    return 1;
+  }
+  game_memory *memory = get_game_memory(&game);
+
+  // The game draws from here, so the window has to run on its I/O thread.
+  window_settings settings = {};
+  settings.io_thread = true;
+  create_a_window(&memory->window, 0, 0, &settings);
+
+  uint64_t frames = 0;
+  uint32_t stride = 0;
+  while (uint8_t *pixels = begin_frame(&memory->window, &stride)) {
+    bool running = get_game_frame(&game)(memory, pixels, stride);
+    end_frame(&memory->window);
+    frames++;
+    if (!running) {
+      break;
+    }
+
+    // Between frames nothing of the old code is on the stack.
+    reload_game_code(&game);
+  }
+
+  if (frames == 0) {
+    printf("jam_host needs a wayland window on its I/O thread, got none\n");
+  }
+
+  if (memory->audio) {
+    close_audio(&memory->audio);
+  }
+  destroy_a_window(&memory->window);
+  close_game_code(&game);
+
+  return 0;
+}
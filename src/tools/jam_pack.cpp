@@ -0,0 +1,426 @@
+#include "../jamPlatforms/pack/asset_pack.h"
+#include "../jamPlatforms/pack/lz4_block.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Packs every regular file under a directory into one asset pack, see
+// src/jamPlatforms/pack/asset_pack.h for the format.
+//
+//   jam_pack [--lz4] <directory> <out.pack>
+//
+// --lz4 compresses each file in chunks and keeps it that way if that saves
+// at least an eighth, what doesn't compress stays usable in place.
+
+#define PACK_PATH_SIZE 4096
+#define PACK_COPY_SIZE (1 << 20)
+
+struct pack_file {
+  char *path; // Relative to the packed directory.
+  char *source;
+  uint64_t size;
+  uint64_t offset;
+  uint64_t hash;
+
+  // Set when it's stored compressed.
+  uint8_t *packed;
+  uint64_t packed_size;
+  uint32_t flags;
+};
+
+struct pack_list {
+  pack_file *files;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+static bool pack_add(pack_list *list, const char *path, const char *source, uint64_t size) {
+  if (list->count == list->capacity) {
+    uint32_t capacity = list->capacity ? list->capacity * 2 : 256;
+    pack_file *files = (pack_file *)realloc(list->files, capacity * sizeof(pack_file));
+    if (!files) return false;
+    list->files = files;
+    list->capacity = capacity;
+  }
+
+  pack_file *file = &list->files[list->count++];
+  memset(file, 0, sizeof(*file));
+  file->path = strdup(path);
+  file->source = strdup(source);
+  file->size = size;
+  return file->path && file->source;
+}
+
+static bool pack_walk(pack_list *list, const char *root, const char *relative) {
+  char directory[PACK_PATH_SIZE];
+  snprintf(directory, sizeof(directory), "%s%s%s", root, relative[0] ? "/" : "", relative);
+
+  DIR *dir = opendir(directory);
+  if (!dir) {
+    printf("Failed to open the directory %s\n", directory);
+    return false;
+  }
+
+  bool result = true;
+  while (struct dirent *entry = readdir(dir)) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+
+    char path[PACK_PATH_SIZE];
+    char source[PACK_PATH_SIZE];
+    int path_length = snprintf(path, sizeof(path), "%s%s%s", relative, relative[0] ? "/" : "", entry->d_name);
+    int source_length = snprintf(source, sizeof(source), "%s/%s", root, path);
+    if (path_length >= (int)sizeof(path) || source_length >= (int)sizeof(source)) {
+      printf("Path too long under %s, skipping %s\n", directory, entry->d_name);
+      continue;
+    }
+
+    struct stat buf = {};
+    if (stat(source, &buf) == -1) {
+      if (errno == ENOENT) {
+        printf("Skipping %s, a link to nothing\n", source);
+        continue;
+      }
+      printf("Failed to stat %s\n", source);
+      result = false;
+      break;
+    }
+
+    if (S_ISDIR(buf.st_mode)) {
+      if (!pack_walk(list, root, path)) {
+        result = false;
+        break;
+      }
+    } else if (S_ISREG(buf.st_mode)) {
+      if (!pack_add(list, path, source, (uint64_t)buf.st_size)) {
+        printf("Out of memory listing %s\n", source);
+        result = false;
+        break;
+      }
+    }
+  }
+
+  closedir(dir);
+  return result;
+}
+
+static int pack_compare(const void *a, const void *b) {
+  return strcmp(((const pack_file *)a)->path, ((const pack_file *)b)->path);
+}
+
+static uint64_t pack_align(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Every path has to fit into its home bucket. Starts at two paths a bucket
+// on average, which a handful of seeds usually manages, and doubles the
+// buckets when none do.
+static bool pack_build_index(pack_list *list, asset_pack_bucket **out_buckets,
+                             uint32_t *out_bucket_count, uint64_t *out_seed) {
+  uint32_t bucket_count = 1;
+  while (bucket_count * 2 < list->count) {
+    bucket_count *= 2;
+  }
+
+  for (;;) {
+    asset_pack_bucket *buckets = (asset_pack_bucket *)aligned_alloc(64, bucket_count * sizeof(asset_pack_bucket));
+    if (!buckets) return false;
+
+    for (uint64_t Attempt = 0; Attempt < ASSET_PACK_SEED_ATTEMPTS; Attempt++) {
+      uint64_t seed = Attempt * 0x9e3779b97f4a7c15ull;
+      memset(buckets, 0, bucket_count * sizeof(asset_pack_bucket));
+
+      bool fits = true;
+      for (uint32_t Index = 0; Index < list->count && fits; Index++) {
+        pack_file *file = &list->files[Index];
+        file->hash = asset_pack_hash(file->path, strlen(file->path), seed);
+        asset_pack_bucket *bucket = &buckets[file->hash & (bucket_count - 1)];
+
+        fits = false;
+        for (uint32_t Slot = 0; Slot < ASSET_PACK_BUCKET_SLOTS; Slot++) {
+          if (bucket->tags[Slot] == 0) {
+            bucket->tags[Slot] = asset_pack_tag(file->hash);
+            bucket->entries[Slot] = Index;
+            fits = true;
+            break;
+          }
+        }
+      }
+
+      if (fits) {
+        *out_buckets = buckets;
+        *out_bucket_count = bucket_count;
+        *out_seed = seed;
+        return true;
+      }
+    }
+
+    free(buckets);
+    if (bucket_count >= (1u << 30)) return false;
+    bucket_count *= 2;
+  }
+}
+
+static bool pack_read_all(const char *path, uint8_t *dst, uint64_t size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  uint64_t done = 0;
+  while (done < size) {
+    ssize_t got = pread(fd, dst + done, size - done, (off_t)done);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) break;
+    done += (uint64_t)got;
+  }
+
+  close(fd);
+  return done == size;
+}
+
+// Chunk header, the chunk sizes, then the chunks, see asset_chunk_header.
+static bool pack_compress(pack_file *file) {
+  uint8_t *raw = (uint8_t *)malloc(file->size);
+  if (!raw || !pack_read_all(file->source, raw, file->size)) {
+    printf("Failed to read %s\n", file->source);
+    free(raw);
+    return false;
+  }
+
+  uint32_t chunk_count = (uint32_t)((file->size + ASSET_PACK_CHUNK_SIZE - 1) / ASSET_PACK_CHUNK_SIZE);
+  uint64_t sizes_end = sizeof(asset_chunk_header) + (uint64_t)chunk_count * sizeof(uint32_t);
+  uint8_t *packed = (uint8_t *)malloc(sizes_end + (uint64_t)chunk_count * lz4_compress_bound(ASSET_PACK_CHUNK_SIZE));
+  if (!packed) {
+    free(raw);
+    return false;
+  }
+
+  asset_chunk_header header = {};
+  header.raw_size = file->size;
+  header.chunk_size = ASSET_PACK_CHUNK_SIZE;
+  header.chunk_count = chunk_count;
+  memcpy(packed, &header, sizeof(header));
+
+  uint64_t packed_size = sizes_end;
+  for (uint32_t Index = 0; Index < chunk_count; Index++) {
+    uint64_t offset = (uint64_t)Index * ASSET_PACK_CHUNK_SIZE;
+    uint64_t size = file->size - offset < ASSET_PACK_CHUNK_SIZE ? file->size - offset : ASSET_PACK_CHUNK_SIZE;
+
+    uint32_t stored = (uint32_t)lz4_compress_block(raw + offset, size, packed + packed_size,
+                                                   lz4_compress_bound(ASSET_PACK_CHUNK_SIZE));
+    if (stored == 0 || stored >= size) {
+      memcpy(packed + packed_size, raw + offset, size);
+      stored = (uint32_t)size | ASSET_CHUNK_STORED;
+    }
+
+    memcpy(packed + sizeof(header) + (uint64_t)Index * sizeof(uint32_t), &stored, sizeof(stored));
+    packed_size += stored & ~ASSET_CHUNK_STORED;
+  }
+  free(raw);
+
+  if (packed_size > file->size - file->size / 8) {
+    free(packed);
+    return true;
+  }
+
+  file->packed = packed;
+  file->packed_size = packed_size;
+  file->flags = ASSET_FLAG_LZ4;
+  return true;
+}
+
+static bool pack_write_all(int fd, const void *data, uint64_t size, uint64_t offset) {
+  const uint8_t *src = (const uint8_t *)data;
+  while (size > 0) {
+    ssize_t written = pwrite(fd, src, size, (off_t)offset);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    src += written;
+    size -= (uint64_t)written;
+    offset += (uint64_t)written;
+  }
+  return true;
+}
+
+// copy_file_range keeps the bytes in the kernel (and shares extents on
+// filesystems that can), plain reads and writes when it can't be used.
+static bool pack_copy_blob(int out, pack_file *file, uint8_t *buffer) {
+  int in = open(file->source, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    printf("Failed to open %s\n", file->source);
+    return false;
+  }
+
+  uint64_t done = 0;
+  bool in_kernel = true;
+  while (done < file->size) {
+    ssize_t copied = -1;
+    if (in_kernel) {
+      off_t in_offset = (off_t)done;
+      off_t out_offset = (off_t)(file->offset + done);
+      copied = copy_file_range(in, &in_offset, out, &out_offset, file->size - done, 0);
+      if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+        in_kernel = false;
+        continue;
+      }
+    } else {
+      uint64_t want = file->size - done < PACK_COPY_SIZE ? file->size - done : PACK_COPY_SIZE;
+      copied = pread(in, buffer, want, (off_t)done);
+      if (copied > 0 && !pack_write_all(out, buffer, (uint64_t)copied, file->offset + done)) {
+        copied = -1;
+      }
+    }
+
+    if (copied == -1 && errno == EINTR) continue;
+    if (copied <= 0) {
+      printf("Failed to copy %s (it changed while packing?)\n", file->source);
+      close(in);
+      return false;
+    }
+    done += (uint64_t)copied;
+  }
+
+  close(in);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  bool lz4 = argc == 4 && strcmp(argv[1], "--lz4") == 0;
+  if (argc != 3 && !lz4) {
+    printf("usage: %s [--lz4] <directory> <out.pack>\n", argv[0]);
+    return 1;
+  }
+  const char *directory = argv[argc - 2];
+  const char *out_path = argv[argc - 1];
+
+  char root[PACK_PATH_SIZE];
+  snprintf(root, sizeof(root), "%s", directory);
+  size_t root_length = strlen(root);
+  while (root_length > 1 && root[root_length - 1] == '/') {
+    root[--root_length] = 0;
+  }
+
+  pack_list list = {};
+  if (!pack_walk(&list, root, "")) {
+    return 1;
+  }
+  qsort(list.files, list.count, sizeof(pack_file), pack_compare);
+
+  uint64_t raw_total = 0;
+  uint64_t stored_total = 0;
+  uint32_t compressed = 0;
+  for (uint32_t Index = 0; Index < list.count; Index++) {
+    pack_file *file = &list.files[Index];
+    if (lz4 && file->size > 0 && !pack_compress(file)) {
+      return 1;
+    }
+    raw_total += file->size;
+    stored_total += file->packed ? file->packed_size : file->size;
+    compressed += file->packed != 0;
+  }
+
+  asset_pack_bucket *buckets = 0;
+  uint32_t bucket_count = 0;
+  uint64_t seed = 0;
+  if (!pack_build_index(&list, &buckets, &bucket_count, &seed)) {
+    printf("Failed to build the index\n");
+    return 1;
+  }
+
+  asset_pack_header header = {};
+  memcpy(header.magic, ASSET_PACK_MAGIC, sizeof(ASSET_PACK_MAGIC));
+  header.version = ASSET_PACK_VERSION;
+  header.alignment = ASSET_PACK_ALIGNMENT;
+  header.hash_seed = seed;
+  header.bucket_count = bucket_count;
+  header.entry_count = list.count;
+  header.buckets_offset = pack_align(sizeof(asset_pack_header), alignof(asset_pack_bucket));
+  header.entries_offset = header.buckets_offset + (uint64_t)bucket_count * sizeof(asset_pack_bucket);
+  header.names_offset = header.entries_offset + (uint64_t)list.count * sizeof(asset_pack_entry);
+
+  asset_pack_entry *entries = (asset_pack_entry *)calloc(list.count ? list.count : 1, sizeof(asset_pack_entry));
+  uint64_t names_size = 0;
+  for (uint32_t Index = 0; Index < list.count; Index++) {
+    names_size += strlen(list.files[Index].path);
+  }
+  if (names_size > UINT32_MAX) {
+    printf("Too many paths for one pack\n");
+    return 1;
+  }
+  char *names = (char *)malloc(names_size ? names_size : 1);
+  if (!entries || !names) {
+    printf("Out of memory\n");
+    return 1;
+  }
+
+  header.names_size = names_size;
+  header.data_offset = pack_align(header.names_offset + names_size, ASSET_PACK_ALIGNMENT);
+
+  uint64_t name_offset = 0;
+  uint64_t offset = header.data_offset;
+  for (uint32_t Index = 0; Index < list.count; Index++) {
+    pack_file *file = &list.files[Index];
+    uint32_t length = (uint32_t)strlen(file->path);
+    memcpy(names + name_offset, file->path, length);
+
+    uint64_t stored = file->packed ? file->packed_size : file->size;
+    file->offset = offset;
+    entries[Index].offset = offset;
+    entries[Index].size = stored;
+    entries[Index].flags = file->flags;
+    entries[Index].name_offset = (uint32_t)name_offset;
+    entries[Index].name_size = length;
+
+    name_offset += length;
+    offset = pack_align(offset + stored, ASSET_PACK_ALIGNMENT);
+  }
+
+  // The last blob isn't padded out, the mapping zero fills its last page.
+  header.file_size = list.count ? list.files[list.count - 1].offset + entries[list.count - 1].size
+                                : header.data_offset;
+
+  int out = open(out_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    printf("Failed to create %s\n", out_path);
+    return 1;
+  }
+
+  uint8_t *buffer = (uint8_t *)malloc(PACK_COPY_SIZE);
+  bool result = buffer &&
+                ftruncate(out, (off_t)header.file_size) == 0 &&
+                pack_write_all(out, &header, sizeof(header), 0) &&
+                pack_write_all(out, buckets, (uint64_t)bucket_count * sizeof(asset_pack_bucket), header.buckets_offset) &&
+                pack_write_all(out, entries, (uint64_t)list.count * sizeof(asset_pack_entry), header.entries_offset) &&
+                pack_write_all(out, names, names_size, header.names_offset);
+
+  for (uint32_t Index = 0; Index < list.count && result; Index++) {
+    pack_file *file = &list.files[Index];
+    result = file->packed ? pack_write_all(out, file->packed, file->packed_size, file->offset)
+                          : pack_copy_blob(out, file, buffer);
+  }
+
+  if (!result || fsync(out) != 0) {
+    printf("Failed to write %s\n", out_path);
+    close(out);
+    unlink(out_path);
+    return 1;
+  }
+  close(out);
+
+  printf("Packed %u files from %s into %s: %llu bytes, %u buckets (%.2f a bucket), seed %llx\n",
+         list.count, root, out_path, (unsigned long long)header.file_size, bucket_count,
+         bucket_count ? (double)list.count / bucket_count : 0.0, (unsigned long long)seed);
+  if (lz4) {
+    printf("Compressed %u of them, %.1f MB down to %.1f MB (%.2fx)\n", compressed,
+           raw_total / 1e6, stored_total / 1e6, stored_total ? (double)raw_total / stored_total : 0.0);
+  }
+  return 0;
+}
@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+# A scripted Wayland compositor, just enough of one for the raw client to
+# run its frame loop against without a display: globals, shm pools and
+# buffers, an xdg_toplevel that's configured once, frame callbacks and a
+# pointer. Nothing is drawn. jam_bench starts it, or run it by hand:
+#
+#   mock_compositor.py --socket $XDG_RUNTIME_DIR/mock [options]
+#   WAYLAND_DISPLAY=mock ./jamExample.out
+#
+#   --vblank HZ     frame callbacks at the next vblank of a HZ display,
+#                   timestamped with it. Default is right after the commit.
+#   --hold          keep the shown buffer until the next commit like a real
+#                   compositor, instead of releasing it straight away.
+#   --motion-ms K   a wl_pointer.motion stamped K ms in the past after
+#                   every other frame, for input latency.
+#   --frames N      hang up after N frames. Default is to run until the
+#                   client does.
+#
+# When the client goes, one line of key=value counts goes to stdout:
+# frames, messages, reads, and callback_to_commit_us_p50/p90, from the
+# frame callback going out to the commit that answers it.
+#
+# Timestamps are CLOCK_MONOTONIC milliseconds, like the real ones.
+
+import argparse, array, os, socket, struct, sys, time
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--socket', required=True)
+parser.add_argument('--vblank', type=float, default=0)
+parser.add_argument('--hold', action='store_true')
+parser.add_argument('--motion-ms', type=float, default=-1)
+parser.add_argument('--frames', type=int, default=0)
+parser.add_argument('--width', type=int, default=0)
+parser.add_argument('--height', type=int, default=0)
+args = parser.parse_args()
+
+GLOBALS = [
+  (1, 'wl_compositor', 5),
+  (2, 'wl_shm', 1),
+  (3, 'xdg_wm_base', 5),
+  (4, 'wl_output', 4),
+  (5, 'wl_seat', 7),
+]
+
+SEAT_POINTER = 1
+SHM_FORMATS = (0, 1) # ARGB8888, XRGB8888.
+
+try:
+  os.unlink(args.socket)
+except FileNotFoundError:
+  pass
+server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+server.bind(args.socket)
+server.listen(1)
+conn, _ = server.accept()
+server.close()
+
+def now_ms():
+  return int(time.monotonic() * 1000) & 0xffffffff
+
+def string(text):
+  data = text.encode() + b'\0'
+  return struct.pack('<I', len(data)) + data + b'\0' * (-len(data) % 4)
+
+out = bytearray()
+def event(object_id, opcode, payload=b''):
+  out.extend(struct.pack('<IHH', object_id, opcode, 8 + len(payload)) + payload)
+
+counts = {'frames': 0, 'messages': 0, 'reads': 0}
+def flush():
+  if out:
+    conn.sendall(out)
+    out.clear()
+
+objects = {1: 'wl_display'}
+fds = []
+serial = 1
+surface = 0
+toplevel = 0
+xdg_surface = 0
+pointer = 0
+configured = False
+attached = 0
+held = [] # Buffers shown and not released yet, with --hold.
+callbacks = []
+callback_sent = 0.0
+callback_to_commit = []
+vblank_start = time.monotonic()
+
+def send_frame_callbacks():
+  global callbacks, callback_sent
+  stamp = now_ms()
+  if args.vblank > 0:
+    period = 1.0 / args.vblank
+    next_vblank = vblank_start + (int((time.monotonic() - vblank_start) / period) + 1) * period
+    time.sleep(max(0.0, next_vblank - time.monotonic()))
+    stamp = int(next_vblank * 1000) & 0xffffffff
+  for callback in callbacks:
+    event(callback, 0, struct.pack('<I', stamp))
+    event(1, 1, struct.pack('<I', callback)) # wl_display.delete_id
+  callbacks = []
+  callback_sent = time.perf_counter()
+
+def request(object_id, opcode, body):
+  global serial, surface, toplevel, xdg_surface, pointer, configured, attached, held, callback_sent
+  kind = objects.get(object_id)
+  u32 = lambda index: struct.unpack_from('<I', body, index * 4)[0]
+
+  if kind == 'wl_display':
+    if opcode == 0: # sync
+      event(u32(0), 0, struct.pack('<I', 0))
+      event(1, 1, struct.pack('<I', u32(0)))
+    elif opcode == 1: # get_registry
+      objects[u32(0)] = 'wl_registry'
+      for name, interface, version in GLOBALS:
+        event(u32(0), 0, struct.pack('<I', name) + string(interface) + struct.pack('<I', version))
+
+  elif kind == 'wl_registry' and opcode == 0: # bind
+    length = u32(1)
+    interface = body[8:8 + length - 1].decode()
+    new_id = struct.unpack_from('<I', body, 8 + ((length + 3) & ~3) + 4)[0]
+    objects[new_id] = interface
+    if interface == 'wl_shm':
+      for format in SHM_FORMATS:
+        event(new_id, 0, struct.pack('<I', format))
+    elif interface == 'wl_seat':
+      event(new_id, 0, struct.pack('<I', SEAT_POINTER))
+    elif interface == 'wl_output':
+      event(new_id, 0, struct.pack('<iiiii', 0, 0, 600, 340, 0) + string('mock') + string('mock') + struct.pack('<i', 0))
+      event(new_id, 1, struct.pack('<Iiii', 1, 1920, 1080, int((args.vblank or 60) * 1000)))
+      event(new_id, 3, struct.pack('<i', 1))
+      event(new_id, 2)
+
+  elif kind == 'wl_compositor' and opcode == 0:
+    objects[u32(0)] = 'wl_surface'
+    surface = surface or u32(0)
+  elif kind == 'wl_shm' and opcode == 0:
+    objects[u32(0)] = 'wl_shm_pool'
+    os.close(fds.pop(0))
+  elif kind == 'wl_shm_pool' and opcode == 0:
+    objects[u32(0)] = 'wl_buffer'
+  elif kind == 'wl_buffer' and opcode == 0:
+    objects.pop(object_id, None)
+    if object_id in held:
+      held.remove(object_id)
+  elif kind == 'xdg_wm_base' and opcode == 2:
+    objects[u32(0)] = 'xdg_surface'
+  elif kind == 'xdg_surface' and opcode == 1:
+    objects[u32(0)] = 'xdg_toplevel'
+    toplevel = u32(0)
+    xdg_surface = object_id
+  elif kind == 'wl_seat' and opcode == 0:
+    objects[u32(0)] = 'wl_pointer'
+    pointer = u32(0)
+
+  elif kind == 'wl_surface':
+    if opcode == 1: # attach
+      attached = u32(0)
+    elif opcode == 3: # frame
+      objects[u32(0)] = 'wl_callback'
+      callbacks.append(u32(0))
+    elif opcode == 6 and object_id == surface: # commit
+      if not configured:
+        configured = True
+        activated = struct.pack('<I', 4)
+        event(toplevel, 0, struct.pack('<iiI', args.width, args.height, len(activated)) + activated)
+        event(xdg_surface, 0, struct.pack('<I', serial))
+        if pointer:
+          serial += 1
+          event(pointer, 0, struct.pack('<IIii', serial, surface, 10 * 256, 10 * 256))
+        return
+
+      if not attached:
+        return
+      counts['frames'] += 1
+      if callback_sent:
+        callback_to_commit.append(time.perf_counter() - callback_sent)
+        callback_sent = 0.0
+
+      send_frame_callbacks()
+      for shown in held:
+        event(shown, 0) # wl_buffer.release
+      held = [attached] if args.hold else []
+      if not args.hold:
+        event(attached, 0)
+      attached = 0
+
+      if pointer and args.motion_ms >= 0 and counts['frames'] % 2 == 0:
+        stamp = int(time.monotonic() * 1000 - args.motion_ms) & 0xffffffff
+        event(pointer, 2, struct.pack('<Iii', stamp, 20 * 256, 20 * 256))
+
+buffer = b''
+while not args.frames or counts['frames'] < args.frames:
+  try:
+    data, ancillary, _, _ = conn.recvmsg(65536, socket.CMSG_SPACE(28 * 4))
+  except ConnectionResetError:
+    break
+  if not data:
+    break
+  counts['reads'] += 1
+  for _, _, fd_data in ancillary:
+    received = array.array('i')
+    received.frombytes(fd_data[:len(fd_data) - len(fd_data) % 4])
+    fds.extend(received)
+
+  buffer += data
+  while len(buffer) >= 8:
+    object_id, opcode, size = struct.unpack_from('<IHH', buffer)
+    if len(buffer) < size:
+      break
+    body = buffer[8:size]
+    buffer = buffer[size:]
+    counts['messages'] += 1
+    request(object_id, opcode, body)
+  try:
+    flush()
+  except (BrokenPipeError, ConnectionResetError):
+    break
+
+conn.close()
+os.unlink(args.socket)
+
+callback_to_commit.sort()
+if callback_to_commit:
+  counts['callback_to_commit_us_p50'] = round(callback_to_commit[len(callback_to_commit) // 2] * 1e6, 1)
+  counts['callback_to_commit_us_p90'] = round(callback_to_commit[len(callback_to_commit) * 9 // 10] * 1e6, 1)
+print(' '.join('%s=%s' % item for item in counts.items()))
+sys.stdout.flush()